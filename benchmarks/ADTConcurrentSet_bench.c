@@ -0,0 +1,168 @@
+//////////////////////////////////////////////////////////////////
+//
+// Benchmark for the ADT ConcurrentSet.
+// Any implementation of ADTSet.h can be used, it is chosen at link time (see Makefile).
+//
+// Runs a read-mostly workload (1 write every WRITE_EVERY operations) with 1, 2, 4, ... threads, once on a Set
+// protected by a global mutex and once on a ConcurrentSet, and prints the throughput of each.
+//
+// Usage: <impl>_ADTConcurrentSet_bench [n] [ops per thread] [max threads]
+//
+//////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ADTConcurrentSet.h"
+
+#define DEFAULT_N 1000000
+#define DEFAULT_OPS 1000000
+#define WRITE_EVERY 100
+
+// The set contains the even keys 0 ... 2n-2, the writers of thread t insert and remove odd keys of their own
+// part of the keys array, so the size of the set stays around n.
+
+static int n;
+static int ops;
+static int* keys;
+
+static int compare_ints(Pointer a, Pointer b) {
+	int x = *(int*)a, y = *(int*)b;
+	return (x > y) - (x < y);
+}
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// What the threads run on: either a Set with a global mutex, or a ConcurrentSet.
+
+static Set locked_set;
+static pthread_mutex_t set_lock = PTHREAD_MUTEX_INITIALIZER;
+static ConcurrentSet concurrent_set;
+
+typedef struct {
+	int thread;
+	int threads;
+	long found; // Returned, so that the finds cannot be optimized away.
+} ThreadArgs;
+
+static void* run_thread(void* arg) {
+	ThreadArgs* args = arg;
+	uint64_t state = 88172645463325252ULL + args->thread; // xorshift, a different sequence per thread
+	int write_key = 2 * args->thread + 1; // The odd keys of this thread are write_key + 2 * threads * j.
+	bool write_insert = true;
+
+	for (int i = 0; i < ops; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+
+		if (i % WRITE_EVERY == WRITE_EVERY - 1) {
+			Pointer value = &keys[write_key];
+			if (concurrent_set != NULL) {
+				if (write_insert)
+					concurrent_set_insert(concurrent_set, value);
+				else
+					concurrent_set_remove(concurrent_set, value);
+			} else {
+				pthread_mutex_lock(&set_lock);
+				if (write_insert)
+					set_insert(locked_set, value);
+				else
+					set_remove(locked_set, value);
+				pthread_mutex_unlock(&set_lock);
+			}
+
+			// Insert a key, then remove it
+			if (!write_insert && (write_key += 2 * args->threads) >= 2 * n)
+				write_key = 2 * args->thread + 1;
+			write_insert = !write_insert;
+
+		} else {
+			Pointer value = &keys[2 * (state % n)];
+			if (concurrent_set != NULL) {
+				args->found += concurrent_set_find(concurrent_set, value) != NULL;
+			} else {
+				pthread_mutex_lock(&set_lock);
+				args->found += set_find(locked_set, value) != NULL;
+				pthread_mutex_unlock(&set_lock);
+			}
+		}
+	}
+	return NULL;
+}
+
+// Runs the workload with the given number of threads, returns the throughput in millions of operations per second.
+
+static double run(int threads) {
+	pthread_t ids[threads];
+	ThreadArgs args[threads];
+
+	double start = now_ns();
+	for (int t = 0; t < threads; t++) {
+		args[t] = (ThreadArgs){ .thread = t, .threads = threads, .found = 0 };
+		pthread_create(&ids[t], NULL, run_thread, &args[t]);
+	}
+
+	long found = 0;
+	for (int t = 0; t < threads; t++) {
+		pthread_join(ids[t], NULL);
+		found += args[t].found;
+	}
+	double elapsed = now_ns() - start;
+
+	if (found == 0)
+		printf("  unexpected results!\n");
+	return (double)threads * ops / elapsed * 1e3;
+}
+
+// 1, 2, 4, ... and finally max_threads itself
+
+static int next_thread_count(int threads, int max_threads) {
+	return threads < max_threads && 2 * threads > max_threads ? max_threads : 2 * threads;
+}
+
+int main(int argc, char** argv) {
+	n = argc > 1 ? atoi(argv[1]) : DEFAULT_N;
+	ops = argc > 2 ? atoi(argv[2]) : DEFAULT_OPS;
+	int max_threads = argc > 3 ? atoi(argv[3]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (n <= 0 || ops <= 0 || max_threads <= 0) {
+		fprintf(stderr, "usage: %s [n] [ops per thread] [max threads]\n", argv[0]);
+		return 1;
+	}
+
+	keys = malloc(2 * (size_t)n * sizeof(int));
+	for (int i = 0; i < 2 * n; i++)
+		keys[i] = i;
+
+	locked_set = set_create(compare_ints, NULL);
+	ConcurrentSet filled = concurrent_set_create(compare_ints, NULL);
+	for (int i = 0; i < n; i++) {
+		set_insert(locked_set, &keys[2 * i]);
+		concurrent_set_insert(filled, &keys[2 * i]);
+	}
+
+	printf("n = %d, %d ops per thread, 1 write every %d ops\n", n, ops, WRITE_EVERY);
+	printf("  %-8s %16s %16s\n", "threads", "mutex Mops/s", "concurrent Mops/s");
+	for (int threads = 1; threads <= max_threads; threads = next_thread_count(threads, max_threads)) {
+		concurrent_set = NULL;
+		double locked = run(threads);
+
+		concurrent_set = filled;
+		double concurrent = run(threads);
+
+		printf("  %-8d %16.2f %16.2f\n", threads, locked, concurrent);
+	}
+
+	set_destroy(locked_set);
+	concurrent_set_destroy(filled);
+	free(keys);
+	return 0;
+}
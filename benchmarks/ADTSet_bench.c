@@ -0,0 +1,359 @@
+//////////////////////////////////////////////////////////////////
+//
+// Benchmark for the ADT Set.
+// Any implementation of ADTSet.h can be used, it is chosen at link time (see Makefile).
+//
+// Usage: <impl>_ADTSet_bench [n]
+//
+// The parallel versions (set_visit_parallel_ordered, set_create_from_sorted_parallel) use all cores.
+//
+//////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "ADTSet.h"
+
+#define DEFAULT_N 1000000
+
+// With -DSET_INT_KEYS the set stores the keys themselves instead of pointers to them (see ADTSet.h). They are stored
+// + 1, because set_find returns NULL for the key 0.
+#ifdef SET_INT_KEYS
+#define VALUE(key_pointer) ((Pointer)(intptr_t)(*(key_pointer) + 1))
+#define KEY(value) ((int)(intptr_t)(value) - 1)
+#else
+#define VALUE(key_pointer) ((Pointer)(key_pointer))
+#define KEY(value) (*(int*)(value))
+#endif
+
+
+// The values of the set are pointers to the keys array, so that only the memory of the set itself is measured.
+
+static int compare_ints(Pointer a, Pointer b) {
+	int x = *(int*)a, y = *(int*)b;
+	return (x > y) - (x < y);
+}
+
+// The hash of set_use_hash_index (the index mixes the bits itself)
+
+static uint64_t hash_int(Pointer value) {
+	return (uint64_t)KEY(value);
+}
+
+// Deterministic pseudo-random numbers (xorshift), so that all implementations see the same sequence.
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng_next(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+// Fills perm with a random permutation of 0 ... n-1
+
+static void random_permutation(int* perm, int n) {
+	for (int i = 0; i < n; i++)
+		perm[i] = i;
+	for (int i = n-1; i > 0; i--) {
+		int j = rng_next() % (i+1);
+		int temp = perm[i];
+		perm[i] = perm[j];
+		perm[j] = temp;
+	}
+}
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Bytes currently allocated with malloc, -1 if it cannot be measured on this platform.
+
+static long allocated_bytes(void) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+	struct mallinfo2 info = mallinfo2();
+	return (long)(info.uordblks + info.hblkhd); // large blocks are allocated with mmap, they are counted separately
+#else
+	return -1;
+#endif
+}
+
+static void report(const char* name, double start, int ops) {
+	printf("  %-20s %10.1f ns/op\n", name, (now_ns() - start) / ops);
+}
+
+// The visit function of set_visit, sums the values so that the visit cannot be optimized away.
+
+static long visit_sum;
+
+static void visit_value(Pointer value) {
+	visit_sum += KEY(value);
+}
+
+// The visit function of set_visit_parallel_ordered, each part has its own sum in ctx.
+
+static void visit_value_part(Pointer value, Pointer ctx) {
+	*(long*)ctx += KEY(value);
+}
+
+static void bench(int n, bool use_pool) {
+	printf("n = %d, %s\n", n, use_pool ? "node pool" : "malloc");
+
+	int* keys = malloc(n * sizeof(int)); // keys[i] == 2*i, so the odd numbers are not in the set
+	int* misses = malloc(n * sizeof(int));
+	int* perm = malloc(n * sizeof(int));
+	for (int i = 0; i < n; i++) {
+		keys[i] = 2*i;
+		misses[i] = 2*i + 1;
+	}
+
+	long memory_before = allocated_bytes();
+	Set set = set_create(compare_ints, NULL);
+	if (use_pool)
+		set_use_node_pool(set, true);
+
+	random_permutation(perm, n);
+	double start = now_ns();
+	for (int i = 0; i < n; i++)
+		set_insert(set, VALUE(&keys[perm[i]]));
+	report("insert (random)", start, n);
+
+	long memory_after = allocated_bytes();
+
+	random_permutation(perm, n);
+	long found = 0;
+	start = now_ns();
+	for (int i = 0; i < n; i++)
+		found += set_find(set, VALUE(&keys[perm[i]])) != NULL;
+	report("find (hit)", start, n);
+
+	start = now_ns();
+	for (int i = 0; i < n; i++)
+		found += set_find(set, VALUE(&misses[perm[i]])) != NULL;
+	report("find (miss)", start, n);
+
+	// The same hits, in batches of 64 searches interleaved by set_find_many
+	Pointer* batch_keys = malloc(n * sizeof(Pointer));
+	Pointer* batch_found = malloc(64 * sizeof(Pointer));
+	for (int i = 0; i < n; i++)
+		batch_keys[i] = VALUE(&keys[perm[i]]);
+	start = now_ns();
+	for (int i = 0; i < n; i += 64) {
+		int count = n - i < 64 ? n - i : 64;
+		set_find_many(set, batch_keys + i, count, batch_found);
+		for (int j = 0; j < count; j++)
+			found += batch_found[j] != NULL;
+	}
+	report("find_many (hit)", start, n);
+	free(batch_keys);
+	free(batch_found);
+
+	// Skewed lookups: 90% of them search the same 4096 keys, first without and then with the find cache, if the
+	// implementation has one
+	int* hot = malloc(n * sizeof(int));
+	for (int i = 0; i < n; i++)
+		hot[i] = rng_next() % 10 != 0 ? perm[rng_next() % 4096 % n] : perm[i];
+	long hot_found = 0;
+	start = now_ns();
+	for (int i = 0; i < n; i++)
+		hot_found += set_find(set, VALUE(&keys[hot[i]])) != NULL;
+	report("find (hot keys)", start, n);
+
+	if (set_use_find_cache(set, hash_int, 8192)) {
+		start = now_ns();
+		for (int i = 0; i < n; i++)
+			hot_found += set_find(set, VALUE(&keys[hot[i]])) != NULL;
+		report("find (hot, cached)", start, n);
+		set_use_find_cache(set, NULL, 0);
+		hot_found -= n;
+	}
+	if (hot_found != n)
+		printf("  unexpected results!\n");
+	free(hot);
+
+	set_use_hash_index(set, hash_int);
+	start = now_ns();
+	for (int i = 0; i < n; i++)
+		found += set_find(set, VALUE(&keys[perm[i]])) != NULL;
+	report("find (hit, hashed)", start, n);
+
+	start = now_ns();
+	for (int i = 0; i < n; i++)
+		found += set_find(set, VALUE(&misses[perm[i]])) != NULL;
+	report("find (miss, hashed)", start, n);
+	set_use_hash_index(set, NULL);
+
+	// Consecutive keys, each seek starts from the position of the previous one
+	SetCursor cursor = set_cursor_create(set);
+	start = now_ns();
+	for (int i = 0; i < n; i++)
+		found += set_cursor_seek(cursor, VALUE(&keys[i]));
+	report("cursor seek (next)", start, n);
+	set_cursor_destroy(cursor);
+
+	long sum = 0;
+	start = now_ns();
+	for (SetNode node = set_first(set); node != SET_EOF; node = set_next(set, node))
+		sum += KEY(set_node_value(set, node));
+	report("set_next (scan)", start, n);
+
+	visit_sum = 0;
+	start = now_ns();
+	set_visit(set, visit_value);
+	report("set_visit (scan)", start, n);
+
+	// One part per 1/8 of a thread, so that the threads balance the work
+	int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	int parts = 8 * threads;
+	long* part_sums = calloc(parts, sizeof(long));
+	Pointer* part_ctxs = malloc(parts * sizeof(Pointer));
+	for (int i = 0; i < parts; i++)
+		part_ctxs[i] = &part_sums[i];
+
+	start = now_ns();
+	set_visit_parallel_ordered(set, visit_value_part, part_ctxs, parts, threads);
+	report("set_visit (parallel)", start, n);
+
+	long parallel_sum = 0;
+	for (int i = 0; i < parts; i++)
+		parallel_sum += part_sums[i];
+	free(part_sums);
+	free(part_ctxs);
+
+	random_permutation(perm, n);
+	start = now_ns();
+	for (int i = 0; i < n; i++)
+		set_remove(set, VALUE(&keys[perm[i]]));
+	report("remove (random)", start, n);
+
+	if (memory_before >= 0)
+		printf("  %-20s %10.1f bytes/element\n", "memory", (double)(memory_after - memory_before) / n);
+
+	// The results are used, so that the compiler cannot remove the loops
+	if (found != 4 * (long)n || sum != visit_sum || sum != parallel_sum || set_size(set) != 0)
+		printf("  unexpected results!\n");
+
+	set_destroy(set);
+
+	// The same insertions with write buffers, if the implementation has them
+	set = set_create(compare_ints, NULL);
+	if (use_pool)
+		set_use_node_pool(set, true);
+	if (set_use_write_buffers(set, true)) {
+		random_permutation(perm, n);
+		start = now_ns();
+		for (int i = 0; i < n; i++)
+			set_insert(set, VALUE(&keys[perm[i]]));
+		set_use_write_buffers(set, false); // Empties the buffers, so that all values are in the tree.
+		report("insert (buffered)", start, n);
+
+		if (set_size(set) != n)
+			printf("  unexpected results!\n");
+	}
+	set_destroy(set);
+
+	// The same removals with lazy removal, including the compactions they trigger
+	set = set_create(compare_ints, NULL);
+	if (use_pool)
+		set_use_node_pool(set, true);
+	random_permutation(perm, n); // In order, the BST would degenerate to a list
+	for (int i = 0; i < n; i++)
+		set_insert(set, VALUE(&keys[perm[i]]));
+	set_use_lazy_removal(set, true);
+
+	random_permutation(perm, n);
+	start = now_ns();
+	for (int i = 0; i < n; i++)
+		set_remove(set, VALUE(&keys[perm[i]]));
+	report("remove (lazy)", start, n);
+
+	if (set_size(set) != 0)
+		printf("  unexpected results!\n");
+	set_destroy(set);
+
+	// set_clear takes O(1) (or frees the slabs at once), the insertions that follow destroy the old nodes in steps
+	set = set_create(compare_ints, NULL);
+	if (use_pool)
+		set_use_node_pool(set, true);
+	random_permutation(perm, n);
+	for (int i = 0; i < n; i++)
+		set_insert(set, VALUE(&keys[perm[i]]));
+
+	start = now_ns();
+	set_clear(set);
+	report("clear (whole set)", start, 1);
+
+	start = now_ns();
+	for (int i = 0; i < n; i++)
+		set_insert(set, VALUE(&keys[perm[i]]));
+	report("insert (after clear)", start, n);
+
+	start = now_ns();
+	while (!set_destroy_incremental(set, 1000))
+		;
+	report("destroy (incremental)", start, n);
+
+	// Bulk loading (only once, it does not depend on the pool)
+	if (!use_pool) {
+		Pointer* sorted = malloc(n * sizeof(Pointer));
+		for (int i = 0; i < n; i++)
+			sorted[i] = VALUE(&keys[i]);
+
+		start = now_ns();
+		set = set_create_from_sorted(compare_ints, NULL, sorted, n);
+		report("bulk load", start, n);
+		set_destroy(set);
+
+		start = now_ns();
+		set = set_create_from_sorted_parallel(compare_ints, NULL, sorted, n, threads);
+		report("bulk load (parallel)", start, n);
+		if (set_size(set) != n)
+			printf("  unexpected results!\n");
+
+		start = now_ns();
+		set_freeze(set);
+		report("freeze", start, n);
+
+		long frozen_found = 0;
+		start = now_ns();
+		for (int i = 0; i < n; i++)
+			frozen_found += set_find(set, VALUE(&keys[perm[i]])) != NULL;
+		report("find (hit, frozen)", start, n);
+
+		start = now_ns();
+		for (int i = 0; i < n; i++)
+			frozen_found += set_find(set, VALUE(&misses[perm[i]])) != NULL;
+		report("find (miss, frozen)", start, n);
+
+		if (frozen_found != n)
+			printf("  unexpected results!\n");
+		set_destroy(set);
+
+		free(sorted);
+	}
+	free(keys);
+	free(misses);
+	free(perm);
+}
+
+int main(int argc, char** argv) {
+	int n = argc > 1 ? atoi(argv[1]) : DEFAULT_N;
+	if (n <= 0) {
+		fprintf(stderr, "usage: %s [n]\n", argv[0]);
+		return 1;
+	}
+
+	bench(n, false);
+	bench(n, true);
+	return 0;
+}
@@ -0,0 +1,572 @@
+//////////////////////////////////////////////////////////////////
+//
+// Workload benchmarks for the ADT Set.
+// Any implementation of ADTSet.h can be used, it is chosen at link time (see Makefile).
+//
+// Runs each workload for each set size and prints one machine-readable record per (workload, size), with the
+// throughput (mean ns/op) and the p50/p99 latency of single operations.
+//
+// Usage: <impl>_ADTSet_workload [options]
+//   --sizes 1000,1000000    set sizes (default 1000,10000,100000,1000000, up to 1e8 is supported memory permitting)
+//   --workloads a,b,...     workloads to run (default all, see the workloads table)
+//   --format csv|json       csv (default, with a header line) or json (one object per line)
+//   --sorted-max n          skip insert_sorted for sizes above n (eg for the BST, which degrades to a list)
+//   --pool                  allocate the nodes of the sets from a node pool (set_use_node_pool)
+//   --keys                  search with integer keys instead of compare (set_set_key_func, only UsingBTree uses them)
+//
+//////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "ADTSet.h"
+
+// With -DSET_INT_KEYS the set stores the keys themselves instead of pointers to them (see ADTSet.h). They are stored
+// + 1, because set_find returns NULL for the key 0.
+#ifdef SET_INT_KEYS
+#define VALUE(key_pointer) ((Pointer)(intptr_t)(*(key_pointer) + 1))
+#define KEY(value) ((int)(intptr_t)(value) - 1)
+#else
+#define VALUE(key_pointer) ((Pointer)(key_pointer))
+#define KEY(value) (*(int*)(value))
+#endif
+
+#define MAX_SAMPLES (1 << 20) // Latencies are sampled, at most this many operations per workload are timed
+#define MIN_STRIDE 4 // and at most 1 in MIN_STRIDE operations, so that timing does not affect much the throughput.
+#define ZIPF_THETA 0.99 // Skew of the zipfian lookups, as in YCSB
+#define SCAN_PASSES 3 // Number of full scans of the scan workloads
+
+
+//// Keys, random numbers and time ////////////////////////////////////////////////////////////////////////////////////
+
+// The values of the sets are pointers to the keys array (keys[i] == i), so that no memory is allocated for the values.
+
+static int* keys;
+
+static int compare_ints(Pointer a, Pointer b) {
+	int x = *(int*)a, y = *(int*)b;
+	return (x > y) - (x < y);
+}
+
+// Deterministic pseudo-random numbers (xorshift), so that all implementations see the same sequence.
+
+static uint64_t rng_state;
+
+static uint64_t rng_next(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static double rng_uniform(void) {
+	return (rng_next() >> 11) * (1.0 / 9007199254740992.0); // 53 random bits in [0, 1)
+}
+
+// Fills perm with a random permutation of 0 ... n-1
+
+static void random_permutation(int* perm, int n) {
+	for (int i = 0; i < n; i++)
+		perm[i] = i;
+	for (int i = n-1; i > 0; i--) {
+		int j = rng_next() % (i+1);
+		int temp = perm[i];
+		perm[i] = perm[j];
+		perm[j] = temp;
+	}
+}
+
+// Zipfian ranks 0 ... n-1 (rank 0 is the most frequent), with the method of Gray et al, "Quickly generating
+// billion-record synthetic databases", also used by YCSB. Only zeta(n) needs O(n) time, once per size.
+
+typedef struct {
+	int n;
+	double alpha, zetan, eta, half_pow_theta;
+} Zipf;
+
+static Zipf zipf_create(int n) {
+	double zetan = 0;
+	for (int i = 1; i <= n; i++)
+		zetan += 1 / pow(i, ZIPF_THETA);
+	double zeta2 = 1 + 1 / pow(2, ZIPF_THETA);
+
+	Zipf zipf = {
+		.n = n,
+		.alpha = 1 / (1 - ZIPF_THETA),
+		.zetan = zetan,
+		.eta = (1 - pow(2.0 / n, 1 - ZIPF_THETA)) / (1 - zeta2 / zetan),
+		.half_pow_theta = pow(0.5, ZIPF_THETA),
+	};
+	return zipf;
+}
+
+static int zipf_next(Zipf* zipf) {
+	double u = rng_uniform();
+	double uz = u * zipf->zetan;
+	if (uz < 1)
+		return 0;
+	if (uz < 1 + zipf->half_pow_theta)
+		return 1;
+
+	int rank = zipf->n * pow(zipf->eta * u - zipf->eta + 1, zipf->alpha);
+	return rank < zipf->n ? rank : zipf->n - 1;
+}
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Bytes currently allocated with malloc, -1 if it cannot be measured on this platform.
+
+static long allocated_bytes(void) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+	struct mallinfo2 info = mallinfo2();
+	return (long)(info.uordblks + info.hblkhd); // large blocks are allocated with mmap, they are counted separately
+#else
+	return -1;
+#endif
+}
+
+
+//// Measurements /////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The measurement of a workload: the total time of all operations, and the latencies of the sampled ones.
+
+typedef struct {
+	long ops;
+	double total_ns;
+	double* samples;
+	int sample_count;
+	int stride; // every stride-th operation is timed
+	double bytes_per_element; // memory of the set (after it has been filled), -1 if unknown
+} Result;
+
+static void result_init(Result* result, long ops) {
+	result->ops = ops;
+	result->total_ns = 0;
+	result->stride = ops / MAX_SAMPLES > MIN_STRIDE ? ops / MAX_SAMPLES + 1 : MIN_STRIDE;
+	result->samples = malloc((ops / result->stride + 1) * sizeof(double));
+	result->sample_count = 0;
+	result->bytes_per_element = -1;
+}
+
+// Runs the statement OP (operation number i of result) and adds its latency to the samples if it is sampled.
+
+#define MEASURE(result, i, OP) do {								\
+	if ((i) % (result)->stride == 0) {							\
+		double op_start = now_ns();								\
+		OP;														\
+		(result)->samples[(result)->sample_count++] = now_ns() - op_start;	\
+	} else {													\
+		OP;														\
+	}															\
+} while (0)
+
+static int compare_doubles(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+// Returns the p-th percentile (0 <= p <= 100) of the sorted samples
+
+static double percentile(double* samples, int count, double p) {
+	if (count == 0)
+		return 0;
+	int index = (int)(p / 100 * (count - 1) + 0.5);
+	return samples[index];
+}
+
+// Memory of the set per element, measured from the memory allocated before the set was created
+
+static double memory_per_element(long memory_before, int n) {
+	long memory = allocated_bytes();
+	return memory_before >= 0 && memory >= 0 && n > 0 ? (double)(memory - memory_before) / n : -1;
+}
+
+
+//// Workloads ////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Each workload creates its set(s) with n elements (the keys' universe is 0 ... 2n-1, so half of them can be missing),
+// measures the operations in result, and destroys the set.
+
+static bool use_pool = false;
+static bool use_keys = false;
+
+static int64_t key_of_int(Pointer value) {
+	return *(int*)value;
+}
+
+static Set create_set(void) {
+	Set set = set_create(compare_ints, NULL);
+	if (use_keys)
+		set_set_key_func(set, key_of_int);
+	if (use_pool)
+		set_use_node_pool(set, true);
+	return set;
+}
+
+// Creates a set with the even keys 0, 2, ..., 2n-2 inserted in random order
+
+static Set create_filled_set(int n) {
+	Set set = create_set();
+	int* perm = malloc(n * sizeof(int));
+	random_permutation(perm, n);
+
+	for (int i = 0; i < n; i++)
+		set_insert(set, VALUE(&keys[2 * perm[i]]));
+
+	free(perm);
+	return set;
+}
+
+static void workload_insert_random(int n, Result* result) {
+	int* perm = malloc(n * sizeof(int));
+	random_permutation(perm, n);
+	result_init(result, n);
+
+	long memory_before = allocated_bytes();
+	Set set = create_set();
+
+	double start = now_ns();
+	for (int i = 0; i < n; i++)
+		MEASURE(result, i, set_insert(set, VALUE(&keys[perm[i]])));
+	result->total_ns = now_ns() - start;
+
+	result->bytes_per_element = memory_per_element(memory_before, n);
+	set_destroy(set);
+	free(perm);
+}
+
+static void workload_insert_sorted(int n, Result* result) {
+	result_init(result, n);
+
+	long memory_before = allocated_bytes();
+	Set set = create_set();
+
+	double start = now_ns();
+	for (int i = 0; i < n; i++)
+		MEASURE(result, i, set_insert(set, VALUE(&keys[i])));
+	result->total_ns = now_ns() - start;
+
+	result->bytes_per_element = memory_per_element(memory_before, n);
+	set_destroy(set);
+}
+
+static void workload_find_zipf(int n, Result* result) {
+	long memory_before = allocated_bytes();
+	Set set = create_filled_set(n);
+	double bytes_per_element = memory_per_element(memory_before, n);
+
+	// The most frequent ranks are mapped to random keys, so that the hot keys are spread in the tree
+	int* perm = malloc(n * sizeof(int));
+	random_permutation(perm, n);
+	Zipf zipf = zipf_create(n);
+	result_init(result, n);
+	result->bytes_per_element = bytes_per_element;
+
+	long found = 0;
+	double start = now_ns();
+	for (int i = 0; i < n; i++) {
+		Pointer value = VALUE(&keys[2 * perm[zipf_next(&zipf)]]);
+		MEASURE(result, i, found += set_find(set, value) != NULL);
+	}
+	result->total_ns = now_ns() - start;
+
+	if (found != n)
+		fprintf(stderr, "find_zipf: unexpected results\n");
+
+	set_destroy(set);
+	free(perm);
+}
+
+// n operations on a set with n elements, find_percent% of them are set_find, insert_percent% set_insert and the rest
+// set_remove, all with random keys of the universe.
+
+static void workload_mixed(int n, int find_percent, int insert_percent, Result* result) {
+	long memory_before = allocated_bytes();
+	Set set = create_filled_set(n);
+	double bytes_per_element = memory_per_element(memory_before, n);
+
+	// The operations and keys are chosen before, so that the random numbers are not measured
+	char* ops = malloc(n);
+	int* op_keys = malloc(n * sizeof(int));
+	for (int i = 0; i < n; i++) {
+		int percent = rng_next() % 100;
+		ops[i] = percent < find_percent ? 'f' : percent < find_percent + insert_percent ? 'i' : 'r';
+		op_keys[i] = rng_next() % (2 * n);
+	}
+	result_init(result, n);
+	result->bytes_per_element = bytes_per_element;
+
+	double start = now_ns();
+	for (int i = 0; i < n; i++) {
+		Pointer value = VALUE(&keys[op_keys[i]]);
+		if (ops[i] == 'f')
+			MEASURE(result, i, set_find(set, value));
+		else if (ops[i] == 'i')
+			MEASURE(result, i, set_insert(set, value));
+		else
+			MEASURE(result, i, set_remove(set, value));
+	}
+	result->total_ns = now_ns() - start;
+
+	set_destroy(set);
+	free(ops);
+	free(op_keys);
+}
+
+static void workload_mixed_read_mostly(int n, Result* result) {
+	workload_mixed(n, 90, 5, result);
+}
+
+static void workload_mixed_balanced(int n, Result* result) {
+	workload_mixed(n, 50, 25, result);
+}
+
+static void workload_mixed_write_heavy(int n, Result* result) {
+	workload_mixed(n, 10, 45, result);
+}
+
+// The visit function of set_visit samples the time between consecutive calls, as the latency of each element.
+
+static Result* visit_result;
+static long visit_count;
+static double visit_last;
+
+static void visit_value(Pointer value) {
+	if (visit_last != 0) {
+		visit_result->samples[visit_result->sample_count++] = now_ns() - visit_last;
+		visit_last = 0;
+	}
+	if (++visit_count % visit_result->stride == 0)
+		visit_last = now_ns();
+}
+
+static void workload_scan_visit(int n, Result* result) {
+	long memory_before = allocated_bytes();
+	Set set = create_filled_set(n);
+	double bytes_per_element = memory_per_element(memory_before, n);
+	result_init(result, (long)SCAN_PASSES * n);
+	result->bytes_per_element = bytes_per_element;
+
+	visit_result = result;
+	visit_count = 0;
+	visit_last = 0;
+
+	double start = now_ns();
+	for (int pass = 0; pass < SCAN_PASSES; pass++)
+		set_visit(set, visit_value);
+	result->total_ns = now_ns() - start;
+
+	set_destroy(set);
+}
+
+static void workload_scan_next(int n, Result* result) {
+	long memory_before = allocated_bytes();
+	Set set = create_filled_set(n);
+	double bytes_per_element = memory_per_element(memory_before, n);
+	result_init(result, (long)SCAN_PASSES * n);
+	result->bytes_per_element = bytes_per_element;
+
+	long i = 0, sum = 0;
+	double start = now_ns();
+	for (int pass = 0; pass < SCAN_PASSES; pass++) {
+		for (SetNode node = set_first(set); node != SET_EOF; i++) {
+			sum += KEY(set_node_value(set, node));
+			MEASURE(result, i, node = set_next(set, node));
+		}
+	}
+	result->total_ns = now_ns() - start;
+
+	if (i != result->ops || sum != (long)SCAN_PASSES * n * (n - 1)) // the keys are 0, 2, ..., 2n-2
+		fprintf(stderr, "scan_next: unexpected results\n");
+
+	set_destroy(set);
+}
+
+// Steady state: each operation removes a random present key and inserts a random missing one, so the size stays n.
+
+static void workload_churn(int n, Result* result) {
+	long memory_before = allocated_bytes();
+	Set set = create_filled_set(n);
+	double bytes_per_element = memory_per_element(memory_before, n);
+
+	// present holds the keys in the set (initially the even ones) and missing the rest, removing present[j] and
+	// inserting missing[j] swaps them.
+	int* present = malloc(n * sizeof(int));
+	int* missing = malloc(n * sizeof(int));
+	for (int i = 0; i < n; i++) {
+		present[i] = 2*i;
+		missing[i] = 2*i + 1;
+	}
+	int* positions = malloc(2 * n * sizeof(int));
+	for (int i = 0; i < n; i++) {
+		positions[i] = rng_next() % n;
+		positions[n + i] = rng_next() % n;
+	}
+	result_init(result, n);
+	result->bytes_per_element = bytes_per_element;
+
+	double start = now_ns();
+	for (int i = 0; i < n; i++) {
+		int p = positions[i], m = positions[n + i];
+		MEASURE(result, i, (set_remove(set, VALUE(&keys[present[p]])), set_insert(set, VALUE(&keys[missing[m]]))));
+
+		int temp = present[p];
+		present[p] = missing[m];
+		missing[m] = temp;
+	}
+	result->total_ns = now_ns() - start;
+
+	if (set_size(set) != n)
+		fprintf(stderr, "churn: unexpected results\n");
+
+	set_destroy(set);
+	free(present);
+	free(missing);
+	free(positions);
+}
+
+typedef void (*WorkloadFunc)(int n, Result* result);
+
+static struct {
+	const char* name;
+	WorkloadFunc run;
+} workloads[] = {
+	{ "insert_random", workload_insert_random },
+	{ "insert_sorted", workload_insert_sorted },
+	{ "find_zipf", workload_find_zipf },
+	{ "mixed_90_5_5", workload_mixed_read_mostly },
+	{ "mixed_50_25_25", workload_mixed_balanced },
+	{ "mixed_10_45_45", workload_mixed_write_heavy },
+	{ "scan_visit", workload_scan_visit },
+	{ "scan_next", workload_scan_next },
+	{ "churn", workload_churn },
+};
+
+#define WORKLOAD_COUNT (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+
+//// Output and main //////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void print_result(const char* impl, const char* workload, int n, Result* result, bool json) {
+	qsort(result->samples, result->sample_count, sizeof(double), compare_doubles);
+	double p50 = percentile(result->samples, result->sample_count, 50);
+	double p99 = percentile(result->samples, result->sample_count, 99);
+	double mean = result->total_ns / result->ops;
+
+	if (json)
+		printf("{\"impl\": \"%s\", \"pool\": %s, \"keys\": %s, \"workload\": \"%s\", \"n\": %d, \"ops\": %ld, \"total_ns\": %.0f, "
+			"\"ns_per_op\": %.1f, \"p50_ns\": %.0f, \"p99_ns\": %.0f, \"bytes_per_element\": %.1f}\n",
+			impl, use_pool ? "true" : "false", use_keys ? "true" : "false", workload, n, result->ops, result->total_ns, mean, p50, p99,
+			result->bytes_per_element);
+	else
+		printf("%s,%d,%d,%s,%d,%ld,%.0f,%.1f,%.0f,%.0f,%.1f\n",
+			impl, use_pool, use_keys, workload, n, result->ops, result->total_ns, mean, p50, p99, result->bytes_per_element);
+	fflush(stdout);
+}
+
+// Returns true if name is in the comma-separated list (NULL matches everything)
+
+static bool in_list(const char* list, const char* name) {
+	if (list == NULL)
+		return true;
+
+	size_t len = strlen(name);
+	for (const char* p = list; p != NULL; p = strchr(p, ',') ? strchr(p, ',') + 1 : NULL)
+		if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+			return true;
+	return false;
+}
+
+// The name of the implementation is the prefix of the executable's name, eg UsingAVL for UsingAVL_ADTSet_workload
+
+static void impl_name(const char* program, char* impl, size_t size) {
+	const char* base = strrchr(program, '/') ? strrchr(program, '/') + 1 : program;
+	const char* end = strstr(base, "_ADTSet");
+	size_t len = end != NULL ? (size_t)(end - base) : strlen(base);
+	if (len >= size)
+		len = size - 1;
+	memcpy(impl, base, len);
+	impl[len] = '\0';
+}
+
+static int usage(const char* program) {
+	fprintf(stderr, "usage: %s [--sizes n,...] [--workloads name,...] [--format csv|json] [--sorted-max n] [--pool] [--keys]\n",
+		program);
+	fprintf(stderr, "workloads:");
+	for (int w = 0; w < WORKLOAD_COUNT; w++)
+		fprintf(stderr, " %s", workloads[w].name);
+	fprintf(stderr, "\n");
+	return 1;
+}
+
+int main(int argc, char** argv) {
+	const char* sizes = "1000,10000,100000,1000000";
+	const char* workload_list = NULL;
+	bool json = false;
+	long sorted_max = -1;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--pool") == 0)
+			use_pool = true;
+		else if (strcmp(argv[i], "--keys") == 0)
+			use_keys = true;
+		else if (i + 1 == argc)
+			return usage(argv[0]);
+		else if (strcmp(argv[i], "--sizes") == 0)
+			sizes = argv[++i];
+		else if (strcmp(argv[i], "--workloads") == 0)
+			workload_list = argv[++i];
+		else if (strcmp(argv[i], "--format") == 0)
+			json = strcmp(argv[++i], "json") == 0;
+		else if (strcmp(argv[i], "--sorted-max") == 0)
+			sorted_max = atol(argv[++i]);
+		else
+			return usage(argv[0]);
+	}
+
+	char impl[64];
+	impl_name(argv[0], impl, sizeof(impl));
+
+	if (!json)
+		printf("impl,pool,keys,workload,n,ops,total_ns,ns_per_op,p50_ns,p99_ns,bytes_per_element\n");
+
+	for (const char* p = sizes; p != NULL; p = strchr(p, ',') ? strchr(p, ',') + 1 : NULL) {
+		int n = (int)atof(p); // atof, so that eg 1e6 is accepted
+		if (n <= 0)
+			return usage(argv[0]);
+
+		keys = malloc(2 * (size_t)n * sizeof(int));
+		for (int i = 0; i < 2*n; i++)
+			keys[i] = i;
+
+		for (int w = 0; w < WORKLOAD_COUNT; w++) {
+			if (!in_list(workload_list, workloads[w].name))
+				continue;
+			if (workloads[w].run == workload_insert_sorted && sorted_max >= 0 && n > sorted_max)
+				continue;
+
+			rng_state = 88172645463325252ULL; // the same sequence for every workload and implementation
+
+			Result result;
+			workloads[w].run(n, &result);
+			print_result(impl, workloads[w].name, n, &result, json);
+			free(result.samples);
+		}
+
+		free(keys);
+	}
+
+	return 0;
+}
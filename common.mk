@@ -61,6 +61,23 @@ ifneq (,$(findstring coverage,$(MAKECMDGOALS)))
 	override LDFLAGS += --coverage
 endif
 
+# Bench mode: αν το Makefile ορίζει BENCH (πχ benchmarks/Makefile) ή στα targets υπάρχει κάποιο bench*,
+# τότε κάνουμε compile με optimizations και χωρίς τα assert, ώστε να μετράμε τον κώδικα που θα χρησιμοποιούνταν
+# στην πράξη. Τα objects σε bench mode ονομάζονται *.bench.o (βλ. κανόνες), για να μην αναμειγνύονται με τα
+# κανονικά objects που έχουν γίνει compile χωρίς optimizations.
+#   -O3            Optimizations
+#   -march=native  Χρήση όλων των εντολών του επεξεργαστή στον οποίο γίνεται το compile
+#   -DNDEBUG       Απενεργοποιεί τα assert
+#   -flto          Link time optimization, μόνο αν ορίσουμε LTO, πχ: make LTO=1 run
+#
+ifneq (,$(BENCH)$(findstring bench,$(MAKECMDGOALS)))
+	override CFLAGS += -O3 -march=native -DNDEBUG
+	ifdef LTO
+		override CFLAGS += -flto
+		override LDFLAGS += -flto
+	endif
+endif
+
 # compiler
 CC = gcc
 
@@ -122,6 +139,11 @@ $(LIBS): $$($$@_OBJS)
 #
 -include $(DEPS)
 
+# Τα objects του bench mode (*.bench.o) γίνονται compile από το ίδιο .c με τα κανονικά objects.
+# Το .d αρχείο τους είναι το *.bench.d, οπότε περιλαμβάνεται κι αυτό στα DEPS.
+%.bench.o: %.c
+	$(CC) $(CFLAGS) -c $< -o $@
+
 # Το make clean καθαρίζει οτιδήποτε φτιάχνεται από αυτό το Makefile
 clean:
 	@$(RM) $(PROGS) $(LIBS) $(OBJS) $(DEPS) $(COV_FILES)
@@ -0,0 +1,59 @@
+////////////////////////////////////////////////////////////////////////
+//
+// ADT ConcurrentSet
+//
+// A Set (see ADTSet.h) that can be shared by many threads, for
+// read-mostly workloads. The readers never wait for a lock: they
+// call set_find, set_first/set_next, set_visit etc without
+// blocking each other or being blocked by the writers, so the read
+// throughput scales with the number of cores. The writers
+// (insert/remove) are serialized among themselves.
+//
+// Works with any implementation of ADTSet.h, chosen at link time.
+//
+////////////////////////////////////////////////////////////////////////
+
+#pragma once // #include at most once
+
+#include "ADTSet.h"
+
+
+// A concurrent set is represented by the type ConcurrentSet
+
+typedef struct concurrent_set* ConcurrentSet;
+
+
+// Creates and returns a concurrent set, with the same arguments as set_create. The set keeps 2 copies of the tree
+// (see ConcurrentSet.c), so it needs twice the memory of a Set, but the values themselves are not copied.
+
+ConcurrentSet concurrent_set_create(CompareFunc compare, DestroyFunc destroy_value);
+
+// Same as set_insert / set_remove. Can be called by any thread, the writers are executed one at a time. An old value
+// (replaced or removed) is destroyed only when no reader can access it any more.
+
+void concurrent_set_insert(ConcurrentSet cset, Pointer value);
+
+bool concurrent_set_remove(ConcurrentSet cset, Pointer value);
+
+// Same as set_find / set_size, without blocking.
+
+Pointer concurrent_set_find(ConcurrentSet cset, Pointer value);
+
+int concurrent_set_size(ConcurrentSet cset);
+
+// Starts a read section, and returns a Set that contains the values of cset at that moment. Any function of ADTSet.h
+// that does not modify the set can be called on it (set_find, set_first, set_next, set_visit, set_rank etc), until
+// the read section of the thread ends with concurrent_set_read_end. The writers do not modify this Set while the
+// section is active, so the SetNodes remain valid until the end of the section. A thread can have one active read
+// section at a time, and must not call concurrent_set_insert/remove of the same cset while it is active.
+//
+// set_use_find_cache must not be called on this Set: with a find cache set_find writes to the slots of the cache, and
+// the readers call it at the same time.
+
+Set concurrent_set_read_begin(ConcurrentSet cset);
+
+void concurrent_set_read_end(ConcurrentSet cset);
+
+// Releases all memory bound to the set. No other thread can be using it.
+
+void concurrent_set_destroy(ConcurrentSet cset);
@@ -10,6 +10,8 @@
 
 #pragma once // #include at most once
 
+#include <stdint.h>
+
 #include "common_types.h"
 
 
@@ -24,9 +26,39 @@ typedef struct set* Set;
 
 Set set_create(CompareFunc compare, DestroyFunc destroy_value);
 
+// Integer keys: if an implementation is compiled with -DSET_INT_KEYS, it implements a set of integers. The values are
+// intptr_t keys stored directly in the Pointer, eg set_insert(set, (Pointer)(intptr_t)key), they are ordered as
+// integers, and they are compared inline, without calling a compare function (the compare argument of set_create is
+// ignored). destroy_value should be NULL. Note that set_find returns NULL both for the key 0 and for a missing key,
+// set_find_node distinguishes them.
+
+// Like set_create, for the B-tree implementation (UsingBTree): every node of the tree has at most
+// order children (order >= 3), so the fan-out can be tuned eg to fill a cache line or a page.
+// set_create uses a default order of 5. The BST and AVL implementations ignore order.
+
+Set set_create_with_order(CompareFunc compare, DestroyFunc destroy_value, int order);
+
+// Creates and returns a set that contains the n values of the values array, which must be sorted (according to
+// compare) and without duplicates. The tree is built directly, in O(n) time, instead of n calls to set_insert.
+// The array itself is not stored in the set, the caller can free it.
+
+Set set_create_from_sorted(CompareFunc compare, DestroyFunc destroy_value, Pointer* values, int n);
+
+// Same as set_create_from_sorted, but the values can be in any order and contain duplicates: they are first sorted
+// in O(n log n). Of equivalent values only the last one is kept and the rest are destroyed with destroy_value,
+// exactly as with n calls to set_insert. The array is not modified.
+
+Set set_create_from_array(CompareFunc compare, DestroyFunc destroy_value, Pointer* values, int n);
+
+// Same as set_create_from_sorted, but the tree is built by nthreads threads (the calling thread and nthreads-1 new
+// ones): the upper levels of the tree are built first, and the independent subtrees below them at the same time.
+// The resulting tree is the same as that of set_create_from_sorted.
+
+Set set_create_from_sorted_parallel(CompareFunc compare, DestroyFunc destroy_value, Pointer* values, int n, int nthreads);
+
 // Returns the number of elements contained in the set set.
 
-int set_size(Set set);;
+int set_size(Set set);
 
 // Adds the value value to the set, replacing any previous value equivalent to value.
 //
@@ -41,19 +73,213 @@ void set_insert(Set set, Pointer value);
 
 bool set_remove(Set set, Pointer value);
 
+// Insert / remove the n values of the values array, which must be sorted, with the same result as n calls
+// to set_insert / set_remove (including the calls to destroy_value). They are faster than the separate calls, since
+// consecutive values are usually close in the tree. Return the number of values actually added / removed.
+
+int set_insert_many(Set set, Pointer* values, int n);
+int set_remove_many(Set set, Pointer* values, int n);
+
 // Returns the unique value of set equivalent to value, or NULL if none exists
 
 Pointer set_find(Set set, Pointer value);
 
+// Stores in out[i] the result of set_find(set, keys[i]), for each of the n keys (in any order). The searches are
+// interleaved in groups of FIND_GROUP (default 16): each round advances every search of the group by one node and
+// prefetches the next node of its path, so the cache misses of the group overlap instead of waiting for each other.
+// In a large set this is several times faster than n calls to set_find.
+
+void set_find_many(Set set, Pointer* keys, int n, Pointer* out);
+
 // Changes the function called on each element removal/replacement to
 // destroy_value. Returns the previous value of the function.
 
-DestroyFunc set_set_destroy_value(Set set, DestroyFunc destroy_value);;
+DestroyFunc set_set_destroy_value(Set set, DestroyFunc destroy_value);
+
+// If use_pool is true, the nodes of the set are allocated from a pool of slabs that belongs to the set, instead
+// of a separate malloc for each node. This makes insertions/removals cheaper and keeps the nodes close in memory,
+// and set_destroy of a set without destroy_value frees all nodes at once, in O(number of slabs). Freed nodes are
+// reused by the set, but their memory is returned to the system only by set_destroy. Can only be called while
+// the set is empty. The BST and AVL implementations always allocate their (24-byte) nodes from such slabs, so there
+// it has no effect.
+
+void set_use_node_pool(Set set, bool use_pool);
+
+// Function that maps a value to an integer key, consistent with compare: compare(a, b) < 0 if and only if
+// key(a) < key(b) (so equivalent values have the same key).
+typedef int64_t (*KeyFunc)(Pointer value);
+
+// With a key function, the searches compare integer keys instead of calling compare: the key of each value is stored
+// next to it, so the implementation can search a whole node with branchless integer comparisons (vectorized by the
+// compiler). Used only by the B-tree implementation (UsingBTree), in the others it is ignored. Can only be called
+// while the set is empty.
+
+void set_set_key_func(Set set, KeyFunc key);
+
+// If concurrent is true, set_insert, set_remove, set_find and set_size can be called by many threads at the same time.
+// The B-tree implementation (UsingBTree) latches (locks) only the nodes each operation touches, so updates of
+// independent ranges of values run in parallel. While enabled, no other function of the set can be called (no
+// iteration, visit, rank/select or batch operations), and the node pool cannot be used. With false (while no operation
+// is running) all functions can be used again. set_find returns a value that a concurrent set_remove may destroy.
+// Returns false if the implementation does not support concurrent writes (then nothing changes), in which case the
+// set can be shared via ConcurrentSet (see ADTConcurrentSet.h).
+
+bool set_use_concurrent_writes(Set set, bool concurrent);
+
+// If buffered is true, set_insert only adds the value to a write buffer of the root. When a buffer fills, the values
+// for the child that receives most of them are moved in one batch to the buffer of that child, and from the lowest
+// buffers to the leaves with the finger of set_insert_many (a B^epsilon-tree), so each node is visited once per batch
+// instead of once per insertion. set_find also searches the buffers of its path, set_remove removes the value from
+// them and from the tree (removals are not buffered, since set_remove has to search the value to return whether it
+// exists). While enabled, only set_insert, set_remove, set_find and set_size can be used; set_size first empties all
+// buffers to the tree. With false the buffers are emptied and all functions can be used again. Cannot be used together
+// with concurrent writes, the hash index, frozen or mapped sets. Returns false if the implementation has no write
+// buffers (only UsingBTree has them), in which case nothing changes.
+
+bool set_use_write_buffers(Set set, bool buffered);
+
+// If lazy is true, set_remove only marks the value as removed (a tombstone), without merging or rebalancing nodes, so
+// each removal costs a single search. set_find, set_find_node, set_first/last/next/previous, the bounds and the visits
+// skip the marked values, and set_size counts only the others. Inserting a marked value makes it part of the set again.
+// The marked values are destroyed by set_compact, which rebuilds the tree in O(n); it is called automatically when the
+// marked values exceed COMPACT_REMOVED_PERCENT (default 50) percent of the tree, and by set_use_lazy_removal(set,
+// false). Compacting invalidates all SetNodes. The batch operations, set_split/set_join, set_rank/set_select and the
+// parallel visits compact first. Cursors skip the marked values, and set_cursor_remove marks the value without ever
+// compacting, so that the cursor remains valid. Cannot be used together with concurrent writes, write buffers, the hash
+// index, frozen or mapped sets, or (in UsingAVL, whose snapshots share the nodes) snapshots; in UsingBTree only with an
+// order up to 64.
+
+void set_use_lazy_removal(Set set, bool lazy);
+
+// Destroys the values marked by set_remove with lazy removal and rebuilds the tree without them (see
+// set_use_lazy_removal). Does nothing if there are none.
+
+void set_compact(Set set);
+
+// Function that maps a value to a hash, consistent with compare: equivalent values have the same hash.
+typedef uint64_t (*HashFunc)(Pointer value);
+
+// With a hash function, the set also keeps a hash table of its elements, so set_find and set_find_node take O(1)
+// expected time instead of O(log n) (in the B-tree implementation (UsingBTree) set_find_node is O(1) only when the
+// value is missing, since nodes move with each update). Insertions and removals also update the table. The ordered
+// functions (bounds, rank, iteration, visit) are not affected. With NULL the table is removed. Cannot be used together
+// with concurrent writes, snapshots (AVL) or mapped sets.
+
+void set_use_hash_index(Set set, HashFunc hash);
+
+// For skewed (eg Zipfian) lookups, where a few values are searched again and again: the set keeps a direct-mapped
+// cache of slots (rounded up to a power of 2) recently found nodes, indexed by hash, in front of set_find and
+// set_find_node. A value whose slot holds its node is found with a single compare instead of a descent from the root,
+// otherwise the node found by the descent replaces that of the slot. The tree itself, and so the order and all ordered
+// functions, are not affected; set_remove removes the slot of the value (and operations that free many nodes empty the
+// cache). Since set_find then writes to the cache, a set with a cache must not be searched by many threads at the same
+// time. With NULL the cache is removed. Returns false if the implementation has no such cache (UsingBTree, whose
+// SetNodes move with each update). Cannot be used together with snapshots (AVL), set_split or set_join.
+
+bool set_use_find_cache(Set set, HashFunc hash, int slots);
+
+// Returns whether set has a find cache (see set_use_find_cache), in which case set_find is not read-only.
+
+bool set_has_find_cache(Set set);
+
+// Returns a new set with the values that set contains at this moment (a snapshot), which is not affected by later
+// changes of set (nor set by changes of the snapshot). Both are normal sets, destroyed separately with set_destroy.
+// The values themselves are not copied, so the set must have no destroy_value.
+//
+// In the AVL implementation (UsingAVL) the snapshot shares all nodes with set, so it takes O(1) time and memory.
+// Each later change of either set copies only the O(log n) nodes of its path, and a node is freed when no set uses
+// it any more. A snapshot can be read by one thread while another changes set. While the sets share nodes,
+// set_next/set_previous of both search from the root, in O(log n). Once all its snapshots are destroyed, the next update
+// of the remaining set relinks its nodes in a single O(n) pass, and from then on it is a normal set again. The other
+// implementations return an independent copy of the tree, in O(n).
+
+Set set_snapshot(Set set);
+
+// Set algebra, on two sets with the same compare. set_union, set_intersection and set_difference return a new set
+// with the values that are in a or b, in both, or in a but not in b (for equivalent values, the one of a). The values
+// are not copied, so the new set has no destroy_value (and the values of a mapped set remain valid while it is open).
+// set_is_subset returns true if every value of a is in b.
+//
+// The in-place versions change set instead (it cannot be frozen or mapped): set_union_in_place adds the values of
+// other that set does not contain (they are then shared by both sets, so at most one of them can destroy its values),
+// the other two remove values of set as set_remove does (destroying them).
+//
+// The ordered sequences of values are merged in a single pass, O(n + m). If a (or set, except for the union) is much
+// smaller than the other set, each of its values is searched there instead, O(n log m).
+
+Set set_union(Set a, Set b);
+Set set_intersection(Set a, Set b);
+Set set_difference(Set a, Set b);
+bool set_is_subset(Set a, Set b);
+
+void set_union_in_place(Set set, Set other);
+void set_intersection_in_place(Set set, Set other);
+void set_difference_in_place(Set set, Set other);
+
+// set_split splits set in *left, with the values < pivot, and *right, with the values >= pivot (both with the compare
+// and destroy_value of set). The nodes of set are moved to the two sets, set itself must not be used afterwards.
+// set_join returns a set with the values of left and right, where all values of left must be < all values of right
+// (with the destroy_value of left), moving their nodes: left and right must not be used afterwards. Not available for
+// frozen or mapped sets, with the hash index, with concurrent writes or (UsingBTree) with the node pool.
+//
+// In the AVL (UsingAVL) and B-tree (UsingBTree) implementations both take O(log n): the trees are cut along the
+// search path of pivot and the parts are joined again. In the AVL the two sets of a split share the node array of set,
+// so they cannot be modified by different threads at the same time. Joining sets with different arrays (that do not
+// come from splits of the same set) first moves the nodes of the smaller one, in O(min(n, m)), and persistent sets
+// (see set_snapshot) are copied, in O(n). The BST implementation copies the values to new sets, in O(n).
+
+void set_split(Set set, Pointer pivot, Set* left, Set* right);
+Set set_join(Set left, Set right);
+
+// On-disk sets, only in the B-tree implementation (UsingBTree), the others return false / NULL.
+//
+// set_save writes the set to the file path, returns false if it cannot be written. Each value is stored as the
+// value_size bytes it points to (with -DSET_INT_KEYS the keys themselves, value_size is ignored), so the values must
+// not contain pointers.
+//
+// set_open_mmap opens a file of set_save, with the same compare (and the same order of values), without reading or
+// deserializing it: the file is mapped in memory read-only, and the searches run directly on its pages, so opening
+// takes O(1) time regardless of the size, and only the pages actually used are loaded, shared by all processes that
+// open the same file. Returns NULL if the file cannot be opened or was not created by set_save of the same build.
+// The values are pointers to their copies in the file (read-only), valid until set_destroy, which unmaps the file.
+// Only the functions that do not modify the set can be used (find, bounds, rank/select, iteration, visit, except the
+// parallel ones), plus set_size, set_get_stats and set_destroy.
+
+bool set_save(Set set, const char* path, int value_size);
+Set set_open_mmap(const char* path, CompareFunc compare);
+
+// Makes the set read-only (frozen), for sets that are built once and then only searched: the values are moved to a
+// single array in Eytzinger order (a complete binary search tree stored level by level, the children of position k
+// are at 2k and 2k+1), and the nodes of the tree are freed. The array has no pointers besides the values themselves,
+// the first levels share a few cache lines, and each search prefetches the levels below it, so searches have much
+// fewer cache misses than in the nodes of a tree. Only the functions that do not modify the set can be used
+// afterwards (find, bounds, rank/select (in O(log^2 n)), iteration, visit, except the parallel ones), plus set_size,
+// set_get_stats and set_destroy. The hash index (set_use_hash_index) is removed. Not available for mapped sets or
+// with concurrent writes.
+
+void set_freeze(Set set);
 
 // Releases all memory bound to the set.
 // Any operation on set after destroy is undefined.
 
-void set_destroy(Set set);;
+void set_destroy(Set set);
+
+// Removes all values of the set in O(1): the tree is set aside, and each following set_insert / set_remove destroys
+// CLEAR_STEPS (default 8) of its nodes (and values, if destroy_value != NULL), so that no single call pays for the
+// whole tree. A set without destroy_value frees the nodes at once, and the remaining nodes of a previous set_clear
+// are destroyed first. Not available for mapped or frozen sets or with concurrent writes.
+
+void set_clear(Set set);
+
+// Destroys the set in steps of bounded work, for sets too large to destroy within a single pause: each call does at
+// most budget steps, each of which destroys (or rotates) a node or a value, at most 3 steps per value in total. Returns
+// true once the set has been freed, after which it must not be used again. Until then only set_destroy_incremental
+// (or set_destroy, which finishes the destruction) can be called. A frozen or mapped set is destroyed in a single call.
+//
+// set_destroy, set_clear and set_destroy_incremental use no recursion, so even a degenerate tree (for example a BST
+// of sorted insertions) cannot overflow the stack.
+
+bool set_destroy_incremental(Set set, int budget);
 
 
 // Destroy the set ////////////////////////////////////////////////////////////
@@ -64,18 +290,35 @@ void set_destroy(Set set);;
 #define SET_BOF (SetNode)0
 #define SET_EOF (SetNode)0
 
-typedef struct set_node* SetNode?
+typedef struct set_node* SetNode;
+
+// CAUTION: in the B-tree implementation (UsingBTree) the values are stored directly in the nodes of the tree,
+// so by default a SetNode is the position (node, index) of its value, valid only until the next set_insert /
+// set_remove (of any value, not only of its own): an insertion or removal shifts the values of its node, or moves
+// them to another node. Code that keeps SetNodes across updates can switch to stable SetNodes (see
+// set_use_stable_nodes), keep the values and find them again with set_find_node, or use a cursor (see
+// set_cursor_create).
+
+// If stable is true, the SetNodes returned from then on remain valid until their value is removed, as in the BST and
+// AVL implementations, where this function has no effect. In the B-tree implementation a stable SetNode is the value
+// itself, so it needs no allocation, but it also becomes invalid when an equivalent value replaces it, and set_next /
+// set_previous search the value from the root to find its position, in O(log n) instead of O(1) amortized (cursors
+// move from their own position and are not affected). The SetNodes returned before the call become invalid. Frozen and
+// mapped sets, which cannot change, keep their own SetNodes. Not available with -DSET_INT_KEYS, where the SetNode of
+// the key 0 would be SET_EOF.
+
+void set_use_stable_nodes(Set set, bool stable);
 
 // Return the first and last node of the set, or SET_BOF / SET_EOF respectively if the set is empty
 
-SetNode set_first(Set set);;
-SetNode set_last(Set set);;
+SetNode set_first(Set set);
+SetNode set_last(Set set);
 
 // Return the next and previous node of the node, or SET_EOF / SET_BOF
 // respectively if the node has no next/previous.
 
-SetNode set_next(Set set, SetNode node);;
-SetNode set_previous(Set set, SetNode node);;
+SetNode set_next(Set set, SetNode node);
+SetNode set_previous(Set set, SetNode node);
 
 // Returns the content of the node node
 
@@ -86,6 +329,64 @@ Pointer set_node_value(Set set, SetNode node);
 
 SetNode set_find_node(Set set, Pointer value);
 
+// Return the node of the smallest element of the set that is >= value (lower bound) or > value (upper bound),
+// or SET_EOF if no such element exists. Together with set_next they allow inequality searches in O(log n).
+
+SetNode set_lower_bound(Set set, Pointer value);
+SetNode set_upper_bound(Set set, Pointer value);
+
+// Returns the number of elements of the set that are < value (the position value has or would have in order).
+// Complexity O(log n).
+
+int set_rank(Set set, Pointer value);
+
+// Returns the node of the k-th smallest element of the set (k = 0 is the first one), or SET_EOF
+// if k < 0 or k >= set_size(set). Complexity O(log n).
+
+SetNode set_select(Set set, int k);
+
+
+// Cursors //////////////////////////////////////////////////////////////////
+//
+// A cursor remembers a position in the set (a node, or SET_EOF after the last one), and its operations start from
+// there instead of the root. A search climbs from the position only up to the smallest subtree that contains the
+// value, so when consecutive operations are close to each other (d elements apart) they usually cost O(log d)
+// instead of O(log n). The set must not be modified while the cursor is used, except through the cursor itself.
+// Not available for mapped sets or with concurrent writes.
+
+typedef struct set_cursor* SetCursor;
+
+// Creates a cursor of set at its first node (SET_EOF if the set is empty). Destroyed with set_cursor_destroy, before
+// set_destroy of its set.
+
+SetCursor set_cursor_create(Set set);
+
+// Returns the node of the position of the cursor, or SET_EOF
+
+SetNode set_cursor_node(SetCursor cursor);
+
+// Moves the cursor to the smallest element that is >= value (SET_EOF if there is none), like set_lower_bound.
+// Returns true if it is equivalent to value.
+
+bool set_cursor_seek(SetCursor cursor, Pointer value);
+
+// Move the cursor to the next / previous node and return it, like set_next / set_previous. Past either end the cursor
+// is at SET_EOF (== SET_BOF), from where set_cursor_next moves to the first node and set_cursor_previous to the last.
+
+SetNode set_cursor_next(SetCursor cursor);
+SetNode set_cursor_previous(SetCursor cursor);
+
+// Same as set_insert, the search starts from the position of the cursor, which then moves to the inserted value.
+
+void set_cursor_insert(SetCursor cursor, Pointer value);
+
+// Removes the value at the position of the cursor (which must not be SET_EOF), like set_remove, and moves the cursor
+// to the next node.
+
+void set_cursor_remove(SetCursor cursor);
+
+void set_cursor_destroy(SetCursor cursor);
+
 
 
 
@@ -98,3 +399,53 @@ typedef void (*VisitFunc)(Pointer value);
 // Calls visit(value) for each element of the set in ordered order
 
 void set_visit(Set set, VisitFunc visit);
+
+// Pointer to a function that "visits" an element value, ctx is an argument given by the caller (eg to collect results)
+
+typedef void (*VisitCtxFunc)(Pointer value, Pointer ctx);
+
+// Calls visit(value, ctx) for each element of the set in ordered order
+
+void set_visit_ctx(Set set, VisitCtxFunc visit, Pointer ctx);
+
+// Calls visit(value) (visit(value, ctx) respectively) in ordered order for each element of the set in the range
+// [lo, hi), that is lo <= value < hi. Complexity O(log n + k), where k is the number of elements visited.
+
+void set_visit_range(Set set, Pointer lo, Pointer hi, VisitFunc visit);
+void set_visit_range_ctx(Set set, Pointer lo, Pointer hi, VisitCtxFunc visit, Pointer ctx);
+
+// Calls visit(value, ctx) for each element of the set, like set_visit_ctx, but from nthreads threads at the same time
+// (the calling thread and nthreads-1 new ones): the set is split in many ranges of consecutive elements, and each
+// thread takes the next range as soon as it finishes the previous one, so that all threads stay busy. So visit must
+// be thread-safe, and the elements are not visited in order. The set must not be modified during the visit.
+
+void set_visit_parallel(Set set, VisitCtxFunc visit, Pointer ctx, int nthreads);
+
+// Ordered reduce: the set is split in parts ranges of consecutive elements, of (almost) equal size, and the elements
+// of range i are visited in order with visit(value, ctxs[i]), by nthreads threads as in set_visit_parallel. Each range
+// is visited by a single thread, so ctxs[i] needs no synchronization, and since range i comes before range i+1,
+// combining ctxs[0], ..., ctxs[parts-1] in this order gives the same result as a sequential visit.
+
+void set_visit_parallel_ordered(Set set, VisitCtxFunc visit, Pointer* ctxs, int parts, int nthreads);
+
+
+//// Statistics, for profiling
+
+// Counters of the work done by a set since its creation, and the current shape of its tree. The counters are collected
+// only if the implementation is compiled with -DSET_STATS, otherwise they cost nothing and are always 0.
+
+typedef struct {
+	long compares; // calls of the compare function
+	long lookups; // searches from the root (set_find, set_insert, set_remove, set_lower_bound, set_rank etc)
+	long nodes_visited; // nodes visited by these searches, nodes_visited / lookups is the average per lookup
+	long rotations; // single rotations (AVL), a double rotation counts as 2
+	long splits, merges, transfers; // splits, merges and transfers of values between siblings (B-tree)
+	long allocations, frees; // nodes allocated and freed
+	int height; // current height of the tree, 0 if it is empty
+	double fill_factor; // B-tree: values / capacity of the nodes, BST/AVL: size / size of a perfect tree of the same height
+} SetStats;
+
+// Stores in *stats the statistics of the set. Returns true if the counters are collected (-DSET_STATS), otherwise
+// they are set to 0 and only height and fill_factor are computed. Complexity O(n) (for height and fill_factor).
+
+bool set_get_stats(Set set, SetStats* stats);
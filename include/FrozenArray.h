@@ -0,0 +1,71 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Frozen Array
+//
+// Immutable sorted array of values, stored in Eytzinger (BFS) order:
+// the array is a complete binary search tree without pointers, with
+// the children of position k at 2k and 2k+1. Used by the Set
+// implementations for set_freeze.
+//
+////////////////////////////////////////////////////////////////////////
+
+#pragma once // #include at most once
+
+#include "common_types.h"
+
+
+// An array is represented by the type FrozenArray
+
+typedef struct frozen_array* FrozenArray;
+
+// The values are at the positions 1 ... size (position 0 means "no value"), in the Eytzinger order, not in the
+// order of the values. The functions that move between values work with positions.
+
+
+// Creates and returns an array with the n values of values, which must be sorted and without duplicates
+
+FrozenArray frozen_array_create(Pointer* values, int n);
+
+// Returns the number of values of the array
+
+int frozen_array_size(FrozenArray array);
+
+// Returns the value at position position
+
+Pointer frozen_array_value(FrozenArray array, int position);
+
+// Returns the position of the smallest value >= value (or > value if strict), or 0 if there is none
+
+int frozen_array_bound(FrozenArray array, CompareFunc compare, Pointer value, bool strict);
+
+// Returns the position of the value equivalent to value, or 0 if there is none
+
+int frozen_array_find(FrozenArray array, CompareFunc compare, Pointer value);
+
+// Return the position of the smallest / largest value, or 0 if the array is empty
+
+int frozen_array_first(FrozenArray array);
+int frozen_array_last(FrozenArray array);
+
+// Return the position of the next / previous value (in order) of position, or 0 if there is none.
+// Amortized O(1) when traversing the whole array.
+
+int frozen_array_next(FrozenArray array, int position);
+int frozen_array_previous(FrozenArray array, int position);
+
+// Returns the number of values that are < value. Complexity O(log^2 n).
+
+int frozen_array_rank(FrozenArray array, CompareFunc compare, Pointer value);
+
+// Returns the position of the k-th smallest value (k = 0 is the first), or 0 if k < 0 or k >= size.
+// Complexity O(log^2 n).
+
+int frozen_array_select(FrozenArray array, int k);
+
+// Returns the height of the implicit tree, 0 if the array is empty
+
+int frozen_array_height(FrozenArray array);
+
+// Releases all memory of the array. If destroy_value != NULL it is called for each value.
+
+void frozen_array_destroy(FrozenArray array, DestroyFunc destroy_value);
@@ -0,0 +1,59 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Hash Index
+//
+// Hash table (open addressing, linear probing) of items, each of which
+// has a value. An item is found from an equivalent value in O(1)
+// expected time. Used by the Set implementations for
+// set_use_hash_index, the items are the nodes of the tree.
+//
+////////////////////////////////////////////////////////////////////////
+
+#pragma once // #include at most once
+
+#include "ADTSet.h"
+
+
+// An index is represented by the type HashIndex
+
+typedef struct hash_index* HashIndex;
+
+// Pointer to a function that returns the value of an item
+
+typedef Pointer (*ItemValueFunc)(Pointer item);
+
+
+// Creates and returns an empty index. The values are hashed with hash and compared with compare, which must be
+// consistent (equivalent values have the same hash). item_value returns the value of an item, if NULL the items are
+// the values themselves. The value of an item must not change to a non-equivalent one while the item is in the index.
+
+HashIndex hash_index_create(HashFunc hash, CompareFunc compare, ItemValueFunc item_value);
+
+// Returns the item with a value equivalent to value, or NULL if there is none.
+
+Pointer hash_index_find(HashIndex index, Pointer value);
+
+// Returns true if the index has an item with a value equivalent to value (hash_index_find cannot tell a NULL item
+// from a missing one).
+
+bool hash_index_contains(HashIndex index, Pointer value);
+
+// Adds item to the index, replacing the item with an equivalent value, if any.
+
+void hash_index_insert(HashIndex index, Pointer item);
+
+// Removes the item with a value equivalent to value, if any. Returns true if it was found.
+
+bool hash_index_remove(HashIndex index, Pointer value);
+
+// Removes all items of the index (the items themselves are not destroyed).
+
+void hash_index_clear(HashIndex index);
+
+// Returns the number of items of the index.
+
+int hash_index_size(HashIndex index);
+
+// Releases all memory of the index (not the items).
+
+void hash_index_destroy(HashIndex index);
@@ -0,0 +1,41 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Node Pool
+//
+// Allocator of fixed-size nodes. The nodes are taken from large blocks
+// of memory (slabs) that belong to the pool, so allocating and freeing
+// a node are O(1) without calling malloc/free, nodes allocated together
+// are close in memory, and all of them are released at once when the
+// pool is destroyed.
+//
+////////////////////////////////////////////////////////////////////////
+
+#pragma once // #include at most once
+
+#include <stddef.h>
+
+#include "common_types.h"
+
+
+// A pool is represented by the type NodePool
+
+typedef struct node_pool* NodePool;
+
+
+// Creates and returns a pool of nodes of node_size bytes each. Every node is aligned to alignment
+// bytes, which must be a power of 2.
+
+NodePool pool_create(size_t node_size, size_t alignment);
+
+// Returns a new (uninitialized) node of the pool.
+
+Pointer pool_alloc(NodePool pool);
+
+// Returns the node node, which was allocated by pool_alloc, to the pool so that it can be reused.
+
+void pool_free(NodePool pool, Pointer node);
+
+// Releases all memory of the pool, including all nodes that have not been freed, in O(number of slabs).
+// Any operation on pool (or its nodes) after destroy is undefined.
+
+void pool_destroy(NodePool pool);
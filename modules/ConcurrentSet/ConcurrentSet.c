@@ -0,0 +1,196 @@
+///////////////////////////////////////////////////////////
+//
+// Implementation of the ADT ConcurrentSet via 2 Sets (Left-Right)
+//
+///////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+
+#include "ADTConcurrentSet.h"
+
+// The set keeps 2 copies of the same tree. The readers use the read copy without any lock, while the writer modifies
+// the other copy, then makes it the read copy, waits for all readers of the old read copy to finish, and applies the
+// same modification to it. So a Set is never modified while a reader is using it, and no reader ever waits.
+//
+// To know when the readers of a copy have finished, each reader increases (and at the end decreases) the counter of a
+// read indicator. There are 2 indicators, the version says which one new readers use. The writer switches the version
+// and waits for the readers of both indicators in turn, so also the readers that loaded the old read copy before the
+// switch, but had not yet increased their counter, have finished.
+//
+// Each indicator has a counter per thread (READ_SLOTS, in separate cache lines): the readers of different threads do
+// not write to the same memory, so they do not slow each other down. Threads beyond READ_SLOTS share counters.
+//
+// Note that with -DSET_STATS the readers also update the statistics of the Set, with relaxed atomic additions (see
+// STATS_ADD in the implementations), so the counters of concurrent readers are not lost.
+
+#define READ_SLOTS 64
+#define CACHE_LINE 64
+
+typedef struct {
+	_Alignas(CACHE_LINE) atomic_long readers; // Number of active readers of the threads of this slot.
+} ReadSlot;
+
+typedef struct {
+	ReadSlot slots[READ_SLOTS];
+} ReadIndicator;
+
+struct concurrent_set {
+	ReadIndicator indicators[2]; // The read indicators of the 2 versions.
+	Set sets[2]; // The 2 copies, they contain the same values (the values are not copied).
+	atomic_int read_set; // Index in sets of the copy that new readers use.
+	atomic_int version; // Index in indicators of the indicator that new readers use.
+	pthread_mutex_t write_lock; // Serializes the writers.
+	DestroyFunc destroy_value; // The copies have no destroy_value, the old values are destroyed here.
+};
+
+// Each thread gets a slot of the indicators the first time it reads, and remembers the indicator of its read section.
+
+static atomic_int next_slot;
+static _Thread_local int thread_slot = -1;
+static _Thread_local int thread_version;
+
+static int get_thread_slot(void) {
+	if (thread_slot == -1)
+		thread_slot = atomic_fetch_add(&next_slot, 1) % READ_SLOTS;
+	return thread_slot;
+}
+
+// Waits until no reader uses the indicator.
+
+static void wait_for_readers(ReadIndicator* indicator) {
+	for (int i = 0; i < READ_SLOTS; i++)
+		while (atomic_load(&indicator->slots[i].readers) != 0)
+			sched_yield();
+}
+
+// Called by the writer after switching the read copy: returns when all readers that may still use the old read copy
+// have finished.
+
+static void switch_version_and_wait(ConcurrentSet cset) {
+	int version = atomic_load(&cset->version);
+
+	wait_for_readers(&cset->indicators[!version]); // Readers that arrived at the new indicator before the previous switch.
+	atomic_store(&cset->version, !version);
+	wait_for_readers(&cset->indicators[version]);
+}
+
+// Returns the copy that the writer can modify, no reader uses it. Must be called with write_lock held.
+
+static int write_set_index(ConcurrentSet cset) {
+	return !atomic_load(&cset->read_set);
+}
+
+// Makes the (already modified) write copy the read copy, and waits until the old read copy can be modified.
+
+static void publish_write_set(ConcurrentSet cset, int index) {
+	atomic_store(&cset->read_set, index);
+	switch_version_and_wait(cset);
+}
+
+
+ConcurrentSet concurrent_set_create(CompareFunc compare, DestroyFunc destroy_value) {
+	// The indicators are aligned to the cache lines, so the struct must be allocated with aligned_alloc.
+	size_t size = (sizeof(struct concurrent_set) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+	ConcurrentSet cset = aligned_alloc(CACHE_LINE, size);
+
+	for (int v = 0; v < 2; v++)
+		for (int i = 0; i < READ_SLOTS; i++)
+			atomic_init(&cset->indicators[v].slots[i].readers, 0);
+
+	cset->sets[0] = set_create(compare, NULL);
+	cset->sets[1] = set_create(compare, NULL);
+	assert(!set_has_find_cache(cset->sets[0]) && !set_has_find_cache(cset->sets[1])); // LCOV_EXCL_LINE
+	atomic_init(&cset->read_set, 0);
+	atomic_init(&cset->version, 0);
+	pthread_mutex_init(&cset->write_lock, NULL);
+	cset->destroy_value = destroy_value;
+
+	return cset;
+}
+
+void concurrent_set_insert(ConcurrentSet cset, Pointer value) {
+	pthread_mutex_lock(&cset->write_lock);
+
+	int index = write_set_index(cset);
+	SetNode node = set_find_node(cset->sets[index], value);
+	Pointer old_value = node != SET_EOF ? set_node_value(cset->sets[index], node) : NULL;
+
+	set_insert(cset->sets[index], value);
+	publish_write_set(cset, index);
+	set_insert(cset->sets[!index], value);
+
+	pthread_mutex_unlock(&cset->write_lock);
+
+	// Like set_insert, the old value of an update is destroyed. No reader can access it any more.
+	if (node != SET_EOF && cset->destroy_value != NULL)
+		cset->destroy_value(old_value);
+}
+
+bool concurrent_set_remove(ConcurrentSet cset, Pointer value) {
+	pthread_mutex_lock(&cset->write_lock);
+
+	int index = write_set_index(cset);
+	SetNode node = set_find_node(cset->sets[index], value);
+	if (node == SET_EOF) {
+		pthread_mutex_unlock(&cset->write_lock);
+		return false;
+	}
+	Pointer old_value = set_node_value(cset->sets[index], node);
+
+	set_remove(cset->sets[index], value);
+	publish_write_set(cset, index);
+	set_remove(cset->sets[!index], value);
+
+	pthread_mutex_unlock(&cset->write_lock);
+
+	if (cset->destroy_value != NULL)
+		cset->destroy_value(old_value);
+	return true;
+}
+
+Pointer concurrent_set_find(ConcurrentSet cset, Pointer value) {
+	Set set = concurrent_set_read_begin(cset);
+	Pointer found = set_find(set, value);
+	concurrent_set_read_end(cset);
+	return found;
+}
+
+int concurrent_set_size(ConcurrentSet cset) {
+	Set set = concurrent_set_read_begin(cset);
+	int size = set_size(set);
+	concurrent_set_read_end(cset);
+	return size;
+}
+
+Set concurrent_set_read_begin(ConcurrentSet cset) {
+	int slot = get_thread_slot();
+	int version = atomic_load(&cset->version);
+
+	atomic_fetch_add(&cset->indicators[version].slots[slot].readers, 1);
+	thread_version = version;
+
+	// The read copy is loaded after arriving at the indicator, so the writer waits for us before modifying it.
+	return cset->sets[atomic_load(&cset->read_set)];
+}
+
+void concurrent_set_read_end(ConcurrentSet cset) {
+	assert(thread_slot != -1); // LCOV_EXCL_LINE
+	// The readers call set_find at the same time, which writes to the slots of a find cache (see ADTConcurrentSet.h)
+	assert(!set_has_find_cache(cset->sets[0]) && !set_has_find_cache(cset->sets[1])); // LCOV_EXCL_LINE
+
+	atomic_fetch_sub(&cset->indicators[thread_version].slots[thread_slot].readers, 1);
+}
+
+void concurrent_set_destroy(ConcurrentSet cset) {
+	// The values are destroyed once, together with one of the copies.
+	set_destroy(cset->sets[1]);
+	set_set_destroy_value(cset->sets[0], cset->destroy_value);
+	set_destroy(cset->sets[0]);
+
+	pthread_mutex_destroy(&cset->write_lock);
+	free(cset);
+}
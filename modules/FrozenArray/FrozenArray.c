@@ -0,0 +1,174 @@
+///////////////////////////////////////////////////////////
+//
+// Implementation of the Frozen Array via the Eytzinger layout
+//
+///////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <assert.h>
+
+#include "FrozenArray.h"
+
+#define CACHE_LINE 64
+#define PREFETCH_DISTANCE 16 // The 16 descendants of k, 4 levels below, are at 16k ... 16k+15 (2 cache lines).
+
+// The search visits the positions 1, 2 or 3, 4 ... 7 etc, so the first levels share a few cache lines that stay in
+// the cache, and while the values of a level are compared, the positions 4 levels below are already being loaded
+// (software prefetching). The array is aligned to a cache line, so that these 16 positions are in 2 lines.
+struct frozen_array {
+	Pointer* values; // values[1 ... size], values[0] is not used.
+	int size;
+};
+
+// Stores the sorted values starting from values[*next] at the positions of the subtree of position, in order.
+static void fill_subtree(FrozenArray array, Pointer* values, int* next, long position) {
+	if (position > array->size)
+		return;
+
+	fill_subtree(array, values, next, 2 * position);
+	array->values[position] = values[(*next)++];
+	fill_subtree(array, values, next, 2 * position + 1);
+}
+
+// Returns the number of positions of the subtree of position: one range of consecutive positions per level.
+static int subtree_size(FrozenArray array, long position) {
+	int size = 0;
+	for (long first = position, last = position; first <= array->size; first = 2 * first, last = 2 * last + 1)
+		size += (last < array->size ? last : array->size) - first + 1;
+	return size;
+}
+
+// The descent from the root moves from k to 2k (left) or 2k+1 (right), so the bits of the final position (beyond
+// the last level) are the turns of the path. The bound is the last position where the path turned left: removing
+// the trailing 1 bits (the right turns after it) and the 0 bit of that turn gives its position (0 if there is none).
+static int last_left_turn(long position) {
+	return (int)(position >> __builtin_ffsl(~position));
+}
+
+
+FrozenArray frozen_array_create(Pointer* values, int n) {
+	assert(n >= 0);
+
+	FrozenArray array = malloc(sizeof(*array));
+	size_t bytes = ((size_t)n + 1) * sizeof(Pointer);
+	array->values = aligned_alloc(CACHE_LINE, (bytes + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+	array->values[0] = NULL;
+	array->size = n;
+
+	int next = 0;
+	fill_subtree(array, values, &next, 1);
+	return array;
+}
+
+int frozen_array_size(FrozenArray array) {
+	return array->size;
+}
+
+Pointer frozen_array_value(FrozenArray array, int position) {
+	assert(position >= 1 && position <= array->size);
+	return array->values[position];
+}
+
+// The result of compare only selects the child (right if value[position] < value, or <= value if strict), there
+// is no branch that depends on the values, so the loop continues while the prefetches are in flight.
+int frozen_array_bound(FrozenArray array, CompareFunc compare, Pointer value, bool strict) {
+	long position = 1;
+	while (position <= array->size) {
+		__builtin_prefetch(array->values + PREFETCH_DISTANCE * position);
+		position = 2 * position + (compare(array->values[position], value) < (int)strict);
+	}
+	return last_left_turn(position);
+}
+
+int frozen_array_find(FrozenArray array, CompareFunc compare, Pointer value) {
+	int position = frozen_array_bound(array, compare, value, false);
+	return position != 0 && compare(array->values[position], value) == 0 ? position : 0;
+}
+
+int frozen_array_first(FrozenArray array) {
+	if (array->size == 0)
+		return 0;
+
+	long position = 1;
+	while (2 * position <= array->size)
+		position = 2 * position;
+	return (int)position;
+}
+
+int frozen_array_last(FrozenArray array) {
+	if (array->size == 0)
+		return 0;
+
+	long position = 1;
+	while (2 * position + 1 <= array->size)
+		position = 2 * position + 1;
+	return (int)position;
+}
+
+// As in a tree: the smallest of the right subtree, otherwise the first ancestor that has position in its left subtree.
+int frozen_array_next(FrozenArray array, int position) {
+	long next = 2 * (long)position + 1;
+	if (next > array->size)
+		return last_left_turn(position); // Climb the right turns, and the left turn before them.
+
+	while (2 * next <= array->size)
+		next = 2 * next;
+	return (int)next;
+}
+
+int frozen_array_previous(FrozenArray array, int position) {
+	long previous = 2 * (long)position;
+	if (previous > array->size)
+		return position >> __builtin_ffs(position); // Climb the left turns (0 bits), and the right turn before them.
+
+	while (2 * previous + 1 <= array->size)
+		previous = 2 * previous + 1;
+	return (int)previous;
+}
+
+int frozen_array_rank(FrozenArray array, CompareFunc compare, Pointer value) {
+	int rank = 0;
+	for (long position = 1; position <= array->size; ) {
+		if (compare(array->values[position], value) < 0) {
+			rank += subtree_size(array, 2 * position) + 1; // The left subtree and the position itself are < value.
+			position = 2 * position + 1;
+		} else {
+			position = 2 * position;
+		}
+	}
+	return rank;
+}
+
+int frozen_array_select(FrozenArray array, int k) {
+	if (k < 0 || k >= array->size)
+		return 0;
+
+	long position = 1;
+	for (;;) {
+		int left_size = subtree_size(array, 2 * position);
+		if (k < left_size) {
+			position = 2 * position;
+		} else if (k == left_size) {
+			return (int)position;
+		} else {
+			k -= left_size + 1;
+			position = 2 * position + 1;
+		}
+	}
+}
+
+int frozen_array_height(FrozenArray array) {
+	int height = 0;
+	for (long first = 1; first <= array->size; first = 2 * first)
+		height++;
+	return height;
+}
+
+void frozen_array_destroy(FrozenArray array, DestroyFunc destroy_value) {
+	if (destroy_value != NULL)
+		for (int i = 1; i <= array->size; i++)
+			destroy_value(array->values[i]);
+
+	free(array->values);
+	free(array);
+}
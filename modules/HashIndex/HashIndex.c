@@ -0,0 +1,153 @@
+///////////////////////////////////////////////////////////
+//
+// Implementation of the Hash Index via open addressing
+//
+///////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "HashIndex.h"
+
+#define MIN_CAPACITY 16 // The table has a power of 2 entries, at least 16,
+#define MAX_LOAD_PERCENT 70 // and it is doubled when more than 70% are used.
+
+// An entry of the table. The hash of the value is stored, so that a probe calls compare only if the hashes are equal,
+// and so that the table can grow without calling hash again. The stored hash is never 0, 0 means an empty entry
+// (the item itself can be NULL, eg the key 0 with SET_INT_KEYS).
+typedef struct {
+	uint64_t hash;
+	Pointer item;
+} HashEntry;
+
+struct hash_index {
+	HashEntry* entries;
+	int capacity; // Number of entries, a power of 2.
+	int size; // Number of items.
+	HashFunc hash;
+	CompareFunc compare;
+	ItemValueFunc item_value; // NULL if the items are the values.
+};
+
+// The hash of the user may be weak (eg the key itself), so its bits are mixed (the finalizer of MurmurHash3) before
+// they are used as a position. The low bit is set so that the result is never 0.
+static uint64_t index_hash(HashIndex index, Pointer value) {
+	uint64_t hash = index->hash(value);
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return hash | 1;
+}
+
+static Pointer item_value(HashIndex index, Pointer item) {
+	return index->item_value != NULL ? index->item_value(item) : item;
+}
+
+// Returns the position of the entry of value, or the empty position where it would be added.
+static int index_probe(HashIndex index, Pointer value, uint64_t hash) {
+	int mask = index->capacity - 1;
+	int pos = (int)(hash >> 32) & mask;
+	while (index->entries[pos].hash != 0 &&
+		(index->entries[pos].hash != hash || index->compare(item_value(index, index->entries[pos].item), value) != 0))
+		pos = (pos + 1) & mask;
+	return pos;
+}
+
+static void index_resize(HashIndex index, int capacity) {
+	HashEntry* old_entries = index->entries;
+	int old_capacity = index->capacity;
+
+	index->entries = calloc(capacity, sizeof(HashEntry));
+	index->capacity = capacity;
+
+	// The values of the table are different, so they are added without comparisons.
+	for (int i = 0; i < old_capacity; i++)
+		if (old_entries[i].hash != 0) {
+			int pos = (int)(old_entries[i].hash >> 32) & (capacity - 1);
+			while (index->entries[pos].hash != 0)
+				pos = (pos + 1) & (capacity - 1);
+			index->entries[pos] = old_entries[i];
+		}
+
+	free(old_entries);
+}
+
+
+HashIndex hash_index_create(HashFunc hash, CompareFunc compare, ItemValueFunc item_value) {
+	assert(hash != NULL);
+	assert(compare != NULL);
+
+	HashIndex index = malloc(sizeof(*index));
+	index->entries = calloc(MIN_CAPACITY, sizeof(HashEntry));
+	index->capacity = MIN_CAPACITY;
+	index->size = 0;
+	index->hash = hash;
+	index->compare = compare;
+	index->item_value = item_value;
+	return index;
+}
+
+Pointer hash_index_find(HashIndex index, Pointer value) {
+	return index->entries[index_probe(index, value, index_hash(index, value))].item;
+}
+
+bool hash_index_contains(HashIndex index, Pointer value) {
+	return index->entries[index_probe(index, value, index_hash(index, value))].hash != 0;
+}
+
+void hash_index_insert(HashIndex index, Pointer item) {
+	Pointer value = item_value(index, item);
+	uint64_t hash = index_hash(index, value);
+	int pos = index_probe(index, value, hash);
+
+	if (index->entries[pos].hash == 0) {
+		// A new item, the table grows before it is too full
+		if ((long)(index->size + 1) * 100 > (long)index->capacity * MAX_LOAD_PERCENT) {
+			index_resize(index, 2 * index->capacity);
+			pos = index_probe(index, value, hash);
+		}
+		index->size++;
+	}
+	index->entries[pos] = (HashEntry){ .hash = hash, .item = item };
+}
+
+// The entry is removed without leaving a tombstone: the entries after it (up to the next empty one) that would not be
+// found any more are moved back to its position (backward shift deletion), so the probes stay short.
+bool hash_index_remove(HashIndex index, Pointer value) {
+	int mask = index->capacity - 1;
+	int pos = index_probe(index, value, index_hash(index, value));
+	if (index->entries[pos].hash == 0)
+		return false;
+
+	for (int next = (pos + 1) & mask; index->entries[next].hash != 0; next = (next + 1) & mask) {
+		// The entry at next can move to pos if its home position is not in (pos, next], cyclically.
+		int home = (int)(index->entries[next].hash >> 32) & mask;
+		if (((next - home) & mask) >= ((next - pos) & mask)) {
+			index->entries[pos] = index->entries[next];
+			pos = next;
+		}
+	}
+	index->entries[pos] = (HashEntry){ .hash = 0, .item = NULL };
+	index->size--;
+	return true;
+}
+
+// The table returns to its initial capacity, so that a cleared index does not keep the memory of its largest size.
+void hash_index_clear(HashIndex index) {
+	free(index->entries);
+	index->entries = calloc(MIN_CAPACITY, sizeof(HashEntry));
+	index->capacity = MIN_CAPACITY;
+	index->size = 0;
+}
+
+int hash_index_size(HashIndex index) {
+	return index->size;
+}
+
+void hash_index_destroy(HashIndex index) {
+	free(index->entries);
+	free(index);
+}
@@ -0,0 +1,113 @@
+///////////////////////////////////////////////////////////
+//
+// Implementation of the Node Pool via slabs
+//
+///////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <assert.h>
+
+#include "NodePool.h"
+
+#define FIRST_SLAB_NODES 64 // The first slab has space for 64 nodes, every next one for twice as many,
+#define MAX_SLAB_NODES 65536 // up to 65536 nodes per slab.
+
+// A slab is a block of memory that starts with this header and continues with the nodes.
+typedef struct slab* Slab;
+
+struct slab {
+	Slab next; // The previously allocated slab, so that pool_destroy can free all of them.
+};
+
+// A free node stores the next free node in its own memory, so the free list needs no extra memory.
+typedef struct free_node* FreeNode;
+
+struct free_node {
+	FreeNode next;
+};
+
+struct node_pool {
+	size_t node_size; // Size of each node, a multiple of the alignment.
+	size_t alignment;
+	size_t header_size; // Space for the header at the start of each slab, a multiple of the alignment.
+	int slab_nodes; // Number of nodes of the next slab.
+	Slab slabs; // The list of all slabs, most recent first.
+	FreeNode free_nodes; // The list of freed nodes, reused before taking new space from the slab.
+	char* next; // The unused space of the most recent slab,
+	char* end; // from next until end.
+};
+
+// Returns size rounded up to a multiple of alignment.
+
+static size_t round_up(size_t size, size_t alignment) {
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+NodePool pool_create(size_t node_size, size_t alignment) {
+	assert((alignment & (alignment - 1)) == 0); // power of 2 // LCOV_EXCL_LINE
+
+	// A node must have space for the free list pointer, and the pointer must be properly aligned.
+	if (alignment < sizeof(FreeNode))
+		alignment = sizeof(FreeNode);
+	if (node_size < sizeof(struct free_node))
+		node_size = sizeof(struct free_node);
+
+	NodePool pool = malloc(sizeof(*pool));
+	pool->alignment = alignment;
+	pool->node_size = round_up(node_size, alignment);
+	pool->header_size = round_up(sizeof(struct slab), alignment);
+	pool->slab_nodes = FIRST_SLAB_NODES;
+	pool->slabs = NULL;
+	pool->free_nodes = NULL;
+	pool->next = pool->end = NULL;
+
+	return pool;
+}
+
+// Allocates a new slab, its space becomes the unused space of the pool.
+
+static void pool_add_slab(NodePool pool) {
+	size_t size = pool->header_size + pool->slab_nodes * pool->node_size; // a multiple of the alignment, as aligned_alloc requires
+	Slab slab = aligned_alloc(pool->alignment, size);
+
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+
+	pool->next = (char*)slab + pool->header_size;
+	pool->end = (char*)slab + size;
+
+	if (pool->slab_nodes < MAX_SLAB_NODES)
+		pool->slab_nodes *= 2;
+}
+
+Pointer pool_alloc(NodePool pool) {
+	// Reuse a freed node, if there is one
+	if (pool->free_nodes != NULL) {
+		FreeNode node = pool->free_nodes;
+		pool->free_nodes = node->next;
+		return node;
+	}
+
+	// Otherwise take the next node from the current slab, allocating a new one if it is full
+	if (pool->next == pool->end)
+		pool_add_slab(pool);
+
+	Pointer node = pool->next;
+	pool->next += pool->node_size;
+	return node;
+}
+
+void pool_free(NodePool pool, Pointer node) {
+	FreeNode free_node = node;
+	free_node->next = pool->free_nodes;
+	pool->free_nodes = free_node;
+}
+
+void pool_destroy(NodePool pool) {
+	while (pool->slabs != NULL) {
+		Slab next = pool->slabs->next;
+		free(pool->slabs);
+		pool->slabs = next;
+	}
+	free(pool);
+}
@@ -5,127 +5,415 @@
 ///////////////////////////////////////////////////////////
 
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "ADTSet.h"
+#include "HashIndex.h"
+#include "FrozenArray.h"
+
+// Statistics for set_get_stats, collected only if compiled with -DSET_STATS, otherwise the STATS_* macros are empty.
+// The node_* functions have no access to the set, so they add to current_stats, the statistics of the set whose
+// operation is running, which is set by STATS_ENTER at the start of the set_* functions.
+#ifdef SET_STATS
+static SetStats unused_stats; // current_stats while no set is running an operation
+static _Thread_local SetStats* current_stats = &unused_stats;
+#define STATS_ENTER(set) (current_stats = &(set)->stats)
+// The counters of a set can be updated by many threads at the same time (concurrent readers of a ConcurrentSet,
+// concurrent writes of the B-tree), so they are added with relaxed atomics, which order nothing but lose no addition.
+#define STATS_ADD(field, n) __atomic_fetch_add(&current_stats->field, (n), __ATOMIC_RELAXED)
+#else
+#define STATS_ENTER(set) ((void)0)
+#define STATS_ADD(field, n) ((void)0)
+#endif
+
+// Calls compare(a, b), counting the call With -DSET_INT_KEYS the module implements a set of integer keys: the values
+// are intptr_t stored directly in the Pointer, eg set_insert(set, (Pointer)(intptr_t)key), and they are compared
+// inline instead of calling compare (which is ignored by set_create).
+#ifdef SET_INT_KEYS
+#define COMPARE(compare, a, b) (STATS_ADD(compares, 1), ((intptr_t)(a) > (intptr_t)(b)) - ((intptr_t)(a) < (intptr_t)(b)))
+
+// Used where the compare function itself is needed (eg for sorting in set_create_from_array)
+static int compare_int_keys(Pointer a, Pointer b) {
+	return COMPARE(NULL, a, b);
+}
+#else
+#define COMPARE(compare, a, b) (STATS_ADD(compares, 1), (compare)(a, b))
+#endif
+
+
+// The nodes are stored in the slabs of a node array, and refer to each other with their 32-bit index in it instead of
+// a pointer, so a node takes 24 bytes (instead of 48, plus the header of malloc). The slab k has FIRST_SLAB_NODES * 2^k
+// nodes, so the slab of an index and its position in it follow from its highest bit, and the slabs are never moved: a
+// SetNode is the address of the node. The index 0 (NO_NODE) is never used, it means "no node" like NULL.
+typedef uint32_t NodeIndex;
+
+#define NO_NODE 0
+#define FIRST_SLAB_NODES 8
+#define MAX_NODES (1u << 29) // the size of a subtree is stored in 29 bits
+#define MAX_SLABS 28 // FIRST_SLAB_NODES * (2^28 - 1) >= MAX_NODES
 
+// With lazy removal (see set_use_lazy_removal) the tree is compacted when more than this percentage of its nodes are
+// marked as removed.
+#ifndef COMPACT_REMOVED_PERCENT
+#define COMPACT_REMOVED_PERCENT 50
+#endif
+
+// After set_clear, each set_insert / set_remove also destroys this many nodes of the cleared tree (see set_clear).
+#ifndef CLEAR_STEPS
+#define CLEAR_STEPS 8
+#endif
+
+// set_find_many advances this many searches at a time, so up to this many cache misses are pending at once.
+#ifndef FIND_GROUP
+#define FIND_GROUP 16
+#endif
+
+typedef struct node_array* NodeArray;
 
 // We implement the ADT Set via AVL, so the struct set is an AVL Tree.
 struct set {
-	SetNode root; // the root, NULL if it's an empty tree
+	NodeIndex root; // the root, NO_NODE if it's an empty tree
 	int size; // size, so that set_size is O(1)
 	CompareFunc compare; // the layout
 	DestroyFunc destroy_value; // function that destroys an element of the set
+	NodeArray nodes; // the nodes of the tree, shared with the snapshots. NULL after set_freeze
+	HashIndex hash_index; // the nodes by value (see set_use_hash_index), NULL if not used
+	NodeIndex* find_cache; // recently found nodes, by the hash of their value (see set_use_find_cache), NULL if not used
+	HashFunc find_cache_hash;
+	uint32_t find_cache_mask; // the number of slots - 1, a power of 2 - 1
+	FrozenArray frozen; // the values after set_freeze (root is NO_NODE), otherwise NULL
+	bool persistent; // the nodes may be shared with snapshots (see set_snapshot), the parent pointers are not used
+	bool lazy; // see set_use_lazy_removal
+	int removed; // nodes marked as removed, not counted in size (but in the sizes of the subtrees)
+	NodeArray cleared_nodes; // the array of the tree of set_clear while it is being destroyed, otherwise NULL
+	NodeIndex cleared; // the root of the nodes of that tree that remain
+	DestroyFunc cleared_destroy_value; // the destroy_value of the set at the time of set_clear, for that tree
+#ifdef SET_STATS
+	SetStats stats; // see set_get_stats
+#endif
 };
 
 // While the struct set_node is a node of an AVL Search Tree
 struct set_node {
-	SetNode left, right; // Children
+	NodeIndex left, right; // Children, NO_NODE if there is none
+	NodeIndex parent; // Parent, NO_NODE for the root. Allows set_next/set_previous without searching from the root
+	unsigned int size : 29; // Number of nodes in the subtree rooted at the node, for set_rank / set_select
+	signed int balance : 2; // Height of the left subtree minus the height of the right one: -1, 0 or 1 (AVL)
+	unsigned int removed : 1; // Marked by set_remove with lazy removal (see set_use_lazy_removal)
 	Pointer value; // Node value
-	int height; // Height of the node in the tree
 };
 
+struct node_array {
+	SetNode slabs[MAX_SLABS]; // slab k has the indices from FIRST_SLAB_NODES * (2^k - 1), NULL if not allocated yet
+	atomic_int* refs[MAX_SLABS]; // the references to each node minus 1 (see node_is_shared), only if shared
+	NodeIndex end; // the indices >= end have never been used
+	NodeIndex free_nodes; // the freed nodes, linked through their left index
+	int sets; // number of sets that use the array (a set and its snapshots, or the parts of a set_split)
+	bool shared; // set_snapshot has been called, so a node may belong to several trees
+};
+
+
+//// Node array /////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Returns the slab of index, and stores in *position the position of index in it
+
+static int node_slab(NodeIndex index, NodeIndex* position) {
+	int slab = 31 - __builtin_clz(index / FIRST_SLAB_NODES + 1);
+	*position = index - FIRST_SLAB_NODES * ((1u << slab) - 1);
+	return slab;
+}
+
+// Returns the node with index index (which is not NO_NODE)
+
+static SetNode node_at(NodeArray nodes, NodeIndex index) {
+	NodeIndex position;
+	int slab = node_slab(index, &position);
+	return nodes->slabs[slab] + position;
+}
+
+// Returns the SetNode of index for the user, NULL (SET_EOF) for NO_NODE
+
+static SetNode node_handle(NodeArray nodes, NodeIndex index) {
+	return index != NO_NODE ? node_at(nodes, index) : NULL;
+}
+
+static NodeArray node_array_create(void) {
+	NodeArray nodes = calloc(1, sizeof(*nodes)); // no slabs yet
+	nodes->end = NO_NODE + 1;
+	nodes->free_nodes = NO_NODE;
+	nodes->sets = 1;
+	return nodes;
+}
+
+// Allocates the slabs that contain the indices up to end - 1, if they do not exist yet. The new slabs of a shared
+// array get counters of references too.
+
+static void node_array_grow(NodeArray nodes, NodeIndex end) {
+	assert(end <= MAX_NODES); // LCOV_EXCL_LINE
+
+	NodeIndex position;
+	int last = node_slab(end - 1, &position);
+	for (int slab = 0; slab <= last; slab++) {
+		if (nodes->slabs[slab] != NULL)
+			continue;
+
+		size_t count = (size_t)FIRST_SLAB_NODES << slab;
+		nodes->slabs[slab] = malloc(count * sizeof(struct set_node));
+		if (nodes->shared)
+			nodes->refs[slab] = calloc(count, sizeof(atomic_int)); // 0: a single reference
+	}
+}
+
+// Returns the index of a new (uninitialized) node, reusing a freed one if there is one
+
+static NodeIndex node_array_alloc(NodeArray nodes) {
+	NodeIndex index = nodes->free_nodes;
+	if (index != NO_NODE) {
+		nodes->free_nodes = node_at(nodes, index)->left;
+		return index;
+	}
+
+	node_array_grow(nodes, nodes->end + 1);
+	return nodes->end++;
+}
+
+// Returns the first of n consecutive new indices, for a tree that is built at once (so its nodes are stored in order)
+
+static NodeIndex node_array_alloc_range(NodeArray nodes, int n) {
+	NodeIndex first = nodes->end;
+	if (n > 0)
+		node_array_grow(nodes, first + n);
+	nodes->end += n;
+	return first;
+}
+
+static void node_array_free(NodeArray nodes, NodeIndex index) {
+	node_at(nodes, index)->left = nodes->free_nodes;
+	nodes->free_nodes = index;
+}
+
+// From now on the references to each node are counted (see node_is_shared). A node without a counter has a single
+// reference, so the counters of the existing nodes start from 0.
+
+static void node_array_share(NodeArray nodes) {
+	if (nodes->shared)
+		return;
+
+	nodes->shared = true;
+	for (int slab = 0; slab < MAX_SLABS && nodes->slabs[slab] != NULL; slab++)
+		nodes->refs[slab] = calloc((size_t)FIRST_SLAB_NODES << slab, sizeof(atomic_int));
+}
+
+// The opposite of node_array_share, when a single tree uses the array again: all its nodes have a single reference,
+// so the counters are no longer needed (a later node_array_share starts them again from 0)
+
+static void node_array_unshare(NodeArray nodes) {
+	nodes->shared = false;
+	for (int slab = 0; slab < MAX_SLABS; slab++) {
+		free(nodes->refs[slab]);
+		nodes->refs[slab] = NULL;
+	}
+}
+
+// Called by each set that stops using the array, the last one frees all slabs at once
+
+static void node_array_release(NodeArray nodes) {
+	if (--nodes->sets > 0)
+		return;
+
+	for (int slab = 0; slab < MAX_SLABS; slab++) {
+		free(nodes->slabs[slab]);
+		free(nodes->refs[slab]);
+	}
+	free(nodes);
+}
+
 
 //// Functions that implement additional AVL functions compared to a simple BST /////////////////////////////////////
 
-// Returns the max value between 2 integers
+// Persistent sets (set_snapshot): a node with refs > 1 is shared by several trees, so it cannot be modified. Before
+// modifying a node, each update calls node_own on it, which returns a private copy if it is shared. Since the updates
+// start from the root and own every node of their path, a node with refs == 1 reached this way belongs only to this
+// tree. The readers of the other trees never read refs, so a snapshot can be read while the set is modified.
+
+// Returns the counter of the references to the node index minus 1. Only in shared arrays.
+
+static atomic_int* node_refs(NodeArray nodes, NodeIndex index) {
+	NodeIndex position;
+	int slab = node_slab(index, &position);
+	return nodes->refs[slab] + position;
+}
+
+static bool node_is_shared(NodeArray nodes, NodeIndex index) {
+	return nodes->shared && atomic_load_explicit(node_refs(nodes, index), memory_order_relaxed) > 0;
+}
+
+// Set the left / right child of node, updating the parent of the child (which can be NO_NODE). All modifications
+// of the children go through these functions, so that the parent pointers are always correct. A shared child may have
+// other parents, its parent pointer is left as it is (persistent sets do not use them).
+
+static void node_set_left(NodeArray nodes, NodeIndex index, NodeIndex left) {
+	node_at(nodes, index)->left = left;
+	if (left != NO_NODE && !node_is_shared(nodes, left))
+		node_at(nodes, left)->parent = index;
+}
 
-static int int_max(int a, int b) {
-	return (a > b) ? a : b ;
+static void node_set_right(NodeArray nodes, NodeIndex index, NodeIndex right) {
+	node_at(nodes, index)->right = right;
+	if (right != NO_NODE && !node_is_shared(nodes, right))
+		node_at(nodes, right)->parent = index;
 }
 
-// Returns the height where the node is in the tree
+static NodeIndex node_own(NodeArray nodes, NodeIndex index);
+
+// Returns the number of nodes in the subtree rooted at node
 
-static int node_height(SetNode node) {
-	if (!node) return 0;
-	return node->height;
+static int node_size(NodeArray nodes, NodeIndex index) {
+	if (index == NO_NODE) return 0;
+	return node_at(nodes, index)->size;
 }
 
-// Updates the height of a node
+// Updates the size of the subtree of a node, after a modification of its children
 
-static void node_update_height(SetNode node) {
-	node->height = 1 + int_max(node_height(node->left), node_height(node->right));;
+static void node_update_size(NodeArray nodes, SetNode node) {
+	node->size = 1 + node_size(nodes, node->left) + node_size(nodes, node->right);
 }
 
-// Returns the height difference between the left and right subtree
+// Returns the height of the subtree rooted at node: the nodes store only their balance, so we follow the path that
+// always continues to the higher subtree. Complexity O(log n).
 
-static int node_balance(SetNode node) {
-	return node_height(node->left) - node_height(node->right);
+static int node_height(NodeArray nodes, NodeIndex index) {
+	int height = 0;
+	for (; index != NO_NODE; height++) {
+		SetNode node = node_at(nodes, index);
+		index = node->balance >= 0 ? node->left : node->right;
+	}
+	return height;
 }
 
 // Rotations : When the height difference between the left and right subtree is
 // greater than 1 the tree is no longer AVL. There are 4 different
 // rotations that are applied depending on the case to restore the
 // balance. Each function takes as an argument the node to be
-// rotate, and returns the root of the new subtree.
+// rotate, and returns the root of the new subtree. The single rotations update
+// the sizes, the balances are set by node_repair_balance.
 
 // Single left rotation
 
-static SetNode node_rotate_left(SetNode node) {
-	SetNode right_node = node->right;
-	SetNode left_subtree = right_node->left;
+static NodeIndex node_rotate_left(NodeArray nodes, NodeIndex index) {
+	STATS_ADD(rotations, 1);
+
+	SetNode node = node_at(nodes, index);
+	NodeIndex right_index = node_own(nodes, node->right); // modified below
+	SetNode right_node = node_at(nodes, right_index);
+	NodeIndex left_subtree = right_node->left;
 
-	right_node->left = node;
-	node->right = left_subtree;
+	node_set_left(nodes, right_index, index);
+	node_set_right(nodes, index, left_subtree);
 
-	node_update_height(node);;
-	node_update_height(right_node);;
-	
-	return right_node;
+	node_update_size(nodes, node);
+	node_update_size(nodes, right_node);
+
+	return right_index;
 }
 
 // Single right rotation
 
-static SetNode node_rotate_right(SetNode node) {
-	SetNode left_node = node->left;
-	SetNode left_right = left_node->right;
+static NodeIndex node_rotate_right(NodeArray nodes, NodeIndex index) {
+	STATS_ADD(rotations, 1);
+
+	SetNode node = node_at(nodes, index);
+	NodeIndex left_index = node_own(nodes, node->left); // modified below
+	SetNode left_node = node_at(nodes, left_index);
+	NodeIndex left_right = left_node->right;
+
+	node_set_right(nodes, left_index, index);
+	node_set_left(nodes, index, left_right);
+
+	node_update_size(nodes, node);
+	node_update_size(nodes, left_node);
 
-	left_node->right = node;
-	node->left = left_right;
+	return left_index;
+}
+
+// After a double rotation the former grandchild is the root, with balance 0. The node that took its left subtree is
+// higher on the left only if the right subtree of the grandchild was the higher one, and vice versa.
 
-	node_update_height(node);;
-	node_update_height(left_node);;
-	
-	return left_node;
+static NodeIndex node_balance_double_rotation(NodeArray nodes, NodeIndex root, int grandchild_balance) {
+	SetNode node = node_at(nodes, root);
+	node_at(nodes, node->left)->balance = grandchild_balance == -1 ? 1 : 0;
+	node_at(nodes, node->right)->balance = grandchild_balance == 1 ? -1 : 0;
+	node->balance = 0;
+	return root;
 }
 
 // Double left-right rotation
 
-static SetNode node_rotate_left_right(SetNode node) {
-	node->left = node_rotate_left(node->left);;
-	return node_rotate_right(node);;
+static NodeIndex node_rotate_left_right(NodeArray nodes, NodeIndex index) {
+	NodeIndex left = node_own(nodes, node_at(nodes, index)->left);
+	int grandchild_balance = node_at(nodes, node_at(nodes, left)->right)->balance;
+
+	node_set_left(nodes, index, node_rotate_left(nodes, left));
+	return node_balance_double_rotation(nodes, node_rotate_right(nodes, index), grandchild_balance);
 }
 
 // Double right-left rotation
 
-static SetNode node_rotate_right_left(SetNode node) {
-	node->right = node_rotate_right(node->right);;
-	return node_rotate_left(node);;
+static NodeIndex node_rotate_right_left(NodeArray nodes, NodeIndex index) {
+	NodeIndex right = node_own(nodes, node_at(nodes, index)->right);
+	int grandchild_balance = node_at(nodes, node_at(nodes, right)->left)->balance;
+
+	node_set_right(nodes, index, node_rotate_right(nodes, right));
+	return node_balance_double_rotation(nodes, node_rotate_left(nodes, index), grandchild_balance);
 }
 
-// Repair the AVL property if not valid
+// Repairs node after the height of its left (if left is true) or right subtree changed by delta (+1, -1, or 0 if it
+// did not change): updates its size and balance, and restores the AVL property if it is not valid. Returns the new
+// root of the subtree, and stores in *changed whether the height of the whole subtree changed (then the parent must be
+// repaired too). The node must not be shared.
 
-static SetNode node_repair_balance(SetNode node) {
-	node_update_height(node);
+static NodeIndex node_repair_balance(NodeArray nodes, NodeIndex index, bool left, int delta, bool* changed) {
+	SetNode node = node_at(nodes, index);
+	node_update_size(nodes, node);
 
-	int balance = node_balance(node);
+	int balance = node->balance + (left ? delta : -delta);
 	if (balance > 1) {
-		// the left subnode is unbalanced
-		if (node_balance(node->left) >= 0) 
-			return node_rotate_right(node);
-		else 
-			return node_rotate_left_right(node);
+		// the left subnode is unbalanced. After an insertion the rotation restores the height of the subtree, after a
+		// removal too only if the left child was balanced. In a join (see node_join) the grown child can also be
+		// balanced, then the subtree is higher after the rotation.
+		int left_balance = node_at(nodes, node->left)->balance;
+		*changed = delta < 0 ? left_balance != 0 : left_balance == 0;
+		if (left_balance >= 0) {
+			NodeIndex root = node_rotate_right(nodes, index);
+			node->balance = left_balance == 0 ? 1 : 0;
+			node_at(nodes, root)->balance = left_balance == 0 ? -1 : 0;
+			return root;
+		} else
+			return node_rotate_left_right(nodes, index);
 
 	} else if (balance < -1) {
 		// the right subnode is unbalanced
-		if (node_balance(node->right) <= 0)
-			return node_rotate_left(node);;
-		else
-			return node_rotate_right_left(node);
+		int right_balance = node_at(nodes, node->right)->balance;
+		*changed = delta < 0 ? right_balance != 0 : right_balance == 0;
+		if (right_balance <= 0) {
+			NodeIndex root = node_rotate_left(nodes, index);
+			node->balance = right_balance == 0 ? -1 : 0;
+			node_at(nodes, root)->balance = right_balance == 0 ? 1 : 0;
+			return root;
+		} else
+			return node_rotate_right_left(nodes, index);
 	}
 
-	// no rotation needed to be performed
-	return node;
+	// no rotation needed to be performed. The subtree became higher if it is no longer balanced after an insertion,
+	// lower if it became balanced after a removal.
+	node->balance = balance;
+	*changed = delta > 0 ? balance != 0 : delta < 0 && balance == 0;
+	return index;
 }
 
 
@@ -136,358 +424,2281 @@ static SetNode node_repair_balance(SetNode node) {
 //
 // Differences are marked with "AVL" in a comment
 
-// Creates and returns a node with value value (no children)
+// Initializes index, a new node of the array, with value value (no children)
 //
-static SetNode node_create(Pointer value) {
-	SetNode node = malloc(sizeof(*node));
-	node->left = NULL;
-	node->right = NULL;
+static void node_init(NodeArray nodes, NodeIndex index, Pointer value) {
+	SetNode node = node_at(nodes, index);
+	node->left = NO_NODE;
+	node->right = NO_NODE;
 	node->value = value;
-	node->height = 1; // AVL
-	return node;
+	node->parent = NO_NODE;
+	node->balance = 0; // AVL
+	node->size = 1;
+	node->removed = 0;
+	if (nodes->shared)
+		atomic_store_explicit(node_refs(nodes, index), 0, memory_order_relaxed); // a single reference
+	STATS_ADD(allocations, 1);
+}
+
+// Creates and returns a node with value value (no children)
+
+static NodeIndex node_create(NodeArray nodes, Pointer value) {
+	NodeIndex index = node_array_alloc(nodes);
+	node_init(nodes, index, value);
+	return index;
 }
 
-// Returns the node with value equal to value in the subtree rooted at node, otherwise NULL
+// Frees the node, returning it to the array to be reused
 
-static SetNode node_find_equal(SetNode node, CompareFunc compare, Pointer value) {
+static void node_free(NodeArray nodes, NodeIndex index) {
+	STATS_ADD(frees, 1);
+	node_array_free(nodes, index);
+}
+
+// Releases a reference to the subtree rooted at node: if no other tree uses the node, it is freed (together with the
+// subtrees that only it uses), destroying the values if destroy_value != NULL.
+
+static void node_release(NodeArray nodes, NodeIndex index, DestroyFunc destroy_value) {
+	if (index == NO_NODE || atomic_fetch_sub(node_refs(nodes, index), 1) > 0)
+		return;
+
+	// first destroy the children, then free the node
+	SetNode node = node_at(nodes, index);
+	node_release(nodes, node->left, destroy_value);
+	node_release(nodes, node->right, destroy_value);
+
+	if (destroy_value != NULL)
+		destroy_value(node->value);
+
+	node_free(nodes, index);
+}
+
+// Returns node itself if it belongs only to this tree, otherwise a private copy of it, which replaces it in the tree
+// (the caller links it to the parent). The children of the copy are then shared by one more node.
+
+static NodeIndex node_own(NodeArray nodes, NodeIndex index) {
+	if (index == NO_NODE || !node_is_shared(nodes, index))
+		return index;
+
+	SetNode node = node_at(nodes, index);
+	NodeIndex copy_index = node_create(nodes, node->value);
+	SetNode copy = node_at(nodes, copy_index);
+	copy->left = node->left;
+	copy->right = node->right;
+	copy->balance = node->balance;
+	copy->size = node->size;
+	if (copy->left != NO_NODE)
+		atomic_fetch_add(node_refs(nodes, copy->left), 1);
+	if (copy->right != NO_NODE)
+		atomic_fetch_add(node_refs(nodes, copy->right), 1);
+
+	node_release(nodes, index, NULL); // may have become private to another tree in the meantime
+	return copy_index;
+}
+
+// Returns the node with value equal to value in the subtree rooted at node, otherwise NO_NODE
+
+static NodeIndex node_find_equal(NodeArray nodes, NodeIndex index, CompareFunc compare, Pointer value) {
 	// empty subtree, no value exists
-	if (node == NULL)
-		return NULL;
-	
+	if (index == NO_NODE)
+		return NO_NODE;
+
 	// where the node we are looking for is located depends on the order of the value
 	// value relative to the value of the current node (node->value)
 	//
-	int compare_res = compare(value, node->value); // save to avoid calling compare twice
+	SetNode node = node_at(nodes, index);
+	STATS_ADD(nodes_visited, 1);
+	int compare_res = COMPARE(compare, value, node->value); // save to avoid calling compare twice
 	if (compare_res == 0) // value equivalent to node->value, we found the node
-		return node;
+		return index;
 	else if (compare_res < 0) // value < node->value, the node we are looking for is in the left subtree
-		return node_find_equal(node->left, compare, value);
+		return node_find_equal(nodes, node->left, compare, value);
 	else // value > node->value, the node we are looking for is in the right subtree
-		return node_find_equal(node->right, compare, value);
+		return node_find_equal(nodes, node->right, compare, value);
+}
+
+// Returns the smallest node in the subtree rooted at node with value >= value (or > value if strict),
+// otherwise NO_NODE. Same descent as node_find_equal.
+
+static NodeIndex node_find_bound(NodeArray nodes, NodeIndex index, CompareFunc compare, Pointer value, bool strict) {
+	// empty subtree, no such value exists
+	if (index == NO_NODE)
+		return NO_NODE;
+
+	SetNode node = node_at(nodes, index);
+	STATS_ADD(nodes_visited, 1);
+	int compare_res = COMPARE(compare, value, node->value);
+	if (compare_res == 0 && !strict) // value equivalent to node->value, it is the bound itself
+		return index;
+	else if (compare_res < 0) { // value < node->value, the bound is in the left subtree, otherwise it is the node itself
+		NodeIndex res = node_find_bound(nodes, node->left, compare, value, strict);
+		return res != NO_NODE ? res : index;
+	} else // value >= node->value, the bound is in the right subtree
+		return node_find_bound(nodes, node->right, compare, value, strict);
+}
+
+// Returns the largest node in the subtree rooted at node with value < value, otherwise NO_NODE (the mirror of
+// node_find_bound with strict).
+
+static NodeIndex node_find_bound_below(NodeArray nodes, NodeIndex index, CompareFunc compare, Pointer value) {
+	if (index == NO_NODE)
+		return NO_NODE;
+
+	SetNode node = node_at(nodes, index);
+	STATS_ADD(nodes_visited, 1);
+	int compare_res = COMPARE(compare, value, node->value);
+	if (compare_res > 0) { // value > node->value, the bound is in the right subtree, otherwise it is the node itself
+		NodeIndex res = node_find_bound_below(nodes, node->right, compare, value);
+		return res != NO_NODE ? res : index;
+	} else // value <= node->value, the bound is in the left subtree
+		return node_find_bound_below(nodes, node->left, compare, value);
 }
 
-// Returns the smallest node of the subtree with root node
+// Returns the number of values in the subtree rooted at node that are < value
+
+static int node_rank(NodeArray nodes, NodeIndex index, CompareFunc compare, Pointer value) {
+	if (index == NO_NODE)
+		return 0;
 
-static SetNode node_find_min(SetNode node) {
-	return node != NULL && node->left != NULL
-		? node_find_min(node->left) // There is a left subtree, the smallest value is there
-		: node; // Otherwise the smallest value is in the node itself
+	SetNode node = node_at(nodes, index);
+	STATS_ADD(nodes_visited, 1);
+	int compare_res = COMPARE(compare, value, node->value);
+	if (compare_res <= 0) // value <= node->value, only the left subtree may contain smaller values
+		return node_rank(nodes, node->left, compare, value);
+	else // value > node->value, the left subtree and the node itself are smaller, plus some of the right subtree
+		return node_size(nodes, node->left) + 1 + node_rank(nodes, node->right, compare, value);
 }
 
-// Returns the largest node of the subtree rooted at node
+// Returns the k-th smallest node (0-based) of the subtree rooted at node, or NO_NODE if it has <= k nodes
+
+static NodeIndex node_select(NodeArray nodes, NodeIndex index, int k) {
+	if (index == NO_NODE)
+		return NO_NODE;
+
+	SetNode node = node_at(nodes, index);
+	STATS_ADD(nodes_visited, 1);
+	int left_size = node_size(nodes, node->left);
+	if (k < left_size) // the k-th is in the left subtree
+		return node_select(nodes, node->left, k);
+	else if (k == left_size) // exactly k nodes are smaller, it is the node itself
+		return index;
+	else // skip the left subtree and the node, continue in the right subtree
+		return node_select(nodes, node->right, k - left_size - 1);
+}
+
+// Returns the smallest node of the subtree with root node.
+// (With a loop instead of recursion, so that a degenerate tree cannot overflow the stack.)
 
-static SetNode node_find_max(SetNode node) {
-	return node != NULL && node->right != NULL
-		? node_find_max(node->right) // There is a right subtree, the largest value is there
-		: node; // Otherwise the largest value is in the node itself
+static NodeIndex node_find_min(NodeArray nodes, NodeIndex index) {
+	while (index != NO_NODE && node_at(nodes, index)->left != NO_NODE)
+		index = node_at(nodes, index)->left; // There is a left subtree, the smallest value is there
+
+	return index; // Otherwise the smallest value is in the node itself
 }
 
-// Returns the previous (in order) of the target node in the subtree rooted at node,
-// or NULL if target is the smaller of the subnode. The subtree must contain the node
-// target, so it cannot be empty.
+// Returns the largest node of the subtree rooted at node.
+// (With a loop instead of recursion, so that a degenerate tree cannot overflow the stack.)
+
+static NodeIndex node_find_max(NodeArray nodes, NodeIndex index) {
+	while (index != NO_NODE && node_at(nodes, index)->right != NO_NODE)
+		index = node_at(nodes, index)->right; // There is a right subtree, the largest value is there
 
-static SetNode node_find_previous(SetNode node, CompareFunc compare, SetNode target) {
-	if (node == target) {
-		// target is the root of the subtree, the previous is the largest of the left subtree.
-		// (If there is no left child, then the node with value is the smaller of the subtree, so
-		// node_find_max will return NULL as we want.)
-		return node_find_max(node->left);
+	return index; // Otherwise the largest value is in the node itself
+}
 
-	} else if (compare(target->value, node->value) < 0) {
-		// The target is in the left subtree, so its predecessor is there too.
-		return node_find_previous(node->left, compare, target);
+// Returns the previous (in order) node of node, or NO_NODE if node is the smallest of the tree.
+// Uses the parent pointers, so no comparisons are needed (amortized O(1) when traversing the whole tree).
 
-	} else {
-		// The target is in the right subtree, its previous may also be there, otherwise
-		// its previous is the node itself.
-		SetNode res = node_find_previous(node->right, compare, target);
-		return res != NULL ? res : node?
+static NodeIndex node_find_previous(NodeArray nodes, NodeIndex index) {
+	// If there is a left subtree, the previous is its largest node.
+	SetNode node = node_at(nodes, index);
+	if (node->left != NO_NODE)
+		return node_find_max(nodes, node->left);
+
+	// Otherwise it is the first ancestor whose right subtree contains node.
+	while (node->parent != NO_NODE && node_at(nodes, node->parent)->left == index) {
+		index = node->parent;
+		node = node_at(nodes, index);
 	}
-}
 
-// Returns the next (in order) node of the target node in the subtree rooted at node,
-// or NULL if target is the largest of the subtree. The subtree must contain the node
-// target, so it cannot be empty.
+	return node->parent;
+}
 
-static SetNode node_find_next(SetNode node, CompareFunc compare, SetNode target) {
-	if (node == target) {
-		// target is the root of the subtree, the previous one is the largest of the left subtree.
-		// (If there is no left child, then the node with value is the smaller of the subtree, so
-		// node_find_max will return NULL as we want.)
-		return node_find_min(node->right);
+// Returns the next (in order) node of node, or NO_NODE if node is the largest of the tree.
+// Uses the parent pointers, so no comparisons are needed (amortized O(1) when traversing the whole tree).
 
-	} else if (compare(target->value, node->value) > 0) {
-		// The target is in the left subtree, so its predecessor is there too.
-		return node_find_next(node->right, compare, target);
+static NodeIndex node_find_next(NodeArray nodes, NodeIndex index) {
+	// If there is a right subtree, the next is its smallest node.
+	SetNode node = node_at(nodes, index);
+	if (node->right != NO_NODE)
+		return node_find_min(nodes, node->right);
 
-	} else {
-		// The target is in the right subtree, its parent may also be there, otherwise
-		// its predecessor is the node itself.
-		SetNode res = node_find_next(node->left, compare, target);
-		return res != NULL ? res : node?
+	// Otherwise it is the first ancestor whose left subtree contains node.
+	while (node->parent != NO_NODE && node_at(nodes, node->parent)->right == index) {
+		index = node->parent;
+		node = node_at(nodes, index);
 	}
+
+	return node->parent;
 }
 
 // If there is a node with a value equivalent to value, it changes its value to value, otherwise it adds
 // new node with value value. Returns the new root of the subtree, and sets *inserted to true
-// if an addition was made, or false if an update was made.
+// if an addition was made, or false if an update was made, and *new_node to the node of value. *grew is set to
+// whether the height of the subtree increased (AVL).
 
-static SetNode node_insert(SetNode node, CompareFunc compare, Pointer value, bool* inserted, Pointer* old_value) {
+static NodeIndex node_insert(NodeArray nodes, NodeIndex index, CompareFunc compare, Pointer value, bool* inserted, Pointer* old_value, NodeIndex* new_node, bool* grew) {
 	// If the subtree is empty, create a new node which becomes the root of the subtree
-	if (node == NULL) {
+	if (index == NO_NODE) {
 		*inserted = true; // we have inserted
-		return node_create(value);
+		*grew = true;
+		*new_node = node_create(nodes, value);
+		return *new_node;
 	}
+	index = node_own(nodes, index); // persistent sets: the node is modified below
+	SetNode node = node_at(nodes, index);
 
 	// where to insert depends on the order of the value
 	// value relative to the value of the current node (node->value)
 	//
-	int compare_res = compare(value, node->value);
+	STATS_ADD(nodes_visited, 1);
+	int compare_res = COMPARE(compare, value, node->value);
 	if (compare_res == 0) {
 		// found equivalent value, update
 		*inserted = false;
+		*grew = false;
 		*old_value = node->value;
+		*new_node = index;
 		node->value = value;
 
 	} else if (compare_res < 0) {
 		// value < node->value, continue left.
-		node->left = node_insert(node->left, compare, value, inserted, old_value);;
+		node_set_left(nodes, index, node_insert(nodes, node->left, compare, value, inserted, old_value, new_node, grew));
 
 	} else {
 		// value > node->value, continue right
-		node->right = node_insert(node->right, compare, value, inserted, old_value);;
+		node_set_right(nodes, index, node_insert(nodes, node->right, compare, value, inserted, old_value, new_node, grew));
 	}
 
-	return node_repair_balance(node); // AVL
+	return node_repair_balance(nodes, index, compare_res < 0, *grew ? 1 : 0, grew); // AVL
 }
 
 // Removes and stores in min_node the smallest node of the subtree with root node.
-// Returns the new root of the subtree.
+// Returns the new root of the subtree, and sets *shrank to whether its height decreased (AVL).
 
-static SetNode node_remove_min(SetNode node, SetNode* min_node) {
-	if (node->left == NULL) {
+static NodeIndex node_remove_min(NodeArray nodes, NodeIndex index, NodeIndex* min_node, bool* shrank) {
+	index = node_own(nodes, index);
+	SetNode node = node_at(nodes, index);
+	if (node->left == NO_NODE) {
 		// We have no left subtree, so the smallest is the node itself
-		*min_node = node;
+		*min_node = index;
+		*shrank = true;
 		return node->right; // new root is the right child
 
 	} else {
 		// We have a left subtree, so the smallest value is there. We continue recursively
 		// and update node->left with the new root of the subtree.
-		node->left = node_remove_min(node->left, min_node)?
+		node_set_left(nodes, index, node_remove_min(nodes, node->left, min_node, shrank));
 
-		return node_repair_balance(node); // AVL
+		return node_repair_balance(nodes, index, true, *shrank ? -1 : 0, shrank); // AVL
 	}
 }
 
 // Deletes the node with a value equivalent to value, if any. Returns the new root of
-// subtree, and sets *removed to true if a deletion was actually made.
+// subtree, and sets *removed to true if a deletion was actually made, *shrank to whether the height of the subtree
+// decreased (AVL).
 
-static SetNode node_remove(SetNode node, CompareFunc compare, Pointer value, bool* removed, Pointer* old_value) {
-	if (node == NULL) {
+static NodeIndex node_remove(NodeArray nodes, NodeIndex index, CompareFunc compare, Pointer value, bool* removed, Pointer* old_value, bool* shrank) {
+	if (index == NO_NODE) {
 		*removed = false; // empty subtree, the value does not exist
-		return NULL;
+		*shrank = false;
+		return NO_NODE;
 	}
 
-	int compare_res = compare(value, node->value);
+	index = node_own(nodes, index); // persistent sets: the node is modified below
+	SetNode node = node_at(nodes, index);
+
+	STATS_ADD(nodes_visited, 1);
+	int compare_res = COMPARE(compare, value, node->value);
 	if (compare_res == 0) {
 		// An equivalent value was found in the node, so we delete it. How this is done depends on whether it has children.
 		*removed = true;
 		*old_value = node->value;
 
-		if (node->left == NULL) {
+		if (node->left == NO_NODE) {
 			// There is no left subtree, so the node is simply deleted and the right child is put as the new root
-			SetNode right = node->right; // save before free!
-			free(node);;
+			NodeIndex right = node->right; // save before free!
+			node_free(nodes, index);
+			*shrank = true;
 			return right;
 
-		} else if (node->right == NULL) {
+		} else if (node->right == NO_NODE) {
 			// there is no right subtree, so just delete the node and the left child is the new root
-			SetNode left = node->left; // save before free!
-			free(node);;
+			NodeIndex left = node->left; // save before free!
+			node_free(nodes, index);
+			*shrank = true;
 			return left;
 
 		} else {
 			// Both children exist. We replace the value of node with the smaller of the right subtree, which
 			// removed. The node_remove_min function does exactly this job.
 
-			SetNode min_right?
-			node->right = node_remove_min(node->right, &min_right);
+			NodeIndex min_right;
+			node_set_right(nodes, index, node_remove_min(nodes, node->right, &min_right, shrank));
 
 			// Link min_right to the node's position
-			min_right->left = node->left;
-			min_right->right = node->right;
+			node_set_left(nodes, min_right, node->left);
+			node_set_right(nodes, min_right, node->right);
+			node_at(nodes, min_right)->balance = node->balance; // AVL
 
-			free(node);;
+			node_free(nodes, index);
 
-			return node_repair_balance(min_right); // AVL
+			return node_repair_balance(nodes, min_right, false, *shrank ? -1 : 0, shrank); // AVL
 		}
 	}
 
 	// compare_res != 0, continue to the left or right subtree, the root does not change.
 	if (compare_res < 0)
-		node->left = node_remove(node->left, compare, value, removed, old_value);;
+		node_set_left(nodes, index, node_remove(nodes, node->left, compare, value, removed, old_value, shrank));
 	else
-		node->right = node_remove(node->right, compare, value, removed, old_value);
+		node_set_right(nodes, index, node_remove(nodes, node->right, compare, value, removed, old_value, shrank));
 
-	return node_repair_balance(node); // AVL
+	return node_repair_balance(nodes, index, compare_res < 0, *shrank ? -1 : 0, shrank); // AVL
+}
+
+// Frees the nodes of the subtree rooted at index, destroying their values if destroy_value != NULL, in at most *budget
+// steps (which are subtracted from it). Returns the root of the nodes that remain, NO_NODE once all are freed.
+// There is no recursion, so even a degenerate tree cannot overflow the stack: a node with a left child is rotated
+// right, otherwise it is freed and the next step continues with its right child. A node rotates at most once, since
+// it is then on the right of the root, so there are at most 2n steps.
+
+static NodeIndex node_destroy_steps(NodeArray nodes, NodeIndex index, DestroyFunc destroy_value, int* budget) {
+	for (; index != NO_NODE && *budget > 0; (*budget)--) {
+		SetNode node = node_at(nodes, index);
+		if (node->left != NO_NODE) {
+			NodeIndex left = node->left;
+			node->left = node_at(nodes, left)->right;
+			node_at(nodes, left)->right = index;
+			index = left;
+		} else {
+			NodeIndex right = node->right;
+			if (destroy_value != NULL)
+				destroy_value(node->value);
+			node_free(nodes, index);
+			index = right;
+		}
+	}
+	return index;
 }
 
 // Destroys the entire subtree with root node
 
-static void node_destroy(SetNode node, DestroyFunc destroy_value) {
-	if (node == NULL)
+static void node_destroy(NodeArray nodes, NodeIndex index, DestroyFunc destroy_value) {
+	while (index != NO_NODE) {
+		int budget = INT_MAX;
+		index = node_destroy_steps(nodes, index, destroy_value, &budget);
+	}
+}
+
+
+// Height of the trees of node_create_from_sorted (and node_link_sorted) with n nodes: the left subtree of the root
+// has n / 2 nodes and is the higher one, so the height is the number of bits of n (AVL).
+
+static int sorted_height(int n) {
+	return n > 0 ? 32 - __builtin_clz(n) : 0;
+}
+
+// Creates a (perfectly balanced) tree with the n values of the values array, which must be sorted and without
+// duplicates. The nodes are stored in order at the indices first ... first + n - 1 (see node_array_alloc_range).
+// Returns the root of the tree. Complexity O(n), there are no comparisons and no rotations.
+
+static NodeIndex node_create_from_sorted(NodeArray nodes, Pointer* values, int n, NodeIndex first) {
+	if (n == 0)
+		return NO_NODE;
+
+	// The middle value becomes the root, the smaller ones are in the left subtree and the larger in the right
+	int mid = n / 2;
+	NodeIndex index = first + mid;
+	node_init(nodes, index, values[mid]);
+	node_set_left(nodes, index, node_create_from_sorted(nodes, values, mid, first));
+	node_set_right(nodes, index, node_create_from_sorted(nodes, values + mid + 1, n - mid - 1, first + mid + 1));
+
+	SetNode node = node_at(nodes, index);
+	node_update_size(nodes, node);
+	node->balance = sorted_height(mid) - sorted_height(n - mid - 1); // AVL
+	return index;
+}
+
+// Links the n nodes of the indices array (sorted, without duplicates) in a perfectly balanced tree, reusing the nodes
+// themselves (their values and SetNode handles do not change). Returns the root of the tree.
+
+static NodeIndex node_link_sorted(NodeArray nodes, NodeIndex* indices, int n) {
+	if (n == 0)
+		return NO_NODE;
+
+	int mid = n / 2;
+	NodeIndex index = indices[mid];
+	node_set_left(nodes, index, node_link_sorted(nodes, indices, mid));
+	node_set_right(nodes, index, node_link_sorted(nodes, indices + mid + 1, n - mid - 1));
+
+	SetNode node = node_at(nodes, index);
+	node_update_size(nodes, node);
+	node->balance = sorted_height(mid) - sorted_height(n - mid - 1); // AVL
+	return index;
+}
+
+// Returns true if a batch of n operations on a tree of the given size is large enough that a single pass over the
+// whole tree (O(size + n)) is cheaper than n separate operations (O(n log size)).
+
+static bool batch_is_large(int size, int n) {
+	int height = 0;
+	for (int s = size; s > 0; s /= 2)
+		height++;
+
+	return (long)n * height >= size;
+}
+
+// Stores in the indices array all nodes of the tree rooted at node, in order. Returns their number.
+
+static int node_collect(NodeArray nodes, NodeIndex index, NodeIndex* indices) {
+	int count = 0;
+	for (index = node_find_min(nodes, index); index != NO_NODE; index = node_find_next(nodes, index))
+		indices[count++] = index;
+	return count;
+}
+
+// Sorts the n values of the values array with merge sort (stable, so equivalent values keep their order),
+// using temp (of size n) as auxiliary space.
+
+static void values_merge_sort(Pointer* values, Pointer* temp, int n, CompareFunc compare) {
+	if (n < 2)
 		return;
-	
-	// first destroy the children, then free the node
-	node_destroy(node->left, destroy_value);;
-	node_destroy(node->right, destroy_value);;
 
-	if (destroy_value != NULL)
-		destroy_value(node->value);; destroy_value(node->value);
+	int mid = n / 2;
+	values_merge_sort(values, temp, mid, compare);
+	values_merge_sort(values + mid, temp, n - mid, compare);
+
+	// Merge the 2 sorted halves in temp, taking from the left half unless the right value is strictly smaller
+	int i = 0, j = mid, k = 0;
+	while (i < mid && j < n)
+		temp[k++] = compare(values[j], values[i]) < 0 ? values[j++] : values[i++];
+	while (i < mid)
+		temp[k++] = values[i++];
+	while (j < n)
+		temp[k++] = values[j++];
 
-	free(node);
+	memcpy(values, temp, n * sizeof(Pointer));
 }
 
+// Sorts the n values of the values array and removes the duplicates. Of equivalent values only the last one is kept and
+// the rest are destroyed (if destroy_value != NULL), exactly as if they had been inserted one by one with set_insert.
+// Returns the number of values kept.
 
-//// ADT Set functions. Generally very simple, since they call the corresponding node_* //////////////////////////////////
-//
-// Also identical to those of the BST-based Set
+static int values_sort_unique(Pointer* values, int n, CompareFunc compare, DestroyFunc destroy_value) {
+	Pointer* temp = malloc(n * sizeof(Pointer));
+	values_merge_sort(values, temp, n, compare);
+	free(temp);
 
-Set set_create(CompareFunc compare, DestroyFunc destroy_value) {
-	assert(compare != NULL); // LCOV_EXCL_LINE
+	int count = 0;
+	for (int i = 0; i < n; i++) {
+		if (i < n-1 && compare(values[i], values[i+1]) == 0) {
+			if (destroy_value != NULL)
+				destroy_value(values[i]); // replaced by the next equivalent value
+		} else {
+			values[count++] = values[i];
+		}
+	}
+	return count;
+}
 
-	// create the stuct
-	Set set = malloc(sizeof(*set));;
-	set->root = NULL; // empty tree
-	set->size = 0;
-	set->compare = compare;
-	set->destroy_value = destroy_value;
+// Joins the trees left and right (of heights left_height and right_height) with the single node mid between them:
+// all values of left are < mid < all values of right. If the heights differ by more than 1, mid is joined with the
+// subtree of the higher tree on the side of the other one (its right subtree if left is higher), which then grows by
+// at most 1, and the higher tree is repaired as after an insertion. Returns the root of the joined tree and stores its
+// height in *height. Complexity O(|left_height - right_height| + 1).
+
+static NodeIndex node_join(NodeArray nodes, NodeIndex left, int left_height, NodeIndex mid, NodeIndex right, int right_height, int* height) {
+	bool grew;
+	if (left_height > right_height + 1) {
+		SetNode node = node_at(nodes, left);
+		int child_height = node->balance > 0 ? left_height - 2 : left_height - 1; // of the right subtree
+		int joined_height;
+		node_set_right(nodes, left, node_join(nodes, node->right, child_height, mid, right, right_height, &joined_height));
+
+		NodeIndex root = node_repair_balance(nodes, left, false, joined_height - child_height, &grew);
+		*height = left_height + grew;
+		return root;
+
+	} else if (right_height > left_height + 1) {
+		SetNode node = node_at(nodes, right);
+		int child_height = node->balance < 0 ? right_height - 2 : right_height - 1; // of the left subtree
+		int joined_height;
+		node_set_left(nodes, right, node_join(nodes, left, left_height, mid, node->left, child_height, &joined_height));
+
+		NodeIndex root = node_repair_balance(nodes, right, true, joined_height - child_height, &grew);
+		*height = right_height + grew;
+		return root;
+	}
 
-	return set;
+	// The heights differ by at most 1, mid becomes the root
+	SetNode node = node_at(nodes, mid);
+	node_set_left(nodes, mid, left);
+	node_set_right(nodes, mid, right);
+	node->balance = left_height - right_height;
+	node_update_size(nodes, node);
+	*height = (left_height > right_height ? left_height : right_height) + 1;
+	return mid;
 }
 
-int set_size(set set) {
-	return set->size;
-} 
+// Splits the tree rooted at node (of height height) in the trees *left with the values < pivot and *right with the
+// values >= pivot, storing their heights in *left_height and *right_height. Each node of the search path is joined
+// (node_join) with the part of its subtree on its side and the result of the split below it. The heights of the
+// joined trees grow along the path, so the joins take O(log n) in total.
 
-void set_insert(set set, pointer value) {
-	bool inserted;
-	pointer old_value;
-	set->root = node_insert(set->root, set->compare, value, &inserted, &old_value);;
-	
-	// The size only changes if a new node is inserted. In updates we destroy the old value
-	if (inserted)
-		set->size++;;
-	else if (set->destroy_value != NULL)
-		set->destroy_value(old_value); 
+static void node_split(NodeArray nodes, NodeIndex index, int height, CompareFunc compare, Pointer pivot, NodeIndex* left, int* left_height, NodeIndex* right, int* right_height) {
+	if (index == NO_NODE) {
+		*left = *right = NO_NODE;
+		*left_height = *right_height = 0;
+		return;
+	}
+
+	SetNode node = node_at(nodes, index);
+	STATS_ADD(nodes_visited, 1);
+	NodeIndex node_left = node->left, node_right = node->right;
+	int node_left_height = node->balance >= 0 ? height - 1 : height - 2;
+	int node_right_height = node->balance <= 0 ? height - 1 : height - 2;
+
+	NodeIndex middle;
+	int middle_height;
+	if (COMPARE(compare, node->value, pivot) < 0) {
+		// node and its left subtree are < pivot, the right subtree is split
+		node_split(nodes, node_right, node_right_height, compare, pivot, &middle, &middle_height, right, right_height);
+		*left = node_join(nodes, node_left, node_left_height, index, middle, middle_height, left_height);
+	} else {
+		// node and its right subtree are >= pivot, the left subtree is split
+		node_split(nodes, node_left, node_left_height, compare, pivot, left, left_height, &middle, &middle_height);
+		*right = node_join(nodes, middle, middle_height, index, node_right, node_right_height, right_height);
+	}
 }
 
-bool set_remove(set set set, pointer value) {
-	bool removed;
-	pointer old_value = NULL;
-	set->root = node_remove(set->root, set->compare, value, &removed, &old_value);;
+// Moves the tree rooted at node from the array from to nodes (eg for set_join of sets with different arrays).
+// Returns the new root.
 
-	// The size only changes if a node is actually removed
-	if (removed) {
-		set->size--;;
+static NodeIndex node_move(NodeArray nodes, NodeArray from, NodeIndex index) {
+	if (index == NO_NODE)
+		return NO_NODE;
 
-		if (set->destroy_value != NULL)
-			set->destroy_value(old_value);
+	SetNode node = node_at(from, index);
+	NodeIndex copy_index = node_create(nodes, node->value);
+	SetNode copy = node_at(nodes, copy_index);
+	copy->balance = node->balance;
+	copy->size = node->size;
+
+	NodeIndex left = node->left, right = node->right; // save before free!
+	node_free(from, index);
+	node_set_left(nodes, copy_index, node_move(nodes, from, left));
+	node_set_right(nodes, copy_index, node_move(nodes, from, right));
+	return copy_index;
+}
+
+// Parallel execution (set_visit_parallel, set_create_from_sorted_parallel). The work is split in independent tasks,
+// more than the threads, and each thread takes the next task that no thread has taken yet, so a thread that finishes
+// early takes over the remaining work of the others. With -DSET_STATS the work of the other threads is not counted
+// in the stats of the set.
+
+#define PARALLEL_TASKS_PER_THREAD 8
+
+// Function that runs the task-th task, ctx is the argument of run_tasks
+typedef void (*TaskFunc)(int task, Pointer ctx);
+
+typedef struct {
+	TaskFunc run;
+	Pointer ctx;
+	int tasks;
+	atomic_int next; // the next task that no thread has taken
+} TaskQueue;
+
+static void* task_worker(void* arg) {
+	TaskQueue* queue = arg;
+	for (int task; (task = atomic_fetch_add(&queue->next, 1)) < queue->tasks; )
+		queue->run(task, queue->ctx);
+	return NULL;
+}
+
+// Runs run(task, ctx) for task = 0 ... tasks-1 with nthreads threads (the calling one and nthreads-1 new ones),
+// returns when all tasks have finished.
+
+static void run_tasks(int tasks, int nthreads, TaskFunc run, Pointer ctx) {
+	TaskQueue queue = { .run = run, .ctx = ctx, .tasks = tasks };
+	atomic_init(&queue.next, 0);
+
+	// A thread that cannot be created is not needed, the others run its tasks
+	int created = 0;
+	pthread_t* threads = malloc((nthreads > 1 ? nthreads - 1 : 1) * sizeof(pthread_t));
+	while (created < nthreads - 1 && created < tasks - 1 && pthread_create(&threads[created], NULL, task_worker, &queue) == 0)
+		created++;
+
+	task_worker(&queue);
+
+	for (int i = 0; i < created; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+// set_create_from_sorted_parallel: the top depth levels of the tree are created by the calling thread, and the
+// (at most 2^depth) subtrees below them by the tasks. Both split the values exactly like node_create_from_sorted,
+// and all indices are allocated in advance, so the tasks do not allocate.
+
+typedef struct {
+	NodeArray nodes;
+	Pointer* values; // the values of the subtree
+	int n;
+	NodeIndex first; // the index of the first value
+	NodeIndex root; // the subtree, created by the task
+} SubtreeTask;
+
+// Stores in tasks the subtrees at the given depth of the tree of the n values, returns their number.
+
+static int subtree_tasks(NodeArray nodes, Pointer* values, int n, NodeIndex first, int depth, SubtreeTask* tasks) {
+	if (n == 0)
+		return 0;
+	if (depth == 0) {
+		tasks[0] = (SubtreeTask){ .nodes = nodes, .values = values, .n = n, .first = first, .root = NO_NODE };
+		return 1;
 	}
 
-	return removed;
+	int mid = n / 2;
+	int count = subtree_tasks(nodes, values, mid, first, depth - 1, tasks);
+	return count + subtree_tasks(nodes, values + mid + 1, n - mid - 1, first + mid + 1, depth - 1, tasks + count);
 }
 
-pointer set_find(set set, pointer value) {
-	SetNode node = node_find_equal(set->root, set->compare, value);;
-	return node == NULL ? NULL : node->value;
+static void create_subtree(int task, Pointer ctx) {
+	SubtreeTask* subtree = (SubtreeTask*)ctx + task;
+	subtree->root = node_create_from_sorted(subtree->nodes, subtree->values, subtree->n, subtree->first);
 }
 
-DestroyFunc set_set_destroy_value(Set vec, DestroyFunc destroy_value) {
-	DestroyFunc old = vec->destroy_value;
-	vec->destroy_value = destroy_value;
-	return old;
+// Creates the top depth levels of the tree of the n values, and links below them the subtrees of *tasks, in order.
+
+static NodeIndex node_link_subtrees(NodeArray nodes, Pointer* values, int n, NodeIndex first, int depth, SubtreeTask** tasks) {
+	if (n == 0)
+		return NO_NODE;
+	if (depth == 0)
+		return (*tasks)++->root;
+
+	int mid = n / 2;
+	NodeIndex index = first + mid;
+	node_init(nodes, index, values[mid]);
+	node_set_left(nodes, index, node_link_subtrees(nodes, values, mid, first, depth - 1, tasks));
+	node_set_right(nodes, index, node_link_subtrees(nodes, values + mid + 1, n - mid - 1, first + mid + 1, depth - 1, tasks));
+
+	SetNode node = node_at(nodes, index);
+	node_update_size(nodes, node);
+	node->balance = sorted_height(mid) - sorted_height(n - mid - 1); // AVL
+	return index;
 }
 
-void set_destroy(set set) {
-	node_destroy(set->root, set->destroy_value);;
-	free(set);
+
+//// ADT Set functions. Generally very simple, since they call the corresponding node_* //////////////////////////////////
+//
+// Also identical to those of the BST-based Set
+
+// Frozen sets (set_freeze): a SetNode is the position of the value in the array, so SET_EOF (0) is no position
+
+static SetNode frozen_pack(int position) {
+	return (SetNode)(uintptr_t)position;
 }
 
-SetNode set_first(Set set) {
-	return node_find_min(set->root);;
+static int frozen_position(SetNode node) {
+	return (int)(uintptr_t)node;
 }
 
-SetNode set_last(Set set) {
-	return node_find_max(set->root);;
+// Returns the index of node (a SetNode given by the user): the one that its parent (or the root) stores. Not for
+// persistent sets, whose parent pointers are not used.
+
+static NodeIndex node_index(Set set, SetNode node) {
+	if (node->parent == NO_NODE)
+		return set->root;
+
+	SetNode parent = node_at(set->nodes, node->parent);
+	return parent->left != NO_NODE && node_at(set->nodes, parent->left) == node ? parent->left : parent->right;
 }
 
-SetNode set_previous(Set set, SetNode node) {
-	return node_find_previous(set->root, set->compare, node);;
+// Sets the parent pointers of the subtree rooted at index, whose parent is parent. The depth of the recursion is
+// O(log n), the tree is balanced (AVL).
+
+static void node_link_parents(NodeArray nodes, NodeIndex index, NodeIndex parent) {
+	if (index == NO_NODE)
+		return;
+
+	SetNode node = node_at(nodes, index);
+	node->parent = parent;
+	node_link_parents(nodes, node->left, index);
+	node_link_parents(nodes, node->right, index);
 }
 
-SetNode set_next(Set set, SetNode node) {
-	return node_find_next(set->root, set->compare, node);;
+// Once all snapshots of a persistent set are destroyed (it is the only set of its node array), all its nodes belong
+// only to it again: the parent pointers are relinked in a single O(n) pass, and the set stops being persistent, so
+// set_next / set_previous no longer search from the root. Called by the updates of the set, not by the readers, which
+// may run in other threads (and the snapshots are destroyed by their own threads, see set_snapshot).
+
+static void persistent_end(Set set) {
+	if (!set->persistent || set->nodes->sets > 1)
+		return;
+
+	node_link_parents(set->nodes, set->root, NO_NODE);
+	node_array_unshare(set->nodes);
+	set->persistent = false;
 }
 
-Pointer set_node_value(Set set, SetNode node) {
-	return node->value;
+// Returns the next (or previous) node of index. The parent pointers of a persistent set may point to nodes of other
+// trees, so the neighbours are searched from the root.
+
+static NodeIndex node_find_neighbour(Set set, NodeIndex index, bool next) {
+	if (set->persistent) {
+		Pointer value = node_at(set->nodes, index)->value;
+		return next ? node_find_bound(set->nodes, set->root, set->compare, value, true) : node_find_bound_below(set->nodes, set->root, set->compare, value);
+	}
+	return next ? node_find_next(set->nodes, index) : node_find_previous(set->nodes, index);
 }
 
-SetNode set_find_node(set set set, pointer value) {
-	return node_find_equal(set->root, set->compare, value);;
+// Skips the nodes marked as removed (see set_use_lazy_removal), moving to the next nodes if next, otherwise to the
+// previous ones.
+
+static SetNode node_skip_removed(Set set, SetNode node, bool next) {
+	while (node != NULL && node->removed)
+		node = node_handle(set->nodes, node_find_neighbour(set, node_index(set, node), next));
+	return node;
 }
 
+// set_remove with lazy removal: the node is only marked, so the tree does not change. When too many nodes are marked
+// it is compacted, so the cost is O(1) amortized for each removal, in addition to the search.
 
+static bool node_mark_removed(Set set, Pointer value) {
+	SetNode node = node_handle(set->nodes, node_find_equal(set->nodes, set->root, set->compare, value));
+	if (node == NULL || node->removed)
+		return false;
 
-// Functions not present in the public interface but used in tests
-// Check that the tree is a correct AVL.
+	node->removed = 1;
+	set->size--;
+	set->removed++;
 
-// LCOV_EXCL_START (we don't care about the coverage of the test commands, and furthermore only true branches are tested in a successful test)
+	if ((long)set->removed * 100 > (long)(set->size + set->removed) * COMPACT_REMOVED_PERCENT)
+		set_compact(set);
+	return true;
+}
 
-bool node_is_avl(SetNode node, CompareFunc compare) {
-	if (node == NULL)
-		return true;
+// Inserting a value whose node is marked as removed (lazy removal), the value returns to the set.
 
-	// We check the property:
-	// each node is > left child, > rightmost node of the left subtree, < right child, < leftmost node of the right subtree.
-	// It is equivalent to the BST property (each node is > left subtree and < right subtree) but easier to check.
-	bool res = true;
-	if(node->left != NULL)
-		res = res && compare(node->left->value, node->value) < 0 && compare(node_find_max(node->left)->value, node->value) < 0;
-	if(node->right != NULL)
-		res = res && compare(node->right->value, node->value) > 0 && compare(node_find_min(node->right)->value, node->value) > 0;
+static void node_revive(Set set, SetNode node) {
+	node->removed = 0;
+	set->removed--;
+	set->size++;
+}
 
-	// The height is correct
-	res = res && node->height == 1 + int_max(node_height(node->left), node_height(node->right))?
+// Continues the destruction of the tree of set_clear (set->cleared_nodes != NULL) with at most budget steps (see
+// node_destroy_steps). Returns the steps that were not used.
 
-	// The node has the AVL property
-	int balance = node_balance(node);
-	res = res && balance >= -1 && balance <= 1;
+static int cleared_destroy_steps(Set set, int budget) {
+	set->cleared = node_destroy_steps(set->cleared_nodes, set->cleared, set->cleared_destroy_value, &budget);
+	if (set->cleared == NO_NODE) {
+		node_array_release(set->cleared_nodes);
+		set->cleared_nodes = NULL;
+	}
+	return budget;
+}
 
-	// The subtrees are correct
-	res = res &&
-		node_is_avl(node->left, compare) &&
-		node_is_avl(node->right, compare);
+// Completes the destruction of the tree of set_clear, if any. Without values to destroy (and if the array is not shared with the other part of a set_split), all
+// slabs are freed at once.
 
-	return res;
+static void cleared_destroy(Set set) {
+	if (set->cleared_nodes != NULL && set->cleared_destroy_value == NULL && set->cleared_nodes->sets == 1)
+		set->cleared = NO_NODE;
+	while (set->cleared_nodes != NULL)
+		cleared_destroy_steps(set, INT_MAX);
+}
+
+// Returns the slot of the find cache for value. The hash of the user may be weak (eg the key itself), so it is
+// multiplied by 2^64 / golden ratio (Fibonacci hashing), and the high bits, which depend on all bits of the hash, are used.
+
+static NodeIndex* find_cache_slot(Set set, Pointer value) {
+	uint64_t hash = set->find_cache_hash(value) * 0x9e3779b97f4a7c15ULL;
+	return &set->find_cache[(uint32_t)(hash >> 32) & set->find_cache_mask];
 }
 
-bool set_is_proper(set node) {
-	return node_is_avl(node->root, node->compare);; return node_is_avl(node->root, node->compare);
+// Removes the node of value from the find cache, before it is freed. The slot may hold another node, which is then
+// simply found again by its next search.
+
+static void find_cache_remove(Set set, Pointer value) {
+	if (set->find_cache != NULL)
+		*find_cache_slot(set, value) = NO_NODE;
 }
 
-// LCOV_EXCL_STOP
+// Empties the find cache, when the nodes are freed (or moved) all together
 
+static void find_cache_clear(Set set) {
+	if (set->find_cache != NULL)
+		memset(set->find_cache, 0, (set->find_cache_mask + 1) * sizeof(NodeIndex)); // NO_NODE is 0
+}
 
+// Returns the node with value equivalent to value, as node_find_equal from the root. If the slot of value in the find
+// cache holds such a node there is no descent, otherwise the node that is found replaces the one of the slot.
 
-//// Additional functions to be implemented in Lab 5
+static NodeIndex node_find_cached(Set set, Pointer value) {
+	if (set->find_cache == NULL)
+		return node_find_equal(set->nodes, set->root, set->compare, value);
 
-void set_visit(Set set, VisitFunc visit) {
-    assert(set != NULL);;
-    assert(visit != NULL);;
-    
-    for (SetNode node = set_first(set); node != NULL; node = set_next(set, node)) {
-        visit(set_node_value(set, node)); visit(set_node_value(set, node));
-    }
+	NodeIndex* slot = find_cache_slot(set, value);
+	if (*slot != NO_NODE && COMPARE(set->compare, value, node_at(set->nodes, *slot)->value) == 0)
+		return *slot;
+
+	NodeIndex index = node_find_equal(set->nodes, set->root, set->compare, value);
+	if (index != NO_NODE)
+		*slot = index;
+	return index;
+}
+
+Set set_create(CompareFunc compare, DestroyFunc destroy_value) {
+#ifdef SET_INT_KEYS
+	compare = compare_int_keys;
+#endif
+	assert(compare != NULL); // LCOV_EXCL_LINE
+
+	// create the stuct
+	Set set = malloc(sizeof(*set));
+	set->root = NO_NODE; // empty tree
+	set->size = 0;
+	set->compare = compare;
+	set->destroy_value = destroy_value;
+#ifdef SET_STATS
+	memset(&set->stats, 0, sizeof(set->stats));
+#endif
+	set->nodes = node_array_create();
+	set->hash_index = NULL; // until set_use_hash_index is called
+	set->find_cache = NULL; // until set_use_find_cache is called
+	set->frozen = NULL; // until set_freeze is called
+	set->persistent = false; // until set_snapshot is called
+	set->lazy = false; // until set_use_lazy_removal is called
+	set->removed = 0;
+	set->cleared_nodes = NULL; // until set_clear is called
+	set->cleared = NO_NODE;
+	set->cleared_destroy_value = NULL;
+
+	return set;
+}
+
+// Each node has a single value, there is no order to choose.
+Set set_create_with_order(CompareFunc compare, DestroyFunc destroy_value, int order) {
+	return set_create(compare, destroy_value);
+}
+
+Set set_create_from_sorted(CompareFunc compare, DestroyFunc destroy_value, Pointer* values, int n) {
+	Set set = set_create(compare, destroy_value);
+	STATS_ENTER(set);
+	NodeIndex first = node_array_alloc_range(set->nodes, n);
+	set->root = node_create_from_sorted(set->nodes, values, n, first);
+	set->size = n;
+
+	return set;
+}
+
+Set set_create_from_array(CompareFunc compare, DestroyFunc destroy_value, Pointer* values, int n) {
+#ifdef SET_INT_KEYS
+	compare = compare_int_keys;
+#endif
+	// Sort a copy of the array, the caller's array is not modified
+	Pointer* sorted = malloc(n * sizeof(Pointer));
+	memcpy(sorted, values, n * sizeof(Pointer));
+
+	int count = values_sort_unique(sorted, n, compare, destroy_value);
+	Set set = set_create_from_sorted(compare, destroy_value, sorted, count);
+
+	free(sorted);
+	return set;
+}
+
+Set set_create_from_sorted_parallel(CompareFunc compare, DestroyFunc destroy_value, Pointer* values, int n, int nthreads) {
+	assert(nthreads >= 1); // LCOV_EXCL_LINE
+
+	Set set = set_create(compare, destroy_value);
+	STATS_ENTER(set);
+
+	// 2^depth subtrees, enough for the threads to balance the work
+	int depth = 0;
+	while ((1 << depth) < nthreads * PARALLEL_TASKS_PER_THREAD && (1 << depth) < n)
+		depth++;
+
+	NodeIndex first = node_array_alloc_range(set->nodes, n);
+	SubtreeTask* tasks = malloc((1 << depth) * sizeof(SubtreeTask));
+	int count = subtree_tasks(set->nodes, values, n, first, depth, tasks);
+	run_tasks(count, nthreads, create_subtree, tasks);
+
+	SubtreeTask* next = tasks;
+	set->root = node_link_subtrees(set->nodes, values, n, first, depth, &next);
+	set->size = n;
+
+	free(tasks);
+	return set;
+}
+
+int set_size(Set set) {
+	return set->size;
+}
+
+void set_insert(Set set, Pointer value) {
+	assert(set->frozen == NULL); // LCOV_EXCL_LINE
+	STATS_ENTER(set);
+	persistent_end(set);
+	if (set->cleared_nodes != NULL)
+		cleared_destroy_steps(set, CLEAR_STEPS);
+	STATS_ADD(lookups, 1);
+	bool inserted, grew;
+	Pointer old_value;
+	NodeIndex new_node;
+	set->root = node_insert(set->nodes, set->root, set->compare, value, &inserted, &old_value, &new_node, &grew);
+	node_at(set->nodes, set->root)->parent = NO_NODE; // the root may have changed
+
+	// The size only changes if a new node is inserted. In updates we destroy the old value
+	if (inserted) {
+		set->size++;
+		if (set->hash_index != NULL)
+			hash_index_insert(set->hash_index, node_at(set->nodes, new_node)); // in updates the node (and its entry) remains the same
+	} else {
+		SetNode node = node_at(set->nodes, new_node);
+		if (node->removed)
+			node_revive(set, node);
+		if (set->destroy_value != NULL)
+			set->destroy_value(old_value);
+	}
+}
+
+bool set_remove(Set set, Pointer value) {
+	assert(set->frozen == NULL); // LCOV_EXCL_LINE
+	STATS_ENTER(set);
+	persistent_end(set);
+	if (set->cleared_nodes != NULL)
+		cleared_destroy_steps(set, CLEAR_STEPS);
+	STATS_ADD(lookups, 1);
+	bool removed, shrank;
+	Pointer old_value = NULL;
+
+	if (set->lazy)
+		return node_mark_removed(set, value);
+
+	// The entry is removed first, while the node still exists (the index reads the values of the nodes)
+	if (set->hash_index != NULL)
+		hash_index_remove(set->hash_index, value);
+	find_cache_remove(set, value);
+
+	// In a persistent set the path is copied, so it is first checked that there is something to remove
+	if (set->persistent && node_find_equal(set->nodes, set->root, set->compare, value) == NO_NODE)
+		return false;
+
+	set->root = node_remove(set->nodes, set->root, set->compare, value, &removed, &old_value, &shrank);
+	if (set->root != NO_NODE && !node_is_shared(set->nodes, set->root))
+		node_at(set->nodes, set->root)->parent = NO_NODE; // the root may have changed
+
+	// The size only changes if a node is actually removed
+	if (removed) {
+		set->size--;
+
+		if (set->destroy_value != NULL)
+			set->destroy_value(old_value);
+	}
+
+	return removed;
+}
+
+// For large batches the values are merged with the nodes of the tree in a single pass, and the tree is relinked
+// balanced. Otherwise (or if the nodes may be shared with snapshots) each value is inserted separately.
+
+int set_insert_many(Set set, Pointer* values, int n) {
+	assert(set->frozen == NULL); // LCOV_EXCL_LINE
+	STATS_ENTER(set);
+	set_compact(set); // With lazy removal, the marked values are destroyed first.
+	persistent_end(set);
+	int old_size = set->size;
+
+	if (set->persistent || !batch_is_large(set->size, n)) {
+		for (int i = 0; i < n; i++)
+			set_insert(set, values[i]);
+		return set->size - old_size;
+	}
+
+	NodeArray nodes = set->nodes;
+	NodeIndex* old_nodes = malloc(set->size * sizeof(NodeIndex));
+	NodeIndex* indices = malloc((set->size + n) * sizeof(NodeIndex));
+	int old_count = node_collect(nodes, set->root, old_nodes);
+
+	// Merge the 2 sorted sequences. Equivalent values replace the existing ones, as in set_insert.
+	int count = 0, j = 0;
+	for (int i = 0; i < n; i++) {
+		while (j < old_count && COMPARE(set->compare, node_at(nodes, old_nodes[j])->value, values[i]) < 0)
+			indices[count++] = old_nodes[j++];
+
+		NodeIndex equal = j < old_count && COMPARE(set->compare, node_at(nodes, old_nodes[j])->value, values[i]) == 0 ? old_nodes[j]
+			: count > 0 && COMPARE(set->compare, node_at(nodes, indices[count-1])->value, values[i]) == 0 ? indices[count-1] // duplicate in the batch
+			: NO_NODE;
+
+		if (equal != NO_NODE) {
+			Pointer old_value = node_at(nodes, equal)->value;
+			node_at(nodes, equal)->value = values[i];
+			if (set->destroy_value != NULL)
+				set->destroy_value(old_value);
+		} else {
+			indices[count++] = node_create(nodes, values[i]);
+			if (set->hash_index != NULL)
+				hash_index_insert(set->hash_index, node_at(nodes, indices[count-1]));
+		}
+	}
+	while (j < old_count)
+		indices[count++] = old_nodes[j++];
+
+	set->root = node_link_sorted(nodes, indices, count);
+	if (set->root != NO_NODE)
+		node_at(nodes, set->root)->parent = NO_NODE;
+	set->size = count;
+
+	free(old_nodes);
+	free(indices);
+	return set->size - old_size;
+}
+
+// For large batches the nodes of the tree are filtered in a single pass, and the remaining ones are relinked
+// balanced. Otherwise (or if the nodes may be shared with snapshots) each value is removed separately.
+
+int set_remove_many(Set set, Pointer* values, int n) {
+	assert(set->frozen == NULL); // LCOV_EXCL_LINE
+	STATS_ENTER(set);
+	set_compact(set); // With lazy removal, the marked values are destroyed first.
+	persistent_end(set);
+	int old_size = set->size;
+
+	if (set->persistent || !batch_is_large(set->size, n)) {
+		for (int i = 0; i < n; i++)
+			set_remove(set, values[i]);
+		return old_size - set->size;
+	}
+
+	NodeArray nodes = set->nodes;
+	NodeIndex* indices = malloc(set->size * sizeof(NodeIndex));
+	int old_count = node_collect(nodes, set->root, indices);
+
+	// Keep the nodes that are not equivalent to any of the values (both sequences are sorted)
+	int count = 0, i = 0;
+	for (int j = 0; j < old_count; j++) {
+		Pointer value = node_at(nodes, indices[j])->value;
+		while (i < n && COMPARE(set->compare, values[i], value) < 0)
+			i++;
+
+		if (i < n && COMPARE(set->compare, values[i], value) == 0) {
+			if (set->hash_index != NULL)
+				hash_index_remove(set->hash_index, value);
+			find_cache_remove(set, value);
+			if (set->destroy_value != NULL)
+				set->destroy_value(value);
+			node_free(nodes, indices[j]);
+		} else {
+			indices[count++] = indices[j];
+		}
+	}
+
+	set->root = node_link_sorted(nodes, indices, count);
+	if (set->root != NO_NODE)
+		node_at(nodes, set->root)->parent = NO_NODE;
+	set->size = count;
+
+	free(indices);
+	return old_size - set->size;
+}
+
+Pointer set_find(Set set, Pointer value) {
+	STATS_ENTER(set);
+	STATS_ADD(lookups, 1);
+	if (set->frozen != NULL) {
+		int position = frozen_array_find(set->frozen, set->compare, value);
+		return position != 0 ? frozen_array_value(set->frozen, position) : NULL;
+	}
+	SetNode node = set->hash_index != NULL ? hash_index_find(set->hash_index, value) : node_handle(set->nodes, node_find_cached(set, value));
+	return node == NULL || node->removed ? NULL : node->value;
+}
+
+// The searches of a group are at current[i], NO_NODE once finished. The slabs of the array are few and always in
+// cache, so the address of the next node is known without reading it.
+
+void set_find_many(Set set, Pointer* keys, int n, Pointer* out) {
+	if (set->frozen != NULL || set->hash_index != NULL) { // a single access per value, there is nothing to interleave
+		for (int i = 0; i < n; i++)
+			out[i] = set_find(set, keys[i]);
+		return;
+	}
+	STATS_ENTER(set);
+	STATS_ADD(lookups, n);
+
+	NodeIndex current[FIND_GROUP];
+	for (int first = 0; first < n; first += FIND_GROUP) {
+		int count = n - first < FIND_GROUP ? n - first : FIND_GROUP;
+		for (int i = 0; i < count; i++) {
+			current[i] = set->root;
+			out[first + i] = NULL;
+		}
+
+		for (bool active = set->root != NO_NODE; active; ) {
+			active = false;
+			for (int i = 0; i < count; i++) {
+				if (current[i] == NO_NODE)
+					continue;
+
+				SetNode node = node_at(set->nodes, current[i]);
+				STATS_ADD(nodes_visited, 1);
+				int compare_res = COMPARE(set->compare, keys[first + i], node->value);
+				if (compare_res == 0) {
+					if (!node->removed)
+						out[first + i] = node->value;
+					current[i] = NO_NODE;
+				} else {
+					current[i] = compare_res < 0 ? node->left : node->right;
+					if (current[i] != NO_NODE) {
+						__builtin_prefetch(node_at(set->nodes, current[i]));
+						active = true;
+					}
+				}
+			}
+		}
+	}
+}
+
+DestroyFunc set_set_destroy_value(Set vec, DestroyFunc destroy_value) {
+	DestroyFunc old = vec->destroy_value;
+	vec->destroy_value = destroy_value;
+	return old;
+}
+
+// The nodes are always allocated from the slabs of the node array (see struct node_array), which is already a pool.
+void set_use_node_pool(Set set, bool use_pool) {
+	assert(set->size == 0); // LCOV_EXCL_LINE
+	assert(set->frozen == NULL); // LCOV_EXCL_LINE
+}
+
+// Each node has a single value, so the keys would not make the search cheaper.
+void set_set_key_func(Set set, KeyFunc key) {
+	assert(set->size == 0); // LCOV_EXCL_LINE
+}
+
+// Every update changes the sizes and balances of the whole path up to the root, so it cannot be split in independent
+// latches.
+bool set_use_concurrent_writes(Set set, bool concurrent) {
+	return false;
+}
+
+// A node holds a single value, so a buffer per node would not visit fewer nodes than the insertions themselves.
+bool set_use_write_buffers(Set set, bool buffered) {
+	return false;
+}
+
+// The SetNodes are the nodes of the tree, which already remain valid until their value is removed.
+void set_use_stable_nodes(Set set, bool stable) {
+}
+
+// The marked values are destroyed, then the tree is rebuilt balanced from the others, in O(n).
+
+void set_compact(Set set) {
+	if (set->removed == 0)
+		return;
+	STATS_ENTER(set);
+
+	Pointer* values = malloc(set->size * sizeof(Pointer));
+	int count = 0;
+	for (NodeIndex index = node_find_min(set->nodes, set->root); index != NO_NODE; index = node_find_next(set->nodes, index)) {
+		SetNode node = node_at(set->nodes, index);
+		if (!node->removed)
+			values[count++] = node->value;
+		else if (set->destroy_value != NULL)
+			set->destroy_value(node->value);
+	}
+
+	// The old nodes are freed at once with their array, unless it is still used by the other part of a set_split.
+	// (A persistent set is never lazy.)
+	if (set->nodes->sets > 1) {
+		node_destroy(set->nodes, set->root, NULL);
+	} else {
+		node_array_release(set->nodes);
+		set->nodes = node_array_create();
+	}
+
+	NodeIndex first = node_array_alloc_range(set->nodes, count);
+	set->root = node_create_from_sorted(set->nodes, values, count, first);
+	set->removed = 0;
+	find_cache_clear(set);
+
+	free(values);
+}
+
+void set_use_lazy_removal(Set set, bool lazy) {
+	persistent_end(set); // the snapshots may have been destroyed
+	assert(set->frozen == NULL); // LCOV_EXCL_LINE
+	assert(set->hash_index == NULL); // LCOV_EXCL_LINE (the removed nodes would remain in the index)
+	assert(!set->persistent); // LCOV_EXCL_LINE (the marks would be shared with the snapshots)
+
+	if (!lazy)
+		set_compact(set);
+	set->lazy = lazy;
+}
+
+// The items of the index are the nodes
+static Pointer node_value(Pointer node) {
+	return ((SetNode)node)->value;
+}
+
+void set_use_hash_index(Set set, HashFunc hash) {
+	persistent_end(set); // as in set_use_lazy_removal
+	assert(!set->lazy); // LCOV_EXCL_LINE (the removed nodes would remain in the index)
+	assert(!set->persistent); // LCOV_EXCL_LINE (the writes copy the nodes, see node_own)
+	assert(set->frozen == NULL); // LCOV_EXCL_LINE
+
+	if (set->hash_index != NULL) {
+		hash_index_destroy(set->hash_index);
+		set->hash_index = NULL;
+	}
+	if (hash == NULL)
+		return;
+
+	set->hash_index = hash_index_create(hash, set->compare, node_value);
+	for (NodeIndex index = node_find_min(set->nodes, set->root); index != NO_NODE; index = node_find_next(set->nodes, index))
+		hash_index_insert(set->hash_index, node_at(set->nodes, index));
+}
+
+// The slots hold the indices of the nodes (4 bytes each), so a cache of a few thousand slots fits in the L1 / L2 cache.
+bool set_use_find_cache(Set set, HashFunc hash, int slots) {
+	persistent_end(set); // as in set_use_lazy_removal
+	assert(!set->persistent); // LCOV_EXCL_LINE (the writes copy the nodes, see node_own)
+	assert(set->frozen == NULL); // LCOV_EXCL_LINE
+	free(set->find_cache);
+	set->find_cache = NULL;
+	if (hash == NULL)
+		return true;
+
+	assert(slots > 0 && slots <= (1 << 30)); // LCOV_EXCL_LINE
+	uint32_t count = 1;
+	while (count < (uint32_t)slots)
+		count *= 2;
+	set->find_cache = calloc(count, sizeof(NodeIndex)); // all NO_NODE
+	set->find_cache_hash = hash;
+	set->find_cache_mask = count - 1;
+	return true;
+}
+
+bool set_has_find_cache(Set set) {
+	return set->find_cache != NULL;
+}
+
+// The root (and the node array) is shared with the snapshot, each write of either set copies its path (see node_own).
+
+Set set_snapshot(Set set) {
+	assert(!set->lazy); // LCOV_EXCL_LINE (the marks would be shared)
+	assert(set->hash_index == NULL); // LCOV_EXCL_LINE (the writes copy the nodes, see node_own)
+	assert(set->find_cache == NULL); // LCOV_EXCL_LINE (likewise)
+	assert(set->destroy_value == NULL); // LCOV_EXCL_LINE (the values are shared)
+	assert(set->frozen == NULL); // LCOV_EXCL_LINE
+
+	Set snapshot = set_create(set->compare, NULL);
+	node_array_release(snapshot->nodes);
+	snapshot->nodes = set->nodes;
+	set->nodes->sets++;
+	node_array_share(set->nodes);
+
+	snapshot->root = set->root;
+	snapshot->size = set->size;
+	snapshot->persistent = true;
+	set->persistent = true;
+	if (set->root != NO_NODE)
+		atomic_fetch_add(node_refs(set->nodes, set->root), 1);
+
+	return snapshot;
+}
+
+// Only the B-tree implementation has an on-disk format.
+bool set_save(Set set, const char* path, int value_size) {
+	return false;
+}
+
+Set set_open_mmap(const char* path, CompareFunc compare) {
+	return NULL;
+}
+
+// Appends value to the array that *ctx points to
+
+static void value_append(Pointer value, Pointer ctx) {
+	Pointer** next = ctx;
+	*(*next)++ = value;
+}
+
+// The values are copied in order to the array, then the nodes are freed (but not the values, which are now in the array)
+
+void set_freeze(Set set) {
+	assert(!set->lazy); // LCOV_EXCL_LINE (set_use_lazy_removal(set, false) destroys the removed values first)
+	if (set->frozen != NULL)
+		return;
+
+	Pointer* values = malloc(set->size * sizeof(Pointer));
+	Pointer* next = values;
+	set_visit_ctx(set, value_append, &next);
+	set->frozen = frozen_array_create(values, set->size);
+	free(values);
+
+	if (set->persistent) {
+		node_release(set->nodes, set->root, NULL); // the nodes shared with snapshots remain
+		set->persistent = false;
+	} else if (set->nodes->sets > 1) {
+		node_destroy(set->nodes, set->root, NULL); // the array is still used by the other part of a set_split
+	}
+	node_array_release(set->nodes); // all slabs at once
+	set->nodes = NULL;
+	set->root = NO_NODE;
+
+	if (set->hash_index != NULL) {
+		hash_index_destroy(set->hash_index);
+		set->hash_index = NULL;
+	}
+	free(set->find_cache);
+	set->find_cache = NULL;
+}
+
+void set_destroy(Set set) {
+	STATS_ENTER(set);
+	cleared_destroy(set);
+
+	// There is no need to visit the nodes if there are no values to destroy, all slabs are freed at once.
+	// A persistent set frees only the nodes it doesn't share, and a set whose array is still used by the other part
+	// of a set_split returns its nodes to the array.
+	if (set->nodes != NULL) {
+		if (set->persistent)
+			node_release(set->nodes, set->root, set->destroy_value);
+		else if (set->destroy_value != NULL || set->nodes->sets > 1)
+			node_destroy(set->nodes, set->root, set->destroy_value);
+		node_array_release(set->nodes);
+	}
+
+	if (set->hash_index != NULL)
+		hash_index_destroy(set->hash_index);
+	free(set->find_cache);
+	if (set->frozen != NULL)
+		frozen_array_destroy(set->frozen, set->destroy_value); // the tree is empty, the values are in the array
+
+#ifdef SET_STATS
+	current_stats = &unused_stats; // the stats of set are no longer valid
+#endif
+	free(set);
+}
+
+void set_clear(Set set) {
+	assert(set->frozen == NULL); // LCOV_EXCL_LINE
+	STATS_ENTER(set);
+	cleared_destroy(set);
+
+	// The nodes of a persistent set are shared with its snapshots, they are only released (in O(log n) stack depth,
+	// the tree is balanced). Otherwise the set continues with a new array, and the old one is destroyed in steps.
+	if (set->persistent) {
+		node_release(set->nodes, set->root, set->destroy_value);
+	} else if (set->root != NO_NODE) {
+		set->cleared_nodes = set->nodes;
+		set->cleared = set->root;
+		set->cleared_destroy_value = set->destroy_value; // set_set_destroy_value may change it before the end
+		set->nodes = node_array_create();
+		if (set->destroy_value == NULL && set->cleared_nodes->sets == 1)
+			cleared_destroy(set); // all slabs at once
+	}
+	set->root = NO_NODE;
+	set->size = 0;
+	set->removed = 0;
+
+	if (set->hash_index != NULL)
+		hash_index_clear(set->hash_index);
+	find_cache_clear(set);
+}
+
+bool set_destroy_incremental(Set set, int budget) {
+	if (set->cleared_nodes != NULL)
+		budget = cleared_destroy_steps(set, budget);
+	else if (set->frozen == NULL && set->nodes != NULL && set->root != NO_NODE) {
+		set_clear(set);
+		if (set->cleared_nodes != NULL)
+			budget = cleared_destroy_steps(set, budget);
+	}
+
+	if (set->cleared_nodes != NULL)
+		return false;
+	set_destroy(set); // the set is now empty (or frozen), this takes O(number of slabs)
+	return true;
+}
+
+SetNode set_first(Set set) {
+	if (set->frozen != NULL)
+		return frozen_pack(frozen_array_first(set->frozen));
+	return node_skip_removed(set, node_handle(set->nodes, node_find_min(set->nodes, set->root)), true);
+}
+
+SetNode set_last(Set set) {
+	if (set->frozen != NULL)
+		return frozen_pack(frozen_array_last(set->frozen));
+	return node_skip_removed(set, node_handle(set->nodes, node_find_max(set->nodes, set->root)), false);
+}
+
+// The parent pointers of a persistent set may point to nodes of other trees, so the neighbours are searched.
+
+SetNode set_previous(Set set, SetNode node) {
+	STATS_ENTER(set);
+	if (set->frozen != NULL)
+		return frozen_pack(frozen_array_previous(set->frozen, frozen_position(node)));
+	return node_skip_removed(set, node_handle(set->nodes, set->persistent
+		? node_find_bound_below(set->nodes, set->root, set->compare, node->value)
+		: node_find_previous(set->nodes, node_index(set, node))), false);
+}
+
+SetNode set_next(Set set, SetNode node) {
+	STATS_ENTER(set);
+	if (set->frozen != NULL)
+		return frozen_pack(frozen_array_next(set->frozen, frozen_position(node)));
+	return node_skip_removed(set, node_handle(set->nodes, set->persistent
+		? node_find_bound(set->nodes, set->root, set->compare, node->value, true)
+		: node_find_next(set->nodes, node_index(set, node))), true);
+}
+
+Pointer set_node_value(Set set, SetNode node) {
+	if (set->frozen != NULL)
+		return frozen_array_value(set->frozen, frozen_position(node));
+	return node->value;
+}
+
+SetNode set_find_node(Set set, Pointer value) {
+	STATS_ENTER(set);
+	STATS_ADD(lookups, 1);
+	if (set->frozen != NULL)
+		return frozen_pack(frozen_array_find(set->frozen, set->compare, value));
+	if (set->hash_index != NULL)
+		return hash_index_find(set->hash_index, value);
+
+	SetNode node = node_handle(set->nodes, node_find_cached(set, value));
+	return node != NULL && node->removed ? SET_EOF : node;
+}
+
+SetNode set_lower_bound(Set set, Pointer value) {
+	STATS_ENTER(set);
+	STATS_ADD(lookups, 1);
+	if (set->frozen != NULL)
+		return frozen_pack(frozen_array_bound(set->frozen, set->compare, value, false));
+	return node_skip_removed(set, node_handle(set->nodes, node_find_bound(set->nodes, set->root, set->compare, value, false)), true);
+}
+
+SetNode set_upper_bound(Set set, Pointer value) {
+	STATS_ENTER(set);
+	STATS_ADD(lookups, 1);
+	if (set->frozen != NULL)
+		return frozen_pack(frozen_array_bound(set->frozen, set->compare, value, true));
+	return node_skip_removed(set, node_handle(set->nodes, node_find_bound(set->nodes, set->root, set->compare, value, true)), true);
+}
+
+int set_rank(Set set, Pointer value) {
+	STATS_ENTER(set);
+	STATS_ADD(lookups, 1);
+	if (set->frozen != NULL)
+		return frozen_array_rank(set->frozen, set->compare, value);
+	set_compact(set); // the sizes of the subtrees also count the nodes marked as removed
+	return node_rank(set->nodes, set->root, set->compare, value);
+}
+
+SetNode set_select(Set set, int k) {
+	STATS_ENTER(set);
+	STATS_ADD(lookups, 1);
+	if (set->frozen != NULL)
+		return frozen_pack(frozen_array_select(set->frozen, k));
+	set_compact(set); // as in set_rank
+	return k >= 0 ? node_handle(set->nodes, node_select(set->nodes, set->root, k)) : SET_EOF;
+}
+
+#ifdef SET_STATS
+// Copies the counters of from, each with an atomic load (see STATS_ADD)
+
+static void stats_load(SetStats* to, SetStats* from) {
+	to->compares = __atomic_load_n(&from->compares, __ATOMIC_RELAXED);
+	to->lookups = __atomic_load_n(&from->lookups, __ATOMIC_RELAXED);
+	to->nodes_visited = __atomic_load_n(&from->nodes_visited, __ATOMIC_RELAXED);
+	to->rotations = __atomic_load_n(&from->rotations, __ATOMIC_RELAXED);
+	to->splits = __atomic_load_n(&from->splits, __ATOMIC_RELAXED);
+	to->merges = __atomic_load_n(&from->merges, __ATOMIC_RELAXED);
+	to->transfers = __atomic_load_n(&from->transfers, __ATOMIC_RELAXED);
+	to->allocations = __atomic_load_n(&from->allocations, __ATOMIC_RELAXED);
+	to->frees = __atomic_load_n(&from->frees, __ATOMIC_RELAXED);
+}
+#endif
+
+bool set_get_stats(Set set, SetStats* stats) {
+#ifdef SET_STATS
+	stats_load(stats, &set->stats);
+#else
+	memset(stats, 0, sizeof(*stats));
+#endif
+
+	// A perfect tree of height h has 2^h - 1 nodes
+	stats->height = set->frozen != NULL ? frozen_array_height(set->frozen) : node_height(set->nodes, set->root);
+	double perfect_size = 1;
+	for (int i = 0; i < stats->height; i++)
+		perfect_size *= 2;
+	stats->fill_factor = stats->height > 0 ? set->size / (perfect_size - 1) : 0;
+
+#ifdef SET_STATS
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+
+// Functions not present in the public interface but used in tests
+// Check that the tree is a correct AVL.
+
+// LCOV_EXCL_START (we don't care about the coverage of the test commands, and furthermore only true branches are tested in a successful test)
+
+// Also stores in *height the height of the subtree (the nodes store only the balance, so it is computed here).
+
+bool node_is_avl(NodeArray nodes, NodeIndex index, CompareFunc compare, bool check_parents, int* height) {
+	*height = 0;
+	if (index == NO_NODE)
+		return true;
+
+	// We check the property:
+	// each node is > left child, > rightmost node of the left subtree, < right child, < leftmost node of the right subtree.
+	// It is equivalent to the BST property (each node is > left subtree and < right subtree) but easier to check.
+	SetNode node = node_at(nodes, index);
+	bool res = true;
+	if(node->left != NO_NODE)
+		res = res && compare(node_at(nodes, node->left)->value, node->value) < 0 && compare(node_at(nodes, node_find_max(nodes, node->left))->value, node->value) < 0;
+	if(node->right != NO_NODE)
+		res = res && compare(node_at(nodes, node->right)->value, node->value) > 0 && compare(node_at(nodes, node_find_min(nodes, node->right))->value, node->value) > 0;
+
+	// The children point back to the node
+	res = res && (!check_parents || ((node->left == NO_NODE || node_at(nodes, node->left)->parent == index) && (node->right == NO_NODE || node_at(nodes, node->right)->parent == index)));
+
+	// The subtrees are correct
+	int left_height = 0, right_height = 0;
+	res = res &&
+		node_is_avl(nodes, node->left, compare, check_parents, &left_height) &&
+		node_is_avl(nodes, node->right, compare, check_parents, &right_height);
+
+	// The balance and the size are correct, and the node has the AVL property
+	*height = 1 + (left_height > right_height ? left_height : right_height);
+	res = res && node->balance == left_height - right_height;
+	res = res && node->size == 1 + node_size(nodes, node->left) + node_size(nodes, node->right);
+
+	return res;
+}
+
+bool set_is_proper(Set node) {
+	int height;
+	if (node->frozen != NULL)
+		return true;
+
+	// The parent pointers of a persistent set are not used (see set_next)
+	if (node->persistent)
+		return node_is_avl(node->nodes, node->root, node->compare, false, &height);
+	return (node->root == NO_NODE || node_at(node->nodes, node->root)->parent == NO_NODE) && node_is_avl(node->nodes, node->root, node->compare, true, &height);
+}
+
+// LCOV_EXCL_STOP
+
+
+
+//// Additional functions to be implemented in Lab 5
+
+// Recursive in-order traversal, for persistent sets (the depth is O(log n))
+
+static void node_visit(NodeArray nodes, NodeIndex index, VisitCtxFunc visit, Pointer ctx) {
+	if (index == NO_NODE)
+		return;
+
+	SetNode node = node_at(nodes, index);
+	node_visit(nodes, node->left, visit, ctx);
+	visit(node->value, ctx);
+	node_visit(nodes, node->right, visit, ctx);
+}
+
+// In-order traversal through the parent pointers: O(n) in total, no comparisons and no recursion.
+
+void set_visit_ctx(Set set, VisitCtxFunc visit, Pointer ctx) {
+	assert(set != NULL);
+	assert(visit != NULL);
+	if (set->frozen != NULL) {
+		for (int position = frozen_array_first(set->frozen); position != 0; position = frozen_array_next(set->frozen, position))
+			visit(frozen_array_value(set->frozen, position), ctx);
+		return;
+	}
+
+	if (set->persistent) {
+		node_visit(set->nodes, set->root, visit, ctx);
+		return;
+	}
+	for (NodeIndex index = node_find_min(set->nodes, set->root); index != NO_NODE; index = node_find_next(set->nodes, index))
+		if (!node_at(set->nodes, index)->removed)
+			visit(node_at(set->nodes, index)->value, ctx);
+}
+
+// Adapts a VisitFunc (passed through ctx) to a VisitCtxFunc
+
+static void visit_without_ctx(Pointer value, Pointer ctx) {
+	VisitFunc* visit = ctx;
+	(*visit)(value);
+}
+
+void set_visit(Set set, VisitFunc visit) {
+	assert(visit != NULL);
+	set_visit_ctx(set, visit_without_ctx, &visit);
+}
+
+// O(log n) to find the lower bound of lo, then O(1) amortized for each of the k visited elements (O(log n) in a
+// persistent set, see set_next).
+
+void set_visit_range_ctx(Set set, Pointer lo, Pointer hi, VisitCtxFunc visit, Pointer ctx) {
+	assert(set != NULL);
+	assert(visit != NULL);
+	STATS_ENTER(set);
+	if (set->frozen != NULL) {
+		for (int position = frozen_array_bound(set->frozen, set->compare, lo, false);
+			 position != 0 && COMPARE(set->compare, frozen_array_value(set->frozen, position), hi) < 0;
+			 position = frozen_array_next(set->frozen, position))
+			visit(frozen_array_value(set->frozen, position), ctx);
+		return;
+	}
+
+	for (NodeIndex index = node_find_bound(set->nodes, set->root, set->compare, lo, false);
+		 index != NO_NODE && COMPARE(set->compare, node_at(set->nodes, index)->value, hi) < 0;
+		 index = node_find_neighbour(set, index, true))
+		if (!node_at(set->nodes, index)->removed)
+			visit(node_at(set->nodes, index)->value, ctx);
+}
+
+void set_visit_range(Set set, Pointer lo, Pointer hi, VisitFunc visit) {
+	assert(visit != NULL);
+	set_visit_range_ctx(set, lo, hi, visit_without_ctx, &visit);
+}
+
+// Visits in order the values of the subtree rooted at node with rank (position in the subtree) in [lo, hi). Only the
+// subtrees that contain such ranks are entered, so O(log n + hi - lo), without parent pointers.
+
+static void node_visit_ranks(NodeArray nodes, NodeIndex index, int lo, int hi, VisitCtxFunc visit, Pointer ctx) {
+	if (index == NO_NODE || lo >= hi)
+		return;
+
+	SetNode node = node_at(nodes, index);
+	int left_size = node_size(nodes, node->left);
+	if (lo < left_size)
+		node_visit_ranks(nodes, node->left, lo, hi, visit, ctx);
+	if (lo <= left_size && left_size < hi)
+		visit(node->value, ctx);
+	if (hi > left_size + 1)
+		node_visit_ranks(nodes, node->right, lo - left_size - 1, hi - left_size - 1, visit, ctx);
+}
+
+// set_visit_parallel(_ordered): the parts are ranges of ranks of (almost) equal size
+
+typedef struct {
+	Set set;
+	VisitCtxFunc visit;
+	Pointer* ctxs; // the ctx of each part, NULL if all parts use ctx
+	Pointer ctx;
+	int parts;
+} ParallelVisit;
+
+static void visit_part(int part, Pointer arg) {
+	ParallelVisit* parallel = arg;
+	int lo = (long)parallel->set->size * part / parallel->parts;
+	int hi = (long)parallel->set->size * (part + 1) / parallel->parts;
+
+	node_visit_ranks(parallel->set->nodes, parallel->set->root, lo, hi, parallel->visit, parallel->ctxs != NULL ? parallel->ctxs[part] : parallel->ctx);
+}
+
+void set_visit_parallel(Set set, VisitCtxFunc visit, Pointer ctx, int nthreads) {
+	assert(visit != NULL);
+	assert(nthreads >= 1);
+	assert(set->frozen == NULL); // LCOV_EXCL_LINE
+	set_compact(set); // the parts are found by the sizes of the subtrees, which also count the marked nodes
+
+	int parts = nthreads * PARALLEL_TASKS_PER_THREAD;
+	if (parts > set->size)
+		parts = set->size;
+
+	ParallelVisit parallel = { .set = set, .visit = visit, .ctxs = NULL, .ctx = ctx, .parts = parts };
+	run_tasks(parts, nthreads, visit_part, &parallel);
+}
+
+void set_visit_parallel_ordered(Set set, VisitCtxFunc visit, Pointer* ctxs, int parts, int nthreads) {
+	assert(visit != NULL);
+	assert(nthreads >= 1);
+	assert(set->frozen == NULL); // LCOV_EXCL_LINE
+	set_compact(set); // as in set_visit_parallel
+
+	ParallelVisit parallel = { .set = set, .visit = visit, .ctxs = ctxs, .ctx = NULL, .parts = parts };
+	run_tasks(parts, nthreads, visit_part, &parallel);
+}
+
+
+//// Set algebra ////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Returns a new array with the values of set in order (set->size of them)
+
+static Pointer* set_values(Set set) {
+	Pointer* values = malloc(set->size * sizeof(Pointer));
+	Pointer* next = values;
+	set_visit_ctx(set, value_append, &next);
+	return values;
+}
+
+// Which values values_merge keeps: those only in a, those in both (the one of a), those only in b
+
+typedef enum { KEEP_A = 1, KEEP_BOTH = 2, KEEP_B = 4 } MergeKeep;
+
+// Merges the sorted arrays a and b in a single pass, stores the kept values (see MergeKeep) in out, in order, and
+// returns how many they are
+
+static int values_merge(Pointer* a, int na, Pointer* b, int nb, CompareFunc compare, int keep, Pointer* out) {
+	int count = 0, i = 0, j = 0;
+	while (i < na && j < nb) {
+		int compare_res = COMPARE(compare, a[i], b[j]);
+		if (compare_res < 0) {
+			if (keep & KEEP_A)
+				out[count++] = a[i];
+			i++;
+		} else if (compare_res > 0) {
+			if (keep & KEEP_B)
+				out[count++] = b[j];
+			j++;
+		} else {
+			if (keep & KEEP_BOTH)
+				out[count++] = a[i];
+			i++;
+			j++;
+		}
+	}
+	if (keep & KEEP_A)
+		while (i < na)
+			out[count++] = a[i++];
+	if (keep & KEEP_B)
+		while (j < nb)
+			out[count++] = b[j++];
+	return count;
+}
+
+// Stores in out (in order) the values of set that are (present == true) or are not in other, and returns how many
+// they are. If set is much smaller than other, each value is searched in other (O(n log m)), otherwise the two
+// sequences are merged (O(n + m)).
+
+static int values_filter(Set set, Set other, bool present, Pointer* out) {
+	Pointer* values = set_values(set);
+	int count = 0;
+
+	if (!batch_is_large(other->size, set->size)) {
+		for (int i = 0; i < set->size; i++)
+			if ((set_find_node(other, values[i]) != SET_EOF) == present)
+				out[count++] = values[i];
+	} else {
+		Pointer* other_values = set_values(other);
+		STATS_ENTER(set);
+		count = values_merge(values, set->size, other_values, other->size, set->compare, present ? KEEP_BOTH : KEEP_A, out);
+		free(other_values);
+	}
+
+	free(values);
+	return count;
+}
+
+Set set_union(Set a, Set b) {
+	assert(a->compare == b->compare); // LCOV_EXCL_LINE
+	STATS_ENTER(a);
+
+	Pointer* a_values = set_values(a);
+	Pointer* b_values = set_values(b);
+	Pointer* values = malloc((a->size + b->size) * sizeof(Pointer));
+	int count = values_merge(a_values, a->size, b_values, b->size, a->compare, KEEP_A | KEEP_BOTH | KEEP_B, values);
+
+	Set result = set_create_from_sorted(a->compare, NULL, values, count);
+	free(a_values);
+	free(b_values);
+	free(values);
+	return result;
+}
+
+Set set_intersection(Set a, Set b) {
+	assert(a->compare == b->compare); // LCOV_EXCL_LINE
+
+	Pointer* values = malloc(a->size * sizeof(Pointer));
+	int count = values_filter(a, b, true, values);
+	Set result = set_create_from_sorted(a->compare, NULL, values, count);
+	free(values);
+	return result;
+}
+
+Set set_difference(Set a, Set b) {
+	assert(a->compare == b->compare); // LCOV_EXCL_LINE
+
+	Pointer* values = malloc(a->size * sizeof(Pointer));
+	int count = values_filter(a, b, false, values);
+	Set result = set_create_from_sorted(a->compare, NULL, values, count);
+	free(values);
+	return result;
+}
+
+bool set_is_subset(Set a, Set b) {
+	assert(a->compare == b->compare); // LCOV_EXCL_LINE
+	if (a->size > b->size)
+		return false;
+
+	Pointer* values = malloc(a->size * sizeof(Pointer));
+	int count = values_filter(a, b, false, values);
+	free(values);
+	return count == 0;
+}
+
+// Removes the values (of set itself) with a single batch operation. They are destroyed at the end, since
+// set_remove_many still compares them with the following nodes after removing them.
+// With lazy removal set_remove_many would only mark them, so it is turned off while removing (the values that
+// are already marked are destroyed first by set_compact)
+
+static void values_remove(Set set, Pointer* values, int count) {
+	bool lazy = set->lazy;
+	if (lazy)
+		set_use_lazy_removal(set, false);
+
+	DestroyFunc destroy_value = set_set_destroy_value(set, NULL);
+	set_remove_many(set, values, count);
+	set_set_destroy_value(set, destroy_value);
+	set->lazy = lazy;
+
+	if (destroy_value != NULL)
+		for (int i = 0; i < count; i++)
+			destroy_value(values[i]);
+}
+
+// The in-place versions compute the values to add (or remove) as above, then change set with a single batch operation
+
+void set_union_in_place(Set set, Set other) {
+	assert(set->compare == other->compare); // LCOV_EXCL_LINE
+	assert(set->frozen == NULL); // LCOV_EXCL_LINE
+
+	Pointer* values = malloc(other->size * sizeof(Pointer));
+	int count = values_filter(other, set, false, values);
+	set_insert_many(set, values, count);
+	free(values);
+}
+
+void set_intersection_in_place(Set set, Set other) {
+	assert(set->compare == other->compare); // LCOV_EXCL_LINE
+	assert(set->frozen == NULL); // LCOV_EXCL_LINE
+
+	Pointer* values = malloc(set->size * sizeof(Pointer));
+	int count = values_filter(set, other, false, values);
+	values_remove(set, values, count);
+	free(values);
+}
+
+void set_difference_in_place(Set set, Set other) {
+	assert(set->compare == other->compare); // LCOV_EXCL_LINE
+	assert(set->frozen == NULL); // LCOV_EXCL_LINE
+
+	Pointer* values = malloc(set->size * sizeof(Pointer));
+	int count = values_filter(set, other, true, values);
+	values_remove(set, values, count);
+	free(values);
+}
+
+
+//// Split and join /////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Destroys set without destroying its values, which now belong to other sets
+
+static void set_destroy_keeping_values(Set set) {
+	set_set_destroy_value(set, NULL);
+	set_destroy(set);
+}
+
+// The two trees are split from the tree of set, so they share its node array (see node_array_release). Persistent
+// sets share the nodes with snapshots, so their values are copied to two new trees instead, in O(n).
+
+void set_split(Set set, Pointer pivot, Set* left, Set* right) {
+	assert(set->frozen == NULL); // LCOV_EXCL_LINE
+	assert(set->hash_index == NULL); // LCOV_EXCL_LINE
+	assert(set->find_cache == NULL); // LCOV_EXCL_LINE
+	STATS_ENTER(set);
+	set_compact(set); // With lazy removal, the marked values are destroyed first.
+	cleared_destroy(set); // And the tree of a set_clear.
+
+	if (set->persistent) {
+		Pointer* values = set_values(set);
+		int count = node_rank(set->nodes, set->root, set->compare, pivot);
+		*left = set_create_from_sorted(set->compare, set->destroy_value, values, count);
+		*right = set_create_from_sorted(set->compare, set->destroy_value, values + count, set->size - count);
+		set_destroy_keeping_values(set);
+		free(values);
+		return;
+	}
+
+	NodeArray nodes = set->nodes;
+	Set right_set = set_create(set->compare, set->destroy_value);
+	node_array_release(right_set->nodes);
+	right_set->nodes = nodes;
+	nodes->sets++;
+
+	NodeIndex left_root, right_root;
+	int left_height, right_height;
+	node_split(nodes, set->root, node_height(nodes, set->root), set->compare, pivot, &left_root, &left_height, &right_root, &right_height);
+
+	set->root = left_root;
+	set->size = node_size(nodes, left_root);
+	right_set->root = right_root;
+	right_set->size = node_size(nodes, right_root);
+	if (left_root != NO_NODE)
+		node_at(nodes, left_root)->parent = NO_NODE;
+	if (right_root != NO_NODE)
+		node_at(nodes, right_root)->parent = NO_NODE;
+
+	*left = set;
+	*right = right_set;
+}
+
+// The smallest node of right is removed, and joins the two trees. If they have different node arrays, the smaller tree
+// is first moved to the array of the other one.
+
+Set set_join(Set left, Set right) {
+	set_compact(left); // With lazy removal, the marked values are destroyed first.
+	set_compact(right);
+	cleared_destroy(left); // And the trees of set_clear.
+	cleared_destroy(right);
+	assert(left->compare == right->compare); // LCOV_EXCL_LINE
+	assert(left->frozen == NULL && right->frozen == NULL); // LCOV_EXCL_LINE
+	assert(left->hash_index == NULL && right->hash_index == NULL); // LCOV_EXCL_LINE
+	assert(left->find_cache == NULL && right->find_cache == NULL); // LCOV_EXCL_LINE
+	assert(left->size == 0 || right->size == 0 || left->compare(node_at(left->nodes, node_find_max(left->nodes, left->root))->value, node_at(right->nodes, node_find_min(right->nodes, right->root))->value) < 0); // LCOV_EXCL_LINE
+	STATS_ENTER(left);
+
+	if (left->persistent || right->persistent) {
+		Pointer* values = malloc((left->size + right->size) * sizeof(Pointer));
+		Pointer* next = values;
+		set_visit_ctx(left, value_append, &next);
+		set_visit_ctx(right, value_append, &next);
+
+		Set set = set_create_from_sorted(left->compare, left->destroy_value, values, left->size + right->size);
+		set_destroy_keeping_values(left);
+		set_destroy_keeping_values(right);
+		free(values);
+		return set;
+	}
+
+	if (left->nodes != right->nodes) {
+		if (left->size >= right->size) {
+			right->root = node_move(left->nodes, right->nodes, right->root);
+		} else {
+			left->root = node_move(right->nodes, left->nodes, left->root);
+			node_array_release(left->nodes);
+			left->nodes = right->nodes;
+			left->nodes->sets++;
+		}
+	}
+
+	NodeArray nodes = left->nodes;
+	if (right->root != NO_NODE) {
+		int right_height = node_height(nodes, right->root);
+		NodeIndex mid;
+		bool shrank;
+		NodeIndex right_root = node_remove_min(nodes, right->root, &mid, &shrank);
+
+		int height;
+		left->root = node_join(nodes, left->root, node_height(nodes, left->root), mid, right_root, right_height - shrank, &height);
+		node_at(nodes, left->root)->parent = NO_NODE;
+	}
+	left->size += right->size;
+
+	node_array_release(right->nodes);
+	free(right);
+	return left;
+}
+
+
+//// Cursors ////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct set_cursor {
+	Set set;
+	NodeIndex node; // the position, NO_NODE at SET_EOF
+};
+
+// Finger search: returns the node with value equivalent to value, otherwise NO_NODE, searching from node instead of
+// the root. Also stores in *bound the smallest node >= value (NO_NODE if there is none), and in *parent the last node
+// visited, which is the parent of value if it is added (value < *parent exactly when *bound == *parent).
+//
+// All values of the left (right) subtree of node are between node and its nearest ancestor that has node in its right
+// (left) subtree. So we climb to that ancestor only while value is beyond it, then search the subtree as usual.
+
+static NodeIndex node_find_from(NodeArray nodes, NodeIndex index, CompareFunc compare, Pointer value, NodeIndex* bound, NodeIndex* parent) {
+	STATS_ADD(nodes_visited, 1);
+	int compare_res = COMPARE(compare, value, node_at(nodes, index)->value);
+	NodeIndex ancestor = NO_NODE;
+
+	while (compare_res != 0) {
+		// The nearest ancestor on the side of value
+		ancestor = index;
+		for (NodeIndex up; (up = node_at(nodes, ancestor)->parent) != NO_NODE; ancestor = up) {
+			SetNode up_node = node_at(nodes, up);
+			if ((compare_res > 0 ? up_node->right : up_node->left) != ancestor)
+				break;
+		}
+		ancestor = node_at(nodes, ancestor)->parent;
+		if (ancestor == NO_NODE)
+			break; // there is no bound on the side of value, it is in the subtree of node
+
+		STATS_ADD(nodes_visited, 1);
+		int ancestor_res = COMPARE(compare, value, node_at(nodes, ancestor)->value);
+		if (compare_res > 0 ? ancestor_res < 0 : ancestor_res > 0)
+			break; // value is between node and ancestor, it is in the subtree of node
+
+		index = ancestor;
+		compare_res = ancestor_res;
+	}
+
+	*parent = index;
+	if (compare_res == 0) {
+		*bound = index;
+		return index;
+	}
+
+	// Continue in the subtree on the side of value, with the same descent as node_find_bound
+	*bound = compare_res < 0 ? index : ancestor;
+	NodeIndex child = compare_res < 0 ? node_at(nodes, index)->left : node_at(nodes, index)->right;
+	while (child != NO_NODE) {
+		*parent = child;
+		SetNode child_node = node_at(nodes, child);
+		STATS_ADD(nodes_visited, 1);
+		compare_res = COMPARE(compare, value, child_node->value);
+		if (compare_res == 0) {
+			*bound = child;
+			return child;
+		} else if (compare_res < 0) {
+			*bound = child;
+			child = child_node->left;
+		} else {
+			child = child_node->right;
+		}
+	}
+	return NO_NODE;
+}
+
+// Walks from node up to the root after the height of its left (if left is true) or right subtree changed by delta,
+// repairing the size and balance of each node (the bottom-up version of the repairs of node_insert / node_remove).
+// Above the first node whose height does not change, only the sizes change.
+
+static void node_repair_to_root(Set set, NodeIndex index, bool left, int delta) {
+	NodeArray nodes = set->nodes;
+	while (index != NO_NODE) {
+		NodeIndex parent = node_at(nodes, index)->parent;
+		bool is_left = parent != NO_NODE && node_at(nodes, parent)->left == index;
+		bool changed;
+		NodeIndex root = node_repair_balance(nodes, index, left, delta, &changed); // the root of the subtree may change
+
+		if (parent == NO_NODE) {
+			set->root = root;
+			node_at(nodes, root)->parent = NO_NODE;
+		} else if (is_left) {
+			node_set_left(nodes, parent, root);
+		} else {
+			node_set_right(nodes, parent, root);
+		}
+		index = parent;
+		left = is_left;
+		delta = changed ? delta : 0;
+	}
+}
+
+// Removes node from the tree of set and frees it, without searching for it (the bottom-up version of node_remove)
+
+static void node_unlink(Set set, NodeIndex index) {
+	NodeArray nodes = set->nodes;
+	SetNode node = node_at(nodes, index);
+	NodeIndex parent = node->parent;
+	NodeIndex replacement; // the node that takes the position of node
+	NodeIndex repair_from; // the lowest node whose subtree changed
+	bool repair_left; // AVL: the subtree of repair_from that became lower
+
+	if (node->left == NO_NODE || node->right == NO_NODE) {
+		replacement = node->left != NO_NODE ? node->left : node->right;
+		repair_from = parent;
+		repair_left = parent != NO_NODE && node_at(nodes, parent)->left == index;
+
+	} else {
+		// Both children exist, node is replaced by the smallest node of its right subtree, as in node_remove
+		replacement = node_find_min(nodes, node->right);
+		SetNode replacement_node = node_at(nodes, replacement);
+		if (replacement_node->parent == index) {
+			repair_from = replacement;
+			repair_left = false;
+		} else {
+			repair_from = replacement_node->parent;
+			repair_left = true;
+			node_set_left(nodes, replacement_node->parent, replacement_node->right);
+			node_set_right(nodes, replacement, node->right);
+		}
+		node_set_left(nodes, replacement, node->left);
+		replacement_node->balance = node->balance; // AVL
+	}
+
+	if (parent == NO_NODE) {
+		set->root = replacement;
+		if (replacement != NO_NODE)
+			node_at(nodes, replacement)->parent = NO_NODE;
+	} else if (node_at(nodes, parent)->left == index) {
+		node_set_left(nodes, parent, replacement);
+	} else {
+		node_set_right(nodes, parent, replacement);
+	}
+
+	node_free(nodes, index);
+	node_repair_to_root(set, repair_from, repair_left, -1); // AVL
+}
+
+// Moves the cursor past the nodes marked as removed (see set_use_lazy_removal), to the next nodes if next, otherwise
+// to the previous ones.
+
+static void cursor_skip_removed(SetCursor cursor, bool next) {
+	Set set = cursor->set;
+	while (cursor->node != NO_NODE && node_at(set->nodes, cursor->node)->removed)
+		cursor->node = node_find_neighbour(set, cursor->node, next);
+}
+
+SetCursor set_cursor_create(Set set) {
+	assert(set->frozen == NULL); // LCOV_EXCL_LINE
+	SetCursor cursor = malloc(sizeof(*cursor));
+	cursor->set = set;
+	cursor->node = node_find_min(set->nodes, set->root);
+	cursor_skip_removed(cursor, true);
+	return cursor;
+}
+
+SetNode set_cursor_node(SetCursor cursor) {
+	return node_handle(cursor->set->nodes, cursor->node);
+}
+
+bool set_cursor_seek(SetCursor cursor, Pointer value) {
+	Set set = cursor->set;
+	STATS_ENTER(set);
+	STATS_ADD(lookups, 1);
+	if (set->root == NO_NODE) {
+		cursor->node = NO_NODE;
+		return false;
+	}
+	if (set->persistent) { // the parent pointers are not used (see set_snapshot), search from the root
+		cursor->node = node_find_bound(set->nodes, set->root, set->compare, value, false);
+		cursor_skip_removed(cursor, true);
+		return cursor->node != NO_NODE && COMPARE(set->compare, value, node_at(set->nodes, cursor->node)->value) == 0;
+	}
+
+	NodeIndex parent;
+	NodeIndex node = node_find_from(set->nodes, cursor->node != NO_NODE ? cursor->node : set->root, set->compare, value, &cursor->node, &parent);
+	cursor_skip_removed(cursor, true); // a marked value is not found, the cursor moves to the next one
+	return node != NO_NODE && node == cursor->node;
+}
+
+SetNode set_cursor_next(SetCursor cursor) {
+	Set set = cursor->set;
+	STATS_ENTER(set);
+	cursor->node = cursor->node != NO_NODE ? node_find_neighbour(set, cursor->node, true) : node_find_min(set->nodes, set->root);
+	cursor_skip_removed(cursor, true);
+	return node_handle(set->nodes, cursor->node);
+}
+
+SetNode set_cursor_previous(SetCursor cursor) {
+	Set set = cursor->set;
+	STATS_ENTER(set);
+	cursor->node = cursor->node != NO_NODE ? node_find_neighbour(set, cursor->node, false) : node_find_max(set->nodes, set->root);
+	cursor_skip_removed(cursor, false);
+	return node_handle(set->nodes, cursor->node);
+}
+
+void set_cursor_insert(SetCursor cursor, Pointer value) {
+	Set set = cursor->set;
+	persistent_end(set);
+	if (set->root == NO_NODE || set->persistent) { // persistent sets copy the path from the root
+		set_insert(set, value);
+		set_cursor_seek(cursor, value);
+		return;
+	}
+
+	STATS_ENTER(set);
+	STATS_ADD(lookups, 1);
+	NodeArray nodes = set->nodes;
+	NodeIndex bound, parent;
+	NodeIndex node = node_find_from(nodes, cursor->node != NO_NODE ? cursor->node : set->root, set->compare, value, &bound, &parent);
+
+	if (node != NO_NODE) {
+		// found equivalent value, update as in set_insert
+		Pointer old_value = node_at(nodes, node)->value;
+		node_at(nodes, node)->value = value;
+		if (node_at(nodes, node)->removed)
+			node_revive(set, node_at(nodes, node));
+		if (set->destroy_value != NULL)
+			set->destroy_value(old_value);
+
+	} else {
+		// the new node becomes a child of parent, on the side of value
+		node = node_create(nodes, value);
+		if (bound == parent)
+			node_set_left(nodes, parent, node);
+		else
+			node_set_right(nodes, parent, node);
+
+		node_repair_to_root(set, parent, bound == parent, 1); // AVL
+		set->size++;
+		if (set->hash_index != NULL)
+			hash_index_insert(set->hash_index, node_at(nodes, node));
+	}
+	cursor->node = node;
+}
+
+void set_cursor_remove(SetCursor cursor) {
+	assert(cursor->node != NO_NODE); // LCOV_EXCL_LINE
+
+	Set set = cursor->set;
+	STATS_ENTER(set);
+	persistent_end(set);
+	NodeIndex node = cursor->node;
+	Pointer value = node_at(set->nodes, node)->value;
+	assert(!node_at(set->nodes, node)->removed); // LCOV_EXCL_LINE
+
+	if (set->persistent) {
+		// The path is copied from the root, so the next node is found again by its value
+		NodeIndex next = node_find_bound(set->nodes, set->root, set->compare, value, true);
+		Pointer next_value = next != NO_NODE ? node_at(set->nodes, next)->value : NULL;
+		set_remove(set, value);
+		cursor->node = next != NO_NODE ? node_find_equal(set->nodes, set->root, set->compare, next_value) : NO_NODE;
+		cursor_skip_removed(cursor, true);
+		return;
+	}
+
+	// The nodes are not moved by node_unlink, so the next node remains valid
+	cursor->node = node_find_next(set->nodes, node);
+	cursor_skip_removed(cursor, true);
+
+	if (set->lazy) {
+		// Marked as in set_remove, but without compacting, which would invalidate the cursor
+		node_at(set->nodes, node)->removed = 1;
+		set->size--;
+		set->removed++;
+		return;
+	}
+	if (set->hash_index != NULL)
+		hash_index_remove(set->hash_index, value);
+	find_cache_remove(set, value);
+
+	node_unlink(set, node);
+	set->size--;
+	if (set->destroy_value != NULL)
+		set->destroy_value(value);
+}
+
+void set_cursor_destroy(SetCursor cursor) {
+	free(cursor);
 }
@@ -4,18 +4,108 @@
 //
 ///////////////////////////////////////////////////////////
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <assert.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "ADTSet.h"
-
-#define MIN_CHILDREN 3 // We implement the B-tree as a (3,5)-tree
-#define MAX_CHILDREN 5
-
-#define MIN_VALUES (MIN_CHILDREN - 1)
-#define MAX_VALUES (MAX_CHILDREN - 1)
-
-typedef struct btree_node* BTreeNode; typedef struct btree_node* BTreeNode;
+#include "NodePool.h"
+#include "HashIndex.h"
+#include "FrozenArray.h"
+
+// Statistics for set_get_stats, collected only if compiled with -DSET_STATS, otherwise the STATS_* macros are empty.
+// The node functions have no access to the set, so they add to current_stats, the statistics of the set whose
+// operation is running, which is set by STATS_ENTER at the start of the set_* functions.
+#ifdef SET_STATS
+static SetStats unused_stats; // current_stats while no set is running an operation
+static _Thread_local SetStats* current_stats = &unused_stats;
+#define STATS_ENTER(set) (current_stats = &(set)->stats)
+// The counters of a set can be updated by many threads at the same time (concurrent readers of a ConcurrentSet,
+// concurrent writes of the B-tree), so they are added with relaxed atomics, which order nothing but lose no addition.
+#define STATS_ADD(field, n) __atomic_fetch_add(&current_stats->field, (n), __ATOMIC_RELAXED)
+#else
+#define STATS_ENTER(set) ((void)0)
+#define STATS_ADD(field, n) ((void)0)
+#endif
+
+// Calls compare(a, b), counting the call. With -DSET_INT_KEYS the module implements a set of integer keys: the values
+// are intptr_t stored directly in the Pointer, eg set_insert(set, (Pointer)(intptr_t)key), and they are compared
+// inline instead of calling compare (which is ignored by set_create).
+#ifdef SET_INT_KEYS
+#define COMPARE(compare, a, b) (STATS_ADD(compares, 1), ((intptr_t)(a) > (intptr_t)(b)) - ((intptr_t)(a) < (intptr_t)(b)))
+
+// Used where the compare function itself is needed (eg for sorting in set_create_from_array)
+static int compare_int_keys(Pointer a, Pointer b) {
+	return COMPARE(NULL, a, b);
+}
+#else
+#define COMPARE(compare, a, b) (STATS_ADD(compares, 1), (compare)(a, b))
+#endif
+
+// The order of the tree is the maximum number of children of a node, it is chosen per set with set_create_with_order.
+// set_create uses DEFAULT_ORDER, by default we implement the B-tree as a (3,5)-tree. Compile with
+// -DDEFAULT_ORDER=<order> to change it, eg so that a node fills a cache line or a page.
+#ifndef DEFAULT_ORDER
+#define DEFAULT_ORDER 5
+#endif
+
+#define MIN_ORDER 3 // With less than 3 children we cannot split a node in 2 valid nodes
+
+#define MIN_CHILDREN(order) (((order) + 1) / 2) // Each node (except the root) has at least ceil(order/2) children
+#define MAX_CHILDREN(order) (order)
+
+#define MIN_VALUES(order) (MIN_CHILDREN(order) - 1)
+#define MAX_VALUES(order) (MAX_CHILDREN(order) - 1)
+
+// Percentage of MAX_VALUES stored in each node by set_create_from_sorted. 100 gives the most compact tree
+// for read-mostly sets, lower values leave space for later inserts before nodes need to be split.
+#ifndef BULK_LOAD_FILL
+#define BULK_LOAD_FILL 100
+#endif
+
+// With set_use_write_buffers, the write buffer of a node is flushed to its children when it has more values than
+// this. Compile with -DWRITE_BUFFER_SIZE=<size> to change it.
+#ifndef WRITE_BUFFER_SIZE
+#define WRITE_BUFFER_SIZE 64
+#endif
+
+// With set_use_lazy_removal, the tree is compacted when more than this percentage of its values are marked as removed.
+#ifndef COMPACT_REMOVED_PERCENT
+#define COMPACT_REMOVED_PERCENT 50
+#endif
+
+#define MAX_LAZY_ORDER 64 // With lazy removal the marks of the values of a node are the bits of a uint64_t.
+
+// After set_clear, each set_insert / set_remove also does this many steps of the destruction of the cleared tree.
+#ifndef CLEAR_STEPS
+#define CLEAR_STEPS 8
+#endif
+
+// set_find_many advances this many searches at a time, so up to this many nodes are being loaded at once.
+#ifndef FIND_GROUP
+#define FIND_GROUP 16
+#endif
+
+typedef struct btree_node* BTreeNode;
+
+// The write buffer of an internal node (see set_use_write_buffers): values inserted in its subtree that have not
+// reached their position yet. A value equivalent to a separator of the node belongs to the left child of the separator.
+struct write_buffer {
+	Pointer* values; // Sorted, without equivalent values.
+	int count;
+	int capacity;
+	CompareFunc compare; // The compare of the set, for the node functions that move values between buffers.
+};
+typedef struct write_buffer* WriteBuffer;
 
 // We implement the ADT Set via B-Tree, so the struct set is a B-Tree.
 struct set {
@@ -23,39 +113,112 @@ struct set {
 	int size; // Size, so that set_size() has complexity O(1).
 	CompareFunc compare; // Order.
 	DestroyFunc destroy_value; // Function that destroys an element of set.
-};
-
-// Node of the set, contains a single value. Each btree_node contains multiple set_nodes!
-struct set_node {
-	Pointer value; // The value of the node.
-	BTreeNode owner; // The btree_node to which this set_node belongs
+	int order; // Maximum number of children of each btree_node.
+	uintptr_t index_mask; // The low bits of a SetNode that hold the index of the value in its btree_node.
+	NodePool pool; // The btree_nodes are allocated from this pool, or with aligned_alloc if NULL.
+	KeyFunc key; // See set_set_key_func, NULL if the values are only compared with compare.
+	pthread_rwlock_t* root_latch; // Protects root with concurrent writes (see set_use_concurrent_writes), otherwise NULL.
+	struct mapped_header* mapped; // The file of set_open_mmap (mapped read-only, root is NULL), otherwise NULL.
+	HashIndex hash_index; // The values (see set_use_hash_index), NULL if not used.
+	FrozenArray frozen; // The values after set_freeze (root is NULL), otherwise NULL.
+	bool write_buffers; // See set_use_write_buffers.
+	int buffered; // Number of values in the write buffers, not counted in size.
+	bool lazy; // See set_use_lazy_removal.
+	bool stable_nodes; // See set_use_stable_nodes.
+	int removed; // Number of values marked as removed, not counted in size (but in the sizes of the subtrees).
+	BTreeNode cleared; // The remaining nodes of the tree of set_clear while it is being destroyed, otherwise NULL.
+	NodePool cleared_pool; // The pool of those nodes, NULL if they were allocated with aligned_alloc.
+	DestroyFunc cleared_destroy_value; // The destroy_value of the set at the time of set_clear, for those nodes.
+#ifdef SET_STATS
+	SetStats stats; // See set_get_stats.
+#endif
 };
 
 // The struct btree_node is the node of a B-Tree.
 // We bind MAX_CHILDREN+1 children and MAX_VALUES+1 values, because when inserting data
 // a node can *provisionally* acquire 1 value more than the maximum.
+// The tables depend on the order of the set, so they are stored in the same allocation as the node
+// (the values first, then their keys if the set has a key function, then the children and their sizes), see node_create.
 struct btree_node {
 	int count; // Number of data stored in the node.
 	BTreeNode parent;       
-	BTreeNode children[MAX_CHILDREN + 1]; // Table of children.
-	SetNode set_nodes[MAX_VALUES + 1]; // Table of set nodes (containing the data).
+	KeyFunc key; // The key function of the set, NULL if it has none.
+	int64_t* keys; // keys[i] == key(values[i]), NULL if key is NULL. The node is searched in this table, see node_search.
+	pthread_rwlock_t* latch; // The latch of the node with concurrent writes, otherwise NULL.
+	BTreeNode* children; // Table of children, MAX_CHILDREN+1 positions.
+	int* sizes; // sizes[i] is the number of values in the subtree children[i] (0 in leaves), for set_rank / set_select.
+	WriteBuffer buffer; // See struct write_buffer, NULL if the node has none (always in leaves).
+	uint64_t removed; // Bit i is set if values[i] is marked as removed (see set_use_lazy_removal).
+	Pointer values[]; // Table of values (the data), MAX_VALUES+1 positions.
 };
 
-// Auxiliary functions
-static BTreeNode node_create();;
-static SetNode set_node_create(Pointer value);
+// Node of the set. The values are stored directly inside the btree_nodes, so a SetNode is the pair
+// (btree_node, index of the value in it), packed in a single pointer: every btree_node is aligned to a
+// power of 2 which is at least equal to the order, so the index fits in the low bits of its address.
+// Consequently a SetNode remains valid only until the next set_insert/set_remove. With set_use_stable_nodes a SetNode
+// is the value itself instead, and its position is found again with a search when it is needed.
+// The struct set_node itself is never defined.
 
-static void node_add_value(BTreeNode node, SetNode set_node, int index);
-static void node_add_child(BTreeNode node, BTreeNode child, int index); static void node_add_child(BTreeNode node, BTreeNode child, int index);
+static SetNode set_node_pack(BTreeNode node, int index) {
+	return (SetNode)((uintptr_t)node | (uintptr_t)index);
+}
+
+static BTreeNode set_node_owner(Set set, SetNode set_node) {
+	return (BTreeNode)((uintptr_t)set_node & ~set->index_mask);
+}
 
-static BTreeNode node_find(BTreeNode node, CompareFunc compare, Pointer value, int* index); static BTreeNode node_find(BTreeNode node, CompareFunc compare, Pointer value, int* index);
+static int set_node_index(Set set, SetNode set_node) {
+	return (int)((uintptr_t)set_node & set->index_mask);
+}
 
-static SetNode node_find_min(BTreeNode node); static SetNode node_find_min(BTreeNode node);
-static SetNode node_find_max(BTreeNode node); static SetNode node_find_max(BTreeNode node);
-static SetNode node_find_previous(SetNode node, CompareFunc compare);;
-static SetNode node_find_next(SetNode node, CompareFunc compare);;
+// Returns the SetNode of the value at position index of node (see set_use_stable_nodes).
+static SetNode set_node_make(Set set, BTreeNode node, int index) {
+	return set->stable_nodes ? (SetNode)node->values[index] : set_node_pack(node, index);
+}
 
-static void btree_destroy(BTreeNode node, DestroyFunc destroy_value); static void btree_destroy(BTreeNode node, DestroyFunc destroy_value);
+// Auxiliary functions
+static BTreeNode node_create(int order, NodePool pool, KeyFunc key);
+static void node_free(BTreeNode node, NodePool pool);
+static void retire_node(BTreeNode node);
+static void node_init_latch(BTreeNode node);
+static void node_lock(BTreeNode node);
+static void node_unlock(BTreeNode node);
+
+static void node_set_value(BTreeNode node, int index, Pointer value);
+static void node_copy_value(BTreeNode node, int index, BTreeNode source, int source_index);
+static bool node_is_removed(BTreeNode node, int index);
+static void node_add_value(BTreeNode node, Pointer value, int index);
+static void node_add_child(BTreeNode node, BTreeNode child, int size, int index);
+static void node_add_to_ancestor_sizes(BTreeNode node, int delta);
+static int node_total_size(BTreeNode node);
+static int buffer_search(WriteBuffer buffer, Pointer value, bool* equal);
+static void buffer_move(BTreeNode to, int index, BTreeNode from, int first, int last);
+
+static int node_search(BTreeNode node, CompareFunc compare, Pointer value, bool* equal);
+static BTreeNode node_find(BTreeNode node, CompareFunc compare, Pointer value, int* index);
+
+static BTreeNode node_find_with_upper(BTreeNode node, CompareFunc compare, Pointer value, int* index, Pointer* upper);
+static BTreeNode node_find_bound(BTreeNode node, CompareFunc compare, Pointer value, bool strict, int* index);
+static BTreeNode node_find_min(BTreeNode node);
+static BTreeNode node_find_max(BTreeNode node);
+static bool node_find_previous(BTreeNode* node, int* index, CompareFunc compare);
+static bool node_find_next(BTreeNode* node, int* index, CompareFunc compare);
+
+static void btree_destroy(BTreeNode node, DestroyFunc destroy_value, NodePool pool);
+static BTreeNode btree_destroy_steps(BTreeNode node, DestroyFunc destroy_value, NodePool pool, int* budget);
+static int node_count(BTreeNode node);
+
+// Returns the btree_node of set_node, and the index of its value in *index. With stable SetNodes the value is
+// searched from the root, in O(log n).
+static BTreeNode set_node_locate(Set set, SetNode set_node, int* index) {
+	if (!set->stable_nodes) {
+		*index = set_node_index(set, set_node);
+		return set_node_owner(set, set_node);
+	}
+	BTreeNode node = node_find(set->root, set->compare, (Pointer)set_node, index);
+	assert(node != NULL && *index != -1); // The value of a valid SetNode is in the tree.
+	return node;
+}
 
 static bool is_leaf(BTreeNode node) {
 	return node->children[0] == NULL;
@@ -66,11 +229,19 @@ static bool is_leaf(BTreeNode node) {
 // Auxiliary functions for set_remove
 static void tranfer_right(BTreeNode node, BTreeNode sibling);
 static void transfer_left(BTreeNode node, BTreeNode sibling);
-static void repair_underflow(BTreeNode node); static void repair_underflow(BTreeNode node);
-static void merge(BTreeNode left, BTreeNode right); static void merge(BTreeNode left, BTreeNode right);
-
-static BTreeNode get_right_sibling(BTreeNode node); static BTreeNode get_right_sibling(BTreeNode node);
-static BTreeNode get_left_sibling(BTreeNode node); static BTreeNode get_left_sibling(BTreeNode node);
+static void repair_underflow(BTreeNode node, int order, NodePool pool);
+static void merge(BTreeNode left, BTreeNode right, int order, NodePool pool);
+
+static BTreeNode get_right_sibling(BTreeNode node);
+static BTreeNode get_left_sibling(BTreeNode node);
+
+// Returns the position of the node in the children of its parent (which must exist).
+static int get_child_index(BTreeNode node) {
+	int index = 0;
+	while (node->parent->children[index] != node)
+		index++;
+	return index;
+}
 
 // If present, returns the node's right sibling, otherwise NULL.
 static BTreeNode get_right_sibling(BTreeNode node) {
@@ -96,33 +267,46 @@ static BTreeNode get_left_sibling(BTreeNode node) {
 
 // Fix underflowed node to satisfy the conditions of a B-tree.
 
-static void repair_underflow(BTreeNode node) {
+static void repair_underflow(BTreeNode node, int order, NodePool pool) {
 	// If an empty or non-empty node or root is given, the tree does not need to be reconfigured.
-	if (node == NULL || node->count >= MIN_VALUES || node->parent == NULL)
+	if (node == NULL || node->count >= MIN_VALUES(order) || node->parent == NULL)
 		return;
 
-	BTreeNode left_sibling = get_left_sibling(node);;
-	BTreeNode right_sibling = get_right_sibling(node);;
+	BTreeNode left_sibling = get_left_sibling(node);
+	BTreeNode right_sibling = get_right_sibling(node);
+
+	// With concurrent writes the writer holds the latches of node and its parent, but not of the siblings.
+	bool latched = node->latch != NULL;
+	if (latched) {
+		node_lock(left_sibling);
+		node_lock(right_sibling);
+	}
 
 	// If right sibling exists & has more data than the minimum possible, do a left rotation.
-	if (right_sibling != NULL && right_sibling->count > MIN_VALUES)
+	if (right_sibling != NULL && right_sibling->count > MIN_VALUES(order))
 		transfer_left(node, right_sibling);
 	
 	// If the left sibling exists & has more data than the minimum possible, do a right rotation.
-	else if (left_sibling != NULL && left_sibling->count > MIN_VALUES)
+	else if (left_sibling != NULL && left_sibling->count > MIN_VALUES(order))
 		tranfer_right(node, left_sibling);
 
 	// If the left sibling exists, merge it with the missing node, taking a separator value from the parent.
 	else if (left_sibling != NULL) 
-		merge(left_sibling, node);
+		merge(left_sibling, node, order, pool);
 
 	else // If the right sibling exists, merge it with the missing node, taking a separator value from the parent.
-		merge(node, right_sibling);
+		merge(node, right_sibling, order, pool);
+
+	if (latched) { // A merged node is freed only after the operation ends (see node_free), so it can still be unlocked.
+		node_unlock(left_sibling);
+		node_unlock(right_sibling);
+	}
 }
 
 
 // Transfer a value to an underflowed node from the left sibling, via the father.
 static void tranfer_right(BTreeNode node, BTreeNode left) {
+	STATS_ADD(transfers, 1);
 	BTreeNode parent = node->parent;
 
 	int sep_index = 0; // Find the location of the separator value in the parent.
@@ -130,23 +314,37 @@ static void tranfer_right(BTreeNode node, BTreeNode left) {
 		;
 
 	// Copy the separator value from the parent to the missing node.
-	node_add_value(node, parent->set_nodes[sep_index], 0);;
+	node_add_value(node, parent->values[sep_index], 0);
 
 	// Move the largest element of the left sibling to the parent, in place of the separator value we moved.
-	parent->set_nodes[sep_index] = left->set_nodes[left->count-1];
-	parent->set_nodes[sep_index]->owner = parent;
+	node_copy_value(parent, sep_index, left, left->count-1);
+
+	// The buffered values of the moved child (those after the new separator value) move with it.
+	if (left->buffer != NULL) {
+		bool equal;
+		int first = buffer_search(left->buffer, parent->values[sep_index], &equal) + equal;
+		buffer_move(node, 0, left, first, left->buffer->count);
+	}
 
 	// Move the older child of the left sibling to the missing node.
-	if (!is_leaf(node))
-		node_add_child(node, left->children[left->count], 0);
+	int moved_size = 0;
+	if (!is_leaf(node)) {
+		moved_size = left->sizes[left->count];
+		node_add_child(node, left->children[left->count], moved_size, 0);
+	}
 
 	// Remove the element moved from the left sibling to the father.
-	left->count--;;
+	left->count--;
+
+	// The separator value and the child moved from the left sibling to the node.
+	parent->sizes[sep_index] -= 1 + moved_size;
+	parent->sizes[sep_index+1] += 1 + moved_size;
 }
 
 
 // Transfer value to underflowed node from right sibling, via father.
 static void transfer_left(BTreeNode node, BTreeNode right) {
+	STATS_ADD(transfers, 1);
 	BTreeNode parent = node->parent;
 
 	int sep_index = 0; // Find the location of the separator value in the parent.
@@ -154,32 +352,48 @@ static void transfer_left(BTreeNode node, BTreeNode right) {
 		;
 
 	// Copy the separator value from the parent to the missing node.
-	node_add_value(node, parent->set_nodes[sep_index], node->count);;
+	node_add_value(node, parent->values[sep_index], node->count);
 
 	// Move the smallest element of the right sibling to the parent, in place of the separator value we moved.
-	parent->set_nodes[sep_index] = right->set_nodes[0];
-	parent->set_nodes[sep_index]->owner = parent;
+	node_copy_value(parent, sep_index, right, 0);
+
+	// The buffered values of the moved child (up to the new separator value) move with it.
+	if (right->buffer != NULL) {
+		bool equal;
+		int last = buffer_search(right->buffer, parent->values[sep_index], &equal) + equal;
+		buffer_move(node, node->buffer != NULL ? node->buffer->count : 0, right, 0, last);
+	}
 
 	// Move the eldest child of the right sibling to the missing node
-	if (!is_leaf(node))
-		node_add_child(node, right->children[0], node->count);
+	int moved_size = 0;
+	if (!is_leaf(node)) {
+		moved_size = right->sizes[0];
+		node_add_child(node, right->children[0], moved_size, node->count);
+	}
 
 	// Move the right sibling's data one position to the left.
 	for (int i = 0; i < right->count-1; i++)
-		right->set_nodes[i] = right->set_nodes[i+1];
+		node_copy_value(right, i, right, i+1);
 
-	for (int i = 0; i < right->count; i++)
+	for (int i = 0; i < right->count; i++) {
 		right->children[i] = right->children[i+1];
+		right->sizes[i] = right->sizes[i+1];
+	}
 
 	// Remove the element moved from right sibling to father.
-	right->count--;;
+	right->count--;
+
+	// The separator value and the child moved from the right sibling to the node.
+	parent->sizes[sep_index] += 1 + moved_size;
+	parent->sizes[sep_index+1] -= 1 + moved_size;
 }
 
 // Merge the right node into the left, taking the separator value from the father.
 // The right node is deleted.
 // If the merge creates a new root, it is returned. Otherwise it returns NULL.
 
-static void merge(BTreeNode left, BTreeNode right) {
+static void merge(BTreeNode left, BTreeNode right, int order, NodePool pool) {
+	STATS_ADD(merges, 1);
 
 	BTreeNode parent = left->parent;
 
@@ -188,29 +402,36 @@ static void merge(BTreeNode left, BTreeNode right) {
 		;
 
 	// Copy the separator value from the parent to the missing node.
-	node_add_value(left, parent->set_nodes[sep_index], left->count);;
+	node_add_value(left, parent->values[sep_index], left->count);
 
 	// If the right node is not a leaf, transfer the children
 	if (!is_leaf(right))
 		for (int i = 0; i <= right->count; i++)
-			node_add_child(left, right->children[i], left->count+i);
+			node_add_child(left, right->children[i], right->sizes[i], left->count+i);
 
 	// Copy all data from the right node to the missing node.
 	for (int i = 0; i < right->count; i++)
-		node_add_value(left, right->set_nodes[i], left->count);
+		node_add_value(left, right->values[i], left->count);
+
+	if (right->buffer != NULL) // And its buffered values, which are all greater.
+		buffer_move(left, left->buffer != NULL ? left->buffer->count : 0, right, 0, right->buffer->count);
+
+	// The left node now contains its values, the separator value and the values of the right node.
+	parent->sizes[sep_index] += 1 + parent->sizes[sep_index+1];
 
 	// Slide to the left all values and children of the father
 	// starting from the position of the value removed.
 	for (int i = sep_index; i < parent->count-1; i++) {
-		parent->set_nodes[i] = parent->set_nodes[i+1];
+		node_copy_value(parent, i, parent, i+1);
 		parent->children[i+1] = parent->children[i+2];
+		parent->sizes[i+1] = parent->sizes[i+2];
 	}
 
 	parent->count--; // The separator value is removed.
-	free(right); // Delete the merged node.
+	node_free(right, pool); // Delete the merged node.
 
 	// The parent may now be incomplete. Equalize its subtree.
-	repair_underflow(parent)?
+	repair_underflow(parent, order, pool);
 }
 
 
@@ -218,14 +439,14 @@ static void merge(BTreeNode left, BTreeNode right) {
 // Sets *removed to true if actually deleted & returns the value deleted in *old_value.
 // Returns the new root of the tree.
 
-static BTreeNode node_remove(BTreeNode root, CompareFunc compare, Pointer value, bool* removed, Pointer* old_value) {
+static BTreeNode node_remove(BTreeNode root, CompareFunc compare, int order, NodePool pool, Pointer value, bool* removed, Pointer* old_value) {
 	if (root == NULL) {
 		*removed = false; // Empty tree, the value does not exist.
 		return root;
 	}
 
-	int index; // Find the node containing the value.
-	BTreeNode node = node_find(root, compare, value, &index);;
+	int index = -1; // Find the node containing the value.
+	BTreeNode node = node_find(root, compare, value, &index);
 
 	if (index == -1) {
 		*removed = false; // The value we want to delete *does not exist* in the tree.
@@ -234,19 +455,18 @@ static BTreeNode node_remove(BTreeNode root, CompareFunc compare, Pointer value,
 
 	// An equivalent value was found in the node, so we delete it. How this is done depends on whether it has children.
 	*removed = true;
-	*old_value = node->set_nodes[index]->value;
-
-	free(node->set_nodes[index]);
+	*old_value = node->values[index];
 
 	if (is_leaf(node)) {
 		// If the node is a leaf, delete the value, reorder the data, and reconfigure the tree.
 
 		for (int i = index; i < node->count-1; i++) // Move all data 1 position to the left.
-			node->set_nodes[i] = node->set_nodes[i + 1];
+			node_copy_value(node, i, node, i + 1);
  
 		node->count--; // Remove the data.
+		node_add_to_ancestor_sizes(node, -1);
 
-		repair_underflow(node); // Reshape the tree.
+		repair_underflow(node, order, pool); // Reshape the tree.
 
 	} else {
 		// If it is an internal node then the value we want to delete acts as a separator value.
@@ -255,15 +475,13 @@ static BTreeNode node_remove(BTreeNode root, CompareFunc compare, Pointer value,
 		// The largest value is found in a leaf. After deleting from a leaf, it is very likely to become incomplete.
 		// So reconfigure the tree starting from the leaf in which the deletion was made.
 		
-		SetNode max = node_find_max(node->children[index])?
+		BTreeNode max_node = node_find_max(node->children[index]);
 
-		BTreeNode max_node = max->owner;
+		node_copy_value(node, index, max_node, max_node->count-1);
 		max_node->count--; // Remove the data.
+		node_add_to_ancestor_sizes(max_node, -1);
 
-		node->set_nodes[index] = max;
-		max->owner = node;;
-
-		repair_underflow(max_node); // Reshape the tree.
+		repair_underflow(max_node, order, pool); // Reshape the tree.
 	}
 
 	// If the root is emptied, free, and root becomes its (unique, if it has one) child
@@ -272,7 +490,7 @@ static BTreeNode node_remove(BTreeNode root, CompareFunc compare, Pointer value,
 		if (first_child != NULL)
 			first_child->parent = NULL;
 
-		free(root);
+		node_free(root, pool);
 		root = first_child;
 	}
 	return root;
@@ -283,136 +501,358 @@ static BTreeNode node_remove(BTreeNode root, CompareFunc compare, Pointer value,
 /* =================================== set_insert ========================================== */
 
 // Auxiliary functions for set_insert
-static void split(BTreeNode node, CompareFunc compare);
+static void split(BTreeNode node, CompareFunc compare, int order, NodePool pool);
 
 
 // If there is a node with a value equivalent to value in the tree with root root, change its value to value, otherwise
-// adds a new node with value value. Sets *inserted to true if an addition was made, or false if an update was made.
+// adds a new node with value value. Sets *inserted to true if an addition was made, or false if an update was made,
+// and *revived to whether the updated value was marked as removed (see set_use_lazy_removal).
 // Returns the new root of the tree.
 
-static BTreeNode node_insert(BTreeNode root, CompareFunc compare, Pointer value, bool* inserted, Pointer* old_value) {
+static BTreeNode node_insert(BTreeNode root, CompareFunc compare, int order, NodePool pool, KeyFunc key, Pointer value, bool* inserted, bool* revived, Pointer* old_value) {
 	// If the tree is empty, create a new node which becomes the root
 	if (root == NULL) {
 		*inserted = true; // The insertion is done
-		root = node_create();
-		node_add_value(root, set_node_create(value), 0);
+		*revived = false;
+		root = node_create(order, pool, key);
+		node_add_value(root, value, 0);
 		return root;
 	}
 
 	// Find the node to which to insert
-	int index;
+	int index = -1;
 	BTreeNode node = node_find(root, compare, value, &index);
 	if (index != -1) {
 		// The value already exists
 		*inserted = false;    
-		*old_value = node->set_nodes[index]->value;
-		node->set_nodes[index]->value = value;
+		*revived = node_is_removed(node, index);
+		*old_value = node->values[index];
+		node_set_value(node, index, value); // Also clears the mark.
 		return root;
 	}
 
 	// Find the position where the value should be inserted
-	for (index = 0; index < node->count && compare(value, node->set_nodes[index]->value) > 0; index++)
-		;
+	bool equal;
+	index = node_search(node, compare, value, &equal);
 
-	node_add_value(node, set_node_create(value), index);;
+	node_add_value(node, value, index);
+	node_add_to_ancestor_sizes(node, 1);
 
-	if (node->count > MAX_VALUES) // The sheet has more than the allowed values, so a split is needed
-		split(node, compare);;
+	if (node->count > MAX_VALUES(order)) // The sheet has more than the allowed values, so a split is needed
+		split(node, compare, order, pool);
 
 	// A new root may have been created
 	*inserted = true;
-	return root->parent != NULL ? root->parent : root?
+	*revived = false;
+	return root->parent != NULL ? root->parent : root;
 }
 
 // Called when node node has overflowed, splits it into 2 nodes.
 // Sends the middle of the node node's values to its parent.
 
-static void split(BTreeNode node, CompareFunc compare) {
-	assert(node->count > MAX_VALUES); // the node has exceeded the maximum value limit.
+static void split(BTreeNode node, CompareFunc compare, int order, NodePool pool) {
+	STATS_ADD(splits, 1);
+	assert(node->count > MAX_VALUES(order)); // the node has exceeded the maximum value limit.
 
-	// Split the node node into 2 nodes, each with MAX_CHILDREN/2 (=2) values.
-	BTreeNode right = node_create();
+	// Split the node node into 2 nodes. The left one keeps the first mid values, the median goes to the parent
+	// and the right one gets the remaining values. For any order both have at least MIN_VALUES values.
+	BTreeNode right = node_create(order, pool, node->key);
 	right->parent = node->parent; // The 2 nodes have the same parent.
+	if (node->latch != NULL)
+		node_init_latch(right); // Not reachable by other writers until the latch of the parent is released.
 
-	// Move half the values and children from the left node to the right node.
-	int half = node->count/2;
+	int mid = node->count/2;
+	int right_count = node->count - mid - 1;
+
+	// Move the values and children after the median from the left node to the right node.
+	int right_size = right_count; // Number of values in the subtree of the right node
 	if (!is_leaf(node))
-		for (int i = 0; i <= half; i++)
-			node_add_child(right, node->children[i + half + 1], i);
+		for (int i = 0; i <= right_count; i++) {
+			node_add_child(right, node->children[i + mid + 1], node->sizes[i + mid + 1], i);
+			right_size += node->sizes[i + mid + 1];
+		}
 
-	for (int i = 0; i < half; i++) {
-		node_add_value(right, node->set_nodes[i + half + 1], i); node_add_value(right, node->set_nodes[i + half + 1], i);
-		node->count--;;
-	}
+	for (int i = 0; i < right_count; i++)
+		node_add_value(right, node->values[i + mid + 1], i);
+	if (node->removed != 0) // The marks move with the values (the bits above count are ignored).
+		right->removed = node->removed >> (mid + 1);
 
 	// remove middle value
-	SetNode median = node->set_nodes[node->count-1];;
-	node->count--;;
+	Pointer median = node->values[mid];
+	bool median_removed = node_is_removed(node, mid);
+	node->count = mid;
+
+	if (node->buffer != NULL) { // The buffered values greater than the median go to the right node.
+		bool equal;
+		int first = buffer_search(node->buffer, median, &equal) + equal;
+		buffer_move(right, 0, node, first, node->buffer->count);
+	}
 
 	// Append the median to the parent of the node node.
 	BTreeNode parent = node->parent;
 	if (parent == NULL) { // node is the root
-		BTreeNode new_root = node_create(); // Create a new root which will have node, right as children.
+		BTreeNode new_root = node_create(order, pool, node->key); // Create a new root which will have node, right as children.
+		if (node->latch != NULL)
+			node_init_latch(new_root);
 
 		node_add_value(new_root, median, 0);
+		new_root->removed = median_removed;
 
 		right->parent = node->parent = new_root;
 		new_root->children[0] = node;
 		new_root->children[1] = right;
+		new_root->sizes[0] = node_total_size(node);
+		new_root->sizes[1] = right_size;
 
 	} else {
-		int index; // Find the location of the value inserted in the parent.
-		for (index = 0; index < parent->count; index++)
-			if (compare(median->value, parent->set_nodes[index]->value) < 0)
-				break;
+		bool equal; // Find the location of the value inserted in the parent (the median is not in it).
+		int index = node_search(parent, compare, median, &equal);
 
-		node_add_child(parent, right, index+1); // Add the right node created as the right child of the (new) separator value
+		node_add_child(parent, right, right_size, index+1); // Add the right node created as the right child of the (new) separator value
 		node_add_value(parent, median, index);
+		if (median_removed)
+			parent->removed |= (uint64_t)1 << index;
+		parent->sizes[index] -= right_size + 1; // The median and the right node were part of the subtree of node
 
-		if (parent->count > MAX_VALUES) // Check if the parent overflowed due to the addition.
-			split(parent, compare);;
+		if (parent->count > MAX_VALUES(order)) // Check if the parent overflowed due to the addition.
+			split(parent, compare, order, pool);
 	}
 }
 
 /* ================================= set_insert_end ======================================== */
 
+// Returns the alignment of the btree_nodes of a tree with the given order: the smallest power of 2
+// that can hold any index of a value (0 ... MAX_VALUES) in its low bits, see set_node_pack.
+static size_t node_alignment(int order) {
+	size_t align = sizeof(Pointer);
+	while (align < (size_t)order)
+		align *= 2;
+	return align;
+}
+
+// Returns the size of the table of values of a btree_node, rounded up so that the table of keys after it is aligned.
+static size_t node_values_size(int order) {
+	size_t size = (MAX_VALUES(order) + 1) * sizeof(Pointer);
+	return (size + sizeof(int64_t) - 1) / sizeof(int64_t) * sizeof(int64_t);
+}
+
+// Returns the size of the allocation of a btree_node together with its tables, a multiple of node_alignment.
+// With a key function (with_keys) the node also stores the key of each value.
+static size_t node_alloc_size(int order, bool with_keys) {
+	size_t align = node_alignment(order);
+	size_t size = sizeof(struct btree_node)
+		+ node_values_size(order)
+		+ (with_keys ? (MAX_VALUES(order) + 1) * sizeof(int64_t) : 0)
+		+ (MAX_CHILDREN(order) + 1) * (sizeof(BTreeNode) + sizeof(int));
+	return (size + align - 1) / align * align; // aligned_alloc needs a multiple of the alignment
+}
+
 // Creates and returns a node with no children or parent (all fields are NULL).
-static BTreeNode node_create() {
-	struct btree_node* node = calloc(1, sizeof(struct btree_node));;
+// The tables of values and children are allocated together with the node, according to the order.
+static BTreeNode node_create(int order, NodePool pool, KeyFunc key) {
+	size_t size = node_alloc_size(order, key != NULL);
+
+	struct btree_node* node = pool != NULL ? pool_alloc(pool) : aligned_alloc(node_alignment(order), size);
+	memset(node, 0, size);
+
+	char* tables = (char*)node->values + node_values_size(order);
+	if (key != NULL) {
+		node->key = key;
+		node->keys = (int64_t*)tables;
+		tables += (MAX_VALUES(order) + 1) * sizeof(int64_t);
+	}
+	node->children = (BTreeNode*)tables;
+	node->sizes = (int*)(node->children + MAX_CHILDREN(order) + 1);
+	STATS_ADD(allocations, 1);
 	return node;
 }
 
-static SetNode set_node_create(pointer value) {
-	SetNode set_node = malloc(sizeof(*set_node));;
-	set_node->value = value;
-	return set_node;
+// Frees the node, returning it to the pool if there is one.
+static void node_free(BTreeNode node, NodePool pool) {
+	STATS_ADD(frees, 1);
+	if (node->buffer != NULL) { // Its values have been moved or destroyed.
+		free(node->buffer->values);
+		free(node->buffer);
+	}
+	if (node->latch != NULL)
+		retire_node(node); // Concurrent writes, the writer may still hold the latch of the node.
+	else if (pool != NULL)
+		pool_free(pool, node);
+	else
+		free(node);
 }
 
-// Adds a set_node value (values are stored inside set nodes) to the index position of the node node
-// (by shifting existing set_nodes). Increases node->count
-
-static void node_add_value(BTreeNode node, SetNode set_node, int index) {
-	set_node->owner = node;
+// Adds the value value to the index position of the node node
+// (by shifting existing values). Increases node->count
 
+static void node_add_value(BTreeNode node, Pointer value, int index) {
 	// Slide to the right all elements of the sheet starting from the position where the addition will be made.
 	for (int i = node->count-1; i >= index; i--)
-		node->set_nodes[i+1] = node->set_nodes[i];
+		node_copy_value(node, i+1, node, i);
 	
-	node->set_nodes[index] = set_node;
+	node_set_value(node, index, value);
 	node->count++;
 }
 
-// Adds the child node as a child at the index position of the node node (by shifting existing children)
-// does NOT increase node->count
+// Stores value at the index position of the node node (together with its key), not marked as removed.
+static void node_set_value(BTreeNode node, int index, Pointer value) {
+	node->values[index] = value;
+	if (node->keys != NULL)
+		node->keys[index] = node->key(value);
+	if (node->removed != 0)
+		node->removed &= ~((uint64_t)1 << index);
+}
+
+// Copies the value at position source_index of source to the index position of node (together with its key and mark).
+static void node_copy_value(BTreeNode node, int index, BTreeNode source, int source_index) {
+	node->values[index] = source->values[source_index];
+	if (node->keys != NULL)
+		node->keys[index] = source->keys[source_index];
+	if ((node->removed | source->removed) != 0)
+		node->removed = (node->removed & ~((uint64_t)1 << index)) | (uint64_t)node_is_removed(source, source_index) << index;
+}
+
+// Returns whether the value at the index position of node is marked as removed (see set_use_lazy_removal).
+static bool node_is_removed(BTreeNode node, int index) {
+	return node->removed != 0 && (node->removed >> index & 1); // Always 0 in sets without lazy removal, whatever the order.
+}
+
+// Adds the child node, whose subtree contains size values, as a child at the index position of the node node
+// (by shifting existing children) does NOT increase node->count
 
-static void node_add_child(BTreeNode node, BTreeNode child, int index) {
+static void node_add_child(BTreeNode node, BTreeNode child, int size, int index) {
 	child->parent = node;
 
 	// Slide to the right all children of the leaf starting at the position where the addition will be made.
-	for (int i = node->count; i >= index; i--)
+	for (int i = node->count; i >= index; i--) {
 		node->children[i+1] = node->children[i];
+		node->sizes[i+1] = node->sizes[i];
+	}
 	
 	node->children[index] = child;
+	node->sizes[index] = size;
+}
+
+// Adds delta to the subtree sizes that all ancestors of node keep, after delta values were added to node.
+static void node_add_to_ancestor_sizes(BTreeNode node, int delta) {
+	for (; node->parent != NULL; node = node->parent)
+		node->parent->sizes[get_child_index(node)] += delta;
+}
+
+// Returns the number of values in the subtree with root node.
+static int node_total_size(BTreeNode node) {
+	if (node == NULL)
+		return 0;
+
+	int size = node->count;
+	if (!is_leaf(node))
+		for (int i = 0; i <= node->count; i++)
+			size += node->sizes[i];
+	return size;
+}
+
+// Creates the (empty) write buffer of node.
+static void buffer_create(BTreeNode node, CompareFunc compare) {
+	node->buffer = malloc(sizeof(*node->buffer));
+	node->buffer->values = NULL;
+	node->buffer->count = 0;
+	node->buffer->capacity = 0;
+	node->buffer->compare = compare;
+}
+
+// Makes space for count values in buffer.
+static void buffer_reserve(WriteBuffer buffer, int count) {
+	if (count <= buffer->capacity)
+		return;
+
+	buffer->capacity = count > 2 * buffer->capacity ? count : 2 * buffer->capacity;
+	buffer->values = realloc(buffer->values, buffer->capacity * sizeof(Pointer));
+}
+
+// Returns the position of the first value of buffer that is >= value (buffer->count if there is none), and sets
+// *equal to true if it is equivalent to value.
+static int buffer_search(WriteBuffer buffer, Pointer value, bool* equal) {
+	int low = 0, high = buffer->count;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (COMPARE(buffer->compare, buffer->values[mid], value) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	*equal = low < buffer->count && COMPARE(buffer->compare, buffer->values[low], value) == 0;
+	return low;
+}
+
+// Removes the values first ... last-1 of buffer.
+static void buffer_remove(WriteBuffer buffer, int first, int last) {
+	memmove(buffer->values + first, buffer->values + last, (buffer->count - last) * sizeof(Pointer));
+	buffer->count -= last - first;
+}
+
+// Moves the values first ... last-1 of the buffer of from to position index of the buffer of to (which is created if
+// needed). Used when a child moves between nodes, so the values are not in the subtree of to and keep its buffer sorted.
+static void buffer_move(BTreeNode to, int index, BTreeNode from, int first, int last) {
+	int n = last - first;
+	if (n == 0)
+		return;
+	if (to->buffer == NULL)
+		buffer_create(to, from->buffer->compare);
+
+	WriteBuffer buffer = to->buffer;
+	buffer_reserve(buffer, buffer->count + n);
+	memmove(buffer->values + index + n, buffer->values + index, (buffer->count - index) * sizeof(Pointer));
+	memcpy(buffer->values + index, from->buffer->values + first, n * sizeof(Pointer));
+	buffer->count += n;
+
+	buffer_remove(from->buffer, first, last);
+}
+
+#ifdef SET_INT_KEYS
+// Returns the number of the count values that are < value, for a set with integer keys (the values are the keys
+// themselves). The loop has no branches that depend on the values, so there are no mispredictions, and at -O3
+// the compiler vectorizes it (eg with AVX2 or NEON).
+static int values_count_less(Pointer* values, int count, Pointer value) {
+	int less = 0;
+	for (int i = 0; i < count; i++)
+		less += (intptr_t)values[i] < (intptr_t)value;
+	return less;
+}
+#else
+// Returns the number of the count keys that are < key. Same as values_count_less, branchless and vectorized.
+static int keys_count_less(const int64_t* keys, int count, int64_t key) {
+	int less = 0;
+	for (int i = 0; i < count; i++)
+		less += keys[i] < key;
+	return less;
+}
+#endif
+
+// Returns the position of the first value of the node that is >= value (node->count if there is none), and sets
+// *equal to true if it is equivalent to value. With keys (or integer keys) the whole node is scanned with integer
+// comparisons and compare is called at most once, otherwise the values are compared one by one.
+
+static int node_search(BTreeNode node, CompareFunc compare, Pointer value, bool* equal) {
+	int i;
+#ifdef SET_INT_KEYS
+	STATS_ADD(compares, node->count);
+	i = values_count_less(node->values, node->count, value);
+	*equal = i < node->count && node->values[i] == value;
+#else
+	if (node->keys != NULL) {
+		int64_t key = node->key(value);
+		STATS_ADD(compares, node->count);
+		i = keys_count_less(node->keys, node->count, key);
+		*equal = i < node->count && node->keys[i] == key;
+	} else {
+		int compare_res = 1;
+		for (i = 0; i < node->count; i++)
+			if ((compare_res = COMPARE(compare, value, node->values[i])) <= 0)
+				break;
+		*equal = compare_res == 0;
+	}
+#endif
+	return i;
 }
 
 // Returns the node at which either the value either already exists or can be added to the subtree rooted at node.
@@ -423,226 +863,2244 @@ static BTreeNode node_find(BTreeNode node, CompareFunc compare, Pointer value, i
 	if (node == NULL)
 		return NULL;
 
-	int i; // Sets the separator value relative to which we are looking for the value.
-	for (i = 0; i < node->count; i++) {
-		int compare_res = compare(value, node->set_nodes[i]->value); // Save to avoid calling compare twice.
-
-		if (compare_res == 0) {
-			*index = i;
-			return node; // The value is found at the current node.
+	STATS_ADD(nodes_visited, 1);
+	bool equal; // Find the separator value relative to which we are looking for the value.
+	int i = node_search(node, compare, value, &equal);
 
-		} else if (compare_res < 0) {
-			// Since the value we are looking for is less than the separator value
-			// then it is found in the left child defined by the separator value (child i)
-			break;
-		}
+	if (equal) {
+		*index = i;
+		return node; // The value is found at the current node.
 	}
 
 	// If we are in a sheet, the value is not found but can be added here. Otherwise we continue in child i
+	// (the value is less than the separator value i, so it is found in the left child that it defines)
+	if (is_leaf(node)) {
+		*index = -1;
+		return node;
+	} else {
+		return node_find(node->children[i], compare, value, index);  
+	}
+}
+
+// Same as node_find (node must not be NULL), but also sets *upper to the smallest separator value of the path that is
+// greater than value (*upper must be NULL initially, and remains NULL if there is no such value). All values that the
+// returned leaf contains, or that can be added to it, are < *upper.
+
+static BTreeNode node_find_with_upper(BTreeNode node, CompareFunc compare, Pointer value, int* index, Pointer* upper) {
+	STATS_ADD(nodes_visited, 1);
+	bool equal; // Find the separator value relative to which we are looking for the value.
+	int i = node_search(node, compare, value, &equal);
+
+	if (equal) {
+		*index = i;
+		return node; // The value is found at the current node.
+	}
+
+	if (i < node->count) // We continue in child i, all of its values are < separator value i.
+		*upper = node->values[i];
+
 	if (is_leaf(node)) {
 		*index = -1;
 		return node;
 	} else {
-		return node_find(node->children[i], compare, value, index);;  
+		return node_find_with_upper(node->children[i], compare, value, index, upper);
+	}
+}
+
+// Returns the node of the subtree with root node that contains the smallest value >= value (or > value
+// if strict), and its position in *index. If no such value exists, NULL is returned.
+// Same descent as node_find.
+
+static BTreeNode node_find_bound(BTreeNode node, CompareFunc compare, Pointer value, bool strict, int* index) {
+	if (node == NULL)
+		return NULL;
+
+	STATS_ADD(nodes_visited, 1);
+	bool equal; // Find the first value of the node that is >= value (> value if strict).
+	int i = node_search(node, compare, value, &equal);
+
+	if (equal && !strict) {
+		*index = i;
+		return node; // The value itself is the bound.
+	} else if (equal) {
+		i++; // The value is smaller than all values of child i+1.
+	}
+
+	// The bound is in child i if it contains a value >= value, otherwise it is the separator value i (if it exists).
+	BTreeNode res = node_find_bound(node->children[i], compare, value, strict, index);
+	if (res == NULL && i < node->count) {
+		*index = i;
+		res = node;
+	}
+	return res;
+}
+
+// Parallel execution (set_visit_parallel, set_create_from_sorted_parallel). The work is split in independent tasks,
+// more than the threads, and each thread takes the next task that no thread has taken yet, so a thread that finishes
+// early takes over the remaining work of the others. With -DSET_STATS the work of the other threads is not counted
+// in the stats of the set.
+
+#define PARALLEL_TASKS_PER_THREAD 8
+
+// Function that runs the task-th task, ctx is the argument of run_tasks.
+typedef void (*TaskFunc)(int task, Pointer ctx);
+
+typedef struct {
+	TaskFunc run;
+	Pointer ctx;
+	int tasks;
+	atomic_int next; // the next task that no thread has taken
+} TaskQueue;
+
+static void* task_worker(void* arg) {
+	TaskQueue* queue = arg;
+	for (int task; (task = atomic_fetch_add(&queue->next, 1)) < queue->tasks; )
+		queue->run(task, queue->ctx);
+	return NULL;
+}
+
+// Runs run(task, ctx) for task = 0 ... tasks-1 with nthreads threads (the calling one and nthreads-1 new ones),
+// returns when all tasks have finished.
+static void run_tasks(int tasks, int nthreads, TaskFunc run, Pointer ctx) {
+	TaskQueue queue = { .run = run, .ctx = ctx, .tasks = tasks };
+	atomic_init(&queue.next, 0);
+
+	// A thread that cannot be created is not needed, the others run its tasks
+	int created = 0;
+	pthread_t* threads = malloc((nthreads > 1 ? nthreads - 1 : 1) * sizeof(pthread_t));
+	while (created < nthreads - 1 && created < tasks - 1 && pthread_create(&threads[created], NULL, task_worker, &queue) == 0)
+		created++;
+
+	task_worker(&queue);
+
+	for (int i = 0; i < created; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+// Returns the number of nodes in which the n values of a level of a bulk-loaded tree are split, so that each
+// node gets about fill values and between every 2 nodes there is one value, which goes to the level above.
+// All nodes get between MIN_VALUES and MAX_VALUES values (except a single one, which becomes the root).
+static int bulk_load_node_count(int n, int fill, int order) {
+	int k = (n + 1 + fill) / (fill + 1); // ceil((n+1) / (fill+1))
+	while (k > 1 && n - (k-1) < k * MIN_VALUES(order))
+		k--;
+	return k;
+}
+
+// A level of a bulk-loaded tree under construction. Its nodes are independent, so they can be created by many threads.
+typedef struct {
+	Pointer* level; // The n values of the level.
+	BTreeNode* children; // The n+1 subtrees between them (with their sizes), NULL for the leaves.
+	int* children_sizes;
+	int k, node_values, extra; // k nodes, the first extra of which get node_values+1 values, the others node_values.
+	int tasks; // The nodes are created by tasks of consecutive nodes.
+	int order;
+	NodePool pool;
+	KeyFunc key;
+	BTreeNode* nodes; // The k nodes of the level, their sizes and the k-1 values between them, for the level above.
+	int* node_sizes;
+	Pointer* separators;
+} BulkLoadLevel;
+
+// Creates the nodes of the task-th range of the level.
+static void bulk_load_nodes(int task, Pointer ctx) {
+	BulkLoadLevel* level = ctx;
+	int begin = (long)level->k * task / level->tasks;
+	int end = (long)level->k * (task + 1) / level->tasks;
+
+	// Each node before begin takes its values and the separator after them, and as many children (plus 1).
+	int pos = begin * (level->node_values + 1) + (begin < level->extra ? begin : level->extra);
+
+	for (int j = begin, child = pos; j < end; j++) {
+		int count = level->node_values + (j < level->extra);
+		BTreeNode node = node_create(level->order, level->pool, level->key);
+		level->node_sizes[j] = count;
+
+		// The children are added first, while the node has no values, so node_add_child does not shift anything.
+		if (level->children != NULL)
+			for (int i = 0; i <= count; i++, child++) {
+				node_add_child(node, level->children[child], level->children_sizes[child], i);
+				level->node_sizes[j] += level->children_sizes[child];
+			}
+
+		for (int i = 0; i < count; i++)
+			node_add_value(node, level->level[pos++], i);
+
+		if (j < level->k-1)
+			level->separators[j] = level->level[pos++];
+
+		level->nodes[j] = node;
+	}
+}
+
+// Creates a B-tree with the n values of the values array, which must be sorted and without duplicates, and returns
+// its root. The tree is built bottom-up, level by level: the values are split in leaves, the values between the leaves
+// are split in the nodes of the level above, etc, until a level has a single node, so there are no comparisons or splits.
+// The nodes of each level are created by nthreads threads (with nthreads > 1 the pool must be NULL).
+static BTreeNode node_create_from_sorted(Pointer* values, int n, int order, NodePool pool, KeyFunc key, int nthreads) {
+	if (n == 0)
+		return NULL;
+	assert(nthreads == 1 || pool == NULL); // The pool is not thread-safe.
+
+	int fill = MAX_VALUES(order) * BULK_LOAD_FILL / 100;
+	if (fill < MIN_VALUES(order))
+		fill = MIN_VALUES(order);
+	if (fill < 1)
+		fill = 1;
+
+	// The current level: n values, and the n+1 subtrees (with their sizes) between them, NULL for the leaves.
+	BulkLoadLevel level = { .level = values, .children = NULL, .children_sizes = NULL, .order = order, .pool = pool, .key = key };
+
+	while (true) {
+		level.k = bulk_load_node_count(n, fill, order);
+		level.node_values = (n - (level.k-1)) / level.k; // the values are distributed evenly, the first extra nodes get 1 more
+		level.extra = (n - (level.k-1)) % level.k;
+
+		level.nodes = malloc(level.k * sizeof(BTreeNode));
+		level.node_sizes = malloc(level.k * sizeof(int));
+		level.separators = malloc(level.k * sizeof(Pointer)); // the k-1 values for the level above
+
+		// The small levels near the root are not worth the threads.
+		level.tasks = level.k >= nthreads * PARALLEL_TASKS_PER_THREAD ? nthreads * PARALLEL_TASKS_PER_THREAD : 1;
+		run_tasks(level.tasks, nthreads, bulk_load_nodes, &level);
+
+		if (level.level != values)
+			free(level.level);
+		free(level.children);
+		free(level.children_sizes);
+
+		if (level.k == 1) { // A single node, it is the root
+			BTreeNode root = level.nodes[0];
+			free(level.nodes);
+			free(level.node_sizes);
+			free(level.separators);
+			return root;
+		}
+
+		// Continue to the level above
+		n = level.k-1;
+		level.level = level.separators;
+		level.children = level.nodes;
+		level.children_sizes = level.node_sizes;
+	}
+}
+
+// Sorts the n values of the values array with merge sort (stable, so equivalent values keep their order),
+// using temp (of size n) as auxiliary space.
+
+static void values_merge_sort(Pointer* values, Pointer* temp, int n, CompareFunc compare) {
+	if (n < 2)
+		return;
+
+	int mid = n / 2;
+	values_merge_sort(values, temp, mid, compare);
+	values_merge_sort(values + mid, temp, n - mid, compare);
+
+	// Merge the 2 sorted halves in temp, taking from the left half unless the right value is strictly smaller
+	int i = 0, j = mid, k = 0;
+	while (i < mid && j < n)
+		temp[k++] = compare(values[j], values[i]) < 0 ? values[j++] : values[i++];
+	while (i < mid)
+		temp[k++] = values[i++];
+	while (j < n)
+		temp[k++] = values[j++];
+
+	memcpy(values, temp, n * sizeof(Pointer));
+}
+
+// Sorts the n values of the values array and removes the duplicates. Of equivalent values only the last one is kept and
+// the rest are destroyed (if destroy_value != NULL), exactly as if they had been inserted one by one with set_insert.
+// Returns the number of values kept.
+
+static int values_sort_unique(Pointer* values, int n, CompareFunc compare, DestroyFunc destroy_value) {
+	Pointer* temp = malloc(n * sizeof(Pointer));
+	values_merge_sort(values, temp, n, compare);
+	free(temp);
+
+	int count = 0;
+	for (int i = 0; i < n; i++) {
+		if (i < n-1 && compare(values[i], values[i+1]) == 0) {
+			if (destroy_value != NULL)
+				destroy_value(values[i]); // replaced by the next equivalent value
+		} else {
+			values[count++] = values[i];
+		}
+	}
+	return count;
+}
+
+// Returns the number of values in the subtree with root node that are < value.
+static int node_rank(BTreeNode node, CompareFunc compare, Pointer value) {
+	if (node == NULL)
+		return 0;
+
+	STATS_ADD(nodes_visited, 1);
+	bool equal;
+	int i = node_search(node, compare, value, &equal);
+
+	int rank = i; // The children 0 ... i-1 and the separator values 0 ... i-1 are smaller than the value.
+	for (int j = 0; j < i; j++)
+		rank += node->sizes[j];
+
+	return equal
+		? rank + node->sizes[i] // Only the subtree of child i is smaller than the value.
+		: rank + node_rank(node->children[i], compare, value); // Continue in child i
+}
+
+// Returns the node of the subtree with root node that contains the k-th smallest value (0-based), and its position in
+// *index. If the subtree has <= k values, NULL is returned.
+static BTreeNode node_select(BTreeNode node, int k, int* index) {
+	if (node == NULL)
+		return NULL;
+
+	STATS_ADD(nodes_visited, 1);
+	for (int i = 0; i <= node->count; i++) {
+		if (k < node->sizes[i]) // The k-th value is in child i
+			return node_select(node->children[i], k, index);
+		k -= node->sizes[i];
+
+		if (i < node->count) {
+			if (k == 0) { // The k-th value is separator value i
+				*index = i;
+				return node;
+			}
+			k--;
+		}
 	}
+	return NULL;
 }
 
-// Returns the smallest set node of the subtree with root node.
-static SetNode node_find_min(BTreeNode node) {
+// Returns the leaf of the subtree with root node that contains the smallest value (its first one).
+static BTreeNode node_find_min(BTreeNode node) {
 	if (node == NULL)
 		return NULL;
 
 	return node->children[0] != NULL
 		? node_find_min(node->children[0]) // There is the leftmost subtree, the smallest value is found there.
-		: node->set_nodes[0]; // Otherwise the smallest set node is the first in this btree node
+		: node; // Otherwise the smallest value is the first in this btree node
 }
 
-// Returns the largest node of the subtree with root node.
-static SetNode node_find_max(BTreeNode node) {
+// Returns the leaf of the subtree with root node that contains the largest value (its last one).
+static BTreeNode node_find_max(BTreeNode node) {
 	if (node == NULL)
 		return NULL;
 
 	return node->children[node->count] != NULL
 		? node_find_max(node->children[node->count] ) // There is the rightmost subtree, the largest value is found there.
-		: node->set_nodes[node->count-1]; // Otherwise the largest set node is the last one in this btree node
+		: node; // Otherwise the largest value is the last one in this btree node
+}
+
+// Destroys the subtree of node (whose parent must be NULL) in at most *budget steps, which are subtracted from it.
+// Returns the node where the destruction continues, NULL once all nodes are freed.
+// There is no recursion: count is used as the position of the traversal, each step descends to the last child,
+// destroys the last value or frees the node (when it has neither) and returns to the parent. Its children are set
+// to NULL as they are visited.
+static BTreeNode btree_destroy_steps(BTreeNode node, DestroyFunc destroy_value, NodePool pool, int* budget) {
+	for (; node != NULL && *budget > 0; (*budget)--) {
+		BTreeNode child = is_leaf(node) ? NULL : node->children[node->count];
+		if (child != NULL) {
+			node->children[node->count] = NULL; // Visited.
+			node = child;
+		} else if (node->count > 0) {
+			node->count--;
+			if (destroy_value != NULL)
+				destroy_value(node->values[node->count]); // Destroy the values.
+		} else {
+			for (int i = 0; destroy_value != NULL && node->buffer != NULL && i < node->buffer->count; i++)
+				destroy_value(node->buffer->values[i]);
+
+			BTreeNode parent = node->parent;
+			node_free(node, pool); // free the node.
+			node = parent;
+		}
+	}
+	return node;
 }
 
 // Destroys the entire subtree with root node.
-static void btree_destroy(BTreeNode node, DestroyFunc destroy_value) {
+static void btree_destroy(BTreeNode node, DestroyFunc destroy_value, NodePool pool) {
 	if (node == NULL)
 		return;
-	
-	// First destroy the children.
-	for (int i = 0; i <= node->count; i++)
-		btree_destroy(node->children[i], destroy_value);
-
-	for (int i = 0; i < node->count; i++) {
-		if (destroy_value != NULL)
-			destroy_value(node->set_nodes[i]->value); // Destroy the values.
 
-		free(node->set_nodes[i]); // and free the set_node
+	node->parent = NULL; // The destruction ends at node.
+	while (node != NULL) {
+		int budget = INT_MAX;
+		node = btree_destroy_steps(node, destroy_value, pool, &budget);
 	}
-
-	free(node); // free the node.
 }
 
 
-// Return the previous (in order) of set_node,
-// or NULL if the node is the smaller of the subtree.
-static SetNode node_find_previous(SetNode set_node, CompareFunc compare) {  
-	// Find which btree_node the set_node belongs to, and its index within it
-	BTreeNode btree_node = set_node->owner;
-	int index;
-	for (index = 0; index < MAX_VALUES && btree_node->set_nodes[index] != set_node; index++)
-		;
-	assert(index < MAX_VALUES); // found
+// Moves (*node, *index) to the position of the previous (in order) value.
+// Returns false if the value is the smallest of the tree.
+static bool node_find_previous(BTreeNode* node, int* index, CompareFunc compare) {
+	BTreeNode btree_node = *node;
+	Pointer value = btree_node->values[*index];
 
-	if (!is_leaf(btree_node)) // if it is an internal node, return the maximum node 
-		return node_find_max(btree_node->children[index]); // from the left child of the separator value, which is set_node.
+	if (!is_leaf(btree_node)) { // if it is an internal node, return the maximum value
+		*node = node_find_max(btree_node->children[*index]); // from the left child of the separator value.
+		*index = (*node)->count-1;
+		return true;
+	}
 
 	// The node is a leaf.
 
-	if (index == 0) { // set_node is first within the btree node
-		// Look for an ancestor of the node that has at least 1 value less than set_node.
-		while (btree_node->parent != NULL && compare(set_node->value, btree_node->parent->set_nodes[0]->value) < 0)
+	if (*index == 0) { // the value is first within the btree node
+		// Look for an ancestor of the node that has at least 1 value less than value.
+		while (btree_node->parent != NULL && COMPARE(compare, value, btree_node->parent->values[0]) < 0)
 			btree_node = btree_node->parent;
 
-		if (btree_node->parent == NULL) // We've reached the root, so set_node is the smallest value in the tree.
-			return NULL;
+		if (btree_node->parent == NULL) // We've reached the root, so value is the smallest value in the tree.
+			return false;
 
-		for (int i = btree_node->parent->count-1; i >= 0 ; i--)
-			if (compare(set_node->value, btree_node->parent->set_nodes[i]->value) > 0)
-				return btree_node->parent->set_nodes[i]; // Find & return the ancestor's set node, which is immediately smaller than set_node.
+		BTreeNode parent = btree_node->parent;
+		for (int i = parent->count-1; i >= 0 ; i--)
+			if (COMPARE(compare, value, parent->values[i]) > 0) {
+				*node = parent; // Find the ancestor's value, which is immediately smaller than value.
+				*index = i;
+				return true;
+			}
 	}
 
-	// Return the immediately preceding set_node of the tree.
-	return btree_node->set_nodes[index-1]?
+	// The immediately preceding value of the tree is in the same leaf.
+	(*index)--;
+	return true;
 }
 
-// Returns the next (in order) node's set_node,
-// or NULL if the node is the largest of the subtree.
-static SetNode node_find_next(SetNode set_node, CompareFunc compare) {
-	// Find which btree_node the set_node belongs to, and its index within it
-	BTreeNode btree_node = set_node->owner;
-	int index;
-	for (index = 0; index < MAX_VALUES && btree_node->set_nodes[index] != set_node; index++)
-		;
-	assert(index < MAX_VALUES); // found
+// Moves (*node, *index) to the position of the next (in order) value.
+// Returns false if the value is the largest of the tree.
+static bool node_find_next(BTreeNode* node, int* index, CompareFunc compare) {
+	BTreeNode btree_node = *node;
+	Pointer value = btree_node->values[*index];
 
-	if (!is_leaf(btree_node)) // if it is an internal node, find and return the smallest node of the corresponding child.
-		return node_find_min(btree_node->children[index+1]);
+	if (!is_leaf(btree_node)) { // if it is an internal node, the next is the smallest value of the corresponding child.
+		*node = node_find_min(btree_node->children[*index+1]);
+		*index = 0;
+		return true;
+	}
 
 	// The node is a leaf.
 
-	if (index == btree_node->count-1) { // The set_node is last within the btree node
-		// Look for an ancestor of the node that has at least 1 value greater than node.
-		while (btree_node->parent != NULL && compare(set_node->value, btree_node->parent->set_nodes[btree_node->parent->count-1]->value) > 0)
+	if (*index == btree_node->count-1) { // The value is last within the btree node
+		// Look for an ancestor of the node that has at least 1 value greater than value.
+		while (btree_node->parent != NULL && COMPARE(compare, value, btree_node->parent->values[btree_node->parent->count-1]) > 0)
 			btree_node = btree_node->parent;
 
-		if (btree_node->parent == NULL) // We've reached the root, so set_node is the largest value in the tree.
-			return NULL;
+		if (btree_node->parent == NULL) // We've reached the root, so value is the largest value in the tree.
+			return false;
 
-		for (int i = 0; i < btree_node->parent->count; i++)
-			if (compare(set_node->value, btree_node->parent->set_nodes[i]->value) < 0)
-				return btree_node->parent->set_nodes[i]; // Find & return the value of the ancestor, which is immediately greater than set_node.
+		BTreeNode parent = btree_node->parent;
+		for (int i = 0; i < parent->count; i++)
+			if (COMPARE(compare, value, parent->values[i]) < 0) {
+				*node = parent; // Find the value of the ancestor, which is immediately greater than value.
+				*index = i;
+				return true;
+			}
 	}
 	
-	// Return the immediately previous set_node of the tree.
-	return btree_node->set_nodes[index+1]?
+	// The immediately next value of the tree is in the same leaf.
+	(*index)++;
+	return true;
 }
 
+// Moves (*node, *index) past the values marked as removed (see set_use_lazy_removal), to the next values if next,
+// otherwise to the previous ones. Returns false if there are no more values.
+static bool node_skip_removed(BTreeNode* node, int* index, bool next, CompareFunc compare) {
+	while (node_is_removed(*node, *index))
+		if (!(next ? node_find_next(node, index, compare) : node_find_previous(node, index, compare)))
+			return false;
+	return true;
+}
 
-//// ADT Set functions.
 
-Set set_create(CompareFunc compare, DestroyFunc destroy_value) {
-	assert(compare != NULL);
+/* ================================= concurrent writes ===================================== */
 
-	Set set = malloc(sizeof(*set));
-	set->root = NULL; // Empty tree.
-	set->size = 0;
-	set->compare = compare;
-	set->destroy_value = destroy_value;
+// With set_use_concurrent_writes every btree_node has a latch (a read-write lock), and root_latch protects set->root.
+// The operations descend from the root with latch coupling: the latch of the child is taken before the latch of its
+// parent is released. A writer keeps the latches of the ancestors only while the nodes are "unsafe", ie they may split
+// (insert, the node is full) or underflow (remove, the node has the minimum number of values). A split or
+// repair_underflow changes only the unsafe nodes of the path and the first safe node above them, so the writer already
+// holds all of them and never needs to latch upwards, and writers of independent subtrees run in parallel. The siblings
+// used by repair_underflow are latched there, while the writer holds their parent.
+//
+// The sizes of the subtrees (for set_rank / set_select) would need a latch on all ancestors, so they are not updated
+// and set_use_concurrent_writes(set, false) recomputes them.
 
-	return set;
-}
+#define MAX_HEIGHT 64 // More than the height of any B-tree with order >= 3 and at most INT_MAX values.
 
-int set_size(set set) {
-	return set->size;
-}
+// The nodes freed by a writer (merged, the old root) may still be latched by it, they are freed when it releases its
+// latches, in latch_chain_finish. They are linked through parent.
+static _Thread_local BTreeNode retired_nodes = NULL;
 
-pointer set_find(set set, pointer value) {
-	SetNode node = set_find_node(set, value);;
-	return node ? node->value : NULL;
+static void retire_node(BTreeNode node) {
+	node->parent = retired_nodes;
+	retired_nodes = node;
 }
 
-bool set_remove(Set set, Pointer value) {
-
-	bool removed;
-	pointer old_value = NULL;
-	
-	set->root = node_remove(set->root, set->compare, value, &removed, &old_value);;
+static void node_init_latch(BTreeNode node) {
+	node->latch = malloc(sizeof(pthread_rwlock_t));
+	pthread_rwlock_init(node->latch, NULL);
+}
 
-	if (removed) {
-		set->size--; // The size only changes if a node is actually removed.
+static void node_destroy_latch(BTreeNode node) {
+	pthread_rwlock_destroy(node->latch);
+	free(node->latch);
+	node->latch = NULL;
+}
 
-		if (set->destroy_value != NULL)
-			set->destroy_value(old_value);
-	}
+// Take / release the write latch of the node, nothing if the node is NULL or has no latch.
 
-	return removed;
+static void node_lock(BTreeNode node) {
+	if (node != NULL && node->latch != NULL)
+		pthread_rwlock_wrlock(node->latch);
 }
 
-SetNode set_first(set set) {
-	return node_find_min(set->root);; return node_find_min(set->root);
+static void node_unlock(BTreeNode node) {
+	if (node != NULL && node->latch != NULL)
+		pthread_rwlock_unlock(node->latch);
 }
 
-SetNode set_last(Set set) {
-	return node_find_max(set->root);;
-}
+// Creates (init true) or destroys the latches of all nodes of the subtree with root node.
+static void node_set_latches(BTreeNode node, bool init) {
+	if (node == NULL)
+		return;
 
-void set_destroy(Set set) {
-	btree_destroy(set->root, set->destroy_value);;
-	free(set);
+	for (int i = 0; i <= node->count; i++)
+		node_set_latches(node->children[i], init);
+
+	if (init)
+		node_init_latch(node);
+	else
+		node_destroy_latch(node);
 }
 
-SetNode set_find_node(set set set, pointer value) {
-	int index;
-	BTreeNode node = node_find(set->root, set->compare, value, &index);;
+// Recomputes the sizes of all nodes of the subtree with root node, returns the number of its values.
+static int node_update_sizes(BTreeNode node) {
+	if (node == NULL)
+		return 0;
 
-	return node && index != -1 ? node->set_nodes[index] : NULL;
+	int size = node->count;
+	for (int i = 0; i <= node->count; i++)
+		size += node->sizes[i] = node_update_sizes(node->children[i]);
+	return size;
 }
 
+// The latches held by a writer: root_latch if root_held, and the path nodes[0 ... count-1] (each one is the parent of
+// the next). target is a node above the path whose latch is kept until the end (the internal node of set_remove).
+typedef struct {
+	BTreeNode nodes[MAX_HEIGHT];
+	int count;
+	bool root_held;
+	BTreeNode target;
+} LatchChain;
+
+// Releases the latches of the path (except target), called when the writer reaches a safe node.
+static void latch_chain_release(Set set, LatchChain* chain) {
+	if (chain->root_held)
+		pthread_rwlock_unlock(set->root_latch);
+	chain->root_held = false;
+
+	for (int i = 0; i < chain->count; i++)
+		if (chain->nodes[i] != chain->target)
+			node_unlock(chain->nodes[i]);
+	chain->count = 0;
+}
 
-void set_insert(set set set, pointer value) {
-	bool inserted;
-	pointer old_value;
-
-	set->root = node_insert(set->root, set->compare, value, &inserted, &old_value);;
+// Releases all latches at the end of an operation, and frees the nodes that the operation removed from the tree.
+static void latch_chain_finish(Set set, LatchChain* chain) {
+	latch_chain_release(set, chain);
+	node_unlock(chain->target);
 
-	// The size only changes if a new node is inserted. In updates we destroy the old value
-	if (inserted)
-		set->size++;;
-	else if (set->destroy_value != NULL)
-		set->destroy_value(old_value);
+	while (retired_nodes != NULL) {
+		BTreeNode next = retired_nodes->parent;
+		node_destroy_latch(retired_nodes);
+		free(retired_nodes); // There is no node pool with concurrent writes.
+		retired_nodes = next;
+	}
 }
 
-SetNode set_previous(Set set, SetNode node) {
-	return node_find_previous(node, set->compare);;
+static Pointer concurrent_find(Set set, Pointer value) {
+	pthread_rwlock_rdlock(set->root_latch);
+	BTreeNode node = set->root;
+	if (node != NULL)
+		pthread_rwlock_rdlock(node->latch);
+	pthread_rwlock_unlock(set->root_latch);
+
+	while (node != NULL) {
+		STATS_ADD(nodes_visited, 1);
+		bool equal;
+		int index = node_search(node, set->compare, value, &equal);
+
+		Pointer found = equal ? node->values[index] : NULL;
+		BTreeNode child = equal ? NULL : node->children[index]; // NULL in the leaves.
+		if (child != NULL)
+			pthread_rwlock_rdlock(child->latch);
+		pthread_rwlock_unlock(node->latch);
+
+		if (equal)
+			return found;
+		node = child;
+	}
+	return NULL;
 }
 
-SetNode set_next(Set set, SetNode node) {
-	return node_find_next(node, set->compare);;
-}
+static void concurrent_insert(Set set, Pointer value) {
+	LatchChain chain = { .count = 0, .root_held = true, .target = NULL };
+	pthread_rwlock_wrlock(set->root_latch);
 
-Pointer set_node_value(Set set, SetNode node) {
-	return node->value;
-}
+	if (set->root == NULL) {
+		set->root = node_create(set->order, set->pool, set->key);
+		node_init_latch(set->root);
+		node_add_value(set->root, value, 0);
+		__atomic_add_fetch(&set->size, 1, __ATOMIC_RELAXED);
+		latch_chain_finish(set, &chain);
+		return;
+	}
 
-DestroyFunc set_set_destroy_value(Set set, DestroyFunc destroy_value) {
-	DestroyFunc old = set->destroy_value;
-	set->destroy_value = destroy_value;
-	return old;
-}
+	BTreeNode node = set->root;
+	node_lock(node);
+	while (true) {
+		STATS_ADD(nodes_visited, 1);
+		if (node->count < MAX_VALUES(set->order)) // The node cannot split, so neither its ancestors.
+			latch_chain_release(set, &chain);
+		chain.nodes[chain.count++] = node;
+
+		bool equal;
+		int index = node_search(node, set->compare, value, &equal);
+
+		if (equal) { // The value already exists, it is replaced.
+			Pointer old_value = node->values[index];
+			node_set_value(node, index, value);
+			latch_chain_finish(set, &chain);
+
+			if (set->destroy_value != NULL)
+				set->destroy_value(old_value);
+			return;
+		}
+
+		if (is_leaf(node)) {
+			node_add_value(node, value, index);
+			__atomic_add_fetch(&set->size, 1, __ATOMIC_RELAXED);
+
+			if (node->count > MAX_VALUES(set->order))
+				split(node, set->compare, set->order, set->pool); // Changes only nodes of the chain.
+
+			if (chain.root_held && set->root->parent != NULL) // The root was split.
+				set->root = set->root->parent;
+
+			latch_chain_finish(set, &chain);
+			return;
+		}
+
+		node_lock(node->children[index]);
+		node = node->children[index];
+	}
+}
+
+static bool concurrent_remove(Set set, Pointer value) {
+	LatchChain chain = { .count = 0, .root_held = true, .target = NULL };
+	pthread_rwlock_wrlock(set->root_latch);
+
+	BTreeNode node = set->root;
+	node_lock(node);
+	int target_index = -1;
+
+	// Find the value, and if it is in an internal node continue to the leaf with the largest value of its left
+	// subtree, which replaces it (as in node_remove).
+	for (bool is_root = true; node != NULL; is_root = false) {
+		STATS_ADD(nodes_visited, 1);
+		if (node->count > (is_root ? 1 : MIN_VALUES(set->order))) // The node cannot underflow, so neither its ancestors.
+			latch_chain_release(set, &chain);
+		chain.nodes[chain.count++] = node;
+
+		int index = node->count; // Below the target, continue in the rightmost child.
+		if (chain.target == NULL) {
+			bool equal;
+			index = node_search(node, set->compare, value, &equal);
+			if (equal) {
+				chain.target = node;
+				target_index = index;
+			}
+		}
+
+		if (is_leaf(node))
+			break;
+
+		node_lock(node->children[index]);
+		node = node->children[index];
+	}
+
+	if (chain.target == NULL) { // Not found.
+		latch_chain_finish(set, &chain);
+		return false;
+	}
+
+	BTreeNode target = chain.target;
+	Pointer old_value = target->values[target_index];
+
+	if (node == target) {
+		for (int i = target_index; i < node->count-1; i++) // Move all data 1 position to the left.
+			node_copy_value(node, i, node, i + 1);
+	} else {
+		node_copy_value(target, target_index, node, node->count-1);
+	}
+	node->count--;
+	__atomic_sub_fetch(&set->size, 1, __ATOMIC_RELAXED);
+
+	repair_underflow(node, set->order, set->pool); // Changes only nodes of the chain and their siblings.
+
+	// If the root was emptied, its child becomes the root (the root is unsafe, so root_latch is held).
+	if (chain.root_held && set->root->count == 0) {
+		BTreeNode root = set->root;
+		set->root = root->children[0];
+		if (set->root != NULL)
+			set->root->parent = NULL;
+		node_free(root, set->pool);
+	}
+
+	latch_chain_finish(set, &chain);
+
+	if (set->destroy_value != NULL)
+		set->destroy_value(old_value);
+	return true;
+}
+
+/* =============================== concurrent writes_end =================================== */
+
+/* =================================== mapped sets ========================================= */
+
+// The file of set_save is a sequence of pages of page_size bytes. Page 0 holds the MappedHeader, every other page a
+// btree_node with page numbers instead of pointers, so the file is valid at any address: set_open_mmap maps it
+// read-only and the searches run directly on the pages, nothing is read before it is needed. The pages are in
+// breadth-first order, so the upper levels, which every search visits, are together at the start of the file.
+// Every page_size is a multiple of node_alignment(order), so a SetNode packs a page and an index like a btree_node.
+
+#define MAPPED_MAGIC "ADTSetB1"
+
+#ifdef SET_INT_KEYS
+#define MAPPED_INT_KEYS 1 // The values are the keys themselves, the files of the 2 builds are not compatible.
+#else
+#define MAPPED_INT_KEYS 0
+#endif
+
+typedef struct mapped_header {
+	char magic[8]; // MAPPED_MAGIC
+	int32_t int_keys; // MAPPED_INT_KEYS of the build that saved the file.
+	int32_t order;
+	int32_t value_size; // The bytes of each value.
+	int32_t page_size;
+	int32_t size; // Number of values.
+	uint32_t root; // The page of the root, 0 if the set is empty.
+	uint32_t pages; // Number of pages, including page 0.
+} MappedHeader;
+
+// A page starts with the MappedPage, followed by the tables of the node (see mapped_children etc):
+//   uint32_t children[MAX_CHILDREN], the pages of the children, 0 in the leaves,
+//   int32_t sizes[MAX_CHILDREN], the number of values in each child,
+//   the values, value_size bytes each, rounded up to 8 bytes so that they are aligned.
+typedef struct {
+	int32_t count; // Number of values.
+	uint32_t parent; // The page of the parent, 0 for the root.
+	int32_t parent_index; // The position of the page in the children of the parent.
+	int32_t unused;
+} MappedPage;
+
+static uint32_t* mapped_children(MappedPage* page) {
+	return (uint32_t*)(page + 1);
+}
+
+static int32_t* mapped_sizes(MappedPage* page, int order) {
+	return (int32_t*)(mapped_children(page) + order);
+}
+
+static char* mapped_values(MappedPage* page, int order) {
+	return (char*)(mapped_sizes(page, order) + order);
+}
+
+static size_t mapped_value_slot(int value_size) {
+	return (value_size + 7) / 8 * 8;
+}
+
+static size_t mapped_page_size(int order, int value_size) {
+	size_t size = sizeof(MappedPage) + 2 * order * sizeof(int32_t) + MAX_VALUES(order) * mapped_value_slot(value_size);
+	if (size < sizeof(MappedHeader))
+		size = sizeof(MappedHeader);
+
+	size_t align = node_alignment(order);
+	return (size + align - 1) / align * align;
+}
+
+static MappedPage* mapped_page(Set set, uint32_t number) {
+	return (MappedPage*)((char*)set->mapped + (size_t)number * set->mapped->page_size);
+}
+
+// The value is stored in the page, with SET_INT_KEYS the value is the key itself.
+static Pointer mapped_value(Set set, MappedPage* page, int index) {
+	char* slot = mapped_values(page, set->order) + index * mapped_value_slot(set->mapped->value_size);
+#ifdef SET_INT_KEYS
+	return (Pointer)*(intptr_t*)slot;
+#else
+	return slot;
+#endif
+}
+
+static SetNode mapped_pack(MappedPage* page, int index) {
+	return set_node_pack((BTreeNode)page, index);
+}
+
+// Returns the number of values of the page that are < value, and sets *equal if the value at that position is
+// equivalent to value. Binary search, the values of a page are sorted.
+static int mapped_search(Set set, MappedPage* page, Pointer value, bool* equal) {
+	STATS_ADD(nodes_visited, 1);
+	int lo = 0, hi = page->count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (COMPARE(set->compare, mapped_value(set, page, mid), value) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*equal = lo < page->count && COMPARE(set->compare, value, mapped_value(set, page, lo)) == 0;
+	return lo;
+}
+
+// Like node_find_bound: returns the page of the smallest value >= value (> value if strict), and its index in *index,
+// or NULL if there is no such value.
+static MappedPage* mapped_find_bound(Set set, Pointer value, bool strict, int* index) {
+	MappedPage* bound = NULL;
+	for (uint32_t number = set->mapped->root; number != 0; ) {
+		MappedPage* page = mapped_page(set, number);
+		bool equal;
+		int i = mapped_search(set, page, value, &equal);
+		if (equal && !strict) {
+			*index = i;
+			return page;
+		} else if (equal) {
+			i++; // The value is smaller than all values of child i+1.
+		}
+
+		if (i < page->count) { // Value i is the bound, unless child i contains a smaller one.
+			bound = page;
+			*index = i;
+		}
+		number = mapped_children(page)[i];
+	}
+	return bound;
+}
+
+static MappedPage* mapped_find(Set set, Pointer value, int* index) {
+	MappedPage* page = mapped_find_bound(set, value, false, index);
+	return page != NULL && COMPARE(set->compare, value, mapped_value(set, page, *index)) == 0 ? page : NULL;
+}
+
+// Like node_rank, the number of values < value.
+static int mapped_rank(Set set, Pointer value) {
+	int rank = 0;
+	for (uint32_t number = set->mapped->root; number != 0; ) {
+		MappedPage* page = mapped_page(set, number);
+		int32_t* sizes = mapped_sizes(page, set->order);
+		bool equal;
+		int i = mapped_search(set, page, value, &equal);
+
+		for (int j = 0; j < i; j++)
+			rank += sizes[j] + 1; // Child j and value j are smaller.
+		if (equal)
+			return rank + sizes[i];
+		number = mapped_children(page)[i];
+	}
+	return rank;
+}
+
+// Like node_select, the page of the k-th smallest value (0-based), NULL if there are <= k values.
+static MappedPage* mapped_select(Set set, int k, int* index) {
+	for (uint32_t number = set->mapped->root; number != 0; ) {
+		MappedPage* page = mapped_page(set, number);
+		int32_t* sizes = mapped_sizes(page, set->order);
+		STATS_ADD(nodes_visited, 1);
+
+		int i = 0;
+		for (; i <= page->count; i++) {
+			if (k < sizes[i]) // The k-th value is in child i
+				break;
+			k -= sizes[i];
+
+			if (i < page->count) {
+				if (k == 0) { // The k-th value is value i
+					*index = i;
+					return page;
+				}
+				k--;
+			}
+		}
+		if (i > page->count)
+			return NULL;
+		number = mapped_children(page)[i];
+	}
+	return NULL;
+}
+
+// The leaf with the smallest (largest if last) value of the subtree of the page.
+static MappedPage* mapped_find_edge(Set set, MappedPage* page, bool last) {
+	while (mapped_children(page)[last ? page->count : 0] != 0)
+		page = mapped_page(set, mapped_children(page)[last ? page->count : 0]);
+	return page;
+}
+
+// Like node_find_next / node_find_previous, with the parent and the position in it instead of comparisons.
+static bool mapped_find_next(Set set, MappedPage** page, int* index) {
+	MappedPage* current = *page;
+	if (mapped_children(current)[*index+1] != 0) { // The smallest value of child index+1.
+		*page = mapped_find_edge(set, mapped_page(set, mapped_children(current)[*index+1]), false);
+		*index = 0;
+		return true;
+	}
+	if (*index+1 < current->count) {
+		(*index)++;
+		return true;
+	}
+
+	// The last value of a leaf, the next is the separator after the first ancestor that is not a last child.
+	while (current->parent != 0 && current->parent_index == mapped_page(set, current->parent)->count)
+		current = mapped_page(set, current->parent);
+	if (current->parent == 0)
+		return false;
+
+	*index = current->parent_index;
+	*page = mapped_page(set, current->parent);
+	return true;
+}
+
+static bool mapped_find_previous(Set set, MappedPage** page, int* index) {
+	MappedPage* current = *page;
+	if (mapped_children(current)[*index] != 0) { // The largest value of child index.
+		*page = mapped_find_edge(set, mapped_page(set, mapped_children(current)[*index]), true);
+		*index = (*page)->count - 1;
+		return true;
+	}
+	if (*index > 0) {
+		(*index)--;
+		return true;
+	}
+
+	while (current->parent != 0 && current->parent_index == 0)
+		current = mapped_page(set, current->parent);
+	if (current->parent == 0)
+		return false;
+
+	*index = current->parent_index - 1;
+	*page = mapped_page(set, current->parent);
+	return true;
+}
+
+// Visits in order the values from (page, index) up to the last one, or up to hi (exclusive) if bounded.
+static void mapped_visit(Set set, MappedPage* page, int index, bool bounded, Pointer hi, VisitCtxFunc visit, Pointer ctx) {
+	if (page == NULL)
+		return;
+
+	do {
+		Pointer value = mapped_value(set, page, index);
+		if (bounded && COMPARE(set->compare, value, hi) >= 0)
+			break;
+		visit(value, ctx);
+	} while (mapped_find_next(set, &page, &index));
+}
+
+/* ================================= mapped sets_end ======================================= */
+
+
+//// ADT Set functions.
+
+// Frozen sets (set_freeze): a SetNode is the position of the value in the array, so SET_EOF (0) is no position.
+static SetNode frozen_pack(int position) {
+	return (SetNode)(uintptr_t)position;
+}
+
+static int frozen_position(SetNode node) {
+	return (int)(uintptr_t)node;
+}
+
+Set set_create(CompareFunc compare, DestroyFunc destroy_value) {
+	return set_create_with_order(compare, destroy_value, DEFAULT_ORDER);
+}
+
+Set set_create_with_order(CompareFunc compare, DestroyFunc destroy_value, int order) {
+#ifdef SET_INT_KEYS
+	compare = compare_int_keys;
+#endif
+	assert(compare != NULL);
+	assert(order >= MIN_ORDER);
+
+	Set set = malloc(sizeof(*set));
+	set->root = NULL; // Empty tree.
+	set->size = 0;
+	set->compare = compare;
+	set->destroy_value = destroy_value;
+	set->order = order;
+	set->index_mask = node_alignment(order) - 1;
+#ifdef SET_STATS
+	memset(&set->stats, 0, sizeof(set->stats));
+#endif
+	set->pool = NULL; // Nodes are allocated with aligned_alloc, until set_use_node_pool is called.
+	set->key = NULL; // Until set_set_key_func is called.
+	set->root_latch = NULL; // Until set_use_concurrent_writes is called.
+	set->mapped = NULL; // Only set_open_mmap creates mapped sets.
+	set->hash_index = NULL; // Until set_use_hash_index is called.
+	set->frozen = NULL; // Until set_freeze is called.
+	set->write_buffers = false; // Until set_use_write_buffers is called.
+	set->buffered = 0;
+	set->lazy = false; // Until set_use_lazy_removal is called.
+	set->stable_nodes = false; // Until set_use_stable_nodes is called.
+	set->removed = 0;
+	set->cleared = NULL; // Until set_clear is called.
+	set->cleared_pool = NULL;
+	set->cleared_destroy_value = NULL;
+
+	return set;
+}
+
+Set set_create_from_sorted(CompareFunc compare, DestroyFunc destroy_value, Pointer* values, int n) {
+	Set set = set_create(compare, destroy_value);
+	STATS_ENTER(set);
+	set->root = node_create_from_sorted(values, n, set->order, set->pool, set->key, 1);
+	set->size = n;
+
+	return set;
+}
+
+Set set_create_from_sorted_parallel(CompareFunc compare, DestroyFunc destroy_value, Pointer* values, int n, int nthreads) {
+	assert(nthreads >= 1);
+
+	Set set = set_create(compare, destroy_value);
+	STATS_ENTER(set);
+	set->root = node_create_from_sorted(values, n, set->order, NULL, set->key, nthreads);
+	set->size = n;
+
+	return set;
+}
+
+Set set_create_from_array(CompareFunc compare, DestroyFunc destroy_value, Pointer* values, int n) {
+#ifdef SET_INT_KEYS
+	compare = compare_int_keys;
+#endif
+	// Sort a copy of the array, the caller's array is not modified
+	Pointer* sorted = malloc(n * sizeof(Pointer));
+	memcpy(sorted, values, n * sizeof(Pointer));
+
+	int count = values_sort_unique(sorted, n, compare, destroy_value);
+	Set set = set_create_from_sorted(compare, destroy_value, sorted, count);
+
+	free(sorted);
+	return set;
+}
+
+// Write buffers (set_use_write_buffers). Each value of a buffer is newer than the equivalent values of the buffers below
+// it and of the tree, so set_find returns the first one it finds on the path, and set_insert only has to add the value to
+// the buffer of the root. A full buffer is flushed to the child that receives most of its values (at least 1/order of
+// them), so the nodes below the root are visited once per batch of values, not once per value.
+
+// Returns the child of node that receives most of the values of its buffer, which are the values *first ... *last-1.
+static int buffer_largest_child(BTreeNode node, int* first, int* last) {
+	WriteBuffer buffer = node->buffer;
+	int child = 0;
+	*first = *last = 0;
+
+	for (int i = 0, j = 0; i <= node->count; i++) {
+		int start = j; // The values of child i follow those of child i-1.
+		if (i == node->count)
+			j = buffer->count;
+		else
+			while (j < buffer->count && COMPARE(buffer->compare, buffer->values[j], node->values[i]) <= 0)
+				j++;
+
+		if (j - start > *last - *first) {
+			child = i;
+			*first = start;
+			*last = j;
+		}
+	}
+	return child;
+}
+
+// Adds the n sorted values to the buffer of node, which is created if needed. Of 2 equivalent values the older is
+// destroyed, as set_insert does with the value it replaces (the added values are newer, unless older is true).
+static void buffer_merge(Set set, BTreeNode node, Pointer* values, int n, bool older) {
+	if (node->buffer == NULL)
+		buffer_create(node, set->compare);
+	WriteBuffer buffer = node->buffer;
+
+	Pointer* merged = malloc((buffer->count + n) * sizeof(Pointer));
+	int i = 0, j = 0, count = 0;
+	while (i < buffer->count && j < n) {
+		int compare_res = COMPARE(set->compare, buffer->values[i], values[j]);
+		if (compare_res < 0) {
+			merged[count++] = buffer->values[i++];
+			continue;
+		}
+		if (compare_res == 0) {
+			if (set->destroy_value != NULL)
+				set->destroy_value(older ? values[j] : buffer->values[i]);
+			set->buffered--;
+			if (older) {
+				j++;
+				continue;
+			}
+			i++;
+		}
+		merged[count++] = values[j++];
+	}
+	while (i < buffer->count)
+		merged[count++] = buffer->values[i++];
+	while (j < n)
+		merged[count++] = values[j++];
+
+	free(buffer->values);
+	buffer->values = merged;
+	buffer->capacity = buffer->count + n;
+	buffer->count = count;
+}
+
+// Flushes the buffer of node until it has at most limit values. The values of an internal child are merged to its
+// buffer, which is flushed in the same way, those of a leaf are appended to pending (the tree itself does not change).
+static void buffer_flush(Set set, BTreeNode node, int limit, WriteBuffer pending) {
+	while (node->buffer->count > limit) {
+		int first, last;
+		BTreeNode child = node->children[buffer_largest_child(node, &first, &last)];
+		int n = last - first;
+
+		if (is_leaf(child)) {
+			buffer_reserve(pending, pending->count + n);
+			memcpy(pending->values + pending->count, node->buffer->values + first, n * sizeof(Pointer));
+			pending->count += n;
+			set->buffered -= n;
+		} else {
+			buffer_merge(set, child, node->buffer->values + first, n, false);
+		}
+		buffer_remove(node->buffer, first, last);
+
+		if (!is_leaf(child))
+			buffer_flush(set, child, limit, pending);
+	}
+}
+
+// Flushes all buffers of the subtree of node to pending.
+static void buffer_flush_all(Set set, BTreeNode node, WriteBuffer pending) {
+	if (node == NULL || is_leaf(node))
+		return;
+
+	if (node->buffer != NULL)
+		buffer_flush(set, node, 0, pending);
+	for (int i = 0; i <= node->count; i++)
+		buffer_flush_all(set, node->children[i], pending);
+}
+
+// Inserts the flushed values in the tree. Each run of increasing values is sorted, so it is inserted with the finger of
+// set_insert_many. A value flushed twice (the newer one from a higher buffer) is in a later run, so it replaces the older.
+static void buffer_apply(Set set, WriteBuffer pending) {
+	for (int first = 0, last; first < pending->count; first = last) {
+		for (last = first + 1; last < pending->count && COMPARE(set->compare, pending->values[last-1], pending->values[last]) < 0; last++)
+			;
+		set_insert_many(set, pending->values + first, last - first);
+	}
+	free(pending->values);
+}
+
+// Empties all buffers to the tree.
+static void buffer_flush_tree(Set set) {
+	if (set->buffered == 0)
+		return;
+
+	struct write_buffer pending = { NULL, 0, 0, set->compare }; // Not sorted, see buffer_apply.
+	buffer_flush_all(set, set->root, &pending);
+	buffer_apply(set, &pending);
+}
+
+// Adds value to the buffer of the root (an internal node), replacing an equivalent one.
+static void buffer_insert(Set set, Pointer value) {
+	BTreeNode root = set->root;
+	if (root->buffer == NULL)
+		buffer_create(root, set->compare);
+	WriteBuffer buffer = root->buffer;
+
+	bool equal;
+	int index = buffer_search(buffer, value, &equal);
+	if (equal) {
+		if (set->destroy_value != NULL)
+			set->destroy_value(buffer->values[index]);
+		buffer->values[index] = value;
+		return;
+	}
+
+	buffer_reserve(buffer, buffer->count + 1);
+	memmove(buffer->values + index + 1, buffer->values + index, (buffer->count - index) * sizeof(Pointer));
+	buffer->values[index] = value;
+	buffer->count++;
+	set->buffered++;
+
+	if (buffer->count > WRITE_BUFFER_SIZE) {
+		struct write_buffer pending = { NULL, 0, 0, set->compare };
+		buffer_flush(set, root, WRITE_BUFFER_SIZE, &pending);
+		buffer_apply(set, &pending);
+	}
+}
+
+// set_find with write buffers: the first value found in a buffer of the path, otherwise the value of the tree.
+static Pointer buffer_find(Set set, Pointer value) {
+	Pointer found = NULL;
+	for (BTreeNode node = set->root; node != NULL; ) {
+		STATS_ADD(nodes_visited, 1);
+		bool equal;
+		if (node->buffer != NULL) {
+			int index = buffer_search(node->buffer, value, &equal);
+			if (equal)
+				return node->buffer->values[index];
+		}
+
+		int index = node_search(node, set->compare, value, &equal);
+		if (equal)
+			found = node->values[index]; // The buffers below may still have a newer value.
+		node = is_leaf(node) ? NULL : node->children[index];
+	}
+	return found;
+}
+
+// If value is a separator of an internal node, node_remove replaces it with the largest value p of its left subtree.
+// The buffered values > p of that subtree would then be on the wrong side of the separator, so they are moved to the
+// buffer of the node (they are older than its own values).
+static void buffer_lift(Set set, Pointer value) {
+	BTreeNode node = set->root;
+	int index;
+	for (;;) {
+		if (node == NULL || is_leaf(node))
+			return;
+		bool equal;
+		index = node_search(node, set->compare, value, &equal);
+		if (equal)
+			break;
+		node = node->children[index];
+	}
+
+	BTreeNode max_node = node_find_max(node->children[index]);
+	Pointer max = max_node->values[max_node->count-1];
+
+	for (BTreeNode child = node->children[index]; child != max_node; child = child->children[child->count]) {
+		if (child->buffer == NULL)
+			continue;
+		bool equal;
+		int first = buffer_search(child->buffer, max, &equal) + equal;
+		buffer_merge(set, node, child->buffer->values + first, child->buffer->count - first, true);
+		buffer_remove(child->buffer, first, child->buffer->count);
+	}
+}
+
+// Prepares set_remove of value: removes (and destroys) the equivalent values from the buffers of its path, returns true
+// if there was one. Then the tree can be changed by node_remove.
+static bool buffer_remove_value(Set set, Pointer value) {
+	bool removed = false;
+	for (BTreeNode node = set->root; node != NULL && !is_leaf(node); ) {
+		bool equal;
+		if (node->buffer != NULL) {
+			int index = buffer_search(node->buffer, value, &equal);
+			if (equal) {
+				if (set->destroy_value != NULL)
+					set->destroy_value(node->buffer->values[index]);
+				buffer_remove(node->buffer, index, index + 1);
+				set->buffered--;
+				removed = true;
+			}
+		}
+		node = node->children[node_search(node, set->compare, value, &equal)];
+	}
+
+	// A root with 1 value is removed if its children are merged, so its buffer is emptied first.
+	while (set->root != NULL && !is_leaf(set->root) && set->root->count == 1 && set->root->buffer != NULL && set->root->buffer->count > 0) {
+		struct write_buffer pending = { NULL, 0, 0, set->compare };
+		buffer_flush(set, set->root, 0, &pending);
+		buffer_apply(set, &pending);
+	}
+
+	buffer_lift(set, value);
+	return removed;
+}
+
+// Frees the (empty) buffers of the subtree of node.
+static void node_free_buffers(BTreeNode node) {
+	if (node == NULL || is_leaf(node))
+		return;
+
+	for (int i = 0; i <= node->count; i++)
+		node_free_buffers(node->children[i]);
+	if (node->buffer != NULL) {
+		free(node->buffer->values);
+		free(node->buffer);
+		node->buffer = NULL;
+	}
+}
+
+// set_remove with lazy removal: the value is only marked, so no nodes are merged. When too many values are marked the
+// tree is compacted, so the cost is O(1) amortized for each removal, in addition to the search.
+static bool lazy_remove(Set set, Pointer value) {
+	int index;
+	BTreeNode node = node_find(set->root, set->compare, value, &index);
+	if (node == NULL || index == -1 || node_is_removed(node, index))
+		return false;
+
+	node->removed |= (uint64_t)1 << index;
+	set->size--;
+	set->removed++;
+
+	if ((long)set->removed * 100 > (long)(set->size + set->removed) * COMPACT_REMOVED_PERCENT)
+		set_compact(set);
+	return true;
+}
+
+// Continues the destruction of the tree of set_clear (set->cleared != NULL) with at most budget steps (see
+// btree_destroy_steps). Returns the steps that were not used.
+static int cleared_destroy_steps(Set set, int budget) {
+	set->cleared = btree_destroy_steps(set->cleared, set->cleared_destroy_value, set->cleared_pool, &budget);
+	if (set->cleared == NULL && set->cleared_pool != NULL) {
+		pool_destroy(set->cleared_pool);
+		set->cleared_pool = NULL;
+	}
+	return budget;
+}
+
+// Completes the destruction of the tree of set_clear, if any.
+static void cleared_destroy(Set set) {
+	while (set->cleared != NULL)
+		cleared_destroy_steps(set, INT_MAX);
+}
+
+int set_size(Set set) {
+	if (set->write_buffers)
+		buffer_flush_tree(set); // The buffered values may replace values of the tree, they are counted once inserted.
+	return __atomic_load_n(&set->size, __ATOMIC_RELAXED); // Can change concurrently, see set_use_concurrent_writes.
+}
+
+// Prefetches the cache lines of child that node_search and is_leaf read: the start of the node, the first child and
+// the table that is searched (the keys, or the values). The tables are at the same offsets in all nodes of the set
+// (see node_create), so their addresses are found from node, without waiting for child itself.
+static void node_prefetch(BTreeNode node, BTreeNode child, int order) {
+	__builtin_prefetch(child);
+	__builtin_prefetch((char*)child + ((char*)node->children - (char*)node));
+
+	char* table = (char*)child + (node->keys != NULL ? (char*)node->keys - (char*)node : (char*)node->values - (char*)node);
+	size_t size = MAX_VALUES(order) * (node->keys != NULL ? sizeof(int64_t) : sizeof(Pointer));
+	for (size_t offset = 0; offset < size; offset += 64) // 64 bytes, the usual size of a cache line
+		__builtin_prefetch(table + offset);
+}
+
+Pointer set_find(Set set, Pointer value) {
+	STATS_ENTER(set);
+	STATS_ADD(lookups, 1);
+	if (set->frozen != NULL) {
+		int position = frozen_array_find(set->frozen, set->compare, value);
+		return position != 0 ? frozen_array_value(set->frozen, position) : NULL;
+	}
+	if (set->root_latch != NULL)
+		return concurrent_find(set, value);
+	if (set->hash_index != NULL)
+		return hash_index_find(set->hash_index, value);
+	if (set->write_buffers)
+		return buffer_find(set, value);
+
+	int index;
+	if (set->mapped != NULL) {
+		MappedPage* page = mapped_find(set, value, &index);
+		return page ? mapped_value(set, page, index) : NULL;
+	}
+	BTreeNode node = node_find(set->root, set->compare, value, &index);
+
+	return node && index != -1 && !node_is_removed(node, index) ? node->values[index] : NULL;
+}
+
+// The searches of a group are at current[i], NULL once finished.
+void set_find_many(Set set, Pointer* keys, int n, Pointer* out) {
+	if (set->frozen != NULL || set->mapped != NULL || set->root_latch != NULL || set->hash_index != NULL || set->write_buffers) {
+		for (int i = 0; i < n; i++)
+			out[i] = set_find(set, keys[i]);
+		return;
+	}
+	STATS_ENTER(set);
+	STATS_ADD(lookups, n);
+
+	BTreeNode current[FIND_GROUP];
+	for (int first = 0; first < n; first += FIND_GROUP) {
+		int count = n - first < FIND_GROUP ? n - first : FIND_GROUP;
+		for (int i = 0; i < count; i++) {
+			current[i] = set->root;
+			out[first + i] = NULL;
+		}
+
+		for (bool active = set->root != NULL; active; ) {
+			active = false;
+			for (int i = 0; i < count; i++) {
+				BTreeNode node = current[i];
+				if (node == NULL)
+					continue;
+
+				STATS_ADD(nodes_visited, 1);
+				bool equal;
+				int index = node_search(node, set->compare, keys[first + i], &equal);
+				if (equal) {
+					if (!node_is_removed(node, index))
+						out[first + i] = node->values[index];
+					current[i] = NULL;
+				} else if (is_leaf(node)) {
+					current[i] = NULL;
+				} else {
+					current[i] = node->children[index];
+					node_prefetch(node, current[i], set->order);
+					active = true;
+				}
+			}
+		}
+	}
+}
+
+bool set_remove(Set set, Pointer value) {
+	assert(set->mapped == NULL);
+	assert(set->frozen == NULL);
+
+	STATS_ENTER(set);
+	STATS_ADD(lookups, 1);
+	if (set->root_latch != NULL)
+		return concurrent_remove(set, value);
+	if (set->cleared != NULL)
+		cleared_destroy_steps(set, CLEAR_STEPS);
+
+	if (set->lazy)
+		return lazy_remove(set, value);
+
+	bool removed;
+	Pointer old_value = NULL;
+	if (set->hash_index != NULL)
+		hash_index_remove(set->hash_index, value);
+
+	// The removals are not buffered: set_remove searches the path anyway, to return whether the value exists.
+	bool buffered = set->write_buffers && buffer_remove_value(set, value);
+	
+	set->root = node_remove(set->root, set->compare, set->order, set->pool, value, &removed, &old_value);
+
+	if (removed) {
+		set->size--; // The size only changes if a node is actually removed.
+
+		if (set->destroy_value != NULL)
+			set->destroy_value(old_value);
+	}
+
+	return removed || buffered;
+}
+
+// A stable SetNode is the value itself (see set_node_make), so no allocation per value is needed.
+void set_use_stable_nodes(Set set, bool stable) {
+#ifdef SET_INT_KEYS
+	assert(!stable); // The SetNode of the key 0 would be SET_EOF.
+#endif
+	set->stable_nodes = stable;
+}
+
+SetNode set_first(Set set) {
+	if (set->frozen != NULL)
+		return frozen_pack(frozen_array_first(set->frozen));
+	if (set->mapped != NULL)
+		return set->mapped->root != 0 ? mapped_pack(mapped_find_edge(set, mapped_page(set, set->mapped->root), false), 0) : SET_BOF;
+
+	BTreeNode node = node_find_min(set->root);
+	int index = 0;
+	return node && node_skip_removed(&node, &index, true, set->compare) ? set_node_make(set, node, index) : SET_BOF;
+}
+
+SetNode set_last(Set set) {
+	if (set->frozen != NULL)
+		return frozen_pack(frozen_array_last(set->frozen));
+	if (set->mapped != NULL) {
+		if (set->mapped->root == 0)
+			return SET_EOF;
+		MappedPage* page = mapped_find_edge(set, mapped_page(set, set->mapped->root), true);
+		return mapped_pack(page, page->count-1);
+	}
+
+	BTreeNode node = node_find_max(set->root);
+	int index = node ? node->count-1 : 0;
+	return node && node_skip_removed(&node, &index, false, set->compare) ? set_node_make(set, node, index) : SET_EOF;
+}
+
+void set_use_node_pool(Set set, bool use_pool) {
+	assert(set->size == 0);
+	assert(set->mapped == NULL);
+	assert(set->root_latch == NULL); // The pool is not thread-safe.
+	assert(set->frozen == NULL);
+
+	if (use_pool && set->pool == NULL) {
+		set->pool = pool_create(node_alloc_size(set->order, set->key != NULL), node_alignment(set->order));
+	} else if (!use_pool && set->pool != NULL) {
+		pool_destroy(set->pool);
+		set->pool = NULL;
+	}
+}
+
+void set_set_key_func(Set set, KeyFunc key) {
+	assert(set->size == 0);
+	assert(set->mapped == NULL); // The pages have no keys.
+#ifndef SET_INT_KEYS
+	set->key = key; // With integer keys the values are searched directly, key is not needed.
+
+	// The nodes now have a different size, the pool must be recreated.
+	if (set->pool != NULL) {
+		set_use_node_pool(set, false);
+		set_use_node_pool(set, true);
+	}
+#endif
+}
+
+bool set_use_concurrent_writes(Set set, bool concurrent) {
+	if (concurrent && set->root_latch == NULL) {
+		assert(set->pool == NULL); // The pool is not thread-safe.
+		assert(set->mapped == NULL);
+		assert(set->hash_index == NULL); // The index is not thread-safe.
+		assert(set->frozen == NULL);
+		assert(!set->write_buffers);
+		assert(!set->lazy);
+
+		set->root_latch = malloc(sizeof(pthread_rwlock_t));
+		pthread_rwlock_init(set->root_latch, NULL);
+		node_set_latches(set->root, true);
+
+	} else if (!concurrent && set->root_latch != NULL) {
+		node_set_latches(set->root, false);
+		pthread_rwlock_destroy(set->root_latch);
+		free(set->root_latch);
+		set->root_latch = NULL;
+
+		node_update_sizes(set->root); // The concurrent writes do not update the sizes.
+	}
+	return true;
+}
+
+bool set_use_write_buffers(Set set, bool buffered) {
+	if (buffered && !set->write_buffers) {
+		assert(set->mapped == NULL);
+		assert(set->frozen == NULL);
+		assert(set->root_latch == NULL);
+		assert(set->hash_index == NULL);
+		assert(!set->lazy);
+
+		set->write_buffers = true; // The buffers are created when values are added to them.
+
+	} else if (!buffered && set->write_buffers) {
+		buffer_flush_tree(set);
+		node_free_buffers(set->root);
+		set->write_buffers = false;
+	}
+	return true;
+}
+
+// Adds value to the index ctx.
+static void index_insert_value(Pointer value, Pointer ctx) {
+	hash_index_insert(ctx, value);
+}
+
+void set_use_hash_index(Set set, HashFunc hash) {
+	assert(set->mapped == NULL);
+	assert(set->root_latch == NULL); // The index is not thread-safe.
+	assert(set->frozen == NULL);
+	assert(!set->write_buffers);
+	assert(!set->lazy);
+
+	if (set->hash_index != NULL) {
+		hash_index_destroy(set->hash_index);
+		set->hash_index = NULL;
+	}
+	if (hash == NULL)
+		return;
+
+	set->hash_index = hash_index_create(hash, set->compare, NULL); // The values are stored in the nodes, not the SetNodes.
+	set_visit_ctx(set, index_insert_value, set->hash_index);
+}
+
+// A SetNode moves with every insertion or removal in its leaf, so a cache of them would be invalidated all the time,
+// and the few top levels of the tree, which every search visits, are already in the CPU cache.
+bool set_use_find_cache(Set set, HashFunc hash, int slots) {
+	return false;
+}
+
+bool set_has_find_cache(Set set) {
+	return false;
+}
+
+// Appends value to the array that *ctx points to.
+static void value_append(Pointer value, Pointer ctx) {
+	Pointer** next = ctx;
+	*(*next)++ = value;
+}
+
+// Destroys the values of the subtree with root node that are marked as removed.
+static void node_destroy_removed(BTreeNode node, DestroyFunc destroy_value) {
+	if (node == NULL)
+		return;
+
+	for (int i = 0; i <= node->count; i++)
+		node_destroy_removed(node->children[i], destroy_value);
+	for (int i = 0; i < node->count; i++)
+		if (node_is_removed(node, i))
+			destroy_value(node->values[i]);
+}
+
+void set_use_lazy_removal(Set set, bool lazy) {
+	assert(set->mapped == NULL);
+	assert(set->frozen == NULL);
+	assert(set->root_latch == NULL);
+	assert(set->hash_index == NULL); // The marked values would remain in the index.
+	assert(!set->write_buffers);
+	assert(set->order <= MAX_LAZY_ORDER);
+
+	if (!lazy)
+		set_compact(set);
+	set->lazy = lazy;
+}
+
+// The marked values are destroyed, then the tree is rebuilt from the others with bulk loading, in O(n).
+void set_compact(Set set) {
+	if (set->removed == 0)
+		return;
+	STATS_ENTER(set);
+
+	Pointer* values = malloc(set->size * sizeof(Pointer));
+	Pointer* next = values;
+	set_visit_ctx(set, value_append, &next); // Only the values that are not marked.
+
+	if (set->destroy_value != NULL)
+		node_destroy_removed(set->root, set->destroy_value);
+	btree_destroy(set->root, NULL, set->pool);
+	set->root = node_create_from_sorted(values, set->size, set->order, set->pool, set->key, 1);
+	set->removed = 0;
+
+	free(values);
+}
+
+// The nodes are modified in place (and SetNodes point inside them), so they cannot be shared between trees. The
+// snapshot is a copy with the same order and key function, built from the sorted values in O(n).
+Set set_snapshot(Set set) {
+	assert(set->destroy_value == NULL); // The values are shared.
+	assert(set->root_latch == NULL);
+	assert(set->mapped == NULL);
+	assert(set->frozen == NULL);
+
+	Pointer* values = malloc(set->size * sizeof(Pointer));
+	Pointer* next = values;
+	set_visit_ctx(set, value_append, &next);
+
+	Set snapshot = set_create_with_order(set->compare, NULL, set->order);
+	snapshot->key = set->key;
+	STATS_ENTER(snapshot);
+	snapshot->root = node_create_from_sorted(values, set->size, snapshot->order, NULL, snapshot->key, 1);
+	snapshot->size = set->size;
+
+	free(values);
+	return snapshot;
+}
+
+bool set_save(Set set, const char* path, int value_size) {
+	assert(set->mapped == NULL);
+	assert(set->root_latch == NULL);
+	assert(set->frozen == NULL);
+#ifdef SET_INT_KEYS
+	value_size = sizeof(intptr_t); // The keys themselves are stored.
+#endif
+	assert(value_size > 0);
+	set_compact(set); // The file has no marks.
+
+	FILE* file = fopen(path, "wb");
+	if (file == NULL)
+		return false;
+
+	size_t page_size = mapped_page_size(set->order, value_size);
+	size_t slot = mapped_value_slot(value_size);
+	int nodes = node_count(set->root);
+	char* buffer = calloc(1, page_size);
+
+	MappedHeader* header = (MappedHeader*)buffer;
+	memcpy(header->magic, MAPPED_MAGIC, sizeof(header->magic));
+	header->int_keys = MAPPED_INT_KEYS;
+	header->order = set->order;
+	header->value_size = value_size;
+	header->page_size = page_size;
+	header->size = set->size;
+	header->root = nodes > 0 ? 1 : 0;
+	header->pages = nodes + 1;
+	bool ok = fwrite(buffer, page_size, 1, file) == 1;
+
+	// The nodes in breadth-first order, queue[i] is written to page i+1. The children of a node are added to the queue
+	// when it is written, so their pages, and the parent and position of each page, are known at that point.
+	BTreeNode* queue = malloc(nodes * sizeof(BTreeNode));
+	uint32_t* parents = malloc(nodes * sizeof(uint32_t));
+	int* positions = malloc(nodes * sizeof(int));
+	int tail = 0;
+	if (nodes > 0) {
+		queue[tail] = set->root;
+		parents[tail] = 0;
+		positions[tail++] = 0;
+	}
+
+	for (int head = 0; head < tail && ok; head++) {
+		BTreeNode node = queue[head];
+		memset(buffer, 0, page_size);
+
+		MappedPage* page = (MappedPage*)buffer;
+		page->count = node->count;
+		page->parent = parents[head];
+		page->parent_index = positions[head];
+
+		for (int i = 0; i <= node->count; i++) {
+			mapped_sizes(page, set->order)[i] = node->sizes[i];
+			if (!is_leaf(node)) {
+				mapped_children(page)[i] = tail + 1;
+				queue[tail] = node->children[i];
+				parents[tail] = head + 1;
+				positions[tail++] = i;
+			}
+		}
+
+		for (int i = 0; i < node->count; i++) {
+			char* value = mapped_values(page, set->order) + i * slot;
+#ifdef SET_INT_KEYS
+			*(intptr_t*)value = (intptr_t)node->values[i];
+#else
+			memcpy(value, node->values[i], value_size);
+#endif
+		}
+
+		ok = fwrite(buffer, page_size, 1, file) == 1;
+	}
+
+	ok = fclose(file) == 0 && ok;
+	free(buffer);
+	free(queue);
+	free(parents);
+	free(positions);
+	return ok;
+}
+
+Set set_open_mmap(const char* path, CompareFunc compare) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+
+	struct stat st;
+	MappedHeader* header = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(MappedHeader))
+		header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd); // The mapping remains valid without the file descriptor.
+	if (header == MAP_FAILED)
+		return NULL;
+
+	// Check that it is a file of set_save, from a build with the same SET_INT_KEYS, and that it is complete.
+	bool valid = memcmp(header->magic, MAPPED_MAGIC, sizeof(header->magic)) == 0
+		&& header->int_keys == MAPPED_INT_KEYS
+		&& header->order >= MIN_ORDER
+		&& header->value_size > 0
+		&& (size_t)header->page_size == mapped_page_size(header->order, header->value_size)
+		&& (off_t)header->pages * header->page_size == st.st_size
+		&& header->root < header->pages
+		&& (uintptr_t)header % node_alignment(header->order) == 0; // The pages must be aligned, see set_node_pack.
+	if (!valid) {
+		munmap(header, st.st_size);
+		return NULL;
+	}
+
+	Set set = set_create_with_order(compare, NULL, header->order);
+	set->mapped = header;
+	set->size = header->size;
+	return set;
+}
+
+// The values are copied in order to the array, then the nodes are freed (but not the values, which are now in the array).
+void set_freeze(Set set) {
+	assert(set->mapped == NULL);
+	assert(set->root_latch == NULL);
+	assert(!set->write_buffers);
+	assert(!set->lazy); // set_use_lazy_removal(set, false) destroys the marked values first.
+	if (set->frozen != NULL)
+		return;
+
+	Pointer* values = malloc(set->size * sizeof(Pointer));
+	Pointer* next = values;
+	set_visit_ctx(set, value_append, &next);
+	set->frozen = frozen_array_create(values, set->size);
+	free(values);
+
+	if (set->pool != NULL) { // All slabs at once.
+		pool_destroy(set->pool);
+		set->pool = NULL;
+	} else {
+		btree_destroy(set->root, NULL, NULL);
+	}
+	set->root = NULL;
+
+	if (set->hash_index != NULL) {
+		hash_index_destroy(set->hash_index);
+		set->hash_index = NULL;
+	}
+}
+
+void set_destroy(Set set) {
+	STATS_ENTER(set);
+	cleared_destroy(set);
+	if (set->mapped != NULL)
+		munmap(set->mapped, (size_t)set->mapped->pages * set->mapped->page_size); // There are no nodes.
+	if (set->frozen != NULL)
+		frozen_array_destroy(set->frozen, set->destroy_value); // Neither here.
+	set_use_concurrent_writes(set, false); // The nodes are freed directly, without latches.
+
+	// With a pool and no values to destroy, there is no need to visit the nodes, all slabs are freed at once (but
+	// not the write buffers).
+	if (set->pool == NULL || set->destroy_value != NULL || set->write_buffers)
+		btree_destroy(set->root, set->destroy_value, set->pool);
+
+	if (set->pool != NULL)
+		pool_destroy(set->pool);
+	if (set->hash_index != NULL)
+		hash_index_destroy(set->hash_index);
+
+#ifdef SET_STATS
+	current_stats = &unused_stats; // The stats of set are no longer valid.
+#endif
+	free(set);
+}
+
+// The tree is moved to cleared with its pool, and the set continues with a new pool (if it had one).
+void set_clear(Set set) {
+	assert(set->mapped == NULL);
+	assert(set->frozen == NULL);
+	assert(set->root_latch == NULL);
+	STATS_ENTER(set);
+	cleared_destroy(set);
+
+	if (set->root != NULL) {
+		set->cleared = set->root;
+		set->cleared->parent = NULL;
+		set->cleared_pool = set->pool;
+		set->cleared_destroy_value = set->destroy_value; // set_set_destroy_value may change it before the end.
+		if (set->pool != NULL)
+			set->pool = pool_create(node_alloc_size(set->order, set->key != NULL), node_alignment(set->order));
+
+		// With a pool and no values to destroy, all slabs are freed at once (but not the write buffers).
+		if (set->cleared_pool != NULL && set->destroy_value == NULL && !set->write_buffers) {
+			pool_destroy(set->cleared_pool);
+			set->cleared = NULL;
+			set->cleared_pool = NULL;
+		}
+	}
+	set->root = NULL;
+	set->size = 0;
+	set->buffered = 0;
+	set->removed = 0;
+
+	if (set->hash_index != NULL)
+		hash_index_clear(set->hash_index);
+}
+
+bool set_destroy_incremental(Set set, int budget) {
+	if (set->cleared != NULL)
+		budget = cleared_destroy_steps(set, budget);
+	else if (set->mapped == NULL && set->frozen == NULL && set->root != NULL) {
+		set_use_concurrent_writes(set, false); // The nodes are freed directly, without latches.
+		set_clear(set);
+		budget = cleared_destroy_steps(set, budget);
+	}
+
+	if (set->cleared != NULL)
+		return false;
+	set_destroy(set); // The tree is now empty, this takes O(number of slabs) (or unmaps the file).
+	return true;
+}
+
+SetNode set_find_node(Set set, Pointer value) {
+	STATS_ENTER(set);
+	STATS_ADD(lookups, 1);
+	if (set->frozen != NULL)
+		return frozen_pack(frozen_array_find(set->frozen, set->compare, value));
+	if (set->hash_index != NULL && !hash_index_contains(set->hash_index, value))
+		return SET_EOF; // The index has no positions, only the misses are answered without a search.
+
+	int index;
+	if (set->mapped != NULL) {
+		MappedPage* page = mapped_find(set, value, &index);
+		return page ? mapped_pack(page, index) : SET_EOF;
+	}
+	BTreeNode node = node_find(set->root, set->compare, value, &index);
+
+	return node && index != -1 && !node_is_removed(node, index) ? set_node_make(set, node, index) : SET_EOF;
+}
+
+SetNode set_lower_bound(Set set, Pointer value) {
+	STATS_ENTER(set);
+	STATS_ADD(lookups, 1);
+	if (set->frozen != NULL)
+		return frozen_pack(frozen_array_bound(set->frozen, set->compare, value, false));
+	int index;
+	if (set->mapped != NULL) {
+		MappedPage* page = mapped_find_bound(set, value, false, &index);
+		return page ? mapped_pack(page, index) : SET_EOF;
+	}
+	BTreeNode node = node_find_bound(set->root, set->compare, value, false, &index);
+
+	return node && node_skip_removed(&node, &index, true, set->compare) ? set_node_make(set, node, index) : SET_EOF;
+}
+
+SetNode set_upper_bound(Set set, Pointer value) {
+	STATS_ENTER(set);
+	STATS_ADD(lookups, 1);
+	if (set->frozen != NULL)
+		return frozen_pack(frozen_array_bound(set->frozen, set->compare, value, true));
+	int index;
+	if (set->mapped != NULL) {
+		MappedPage* page = mapped_find_bound(set, value, true, &index);
+		return page ? mapped_pack(page, index) : SET_EOF;
+	}
+	BTreeNode node = node_find_bound(set->root, set->compare, value, true, &index);
+
+	return node && node_skip_removed(&node, &index, true, set->compare) ? set_node_make(set, node, index) : SET_EOF;
+}
+
+int set_rank(Set set, Pointer value) {
+	STATS_ENTER(set);
+	STATS_ADD(lookups, 1);
+	if (set->frozen != NULL)
+		return frozen_array_rank(set->frozen, set->compare, value);
+	if (set->mapped != NULL)
+		return mapped_rank(set, value);
+	set_compact(set); // The sizes of the subtrees also count the values marked as removed.
+	return node_rank(set->root, set->compare, value);
+}
+
+SetNode set_select(Set set, int k) {
+	STATS_ENTER(set);
+	STATS_ADD(lookups, 1);
+	if (set->frozen != NULL)
+		return frozen_pack(frozen_array_select(set->frozen, k));
+	int index;
+	if (set->mapped != NULL) {
+		MappedPage* page = k >= 0 ? mapped_select(set, k, &index) : NULL;
+		return page ? mapped_pack(page, index) : SET_EOF;
+	}
+	set_compact(set); // As in set_rank.
+	BTreeNode node = k >= 0 ? node_select(set->root, k, &index) : NULL;
+
+	return node ? set_node_make(set, node, index) : SET_EOF;
+}
+
+// Returns the number of btree_nodes of the subtree with root node.
+static int node_count(BTreeNode node) {
+	if (node == NULL)
+		return 0;
+
+	int count = 1;
+	for (int i = 0; i <= node->count; i++)
+		count += node_count(node->children[i]);
+	return count;
+}
+
+#ifdef SET_STATS
+// Copies the counters of from, each with an atomic load (see STATS_ADD).
+static void stats_load(SetStats* to, SetStats* from) {
+	to->compares = __atomic_load_n(&from->compares, __ATOMIC_RELAXED);
+	to->lookups = __atomic_load_n(&from->lookups, __ATOMIC_RELAXED);
+	to->nodes_visited = __atomic_load_n(&from->nodes_visited, __ATOMIC_RELAXED);
+	to->rotations = __atomic_load_n(&from->rotations, __ATOMIC_RELAXED);
+	to->splits = __atomic_load_n(&from->splits, __ATOMIC_RELAXED);
+	to->merges = __atomic_load_n(&from->merges, __ATOMIC_RELAXED);
+	to->transfers = __atomic_load_n(&from->transfers, __ATOMIC_RELAXED);
+	to->allocations = __atomic_load_n(&from->allocations, __ATOMIC_RELAXED);
+	to->frees = __atomic_load_n(&from->frees, __ATOMIC_RELAXED);
+}
+#endif
+
+bool set_get_stats(Set set, SetStats* stats) {
+#ifdef SET_STATS
+	stats_load(stats, &set->stats);
+#else
+	memset(stats, 0, sizeof(*stats));
+#endif
+
+	// All leaves are at the same depth, so the height is the length of any path to a leaf.
+	stats->height = 0;
+	for (BTreeNode node = set->root; node != NULL; node = node->children[0])
+		stats->height++;
+	if (set->mapped != NULL)
+		for (uint32_t number = set->mapped->root; number != 0; number = mapped_children(mapped_page(set, number))[0])
+			stats->height++;
+
+	int nodes = set->mapped != NULL ? (int)set->mapped->pages - 1 : node_count(set->root);
+	stats->fill_factor = nodes > 0 ? (double)set->size / (nodes * MAX_VALUES(set->order)) : 0;
+	if (set->frozen != NULL) { // The array has no empty positions.
+		stats->height = frozen_array_height(set->frozen);
+		stats->fill_factor = set->size > 0 ? 1 : 0;
+	}
+
+#ifdef SET_STATS
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+void set_insert(Set set, Pointer value) {
+	assert(set->mapped == NULL); // Mapped sets are read-only.
+	assert(set->frozen == NULL);
+	STATS_ENTER(set);
+	STATS_ADD(lookups, 1);
+	if (set->root_latch != NULL) {
+		concurrent_insert(set, value);
+		return;
+	}
+	if (set->cleared != NULL)
+		cleared_destroy_steps(set, CLEAR_STEPS);
+	if (set->write_buffers && set->root != NULL && !is_leaf(set->root)) {
+		buffer_insert(set, value);
+		return;
+	}
+
+	bool inserted, revived;
+	Pointer old_value;
+
+	set->root = node_insert(set->root, set->compare, set->order, set->pool, set->key, value, &inserted, &revived, &old_value);
+	if (set->hash_index != NULL)
+		hash_index_insert(set->hash_index, value); // Replaces the old value, before it is destroyed.
+
+	// The size only changes if a new node is inserted. In updates we destroy the old value
+	if (inserted)
+		set->size++;
+	else if (set->destroy_value != NULL)
+		set->destroy_value(old_value);
+
+	if (revived) { // Lazy removal, the value is part of the set again.
+		set->size++;
+		set->removed--;
+	}
+}
+
+// Replaces the value at position index of node with value, destroying the old one (like set_insert for an existing value).
+static void replace_value(Set set, BTreeNode node, int index, Pointer value) {
+	Pointer old_value = node->values[index];
+	node_set_value(node, index, value);
+
+	if (set->destroy_value != NULL)
+		set->destroy_value(old_value);
+}
+
+// The leaf of the last insertion is kept as a "finger". While the next value is >= the previous one and < the separator
+// value that bounds the leaf from the right, it belongs to the same leaf, so it is added there directly, continuing
+// from the position of the previous value, without a new search from the root. The sizes of the ancestors are updated
+// once for all the values added to a leaf, when we leave it.
+
+int set_insert_many(Set set, Pointer* values, int n) {
+	assert(set->mapped == NULL);
+	assert(set->frozen == NULL);
+	STATS_ENTER(set);
+	set_compact(set); // With lazy removal, the marked values are destroyed first.
+	int old_size = set->size;
+
+	// The finger changes the leaves directly, with an index each value is added separately.
+	if (set->hash_index != NULL) {
+		for (int i = 0; i < n; i++)
+			set_insert(set, values[i]);
+		return set->size - old_size;
+	}
+
+	BTreeNode leaf = NULL; // The finger, NULL if a new search from the root is needed.
+	Pointer upper = NULL; // The separator value that bounds the leaf from the right, NULL if there is none.
+	int index = 0; // The position of the previous value in the leaf.
+	int added = 0; // Values added to the leaf, not yet counted in the sizes of its ancestors.
+
+	for (int i = 0; i < n; i++) {
+		Pointer value = values[i];
+
+		// Leave the leaf if the value does not belong to it.
+		if (leaf != NULL && ((upper != NULL && COMPARE(set->compare, value, upper) >= 0) || COMPARE(set->compare, value, values[i-1]) < 0)) {
+			node_add_to_ancestor_sizes(leaf, added);
+			leaf = NULL;
+		}
+
+		if (leaf == NULL) {
+			if (set->root == NULL) {
+				set_insert(set, value);
+				continue;
+			}
+
+			upper = NULL;
+			added = 0;
+			BTreeNode node = node_find_with_upper(set->root, set->compare, value, &index, &upper);
+
+			if (index != -1 && !is_leaf(node)) { // The value exists in an internal node
+				replace_value(set, node, index, value);
+				continue;
+			}
+
+			leaf = node;
+			if (index == -1)
+				index = 0;
+		}
+
+		// Find the position of the value in the leaf, after the previous value.
+		int compare_res = 1;
+		while (index < leaf->count && (compare_res = COMPARE(set->compare, value, leaf->values[index])) > 0)
+			index++;
+
+		if (index < leaf->count && compare_res == 0) { // The value already exists.
+			replace_value(set, leaf, index, value);
+			continue;
+		}
+
+		node_add_value(leaf, value, index);
+		added++;
+		set->size++;
+
+		if (leaf->count > MAX_VALUES(set->order)) { // The leaf needs to be split, the finger is no longer valid.
+			node_add_to_ancestor_sizes(leaf, added);
+			split(leaf, set->compare, set->order, set->pool);
+
+			if (set->root->parent != NULL) // A new root may have been created
+				set->root = set->root->parent;
+			leaf = NULL;
+		}
+	}
+
+	if (leaf != NULL)
+		node_add_to_ancestor_sizes(leaf, added);
+
+	return set->size - old_size;
+}
+
+// Same finger as set_insert_many. Values are removed from the leaf directly as long as it does not underflow, otherwise
+// (or for values in internal nodes) set_remove is used.
+
+int set_remove_many(Set set, Pointer* values, int n) {
+	assert(set->mapped == NULL);
+	assert(set->frozen == NULL);
+	STATS_ENTER(set);
+	set_compact(set); // With lazy removal, the marked values are destroyed first.
+	int old_size = set->size;
+
+	// The finger changes the leaves directly, with an index each value is removed separately.
+	if (set->hash_index != NULL) {
+		for (int i = 0; i < n; i++)
+			set_remove(set, values[i]);
+		return old_size - set->size;
+	}
+
+	BTreeNode leaf = NULL; // The finger, NULL if a new search from the root is needed.
+	Pointer upper = NULL; // The separator value that bounds the leaf from the right, NULL if there is none.
+	int index = 0; // The position after the previous value in the leaf.
+	int removed = 0; // Values removed from the leaf, not yet counted in the sizes of its ancestors.
+
+	for (int i = 0; i < n && set->root != NULL; i++) {
+		Pointer value = values[i];
+
+		// Leave the leaf if the value does not belong to it.
+		if (leaf != NULL && ((upper != NULL && COMPARE(set->compare, value, upper) >= 0) || COMPARE(set->compare, value, values[i-1]) < 0)) {
+			node_add_to_ancestor_sizes(leaf, -removed);
+			leaf = NULL;
+		}
+
+		if (leaf == NULL) {
+			upper = NULL;
+			removed = 0;
+			BTreeNode node = node_find_with_upper(set->root, set->compare, value, &index, &upper);
+
+			if (index != -1 && !is_leaf(node)) { // The value exists in an internal node
+				set_remove(set, value);
+				continue;
+			}
+
+			leaf = node;
+			if (index == -1)
+				index = 0;
+		}
+
+		// Find the position of the value in the leaf, after the previous value.
+		int compare_res = 1;
+		while (index < leaf->count && (compare_res = COMPARE(set->compare, value, leaf->values[index])) > 0)
+			index++;
+
+		if (index == leaf->count || compare_res != 0) // The value does not exist (it could only be in this leaf).
+			continue;
+
+		if (leaf->count > MIN_VALUES(set->order) || (leaf->parent == NULL && leaf->count > 1)) {
+			// The leaf does not underflow, remove the value directly.
+			if (set->destroy_value != NULL)
+				set->destroy_value(leaf->values[index]);
+
+			for (int j = index; j < leaf->count-1; j++) // Move all data 1 position to the left.
+				node_copy_value(leaf, j, leaf, j + 1);
+
+			leaf->count--;
+			removed++;
+			set->size--;
+
+		} else { // The tree needs to be reshaped, the finger is no longer valid.
+			node_add_to_ancestor_sizes(leaf, -removed);
+			leaf = NULL;
+			set_remove(set, value);
+		}
+	}
+
+	if (leaf != NULL)
+		node_add_to_ancestor_sizes(leaf, -removed);
+
+	return old_size - set->size;
+}
+
+SetNode set_previous(Set set, SetNode node) {
+	STATS_ENTER(set);
+	if (set->frozen != NULL)
+		return frozen_pack(frozen_array_previous(set->frozen, frozen_position(node)));
+	if (set->mapped != NULL) {
+		MappedPage* page = (MappedPage*)set_node_owner(set, node);
+		int index = set_node_index(set, node);
+		return mapped_find_previous(set, &page, &index) ? mapped_pack(page, index) : SET_BOF;
+	}
+
+	int index;
+	BTreeNode btree_node = set_node_locate(set, node, &index);
+
+	return node_find_previous(&btree_node, &index, set->compare) && node_skip_removed(&btree_node, &index, false, set->compare)
+		? set_node_make(set, btree_node, index) : SET_BOF;
+}
+
+SetNode set_next(Set set, SetNode node) {
+	STATS_ENTER(set);
+	if (set->frozen != NULL)
+		return frozen_pack(frozen_array_next(set->frozen, frozen_position(node)));
+	if (set->mapped != NULL) {
+		MappedPage* page = (MappedPage*)set_node_owner(set, node);
+		int index = set_node_index(set, node);
+		return mapped_find_next(set, &page, &index) ? mapped_pack(page, index) : SET_EOF;
+	}
+
+	int index;
+	BTreeNode btree_node = set_node_locate(set, node, &index);
+
+	return node_find_next(&btree_node, &index, set->compare) && node_skip_removed(&btree_node, &index, true, set->compare)
+		? set_node_make(set, btree_node, index) : SET_EOF;
+}
+
+Pointer set_node_value(Set set, SetNode node) {
+	if (set->frozen != NULL)
+		return frozen_array_value(set->frozen, frozen_position(node));
+	if (set->mapped != NULL)
+		return mapped_value(set, (MappedPage*)set_node_owner(set, node), set_node_index(set, node));
+	if (set->stable_nodes)
+		return (Pointer)node;
+	return set_node_owner(set, node)->values[set_node_index(set, node)];
+}
+
+DestroyFunc set_set_destroy_value(Set set, DestroyFunc destroy_value) {
+	DestroyFunc old = set->destroy_value;
+	set->destroy_value = destroy_value;
+	return old;
+}
 
 
 
@@ -685,21 +3143,39 @@ static bool is_valid_parent(BTreeNode node) {
 	return true;
 }
 
-static bool node_is_btree(BTreeNode node, CompareFunc compare) {
+// Check that the sizes kept for the children of the node are correct.
+static bool is_valid_sizes(BTreeNode node) {
+	if (node == NULL)
+		return true;
+
+	for (int i = 0; i <= node->count; i++)
+		if (node->sizes[i] != (is_leaf(node) ? 0 : node_total_size(node->children[i])))
+			return false;
+
+	return true;
+}
+
+static bool node_is_btree(BTreeNode node, CompareFunc compare, int order) {
 	if (node == NULL)
 		return true;
 
 	// The node has more values than it should have.
-	if (node->count > MAX_VALUES)
+	if (node->count > MAX_VALUES(order))
 		return false;
 
 	// The node *is not* the root and has fewer values than it should have.
-	if (node->parent != NULL && node->count < MIN_VALUES)
+	if (node->parent != NULL && node->count < MIN_VALUES(order))
 		return false;
 
 	// All values of the node are in the correct order.
 	for (int i = 0; i < node->count-1; i++) {
-		if (compare(node->set_nodes[i]->value, node->set_nodes[i+1]->value) >= 0)
+		if (compare(node->values[i], node->values[i+1]) >= 0)
+			return false;
+	}
+
+	// The stored keys are the keys of the values.
+	for (int i = 0; node->keys != NULL && i < node->count; i++) {
+		if (node->keys[i] != node->key(node->values[i]))
 			return false;
 	}
 
@@ -711,31 +3187,35 @@ static bool node_is_btree(BTreeNode node, CompareFunc compare) {
 	if (!is_valid_parent(node))
 		return false;
 
+	// Check the sizes of the subtrees of the children.
+	if (!is_valid_sizes(node))
+		return false;
+
 	// For all values of the node.
 	for (int i = 0; i < node->count; i++) {
 
-		SetNode left_max = node_find_max(node->children[i]); // Maximum left subtree child.
-		SetNode right_min = node_find_min(node->children[i+1]); // Minimum child of right subtree.
+		BTreeNode left_max = node_find_max(node->children[i]); // Maximum left subtree child.
+		BTreeNode right_min = node_find_min(node->children[i+1]); // Minimum child of right subtree.
 
 		Pointer left_last = (node->children[i] != NULL) // Largest left child element.
-			? node->children[i]->set_nodes[ node->children[i]->count-1 ]->value
+			? node->children[i]->values[ node->children[i]->count-1 ]
 			: NULL;
 
 		Pointer right_first = (node->children[i+1] != NULL) // Smallest element of right child.
-			? node->children[i+1]->set_nodes[0]->value 
+			? node->children[i+1]->values[0]
 			: NULL;
 
-		Pointer val = node->set_nodes[i]->value; // Value checked.
+		Pointer val = node->values[i]; // Value checked.
 
 		bool correct = 
 			(left_last == NULL || compare(left_last, val) < 0) && // Greater than the largest value of the left child.
 			(right_first == NULL || compare(right_first, val) > 0) && // Less than the smallest of the right child.
-			(left_max == NULL || compare(left_max->value, val) < 0) && // Greater than the maximum of the left subtree
-			(right_min == NULL || compare(right_min->value, val) > 0) && // Less than the minimum of the right subtree
-			node_is_btree(node->children[i], compare); // Check the left subtree as well.
+			(left_max == NULL || compare(left_max->values[left_max->count-1], val) < 0) && // Greater than the maximum of the left subtree
+			(right_min == NULL || compare(right_min->values[0], val) > 0) && // Less than the minimum of the right subtree
+			node_is_btree(node->children[i], compare, order); // Check the left subtree as well.
 
 		if (i == node->count-1) // If this is the last separator value, check the right subtree as well.
-			correct = correct && node_is_btree(node->children[node->count], compare);
+			correct = correct && node_is_btree(node->children[node->count], compare, order);
 
 		if (!correct)
 			return false;
@@ -745,7 +3225,7 @@ static bool node_is_btree(BTreeNode node, CompareFunc compare) {
 }
 
 bool set_is_proper(Set set) {
-	return node_is_btree(set->root, set->compare);;
+	return node_is_btree(set->root, set->compare, set->order);
 }
 
 // LCOV_EXCL_STOP
@@ -754,17 +3234,806 @@ bool set_is_proper(Set set) {
 
 //// Additional functions to be implemented in Lab 5
 
-void btree_set_visit(SetNode node, VisitFunc visit, int degree) {
-    if (node == NULL) return;
-    for (int i = 0; i < node->num_keys; i++) {
-        btree_set_visit(node->children[i], visit, degree); // visit child subtree
-        visit(node->keys[i]); // visit key
-    }
-    btree_set_visit(node->children[node->num_keys], visit, degree); // visit last child subtree
+// Visits in order all values of the subtree with root node, directly through the children and values tables
+// (no comparisons). The recursion depth is the height of the tree, which is O(log n).
+static void node_visit(BTreeNode node, VisitCtxFunc visit, Pointer ctx) {
+	if (node == NULL)
+		return;
+
+	for (int i = 0; i < node->count; i++) {
+		node_visit(node->children[i], visit, ctx); // visit child subtree
+		if (!node_is_removed(node, i))
+			visit(node->values[i], ctx); // visit value
+	}
+	node_visit(node->children[node->count], visit, ctx); // visit last child subtree
+}
+
+void set_visit_ctx(Set set, VisitCtxFunc visit, Pointer ctx) {
+	assert(set != NULL);
+	assert(visit != NULL);
+	if (set->frozen != NULL) {
+		for (int position = frozen_array_first(set->frozen); position != 0; position = frozen_array_next(set->frozen, position))
+			visit(frozen_array_value(set->frozen, position), ctx);
+		return;
+	}
+	if (set->mapped != NULL) {
+		if (set->mapped->root != 0)
+			mapped_visit(set, mapped_find_edge(set, mapped_page(set, set->mapped->root), false), 0, false, NULL, visit, ctx);
+		return;
+	}
+	node_visit(set->root, visit, ctx);
+}
+
+// Adapts a VisitFunc (passed through ctx) to a VisitCtxFunc
+static void visit_without_ctx(Pointer value, Pointer ctx) {
+	VisitFunc* visit = ctx;
+	(*visit)(value);
 }
 
 void set_visit(Set set, VisitFunc visit) {
-    assert(set != NULL);;
-    assert(visit != NULL);;
-    btree_set_visit(set->root, visit, set->degree);;
+	assert(visit != NULL);
+	set_visit_ctx(set, visit_without_ctx, &visit);
+}
+
+// O(log n) to find the lower bound of lo, then the k values in range are visited with node_find_next.
+void set_visit_range_ctx(Set set, Pointer lo, Pointer hi, VisitCtxFunc visit, Pointer ctx) {
+	assert(set != NULL);
+	assert(visit != NULL);
+	STATS_ENTER(set);
+	if (set->frozen != NULL) {
+		for (int position = frozen_array_bound(set->frozen, set->compare, lo, false);
+			 position != 0 && COMPARE(set->compare, frozen_array_value(set->frozen, position), hi) < 0;
+			 position = frozen_array_next(set->frozen, position))
+			visit(frozen_array_value(set->frozen, position), ctx);
+		return;
+	}
+
+	int index = 0;
+	if (set->mapped != NULL) {
+		MappedPage* page = mapped_find_bound(set, lo, false, &index);
+		mapped_visit(set, page, index, true, hi, visit, ctx);
+		return;
+	}
+	BTreeNode node = node_find_bound(set->root, set->compare, lo, false, &index);
+	if (node == NULL)
+		return;
+
+	do {
+		if (COMPARE(set->compare, node->values[index], hi) >= 0)
+			break;
+		if (!node_is_removed(node, index))
+			visit(node->values[index], ctx);
+	} while (node_find_next(&node, &index, set->compare));
+}
+
+void set_visit_range(Set set, Pointer lo, Pointer hi, VisitFunc visit) {
+	assert(visit != NULL);
+	set_visit_range_ctx(set, lo, hi, visit_without_ctx, &visit);
+}
+
+// Visits in order the values of the subtree with root node with rank (position in the subtree) in [lo, hi). Only the
+// children that contain such ranks are entered, so O(log n + hi - lo), no comparisons.
+static void node_visit_ranks(BTreeNode node, int lo, int hi, VisitCtxFunc visit, Pointer ctx) {
+	if (node == NULL)
+		return;
+
+	// lo and hi are kept relative to the start of child i (then of value i).
+	for (int i = 0; i <= node->count && hi > 0; i++) {
+		if (lo < node->sizes[i])
+			node_visit_ranks(node->children[i], lo, hi, visit, ctx);
+		lo -= node->sizes[i];
+		hi -= node->sizes[i];
+
+		if (i < node->count) {
+			if (lo <= 0 && hi > 0)
+				visit(node->values[i], ctx);
+			lo--;
+			hi--;
+		}
+	}
+}
+
+// set_visit_parallel(_ordered): the parts are ranges of ranks of (almost) equal size.
+typedef struct {
+	Set set;
+	VisitCtxFunc visit;
+	Pointer* ctxs; // the ctx of each part, NULL if all parts use ctx
+	Pointer ctx;
+	int parts;
+} ParallelVisit;
+
+static void visit_part(int part, Pointer arg) {
+	ParallelVisit* parallel = arg;
+	int lo = (long)parallel->set->size * part / parallel->parts;
+	int hi = (long)parallel->set->size * (part + 1) / parallel->parts;
+
+	node_visit_ranks(parallel->set->root, lo, hi, parallel->visit, parallel->ctxs != NULL ? parallel->ctxs[part] : parallel->ctx);
+}
+
+// The sizes are not updated by concurrent writes, the mode must be disabled.
+void set_visit_parallel(Set set, VisitCtxFunc visit, Pointer ctx, int nthreads) {
+	assert(visit != NULL);
+	assert(nthreads >= 1);
+	assert(set->root_latch == NULL);
+	assert(set->mapped == NULL);
+	assert(set->frozen == NULL);
+	set_compact(set); // The parts are found by the sizes of the subtrees, which also count the marked values.
+
+	int parts = nthreads * PARALLEL_TASKS_PER_THREAD;
+	if (parts > set->size)
+		parts = set->size;
+
+	ParallelVisit parallel = { .set = set, .visit = visit, .ctxs = NULL, .ctx = ctx, .parts = parts };
+	run_tasks(parts, nthreads, visit_part, &parallel);
+}
+
+void set_visit_parallel_ordered(Set set, VisitCtxFunc visit, Pointer* ctxs, int parts, int nthreads) {
+	assert(visit != NULL);
+	assert(nthreads >= 1);
+	assert(set->root_latch == NULL);
+	assert(set->mapped == NULL);
+	assert(set->frozen == NULL);
+	set_compact(set); // As in set_visit_parallel.
+
+	ParallelVisit parallel = { .set = set, .visit = visit, .ctxs = ctxs, .ctx = NULL, .parts = parts };
+	run_tasks(parts, nthreads, visit_part, &parallel);
+}
+
+
+/* =================================== set algebra ========================================= */
+
+// Returns a new array with the values of set in order (set->size of them).
+static Pointer* set_values(Set set) {
+	Pointer* values = malloc(set->size * sizeof(Pointer));
+	Pointer* next = values;
+	set_visit_ctx(set, value_append, &next);
+	return values;
+}
+
+// Which values values_merge keeps: those only in a, those in both (the one of a), those only in b.
+typedef enum { KEEP_A = 1, KEEP_BOTH = 2, KEEP_B = 4 } MergeKeep;
+
+// Merges the sorted arrays a and b in a single pass, stores the kept values (see MergeKeep) in out, in order, and
+// returns how many they are.
+static int values_merge(Pointer* a, int na, Pointer* b, int nb, CompareFunc compare, int keep, Pointer* out) {
+	int count = 0, i = 0, j = 0;
+	while (i < na && j < nb) {
+		int compare_res = COMPARE(compare, a[i], b[j]);
+		if (compare_res < 0) {
+			if (keep & KEEP_A)
+				out[count++] = a[i];
+			i++;
+		} else if (compare_res > 0) {
+			if (keep & KEEP_B)
+				out[count++] = b[j];
+			j++;
+		} else {
+			if (keep & KEEP_BOTH)
+				out[count++] = a[i];
+			i++;
+			j++;
+		}
+	}
+	if (keep & KEEP_A)
+		while (i < na)
+			out[count++] = a[i++];
+	if (keep & KEEP_B)
+		while (j < nb)
+			out[count++] = b[j++];
+	return count;
+}
+
+// Returns true if a batch of n operations on a tree of the given size is large enough that a single pass over the
+// whole tree (O(size + n)) is cheaper than n separate operations (O(n log size)).
+static bool batch_is_large(int size, int n) {
+	int height = 0;
+	for (int s = size; s > 0; s /= 2)
+		height++;
+
+	return (long)n * height >= size;
+}
+
+// Returns a new set with the n sorted values, with the order and key function of set (and no destroy_value, the
+// values are shared), built as in set_snapshot.
+static Set set_create_like(Set set, Pointer* values, int n) {
+	Set result = set_create_with_order(set->compare, NULL, set->order);
+	result->key = set->key;
+	STATS_ENTER(result);
+	result->root = node_create_from_sorted(values, n, result->order, NULL, result->key, 1);
+	result->size = n;
+	return result;
+}
+
+// Stores in out (in order) the values of set that are (present == true) or are not in other, and returns how many
+// they are. If set is much smaller than other, each value is searched in other (O(n log m)), otherwise the two
+// sequences are merged (O(n + m)).
+static int values_filter(Set set, Set other, bool present, Pointer* out) {
+	Pointer* values = set_values(set);
+	int count = 0;
+
+	if (!batch_is_large(other->size, set->size)) {
+		for (int i = 0; i < set->size; i++)
+			if ((set_find_node(other, values[i]) != SET_EOF) == present)
+				out[count++] = values[i];
+	} else {
+		Pointer* other_values = set_values(other);
+		STATS_ENTER(set);
+		count = values_merge(values, set->size, other_values, other->size, set->compare, present ? KEEP_BOTH : KEEP_A, out);
+		free(other_values);
+	}
+
+	free(values);
+	return count;
+}
+
+Set set_union(Set a, Set b) {
+	assert(a->compare == b->compare);
+	STATS_ENTER(a);
+
+	Pointer* a_values = set_values(a);
+	Pointer* b_values = set_values(b);
+	Pointer* values = malloc((a->size + b->size) * sizeof(Pointer));
+	int count = values_merge(a_values, a->size, b_values, b->size, a->compare, KEEP_A | KEEP_BOTH | KEEP_B, values);
+
+	Set result = set_create_like(a, values, count);
+	free(a_values);
+	free(b_values);
+	free(values);
+	return result;
+}
+
+Set set_intersection(Set a, Set b) {
+	assert(a->compare == b->compare);
+
+	Pointer* values = malloc(a->size * sizeof(Pointer));
+	int count = values_filter(a, b, true, values);
+	Set result = set_create_like(a, values, count);
+	free(values);
+	return result;
+}
+
+Set set_difference(Set a, Set b) {
+	assert(a->compare == b->compare);
+
+	Pointer* values = malloc(a->size * sizeof(Pointer));
+	int count = values_filter(a, b, false, values);
+	Set result = set_create_like(a, values, count);
+	free(values);
+	return result;
+}
+
+bool set_is_subset(Set a, Set b) {
+	assert(a->compare == b->compare);
+	if (a->size > b->size)
+		return false;
+
+	Pointer* values = malloc(a->size * sizeof(Pointer));
+	int count = values_filter(a, b, false, values);
+	free(values);
+	return count == 0;
+}
+
+// Removes the values (of set itself) with a single batch operation. They are destroyed at the end, since
+// set_remove_many still compares them with the following values after removing them.
+// With lazy removal set_remove_many would only mark them, so it is turned off while removing (the values that
+// are already marked are destroyed first by set_compact).
+static void values_remove(Set set, Pointer* values, int count) {
+	bool lazy = set->lazy;
+	if (lazy)
+		set_use_lazy_removal(set, false);
+
+	DestroyFunc destroy_value = set_set_destroy_value(set, NULL);
+	set_remove_many(set, values, count);
+	set_set_destroy_value(set, destroy_value);
+	set->lazy = lazy;
+
+	if (destroy_value != NULL)
+		for (int i = 0; i < count; i++)
+			destroy_value(values[i]);
+}
+
+// The in-place versions compute the values to add (or remove) as above, then change set with a single batch operation.
+void set_union_in_place(Set set, Set other) {
+	assert(set->compare == other->compare);
+	assert(set->mapped == NULL);
+	assert(set->frozen == NULL);
+
+	Pointer* values = malloc(other->size * sizeof(Pointer));
+	int count = values_filter(other, set, false, values);
+	set_insert_many(set, values, count);
+	free(values);
+}
+
+void set_intersection_in_place(Set set, Set other) {
+	assert(set->compare == other->compare);
+	assert(set->mapped == NULL);
+	assert(set->frozen == NULL);
+
+	Pointer* values = malloc(set->size * sizeof(Pointer));
+	int count = values_filter(set, other, false, values);
+	values_remove(set, values, count);
+	free(values);
+}
+
+void set_difference_in_place(Set set, Set other) {
+	assert(set->compare == other->compare);
+	assert(set->mapped == NULL);
+	assert(set->frozen == NULL);
+
+	Pointer* values = malloc(set->size * sizeof(Pointer));
+	int count = values_filter(set, other, true, values);
+	values_remove(set, values, count);
+	free(values);
+}
+
+
+/* ================================== split / join ========================================= */
+
+// Returns the height of the tree with root node (0 if it is empty): all leaves are at the same depth.
+static int btree_height(BTreeNode node) {
+	int height = 0;
+	for (; node != NULL; node = node->children[0])
+		height++;
+	return height;
+}
+
+// Returns the root of the tree that contains node.
+static BTreeNode btree_root(BTreeNode node) {
+	while (node->parent != NULL)
+		node = node->parent;
+	return node;
+}
+
+// Fills node, which was just attached as the first or last child of its parent, from its sibling one value at a time
+// until it has MIN_VALUES, or merges it with the sibling (which then cannot overflow) if the sibling has no value
+// to spare. The same choices as repair_underflow, which repairs a node that lacks a single value.
+static void repair_join(BTreeNode node, int order, NodePool pool) {
+	while (node->count < MIN_VALUES(order)) {
+		BTreeNode left_sibling = get_left_sibling(node);
+		BTreeNode right_sibling = get_right_sibling(node);
+
+		if (right_sibling != NULL && right_sibling->count > MIN_VALUES(order))
+			transfer_left(node, right_sibling);
+		else if (left_sibling != NULL && left_sibling->count > MIN_VALUES(order))
+			tranfer_right(node, left_sibling);
+		else {
+			if (left_sibling != NULL)
+				merge(left_sibling, node, order, pool);
+			else
+				merge(node, right_sibling, order, pool);
+			return;
+		}
+	}
+}
+
+// Joins the trees left and right (of heights left_height and right_height, their roots have no parent) with the value
+// sep between them: all values of left are < sep < all values of right. The lower tree becomes the last (or first)
+// child of the node of the higher tree at the level above it, with sep as the separator value, and is then repaired
+// (repair_join) and the node split if it overflowed, as after an insertion. Returns the root of the joined tree.
+// Complexity O((|left_height - right_height| + 1) * order^2).
+static BTreeNode btree_join(BTreeNode left, int left_height, Pointer sep, BTreeNode right, int right_height, CompareFunc compare, int order, NodePool pool, KeyFunc key) {
+	BTreeNode node;
+	if (left == NULL && right == NULL) {
+		node = node_create(order, pool, key);
+		node_add_value(node, sep, 0);
+		return node;
+
+	} else if (right == NULL) { // sep is the largest value, it is added to the last leaf.
+		node = node_find_max(left);
+		node_add_value(node, sep, node->count);
+		node_add_to_ancestor_sizes(node, 1);
+
+	} else if (left == NULL) { // sep is the smallest value, it is added to the first leaf.
+		node = node_find_min(right);
+		node_add_value(node, sep, 0);
+		node_add_to_ancestor_sizes(node, 1);
+
+	} else if (left_height > right_height) {
+		node = left;
+		for (int height = left_height; height > right_height + 1; height--)
+			node = node->children[node->count];
+
+		// The child first, node_add_child needs the count without sep.
+		int right_size = node_total_size(right);
+		node_add_child(node, right, right_size, node->count + 1);
+		node_add_value(node, sep, node->count);
+		node_add_to_ancestor_sizes(node, 1 + right_size);
+		repair_join(right, order, pool);
+
+	} else if (left_height < right_height) {
+		node = right;
+		for (int height = right_height; height > left_height + 1; height--)
+			node = node->children[0];
+
+		int left_size = node_total_size(left);
+		node_add_child(node, left, left_size, 0);
+		node_add_value(node, sep, 0);
+		node_add_to_ancestor_sizes(node, 1 + left_size);
+		repair_join(left, order, pool);
+
+	} else { // Same height, a new root with the 2 trees as children.
+		node = node_create(order, pool, key);
+		node_add_value(node, sep, 0);
+		node_add_child(node, left, node_total_size(left), 0);
+		node_add_child(node, right, node_total_size(right), 1);
+
+		repair_join(left, order, pool);
+		if (node->count > 0) // Not merged.
+			repair_join(right, order, pool);
+
+		if (node->count == 0) { // The 2 trees were merged in left.
+			left->parent = NULL;
+			node_free(node, pool);
+			return left;
+		}
+		return node;
+	}
+
+	if (node->count > MAX_VALUES(order))
+		split(node, compare, order, pool);
+	return btree_root(node);
+}
+
+// Splits the tree with root node (of height height) in the trees *left with the values < pivot and *right with the
+// values >= pivot. If pivot belongs to child i of node, the values and children of node before it and the left part
+// of child i are joined (btree_join) in *left, the right part of child i and the values and children after it in
+// *right. The heights of the joined trees grow along the path, so the joins take O(order^2 log n) in total.
+static void btree_split(BTreeNode node, int height, CompareFunc compare, int order, NodePool pool, KeyFunc key, Pointer pivot, BTreeNode* left, BTreeNode* right) {
+	STATS_ADD(nodes_visited, 1);
+	bool equal;
+	int i = node_search(node, compare, pivot, &equal); // values[0 ... i-1] < pivot <= values[i ... count-1]
+
+	// The values and children after i move to a new node, node keeps the ones before it.
+	BTreeNode after = node_create(order, pool, key);
+	for (int j = i; j < node->count; j++)
+		node_copy_value(after, j - i, node, j);
+	after->count = node->count - i;
+	node->count = i;
+
+	if (is_leaf(node)) {
+		*left = node;
+		*right = after;
+		if (node->count == 0) {
+			node_free(node, pool);
+			*left = NULL;
+		}
+		if (after->count == 0) {
+			node_free(after, pool);
+			*right = NULL;
+		}
+		return;
+	}
+
+	for (int j = i + 1; j <= i + after->count; j++) {
+		after->children[j - i - 1] = node->children[j];
+		after->sizes[j - i - 1] = node->sizes[j];
+		node->children[j]->parent = after;
+	}
+	BTreeNode child = node->children[i];
+	child->parent = NULL;
+
+	BTreeNode child_left, child_right;
+	btree_split(child, height - 1, compare, order, pool, key, pivot, &child_left, &child_right);
+
+	// The left part: children 0 ... i-1 of node with values[0 ... i-2] between them, values[i-1], the left part of child.
+	if (i == 0) {
+		*left = child_left;
+		node_free(node, pool);
+	} else {
+		Pointer sep = node->values[i-1];
+		BTreeNode before = node;
+		int before_height = height;
+		if (--node->count == 0) { // A single child remains.
+			before = node->children[0];
+			before->parent = NULL;
+			before_height = height - 1;
+			node_free(node, pool);
+		}
+		*left = btree_join(before, before_height, sep, child_left, btree_height(child_left), compare, order, pool, key);
+	}
+
+	// The right part: the right part of child, after->values[0], children i+1 ... count of node with the values
+	// between them.
+	if (after->count == 0) {
+		*right = child_right;
+		node_free(after, pool);
+	} else {
+		Pointer sep = after->values[0];
+		for (int j = 0; j < after->count - 1; j++)
+			node_copy_value(after, j, after, j + 1);
+		BTreeNode rest = after;
+		int rest_height = height;
+		if (--after->count == 0) { // A single child remains.
+			rest = after->children[0];
+			rest->parent = NULL;
+			rest_height = height - 1;
+			node_free(after, pool);
+		}
+		*right = btree_join(child_right, btree_height(child_right), sep, rest, rest_height, compare, order, pool, key);
+	}
+}
+
+// The nodes on the path of pivot are split, the rest move to *left and *right along with the subtrees that contain them.
+void set_split(Set set, Pointer pivot, Set* left, Set* right) {
+	assert(set->root_latch == NULL);
+	assert(set->mapped == NULL);
+	assert(set->frozen == NULL);
+	assert(set->hash_index == NULL);
+	assert(set->pool == NULL); // The nodes of the pool cannot move to another set.
+	STATS_ENTER(set);
+	set_compact(set); // With lazy removal, the marked values are destroyed first.
+
+	Set right_set = set_create_with_order(set->compare, set->destroy_value, set->order);
+	right_set->key = set->key;
+
+	BTreeNode left_root = NULL, right_root = NULL;
+	if (set->root != NULL)
+		btree_split(set->root, btree_height(set->root), set->compare, set->order, NULL, set->key, pivot, &left_root, &right_root);
+
+	set->root = left_root;
+	set->size = node_total_size(left_root);
+	right_set->root = right_root;
+	right_set->size = node_total_size(right_root);
+
+	*left = set;
+	*right = right_set;
+}
+
+// The smallest value of right is removed, and becomes the separator value that joins the two trees.
+Set set_join(Set left, Set right) {
+	set_compact(left); // With lazy removal, the marked values are destroyed first.
+	set_compact(right);
+	assert(left->compare == right->compare);
+	assert(left->order == right->order && left->key == right->key);
+	assert(left->root_latch == NULL && right->root_latch == NULL);
+	assert(left->mapped == NULL && right->mapped == NULL);
+	assert(left->frozen == NULL && right->frozen == NULL);
+	assert(left->hash_index == NULL && right->hash_index == NULL);
+	assert(left->pool == NULL && right->pool == NULL);
+	assert(left->root == NULL || right->root == NULL || left->compare(node_find_max(left->root)->values[node_find_max(left->root)->count-1], node_find_min(right->root)->values[0]) < 0);
+	STATS_ENTER(left);
+
+	if (left->root == NULL) {
+		left->root = right->root;
+	} else if (right->root != NULL) {
+		Pointer sep = node_find_min(right->root)->values[0];
+		bool removed;
+		Pointer old_value;
+		BTreeNode right_root = node_remove(right->root, right->compare, right->order, NULL, sep, &removed, &old_value);
+		left->root = btree_join(left->root, btree_height(left->root), sep, right_root, btree_height(right_root), left->compare, left->order, NULL, left->key);
+	}
+	left->size += right->size;
+
+	right->root = NULL; // The nodes now belong to left.
+	right->size = 0;
+	set_destroy(right);
+	return left;
+}
+
+
+/* ===================================== cursors =========================================== */
+
+struct set_cursor {
+	Set set;
+	BTreeNode node; // The position is the value index of node, node is NULL at SET_EOF.
+	int index;
+};
+
+// Finger search: returns the lowest ancestor of node (or node itself) whose subtree contains value or the position
+// where it would be added, so that node_find / node_find_bound can search from there instead of the root. If the
+// smallest value >= value is not in that subtree, it is the separator value *upper_index of *upper, otherwise *upper
+// is NULL.
+//
+// The values of the subtree of a node are between the separator values of its parent on either side of it. So we
+// climb only while value is beyond the values of the node and beyond the separator value on the side of value.
+static BTreeNode node_find_start(BTreeNode node, CompareFunc compare, Pointer value, BTreeNode* upper, int* upper_index) {
+	*upper = NULL;
+	while (node->parent != NULL) {
+		STATS_ADD(nodes_visited, 1);
+		bool after = COMPARE(compare, value, node->values[node->count-1]) > 0;
+		if (!after && COMPARE(compare, value, node->values[0]) >= 0)
+			return node; // value is between the values of node.
+
+		BTreeNode parent = node->parent;
+		int child = get_child_index(node);
+		if (after && child < parent->count) {
+			int compare_res = COMPARE(compare, value, parent->values[child]);
+			if (compare_res == 0)
+				return parent; // value is the separator value itself.
+			if (compare_res < 0) {
+				*upper = parent;
+				*upper_index = child;
+				return node;
+			}
+		} else if (!after && child > 0 && COMPARE(compare, value, parent->values[child-1]) > 0) {
+			return node;
+		}
+		node = parent;
+	}
+	return node;
+}
+
+// Moves the cursor to the position of set_node.
+static void cursor_move(SetCursor cursor, SetNode set_node) {
+	cursor->node = set_node != SET_EOF ? set_node_locate(cursor->set, set_node, &cursor->index) : NULL;
+}
+
+// Moves the cursor past the values marked as removed (see set_use_lazy_removal), to the next values.
+static void cursor_skip_removed(SetCursor cursor) {
+	if (cursor->node != NULL && !node_skip_removed(&cursor->node, &cursor->index, true, cursor->set->compare))
+		cursor->node = NULL;
+}
+
+SetCursor set_cursor_create(Set set) {
+	assert(set->mapped == NULL);
+	assert(set->root_latch == NULL);
+	assert(set->frozen == NULL);
+
+	SetCursor cursor = malloc(sizeof(*cursor));
+	cursor->set = set;
+	cursor->node = node_find_min(set->root);
+	cursor->index = 0;
+	cursor_skip_removed(cursor);
+	return cursor;
+}
+
+SetNode set_cursor_node(SetCursor cursor) {
+	return cursor->node != NULL ? set_node_make(cursor->set, cursor->node, cursor->index) : SET_EOF;
+}
+
+bool set_cursor_seek(SetCursor cursor, Pointer value) {
+	Set set = cursor->set;
+	STATS_ENTER(set);
+	STATS_ADD(lookups, 1);
+	if (set->root == NULL) {
+		cursor->node = NULL;
+		return false;
+	}
+
+	BTreeNode upper = NULL;
+	int upper_index = 0;
+	BTreeNode start = cursor->node != NULL ? node_find_start(cursor->node, set->compare, value, &upper, &upper_index) : set->root;
+
+	cursor->node = node_find_bound(start, set->compare, value, false, &cursor->index);
+	if (cursor->node == NULL && upper != NULL) {
+		cursor->node = upper;
+		cursor->index = upper_index;
+	}
+	cursor_skip_removed(cursor); // A marked value is not found, the cursor moves to the next one.
+	return cursor->node != NULL && COMPARE(set->compare, value, cursor->node->values[cursor->index]) == 0;
+}
+
+// Moves the cursor to the next value if next, otherwise to the previous one. The cursor moves from its own position,
+// so that also with stable SetNodes (see set_use_stable_nodes) the value is not searched again.
+static void cursor_step(SetCursor cursor, bool next) {
+	Set set = cursor->set;
+	STATS_ENTER(set);
+	if (cursor->node == NULL) {
+		cursor_move(cursor, next ? set_first(set) : set_last(set));
+		return;
+	}
+
+	bool found = next ? node_find_next(&cursor->node, &cursor->index, set->compare)
+		: node_find_previous(&cursor->node, &cursor->index, set->compare);
+	if (!found || !node_skip_removed(&cursor->node, &cursor->index, next, set->compare))
+		cursor->node = NULL;
+}
+
+SetNode set_cursor_next(SetCursor cursor) {
+	cursor_step(cursor, true);
+	return set_cursor_node(cursor);
+}
+
+SetNode set_cursor_previous(SetCursor cursor) {
+	cursor_step(cursor, false);
+	return set_cursor_node(cursor);
+}
+
+void set_cursor_insert(SetCursor cursor, Pointer value) {
+	Set set = cursor->set;
+	if (set->root == NULL) {
+		set_insert(set, value);
+		set_cursor_seek(cursor, value);
+		return;
+	}
+
+	STATS_ENTER(set);
+	STATS_ADD(lookups, 1);
+	BTreeNode upper; // Not needed, node_find returns the leaf where value would be added.
+	int upper_index, index = -1;
+	BTreeNode start = cursor->node != NULL ? node_find_start(cursor->node, set->compare, value, &upper, &upper_index) : set->root;
+	BTreeNode node = node_find(start, set->compare, value, &index);
+	if (set->hash_index != NULL)
+		hash_index_insert(set->hash_index, value); // Replaces the old value, before it is destroyed.
+
+	if (index != -1) { // The value already exists.
+		if (node_is_removed(node, index)) { // Lazy removal, the value is part of the set again.
+			set->size++;
+			set->removed--;
+		}
+		replace_value(set, node, index, value); // Also clears the mark.
+
+	} else {
+		bool equal;
+		index = node_search(node, set->compare, value, &equal);
+		node_add_value(node, value, index);
+		node_add_to_ancestor_sizes(node, 1);
+		set->size++;
+
+		if (node->count > MAX_VALUES(set->order)) {
+			split(node, set->compare, set->order, set->pool);
+			if (set->root->parent != NULL) // A new root may have been created
+				set->root = set->root->parent;
+
+			// The value may have moved to the new sibling or to the parent, which are next to node.
+			cursor->node = node;
+			set_cursor_seek(cursor, value);
+			return;
+		}
+	}
+	cursor->node = node;
+	cursor->index = index;
+}
+
+// While the leaf does not underflow the value is removed directly, as in set_remove_many, otherwise with set_remove,
+// and then the next value is found again from the root.
+void set_cursor_remove(SetCursor cursor) {
+	assert(cursor->node != NULL);
+
+	Set set = cursor->set;
+	STATS_ENTER(set);
+	BTreeNode node = cursor->node;
+	int index = cursor->index;
+	Pointer value = node->values[index];
+	assert(!node_is_removed(node, index));
+
+	BTreeNode next = node;
+	int next_index = index;
+	bool has_next = node_find_next(&next, &next_index, set->compare);
+
+	if (set->lazy) {
+		// Marked as in lazy_remove, but without compacting, which would invalidate the cursor.
+		node->removed |= (uint64_t)1 << index;
+		set->size--;
+		set->removed++;
+
+		cursor->node = has_next ? next : NULL;
+		cursor->index = next_index;
+		cursor_skip_removed(cursor);
+		return;
+	}
+
+	if (is_leaf(node) && (node->count > MIN_VALUES(set->order) || (node->parent == NULL && node->count > 1))) {
+		if (set->hash_index != NULL)
+			hash_index_remove(set->hash_index, value);
+
+		for (int i = index; i < node->count-1; i++) // Move all data 1 position to the left.
+			node_copy_value(node, i, node, i + 1);
+		node->count--;
+		node_add_to_ancestor_sizes(node, -1);
+		set->size--;
+
+		if (set->destroy_value != NULL)
+			set->destroy_value(value);
+
+		// The next value is either the one that took the position of value, or in an ancestor that did not change.
+		if (!has_next)
+			cursor->node = NULL;
+		else if (next != node) {
+			cursor->node = next;
+			cursor->index = next_index;
+		}
+
+	} else {
+		Pointer next_value = has_next ? next->values[next_index] : NULL;
+		set_remove(set, value);
+
+		cursor->node = NULL;
+		if (has_next)
+			set_cursor_seek(cursor, next_value);
+	}
+}
+
+void set_cursor_destroy(SetCursor cursor) {
+	free(cursor);
 }
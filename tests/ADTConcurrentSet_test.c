@@ -0,0 +1,326 @@
+//////////////////////////////////////////////////////////////////
+//
+// Unit tests for the ADT ConcurrentSet.
+// They run with any implementation of ADTSet.h (chosen at link
+// time, see Makefile).
+//
+//////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "acutest.h"			// Simple library for unit testing
+
+#include "ADTConcurrentSet.h"
+
+
+// The values are items with a key; a replaced value is a different item with the same key. The destroy_value of
+// the tests counts the destroyed items, in the item itself (to check that it is destroyed exactly once) or in total.
+
+typedef struct {
+	int key;
+	atomic_int destroyed;
+} Item;
+
+static int compare_items(Pointer a, Pointer b) {
+	int x = ((Item*)a)->key, y = ((Item*)b)->key;
+	return (x > y) - (x < y);
+}
+
+static Item* create_item(int key) {
+	Item* item = malloc(sizeof(Item));
+	item->key = key;
+	atomic_init(&item->destroyed, 0);
+	return item;
+}
+
+static atomic_int destroyed_items;
+
+static void destroy_item(Pointer value) {
+	atomic_fetch_add(&destroyed_items, 1);
+	free(value);
+}
+
+// For the items of a pool, which remain allocated until the end of the test
+
+static void mark_destroyed(Pointer value) {
+	atomic_fetch_add(&((Item*)value)->destroyed, 1);
+	atomic_fetch_add(&destroyed_items, 1);
+}
+
+
+void test_create(void) {
+	ConcurrentSet cset = concurrent_set_create(compare_items, destroy_item);
+	TEST_ASSERT(cset != NULL);
+	TEST_ASSERT(concurrent_set_size(cset) == 0);
+
+	Set set = concurrent_set_read_begin(cset);
+	TEST_ASSERT(set_first(set) == SET_EOF);
+	concurrent_set_read_end(cset);
+
+	concurrent_set_destroy(cset);
+}
+
+void test_insert_remove(void) {
+	atomic_store(&destroyed_items, 0);
+	ConcurrentSet cset = concurrent_set_create(compare_items, destroy_item);
+	for (int i = 0; i < 100; i++)
+		concurrent_set_insert(cset, create_item(i));
+	TEST_ASSERT(concurrent_set_size(cset) == 100);
+
+	// An update replaces the value and destroys the old one
+	Item key = { .key = 10 };
+	Item* item = create_item(10);
+	concurrent_set_insert(cset, item);
+	TEST_ASSERT(concurrent_set_find(cset, &key) == item);
+	TEST_ASSERT(concurrent_set_size(cset) == 100);
+	TEST_ASSERT(atomic_load(&destroyed_items) == 1);
+
+	for (int i = 0; i < 100; i += 2) {
+		key.key = i;
+		TEST_ASSERT(concurrent_set_remove(cset, &key));
+	}
+	TEST_ASSERT(!concurrent_set_remove(cset, &key));
+	TEST_ASSERT(concurrent_set_size(cset) == 50);
+	TEST_ASSERT(atomic_load(&destroyed_items) == 51);
+
+	// A read section sees the values in order
+	Set set = concurrent_set_read_begin(cset);
+	int i = 1;
+	for (SetNode node = set_first(set); node != SET_EOF; node = set_next(set, node), i += 2)
+		TEST_ASSERT(((Item*)set_node_value(set, node))->key == i);
+	TEST_ASSERT(i == 101);
+	concurrent_set_read_end(cset);
+
+	concurrent_set_destroy(cset);
+	TEST_ASSERT(atomic_load(&destroyed_items) == 101);
+}
+
+
+// Several readers and writers use the set at the same time. The keys 3k are always in the set (the writers only
+// replace their values), the keys 3k+1 never, and the keys 3k+2 are inserted and removed by the writers. Each writer
+// has its own keys (key % WRITERS), so the final state is known from the last operation of each writer on each key.
+// Since the threads cannot use TEST_ASSERT, the readers count the errors they find.
+
+#define KEYS 300
+#define WRITERS 4
+#define READERS 4
+#define OPS 2000
+
+typedef struct {
+	ConcurrentSet cset;
+	int writer;
+	Item* pool; // The items of the writer (if NULL they are allocated).
+	bool present[KEYS]; // Whether each key 3k+2 of the writer is in the set at the end.
+	int destroyed; // Number of values that the writer replaced or removed.
+} WriterArgs;
+
+typedef struct {
+	ConcurrentSet cset;
+	atomic_bool* done;
+	bool check_destroyed; // The values are items of a pool, marked when they are destroyed.
+	atomic_int sections; // Number of read sections of the reader.
+	int errors;
+} ReaderArgs;
+
+static Item* new_item(WriterArgs* args, int op, int key) {
+	if (args->pool == NULL)
+		return create_item(key);
+
+	Item* item = &args->pool[op];
+	item->key = key;
+	return item;
+}
+
+static void* writer(void* arg) {
+	WriterArgs* args = arg;
+	unsigned int seed = args->writer;
+
+	for (int op = 0; op < OPS; op++) {
+		int key = (rand_r(&seed) % (KEYS / WRITERS)) * WRITERS + args->writer;
+		if (key % 3 == 1)
+			continue;
+
+		if (key % 3 == 0 || rand_r(&seed) % 2 == 0) {
+			bool update = key % 3 == 0 || args->present[key];
+			concurrent_set_insert(args->cset, new_item(args, op, key));
+			args->present[key] = true;
+			args->destroyed += update;
+		} else {
+			Item item = { .key = key };
+			bool removed = concurrent_set_remove(args->cset, &item);
+			if (removed != args->present[key])
+				abort(); // The writer is the only one that changes this key.
+			args->present[key] = false;
+			args->destroyed += removed;
+		}
+		sched_yield(); // So that the readers run between the writes, also with few cores.
+	}
+	return NULL;
+}
+
+// Whether the presence of key is wrong, for the keys that are always or never in the set
+
+static bool wrong_presence(int key, bool found) {
+	return key % 3 == 0 ? !found : key % 3 == 1 ? found : false;
+}
+
+static bool item_alive(ReaderArgs* args, Item* item) {
+	return !args->check_destroyed || atomic_load(&item->destroyed) == 0;
+}
+
+static void* reader(void* arg) {
+	ReaderArgs* args = arg;
+	unsigned int seed = 0;
+
+	while (!atomic_load(args->done)) {
+		Set set = concurrent_set_read_begin(args->cset);
+
+		// The values are in order, and their number is the size of the set
+		int count = 0, previous = -1;
+		for (SetNode node = set_first(set); node != SET_EOF; node = set_next(set, node), count++) {
+			Item* item = set_node_value(set, node);
+			if (item->key <= previous || item->key % 3 == 1 || !item_alive(args, item))
+				args->errors++;
+			previous = item->key;
+		}
+		if (count != set_size(set))
+			args->errors++;
+
+		// Within the section each key is consistently present or absent
+		for (int key = 0; key < KEYS; key++) {
+			Item item = { .key = key };
+			Item* found = set_find(set, &item);
+			SetNode node = set_find_node(set, &item);
+			if ((found != NULL) != (node != SET_EOF) || wrong_presence(key, found != NULL))
+				args->errors++;
+			if (found != NULL && (found != set_node_value(set, node) || !item_alive(args, found)))
+				args->errors++;
+		}
+		concurrent_set_read_end(args->cset);
+		atomic_fetch_add(&args->sections, 1);
+
+		// And without a read section
+		Item item = { .key = rand_r(&seed) % KEYS };
+		if (wrong_presence(item.key, concurrent_set_find(args->cset, &item) != NULL))
+			args->errors++;
+		sched_yield(); // And the writers between the read sections.
+	}
+	return NULL;
+}
+
+// Runs the writers and readers on a set with the keys 3k, and checks the final contents. Returns the total number of
+// values that the writers replaced or removed.
+
+static int run_threads(ConcurrentSet cset, Item* pool, bool check_destroyed) {
+	for (int key = 0; key < KEYS; key += 3) {
+		Item* item = pool != NULL ? &pool[key / 3] : create_item(key);
+		item->key = key;
+		concurrent_set_insert(cset, item);
+	}
+
+	atomic_bool done;
+	atomic_init(&done, false);
+	pthread_t readers[READERS], writers[WRITERS];
+	ReaderArgs reader_args[READERS];
+	WriterArgs* writer_args = calloc(WRITERS, sizeof(WriterArgs));
+
+	for (int t = 0; t < READERS; t++) {
+		reader_args[t] = (ReaderArgs){ .cset = cset, .done = &done, .check_destroyed = check_destroyed };
+		pthread_create(&readers[t], NULL, reader, &reader_args[t]);
+	}
+
+	// The writers start when all readers are reading
+	for (int t = 0; t < READERS; t++)
+		while (atomic_load(&reader_args[t].sections) == 0)
+			sched_yield();
+	for (int t = 0; t < WRITERS; t++) {
+		writer_args[t].cset = cset;
+		writer_args[t].writer = t;
+		writer_args[t].pool = pool != NULL ? &pool[KEYS + t*OPS] : NULL;
+		pthread_create(&writers[t], NULL, writer, &writer_args[t]);
+	}
+
+	for (int t = 0; t < WRITERS; t++)
+		pthread_join(writers[t], NULL);
+	atomic_store(&done, true);
+	for (int t = 0; t < READERS; t++) {
+		pthread_join(readers[t], NULL);
+		TEST_ASSERT_(reader_args[t].errors == 0, "reader %d found %d errors", t, reader_args[t].errors);
+	}
+
+	// The final contents are the keys 3k and the keys 3k+2 that the last operation of their writer inserted
+	int destroyed = 0, size = 0;
+	Set set = concurrent_set_read_begin(cset);
+	for (int key = 0; key < KEYS; key++) {
+		bool expected = key % 3 == 0 || (key % 3 == 2 && writer_args[key % WRITERS].present[key]);
+		Item item = { .key = key };
+		TEST_ASSERT((set_find(set, &item) != NULL) == expected);
+		size += expected;
+	}
+	TEST_ASSERT(set_size(set) == size);
+	concurrent_set_read_end(cset);
+	TEST_ASSERT(concurrent_set_size(cset) == size);
+
+	for (int t = 0; t < WRITERS; t++)
+		destroyed += writer_args[t].destroyed;
+	free(writer_args);
+	return destroyed;
+}
+
+// With destroy_value == free, a value that is destroyed while a reader can still access it (or twice) is found by
+// ASan or valgrind.
+
+void test_threads(void) {
+	atomic_store(&destroyed_items, 0);
+	ConcurrentSet cset = concurrent_set_create(compare_items, destroy_item);
+	int destroyed = run_threads(cset, NULL, false);
+	TEST_ASSERT(atomic_load(&destroyed_items) == destroyed);
+
+	int size = concurrent_set_size(cset);
+	concurrent_set_destroy(cset);
+	TEST_ASSERT(atomic_load(&destroyed_items) == destroyed + size);
+}
+
+// The values are items of a pool, so each destroyed item can still be checked: the readers never see a destroyed
+// item, and each replaced or removed item is destroyed exactly once.
+
+void test_threads_destroy_once(void) {
+	atomic_store(&destroyed_items, 0);
+	Item* pool = calloc(KEYS + WRITERS*OPS, sizeof(Item));
+	ConcurrentSet cset = concurrent_set_create(compare_items, mark_destroyed);
+	int destroyed = run_threads(cset, pool, true);
+	TEST_ASSERT(atomic_load(&destroyed_items) == destroyed);
+
+	// The items still in the set are not destroyed, the others at most once
+	Set set = concurrent_set_read_begin(cset);
+	for (int i = 0; i < KEYS + WRITERS*OPS; i++) {
+		Item* item = &pool[i];
+		int count = atomic_load(&item->destroyed);
+		TEST_ASSERT(count <= 1);
+		if (set_find(set, item) == item)
+			TEST_ASSERT(count == 0);
+	}
+	concurrent_set_read_end(cset);
+
+	// concurrent_set_destroy destroys the rest, so all used items are destroyed exactly once
+	int size = concurrent_set_size(cset);
+	concurrent_set_destroy(cset);
+	TEST_ASSERT(atomic_load(&destroyed_items) == destroyed + size);
+	for (int i = 0; i < KEYS + WRITERS*OPS; i++)
+		TEST_ASSERT(atomic_load(&pool[i].destroyed) <= 1);
+	free(pool);
+}
+
+
+// List of all tests to be executed
+TEST_LIST = {
+	{ "concurrent_set_create", test_create },
+	{ "concurrent_set_insert_remove", test_insert_remove },
+	{ "concurrent_set_threads", test_threads },
+	{ "concurrent_set_threads_destroy_once", test_threads_destroy_once },
+
+	{ NULL, NULL } // end of the list
+};
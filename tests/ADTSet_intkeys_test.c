@@ -0,0 +1,171 @@
+//////////////////////////////////////////////////////////////////
+//
+// Unit tests for the ADT Set with integer keys.
+// They run with any implementation of ADTSet.h compiled with
+// -DSET_INT_KEYS (see Makefile, *.intkeys.o).
+//
+//////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "acutest.h"			// Simple library for unit testing
+
+#include "ADTSet.h"
+
+
+// The values are the keys themselves (see SET_INT_KEYS in ADTSet.h), and the compare argument of set_create is ignored
+
+#define VALUE(key) ((Pointer)(intptr_t)(key))
+#define KEY(value) ((int)(intptr_t)(value))
+
+#define N 1000
+
+// Fills array with a random permutation of first ... first + n-1
+
+static void shuffle(int* array, int n, int first) {
+	for (int i = 0; i < n; i++)
+		array[i] = first + i;
+	for (int i = n-1; i > 0; i--) {
+		int j = rand() % (i+1);
+		int temp = array[i];
+		array[i] = array[j];
+		array[j] = temp;
+	}
+}
+
+// Checks that set contains exactly the n keys of the sorted array expected, in order, in both directions
+
+static void check_contents(Set set, int* expected, int n) {
+	TEST_ASSERT(set_size(set) == n);
+
+	int i = 0;
+	for (SetNode node = set_first(set); node != SET_EOF; node = set_next(set, node), i++)
+		TEST_ASSERT(i < n && KEY(set_node_value(set, node)) == expected[i]);
+	TEST_ASSERT(i == n);
+
+	for (SetNode node = set_last(set); node != SET_BOF; node = set_previous(set, node))
+		TEST_ASSERT(KEY(set_node_value(set, node)) == expected[--i]);
+	TEST_ASSERT(i == 0);
+}
+
+
+// The keys -N/2 ... N/2-1 are ordered as integers, including the negative ones and the key 0
+
+void test_insert_remove(void) {
+	Set set = set_create(NULL, NULL);
+	int order[N], expected[N];
+	shuffle(order, N, -N/2);
+	for (int i = 0; i < N; i++)
+		set_insert(set, VALUE(order[i]));
+	set_insert(set, VALUE(order[0])); // already in the set
+	TEST_ASSERT(set_size(set) == N);
+
+	for (int i = 0; i < N; i++)
+		expected[i] = i - N/2;
+	check_contents(set, expected, N);
+
+	// set_find returns NULL for the key 0, set_find_node finds it
+	for (int key = -N/2; key < N/2; key++) {
+		TEST_ASSERT(set_find(set, VALUE(key)) == VALUE(key));
+		SetNode node = set_find_node(set, VALUE(key));
+		TEST_ASSERT(node != SET_EOF && KEY(set_node_value(set, node)) == key);
+	}
+	TEST_ASSERT(set_find(set, VALUE(N)) == NULL);
+	TEST_ASSERT(set_find_node(set, VALUE(N)) == SET_EOF);
+
+	// Remove the even keys
+	int count = 0;
+	for (int i = 0; i < N; i++)
+		if (order[i] % 2 == 0)
+			TEST_ASSERT(set_remove(set, VALUE(order[i])));
+	for (int key = -N/2; key < N/2; key++)
+		if (key % 2 != 0)
+			expected[count++] = key;
+	TEST_ASSERT(!set_remove(set, VALUE(0)));
+	TEST_ASSERT(set_find_node(set, VALUE(0)) == SET_EOF);
+	check_contents(set, expected, count);
+
+	// The key 0 returns
+	set_insert(set, VALUE(0));
+	TEST_ASSERT(set_find_node(set, VALUE(0)) != SET_EOF);
+	TEST_ASSERT(set_size(set) == count + 1);
+
+	set_destroy(set);
+}
+
+// The keys 0, 2, ..., 2(N-1): the bounds and the rank of the missing odd keys
+
+void test_bounds_rank(void) {
+	Set set = set_create(NULL, NULL);
+	for (int i = 0; i < N; i++)
+		set_insert(set, VALUE(2 * i));
+
+	TEST_ASSERT(KEY(set_node_value(set, set_lower_bound(set, VALUE(0)))) == 0);
+	TEST_ASSERT(KEY(set_node_value(set, set_lower_bound(set, VALUE(-1)))) == 0);
+	TEST_ASSERT(KEY(set_node_value(set, set_upper_bound(set, VALUE(0)))) == 2);
+	TEST_ASSERT(set_rank(set, VALUE(0)) == 0);
+
+	for (int i = 0; i < N; i++) {
+		int key = 2 * i;
+		TEST_ASSERT(set_rank(set, VALUE(key)) == i);
+		TEST_ASSERT(set_rank(set, VALUE(key + 1)) == i + 1);
+		TEST_ASSERT(KEY(set_node_value(set, set_select(set, i))) == key);
+
+		SetNode lower = set_lower_bound(set, VALUE(key + 1));
+		SetNode upper = set_upper_bound(set, VALUE(key));
+		TEST_ASSERT(lower == upper);
+		TEST_ASSERT(i == N-1 ? lower == SET_EOF : KEY(set_node_value(set, lower)) == key + 2);
+	}
+	TEST_ASSERT(set_select(set, N) == SET_EOF);
+
+	set_destroy(set);
+}
+
+// set_save stores the keys themselves, so the mapped set contains the same keys (only UsingBTree has on-disk sets)
+
+#define SAVE_PATH "ADTSet_intkeys_test.set"
+
+void test_save_open_mmap(void) {
+	Set set = set_create(NULL, NULL);
+	int expected[N];
+	for (int i = 0; i < N; i++) {
+		expected[i] = 2 * i;
+		set_insert(set, VALUE(2 * i));
+	}
+
+	bool saved = set_save(set, SAVE_PATH, 0); // value_size is ignored
+	set_destroy(set);
+	Set mapped = set_open_mmap(SAVE_PATH, NULL);
+	if (!saved) {
+		TEST_ASSERT(mapped == NULL);
+		return;
+	}
+	TEST_ASSERT(mapped != NULL);
+
+	check_contents(mapped, expected, N);
+	TEST_ASSERT(set_find(mapped, VALUE(0)) == NULL);
+	TEST_ASSERT(set_find_node(mapped, VALUE(0)) != SET_EOF);
+	for (int i = 0; i < N; i++) {
+		int key = 2 * i;
+		TEST_ASSERT(i == 0 || set_find(mapped, VALUE(key)) == VALUE(key));
+		TEST_ASSERT(set_find_node(mapped, VALUE(key + 1)) == SET_EOF);
+		TEST_ASSERT(set_rank(mapped, VALUE(key + 1)) == i + 1);
+		TEST_ASSERT(KEY(set_node_value(mapped, set_select(mapped, i))) == key);
+		SetNode bound = set_lower_bound(mapped, VALUE(key + 1));
+		TEST_ASSERT(i == N-1 ? bound == SET_EOF : KEY(set_node_value(mapped, bound)) == key + 2);
+	}
+	set_destroy(mapped);
+	remove(SAVE_PATH);
+}
+
+
+// List of all tests to be executed
+TEST_LIST = {
+	{ "set_insert_remove", test_insert_remove },
+	{ "set_bounds_rank", test_bounds_rank },
+	{ "set_save_open_mmap", test_save_open_mmap },
+
+	{ NULL, NULL } // end of the list
+};
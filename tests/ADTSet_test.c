@@ -1,372 +1,1343 @@
-///////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////
 //
-// Implementation of the ADT Set via Binary Search Tree (BST)
+// Unit tests for the ADT Set.
+// Any implementation of ADTSet.h should pass these tests (the
+// implementation is chosen at link time, see Makefile).
 //
-///////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////
 
+#include <stdio.h>
 #include <stdlib.h>
-#include <assert.h>
+#include <pthread.h>
 
-#include "ADTSet.h"
+#include "acutest.h"			// Simple library for unit testing
 
+#include "ADTSet.h"
 
-// We implement the ADT Set via BST, so the struct set is a Binary Search Tree.
-struct set {
-	SetNode root; // the root, NULL if it's an empty tree
-	int size; // size, so that set_size is O(1)
-	CompareFunc compare; // the layout
-	DestroyFunc destroy_value; // function that destroys an element of the set
-};
 
-// While the struct set_node is a node of a Binary Search Tree
-struct set_node {
-	SetNode left, right; // Children
-	Pointer value;
-};
+// The values of most tests are pointers to the elements of an int array, so that the sets need no destroy_value.
 
+static int compare_ints(Pointer a, Pointer b) {
+	int x = *(int*)a, y = *(int*)b;
+	return (x > y) - (x < y);
+}
 
-// Remarks about node_* functions
-// - they are helper (hidden from the user) and implement various functions on BST nodes.
-// - they are recursive, recursion is generally very helpful in trees.
-// - those functions that _modify_ the tree, essentially act on the _subtree_ rooted at the node node, and return the new
-// root of the subtree after modification. The new root is used from the previous recursive call.
-//
-// The set_* functions (later in the file), implement the ADT Set functions, and are simple, calling the corresponding node_*.
+// Allocates an int with the given value, for the tests with destroy_value == free
 
+static int* create_int(int value) {
+	int* pointer = malloc(sizeof(int));
+	*pointer = value;
+	return pointer;
+}
 
-// Creates and returns a node with value value (no children)
+// Fills array with a random permutation of 0 ... n-1
 
-static SetNode node_create(Pointer value) {
-	SetNode node = malloc(sizeof(*node));
-	node->left = NULL;
-	node->right = NULL;
-	node->value = value;
-	return node;
+static void shuffle(int* array, int n) {
+	for (int i = 0; i < n; i++)
+		array[i] = i;
+	for (int i = n-1; i > 0; i--) {
+		int j = rand() % (i+1);
+		int temp = array[i];
+		array[i] = array[j];
+		array[j] = temp;
+	}
 }
 
-// Returns the node with value equal to value in the subtree rooted at node, otherwise NULL
+// Checks that set contains exactly the n values of the sorted array expected, in order, in both directions
 
-static SetNode node_find_equal(SetNode node, CompareFunc compare, Pointer value) {
-	// empty subtree, no value exists
-	if (node == NULL)
-		return NULL;
-	
-	// where the node we are looking for is located depends on the order of the value
-	// value relative to the value of the current node (node->value)
-	//
-	int compare_res = compare(value, node->value); // save to avoid calling compare twice
-	if (compare_res == 0) // value equivalent to node->value, we found the node
-		return node;
-	else if (compare_res < 0) // value < node->value, the node we are looking for is in the left subtree
-		return node_find_equal(node->left, compare, value);
-	else // value > node->value, the node we are looking for is in the right subtree
-		return node_find_equal(node->right, compare, value);
-}
+static void check_contents(Set set, int* expected, int n) {
+	TEST_ASSERT(set_size(set) == n);
 
-// Returns the smallest node of the subtree with root node
+	int i = 0;
+	for (SetNode node = set_first(set); node != SET_EOF; node = set_next(set, node), i++)
+		TEST_ASSERT(i < n && *(int*)set_node_value(set, node) == expected[i]);
+	TEST_ASSERT(i == n);
 
-static SetNode node_find_min(SetNode node) {
-	return node != NULL && node->left != NULL
-		? node_find_min(node->left) // There is a left subtree, the smallest value is there
-		: node; // Otherwise the smallest value is in the node itself
+	for (SetNode node = set_last(set); node != SET_BOF; node = set_previous(set, node))
+		TEST_ASSERT(*(int*)set_node_value(set, node) == expected[--i]);
+	TEST_ASSERT(i == 0);
 }
 
-// Returns the largest node of the subtree rooted at node
 
-static SetNode node_find_max(SetNode node) {
-	return node != NULL && node->right != NULL
-		? node_find_max(node->right) // There is a right subtree, the largest value is there
-		: node; // Otherwise the largest value is in the node itself
+#define N 1000
+
+void test_create(void) {
+	Set set = set_create(compare_ints, NULL);
+	TEST_ASSERT(set != NULL);
+	TEST_ASSERT(set_size(set) == 0);
+	TEST_ASSERT(set_first(set) == SET_EOF);
+	TEST_ASSERT(set_last(set) == SET_BOF);
+	set_destroy(set);
 }
 
-// Returns the previous (in order) of the target node in the subtree rooted at node,
-// or NULL if target is the smaller of the subnode. The subtree must contain the node
-// target, so it cannot be empty.
+void test_insert_remove(void) {
+	Set set = set_create(compare_ints, free);
+	int order[N];
+	shuffle(order, N);
+	for (int i = 0; i < N; i++)
+		set_insert(set, create_int(order[i]));
+	TEST_ASSERT(set_size(set) == N);
+
+	// An equivalent value replaces (and destroys) the old one
+	int* value = create_int(order[0]);
+	set_insert(set, value);
+	TEST_ASSERT(set_size(set) == N);
+	TEST_ASSERT(set_find(set, &order[0]) == value);
+
+	int expected[N];
+	for (int i = 0; i < N; i++)
+		expected[i] = i;
+	check_contents(set, expected, N);
+
+	// Remove the even values, in random order
+	for (int i = 0; i < N; i++)
+		if (order[i] % 2 == 0)
+			TEST_ASSERT(set_remove(set, &order[i]));
+	int missing = 0;
+	TEST_ASSERT(!set_remove(set, &missing));
+
+	for (int i = 0; i < N/2; i++)
+		expected[i] = 2*i + 1;
+	check_contents(set, expected, N/2);
+
+	for (int i = 0; i < N; i++) {
+		Pointer found = set_find(set, &i);
+		TEST_ASSERT(i % 2 == 0 ? found == NULL : *(int*)found == i);
+		TEST_ASSERT((set_find_node(set, &i) != SET_EOF) == (i % 2 != 0));
+	}
+	set_destroy(set);
+}
 
-static SetNode node_find_previous(SetNode node, CompareFunc compare, SetNode target) {
-	if (node == target) {
-		// target is the root of the subtree, the previous is the largest of the left subtree.
-		// (If there is no left child, then the node with value is the smaller of the subtree, so
-		// node_find_max will return NULL as we want.)
-		return node_find_max(node->left);
+// set_create_with_order: the B-tree with various orders, the BST and AVL ignore it
+
+void test_create_with_order(void) {
+	int values[N], order[N], expected[N];
+	for (int i = 0; i < N; i++)
+		values[i] = expected[i] = i;
+
+	int orders[] = { 3, 4, 5, 16, 64, 255 };
+	for (int o = 0; o < (int)(sizeof(orders) / sizeof(orders[0])); o++) {
+		Set set = set_create_with_order(compare_ints, NULL, orders[o]);
+		shuffle(order, N);
+		for (int i = 0; i < N; i++)
+			set_insert(set, &values[order[i]]);
+		check_contents(set, expected, N);
+
+		shuffle(order, N);
+		for (int i = 0; i < N; i++) {
+			TEST_ASSERT(set_remove(set, &values[order[i]]));
+			TEST_ASSERT(set_find(set, &values[order[i]]) == NULL);
+		}
+		TEST_ASSERT(set_size(set) == 0);
+		set_destroy(set);
+	}
+}
 
-	} else if (compare(target->value, node->value) < 0) {
-		// The target is in the left subtree, so its predecessor is there too.
-		return node_find_previous(node->left, compare, target);
+// set_lower_bound / set_upper_bound and the range visits, on the even values 0 ... 2N-2
 
-	} else {
-		// The target is in the right subtree, its previous may also be there,
-		// if not its previous is the node itself.
-		SetNode res = node_find_previous(node->right, compare, target);
-		return res != NULL ? res : node?
-	}
+static void visit_sum(Pointer value, Pointer ctx) {
+	*(long*)ctx += *(int*)value;
 }
 
-// Returns the next (in order) node of the target node in the subtree rooted at node,
-// or NULL if target is the largest of the subtree. The subtree must contain the node
-// target, so it cannot be empty.
+static long range_sum;
 
-static SetNode node_find_next(SetNode node, CompareFunc compare, SetNode target) {
-	if (node == target) {
-		// target is the root of the subtree, its next is the smaller of the right subtree.
-		// (If there is no right child, then the node with value is the largest of the subtree, so
-		// node_find_min will return NULL as we want.)
-		return node_find_min(node->right);
+static void visit_range_sum(Pointer value) {
+	range_sum += *(int*)value;
+}
 
-	} else if (compare(target->value, node->value) > 0) {
-		// The target is in the right subtree, so its next one is there.
-		return node_find_next(node->right, compare, target);
+void test_bounds(void) {
+	int values[N], order[N];
+	Set set = set_create(compare_ints, NULL);
+	shuffle(order, N);
+	for (int i = 0; i < N; i++) {
+		values[order[i]] = 2 * order[i];
+		set_insert(set, &values[order[i]]);
+	}
 
-	} else {
-		// The target is in the left subtree, its next one may also be there,
-		// if not its next is the node itself.
-		SetNode res = node_find_next(node->left, compare, target);
-		return res != NULL ? res : node?
+	for (int key = -1; key <= 2*N; key++) {
+		// the smallest value >= key (> key), SET_EOF after the last one
+		int lower = key < 0 ? 0 : (key + 1) / 2 * 2;
+		int upper = key < 0 ? 0 : key / 2 * 2 + 2;
+		SetNode node = set_lower_bound(set, &key);
+		TEST_ASSERT(lower >= 2*N ? node == SET_EOF : *(int*)set_node_value(set, node) == lower);
+		node = set_upper_bound(set, &key);
+		TEST_ASSERT(upper >= 2*N ? node == SET_EOF : *(int*)set_node_value(set, node) == upper);
 	}
+	set_destroy(set);
 }
 
-// If there is a node with a value equivalent to value, it changes its value to value, otherwise it adds
-// new node with value value. Returns the new root of the subtree, and sets *inserted to true
-// if an addition was made, or false if an update was made.
+void test_visit_range(void) {
+	int values[N];
+	for (int i = 0; i < N; i++)
+		values[i] = 2 * i;
+	Set set = set_create(compare_ints, NULL);
+	for (int i = 0; i < N; i++)
+		set_insert(set, &values[i]);
+
+	for (int test = 0; test < 100; test++) {
+		int lo = rand() % (2*N + 2) - 1, hi = rand() % (2*N + 2) - 1;
+		long expected = 0;
+		for (int i = 0; i < N; i++)
+			if (lo <= values[i] && values[i] < hi)
+				expected += values[i];
+
+		long sum = 0;
+		set_visit_range_ctx(set, &lo, &hi, visit_sum, &sum);
+		TEST_ASSERT(sum == expected);
+
+		range_sum = 0;
+		set_visit_range(set, &lo, &hi, visit_range_sum);
+		TEST_ASSERT(range_sum == expected);
+	}
+	set_destroy(set);
+}
+
+void test_rank_select(void) {
+	int values[N], order[N];
+	for (int i = 0; i < N; i++)
+		values[i] = 2 * i;
+	Set set = set_create(compare_ints, NULL);
+	shuffle(order, N);
+	for (int i = 0; i < N; i++)
+		set_insert(set, &values[order[i]]);
+
+	for (int k = 0; k < N; k++) {
+		TEST_ASSERT(*(int*)set_node_value(set, set_select(set, k)) == 2*k);
+		TEST_ASSERT(set_rank(set, &values[k]) == k);
+		int missing = 2*k + 1; // between values[k] and values[k+1]
+		TEST_ASSERT(set_rank(set, &missing) == k + 1);
+	}
+	TEST_ASSERT(set_select(set, -1) == SET_EOF);
+	TEST_ASSERT(set_select(set, N) == SET_EOF);
+
+	// The sizes of the subtrees follow the removals
+	for (int i = 0; i < N; i += 2)
+		set_remove(set, &values[i]);
+	for (int k = 0; k < N/2; k++) {
+		TEST_ASSERT(*(int*)set_node_value(set, set_select(set, k)) == 4*k + 2);
+		TEST_ASSERT(set_rank(set, &values[2*k + 1]) == k);
+	}
+	set_destroy(set);
+}
 
-static SetNode node_insert(SetNode node, CompareFunc compare, Pointer value, bool* inserted, Pointer* old_value) {
-	// If the subtree is empty, create a new node which becomes the root of the subtree
-	if (node == NULL) {
-		*inserted = true; // we have inserted
-		return node_create(value);
+void test_create_from_sorted(void) {
+	int values[N];
+	Pointer sorted[N];
+	for (int i = 0; i < N; i++) {
+		values[i] = i;
+		sorted[i] = &values[i];
 	}
 
-	// where the addition is made depends on the order of the value
-	// value relative to the value of the current node (node->value)
-	//
-	int compare_res = compare(value, node->value);
-	if (compare_res == 0) {
-		// found equivalent value, update
-		*inserted = false;
-		*old_value = node->value;
-		node->value = value;
+	// All sizes up to a few levels, so that every shape of the last level is built
+	for (int n = 0; n <= 100; n++) {
+		Set set = set_create_from_sorted(compare_ints, NULL, sorted, n);
+		check_contents(set, values, n);
+		for (int k = 0; k < n; k++)
+			TEST_ASSERT(set_select(set, k) == set_find_node(set, &values[k]));
+
+		// The tree remains usable
+		set_insert(set, &values[N-1]);
+		TEST_ASSERT(set_size(set) == n + 1);
+		set_destroy(set);
+	}
 
-	} else if (compare_res < 0) {
-		// value < node->value, continue left.
-		node->left = node_insert(node->left, compare, value, inserted, old_value);;
+	Set set = set_create_from_sorted(compare_ints, NULL, sorted, N);
+	check_contents(set, values, N);
+	set_destroy(set);
+}
 
-	} else {
-		// value > node->value, continue right
-		node->right = node_insert(node->right, compare, value, inserted, old_value);;
+void test_create_from_array(void) {
+	// Every value twice, in random order; only the last of equivalent values is kept, the others are destroyed
+	int order[N];
+	shuffle(order, N);
+	Pointer array[2*N];
+	for (int i = 0; i < N; i++) {
+		array[i] = create_int(order[i]);
+		array[N + i] = create_int(order[N-1 - i]);
 	}
 
-	return node; // the root of the subtree does not change
+	Set set = set_create_from_array(compare_ints, free, array, 2*N);
+	int expected[N];
+	for (int i = 0; i < N; i++)
+		expected[i] = i;
+	check_contents(set, expected, N);
+	for (int i = N; i < 2*N; i++)
+		TEST_ASSERT(set_find(set, array[i]) == array[i]);
+	set_destroy(set);
 }
 
-// Removes and stores in min_node the smallest node of the subtree with root node.
-// Returns the new root of the subtree.
+void test_insert_remove_many(void) {
+	int values[N];
+	Pointer evens[N/2], all[N];
+	for (int i = 0; i < N; i++) {
+		values[i] = i;
+		all[i] = &values[i];
+		if (i % 2 == 0)
+			evens[i/2] = &values[i];
+	}
 
-static SetNode node_remove_min(SetNode node, SetNode* min_node) {
-	if (node->left == NULL) {
-		// We have no left subtree, so the smallest is the node itself
-		*min_node = node;
-		return node->right; // new root is the right child
+	Set set = set_create(compare_ints, NULL);
+	TEST_ASSERT(set_insert_many(set, evens, N/2) == N/2);
+	int expected[N];
+	for (int i = 0; i < N/2; i++)
+		expected[i] = 2*i;
+	check_contents(set, expected, N/2);
+
+	// Only the odd values are new
+	TEST_ASSERT(set_insert_many(set, all, N) == N/2);
+	check_contents(set, values, N);
+
+	// Remove the evens, then all: only the odd values remain to be removed
+	TEST_ASSERT(set_remove_many(set, evens, N/2) == N/2);
+	for (int i = 0; i < N/2; i++)
+		expected[i] = 2*i + 1;
+	check_contents(set, expected, N/2);
+	TEST_ASSERT(set_remove_many(set, all, N) == N/2);
+	TEST_ASSERT(set_size(set) == 0);
+
+	// Batches in the middle of an existing tree, with destroy_value
+	set_set_destroy_value(set, free);
+	for (int i = 0; i < N; i += 10)
+		set_insert(set, create_int(i));
+	Pointer batch[N];
+	for (int i = 0; i < N; i++)
+		batch[i] = create_int(i);
+	TEST_ASSERT(set_insert_many(set, batch, N) == N - N/10); // the others replace (and destroy) the old values
+	for (int i = 0; i < N; i++)
+		TEST_ASSERT(set_find(set, &values[i]) == batch[i]);
+	TEST_ASSERT(set_remove_many(set, all + N/4, N/2) == N/2);
+	TEST_ASSERT(set_size(set) == N - N/2);
+	set_destroy(set);
+}
 
-	} else {
-		// We have a left subtree, so the smallest value is there. We continue recursively
-		// and update node->left with the new root of the subtree.
-		node->left = node_remove_min(node->left, min_node)?
-		return node; // the root does not change
+// set_use_concurrent_writes: THREADS threads insert their own values (interleaved with those of the others), then
+// remove half of them, while searching the values of the other threads.
+
+#define THREADS 4
+
+typedef struct {
+	Set set;
+	int* values;
+	int thread;
+	bool failed;
+} WriterArgs;
+
+static void* writer(void* arg) {
+	WriterArgs* args = arg;
+	for (int i = args->thread; i < N; i += THREADS)
+		set_insert(args->set, &args->values[i]);
+	for (int i = args->thread; i < N; i += 2*THREADS) {
+		if (!set_remove(args->set, &args->values[i]))
+			args->failed = true;
+		set_find(args->set, &args->values[(i + 1) % N]);
 	}
+	for (int i = args->thread; i < N; i += THREADS)
+		if ((set_find(args->set, &args->values[i]) != NULL) != (i % (2*THREADS) >= THREADS))
+			args->failed = true;
+	return NULL;
 }
 
-// Deletes the node with a value equivalent to value, if any. Returns the new root of
-// subnode, and sets *removed to true if deletion actually occurred.
+void test_concurrent_writes(void) {
+	int values[N];
+	for (int i = 0; i < N; i++)
+		values[i] = i;
 
-static SetNode node_remove(SetNode node, CompareFunc compare, Pointer value, bool* removed, Pointer* old_value) {
-	if (node == NULL) {
-		*removed = false; // empty subtree, the value does not exist
-		return NULL;
+	Set set = set_create(compare_ints, NULL);
+	if (!set_use_concurrent_writes(set, true)) { // not supported, the set is unchanged
+		set_insert(set, &values[0]);
+		TEST_ASSERT(set_size(set) == 1);
+		set_destroy(set);
+		return;
 	}
 
-	int compare_res = compare(value, node->value);
-	if (compare_res == 0) {
-		// An equivalent value was found in the node, so we delete it. How this is done depends on whether it has children.
-		*removed = true;
-		*old_value = node->value;
-
-		if (node->left == NULL) {
-			// There is no left subtree, so the node is simply deleted and the right child is put as the new root
-			SetNode right = node->right; // save before free!
-			free(node);;
-			return right;
+	pthread_t threads[THREADS];
+	WriterArgs args[THREADS];
+	for (int t = 0; t < THREADS; t++) {
+		args[t] = (WriterArgs){ .set = set, .values = values, .thread = t, .failed = false };
+		pthread_create(&threads[t], NULL, writer, &args[t]);
+	}
+	for (int t = 0; t < THREADS; t++) {
+		pthread_join(threads[t], NULL);
+		TEST_ASSERT(!args[t].failed);
+	}
+	TEST_ASSERT(set_size(set) == N/2);
+
+	set_use_concurrent_writes(set, false);
+	int expected[N/2], count = 0;
+	for (int i = 0; i < N; i++)
+		if (i % (2*THREADS) >= THREADS)
+			expected[count++] = i;
+	check_contents(set, expected, count);
+	set_destroy(set);
+}
 
-		} else if (node->right == NULL) {
-			// there is no right subtree, so just delete the node and the left child is the new root
-			SetNode left = node->left; // save before free!
-			free(node);;
-			return left;
+void test_snapshot(void) {
+	int values[N], expected[N];
+	for (int i = 0; i < N; i++)
+		values[i] = expected[i] = i;
+	Set set = set_create(compare_ints, NULL);
+	for (int i = 0; i < N/2; i++)
+		set_insert(set, &values[i]);
+
+	Set snapshot = set_snapshot(set);
+	check_contents(snapshot, values, N/2);
+
+	// Later changes of either set do not affect the other
+	for (int i = N/2; i < N; i++)
+		set_insert(set, &values[i]);
+	for (int i = 0; i < N/2; i += 2)
+		set_remove(snapshot, &values[i]);
+	check_contents(set, expected, N);
+
+	for (int i = 0; i < N/4; i++)
+		expected[i] = 2*i + 1;
+	check_contents(snapshot, expected, N/4);
+
+	// A snapshot of a snapshot, and the original destroyed first
+	Set second = set_snapshot(snapshot);
+	set_destroy(set);
+	set_insert(snapshot, &values[0]);
+	check_contents(second, expected, N/4);
+	TEST_ASSERT(set_size(snapshot) == N/4 + 1);
+	for (int k = 0; k < N/4; k++)
+		TEST_ASSERT(*(int*)set_node_value(second, set_select(second, k)) == expected[k]);
+
+	set_destroy(snapshot);
+	set_destroy(second);
+}
 
-		} else {
-			// Both children exist. We replace the value of node with the smaller of the right subtree, which
-			// removed. The node_remove_min function does exactly this job.
+// The visit of set_visit_parallel, called by many threads at the same time
 
-			SetNode min_right?
-			node->right = node_remove_min(node->right, &min_right);
+static void visit_sum_atomic(Pointer value, Pointer ctx) {
+	__atomic_fetch_add((long*)ctx, *(int*)value, __ATOMIC_RELAXED);
+}
 
-			// Link min_right to the node's position
-			min_right->left = node->left;
-			min_right->right = node->right;
+// The visit of set_visit_parallel_ordered, checks that each part is visited in order
+
+typedef struct {
+	int first, last, count;
+} PartResult;
+
+static void visit_part(Pointer value, Pointer ctx) {
+	PartResult* part = ctx;
+	int v = *(int*)value;
+	if (part->count == 0)
+		part->first = v;
+	else if (v <= part->last)
+		part->first = -1; // out of order, detected below
+	part->last = v;
+	part->count++;
+}
 
-			free(node);;
-			return min_right;
+void test_visit_parallel(void) {
+	int values[N];
+	Pointer sorted[N];
+	for (int i = 0; i < N; i++) {
+		values[i] = i;
+		sorted[i] = &values[i];
+	}
+	long expected = (long)N * (N-1) / 2;
+
+	for (int nthreads = 1; nthreads <= 4; nthreads++) {
+		Set set = set_create_from_sorted_parallel(compare_ints, NULL, sorted, N, nthreads);
+		check_contents(set, values, N);
+
+		long sum = 0;
+		set_visit_parallel(set, visit_sum_atomic, &sum, nthreads);
+		TEST_ASSERT(sum == expected);
+
+		// The parts are consecutive ranges, of (almost) equal size
+		int parts = 7;
+		PartResult results[7] = { 0 };
+		Pointer ctxs[7];
+		for (int i = 0; i < parts; i++)
+			ctxs[i] = &results[i];
+		set_visit_parallel_ordered(set, visit_part, ctxs, parts, nthreads);
+
+		int next = 0;
+		for (int i = 0; i < parts; i++) {
+			TEST_ASSERT(results[i].first == next);
+			TEST_ASSERT(results[i].count >= N / parts && results[i].count <= N / parts + 1);
+			next = results[i].last + 1;
 		}
+		TEST_ASSERT(next == N);
+		set_destroy(set);
 	}
-
-	// compare_res != 0, continue to the left or right subtree, the root does not change.
-	if (compare_res < 0)
-		node->left = node_remove(node->left, compare, value, removed, old_value);;
-	else
-		node->right = node_remove(node->right, compare, value, removed, old_value);
-
-	return node;
 }
 
-// Destroys the entire subtree with root node
-
-static void node_destroy(SetNode node, DestroyFunc destroy_value) {
-	if (node == NULL)
+#define SAVE_PATH "ADTSet_test.save"
+
+void test_save_open_mmap(void) {
+	int values[N];
+	for (int i = 0; i < N; i++)
+		values[i] = 2 * i;
+	Set set = set_create(compare_ints, NULL);
+	for (int i = 0; i < N; i++)
+		set_insert(set, &values[i]);
+
+	bool saved = set_save(set, SAVE_PATH, sizeof(int));
+	set_destroy(set);
+	Set mapped = set_open_mmap(SAVE_PATH, compare_ints);
+	if (!saved) { // only UsingBTree has on-disk sets
+		TEST_ASSERT(mapped == NULL);
 		return;
-	
-	// first destroy the children, then free the node
-	node_destroy(node->left, destroy_value);;
-	node_destroy(node->right, destroy_value);;
+	}
+	TEST_ASSERT(mapped != NULL);
+
+	// The values are copies in the file
+	check_contents(mapped, values, N);
+	for (int i = 0; i < N; i++) {
+		int* found = set_find(mapped, &values[i]);
+		TEST_ASSERT(found != NULL && found != &values[i] && *found == values[i]);
+		int missing = values[i] + 1;
+		TEST_ASSERT(set_find(mapped, &missing) == NULL);
+		TEST_ASSERT(set_rank(mapped, &missing) == i + 1);
+		TEST_ASSERT(*(int*)set_node_value(mapped, set_select(mapped, i)) == values[i]);
+		SetNode bound = set_lower_bound(mapped, &missing);
+		TEST_ASSERT(i == N-1 ? bound == SET_EOF : *(int*)set_node_value(mapped, bound) == values[i] + 2);
+	}
 
-	if (destroy_value != NULL)
-		destroy_value(node->value);; destroy_value(node->value);
+	long sum = 0;
+	set_visit_ctx(mapped, visit_sum, &sum);
+	TEST_ASSERT(sum == (long)N * (N-1));
+	set_destroy(mapped);
 
-	free(node);
+	TEST_ASSERT(set_open_mmap("ADTSet_test.missing", compare_ints) == NULL);
+	remove(SAVE_PATH);
 }
 
+// The hash of set_use_hash_index and set_use_find_cache (the implementations mix the bits themselves)
 
-//// ADT Set functions. Generally very simple, since they call the corresponding node_*
+static uint64_t hash_int(Pointer value) {
+	return (uint64_t)*(int*)value;
+}
+
+void test_hash_index(void) {
+	int values[N], order[N];
+	for (int i = 0; i < N; i++)
+		values[i] = 2 * i;
+	Set set = set_create(compare_ints, NULL);
+	for (int i = 0; i < N/2; i++)
+		set_insert(set, &values[i]);
+
+	// The existing values are added to the index, and then it follows the insertions and removals
+	set_use_hash_index(set, hash_int);
+	for (int i = N/2; i < N; i++)
+		set_insert(set, &values[i]);
+	bool removed[N] = { false };
+	shuffle(order, N);
+	for (int i = 0; i < N/2; i++) {
+		set_remove(set, &values[order[i]]);
+		removed[order[i]] = true;
+	}
 
-Set set_create(CompareFunc compare, DestroyFunc destroy_value) {
-	assert(compare != NULL); // LCOV_EXCL_LINE
+	int expected[N], count = 0;
+	for (int i = 0; i < N; i++) {
+		TEST_ASSERT(set_find(set, &values[i]) == (removed[i] ? NULL : &values[i]));
+		SetNode node = set_find_node(set, &values[i]);
+		TEST_ASSERT(removed[i] ? node == SET_EOF : set_node_value(set, node) == &values[i]);
+		int missing = values[i] + 1;
+		TEST_ASSERT(set_find(set, &missing) == NULL);
+		if (!removed[i])
+			expected[count++] = values[i];
+	}
 
-	// create the stuct
-	Set set = malloc(sizeof(*set));;
-	set->root = NULL; // empty tree
-	set->size = 0;
-	set->compare = compare;
-	set->destroy_value = destroy_value;
+	// The ordered functions are not affected
+	check_contents(set, expected, count);
 
-	return set;
+	set_use_hash_index(set, NULL);
+	TEST_ASSERT(set_find(set, &expected[0]) != NULL);
+	set_destroy(set);
 }
 
-int set_size(set set) {
-	return set->size;
+void test_cursor(void) {
+	int values[N];
+	for (int i = 0; i < N; i++)
+		values[i] = 2 * i;
+	Set set = set_create(compare_ints, NULL);
+	SetCursor cursor = set_cursor_create(set);
+	TEST_ASSERT(set_cursor_node(cursor) == SET_EOF);
+
+	// Insertions in order, each next to the previous one
+	for (int i = 0; i < N; i++) {
+		set_cursor_insert(cursor, &values[i]);
+		TEST_ASSERT(set_node_value(set, set_cursor_node(cursor)) == &values[i]);
+	}
+	check_contents(set, values, N);
+
+	// Seeks in both directions
+	for (int i = N-1; i >= 0; i -= 7) {
+		TEST_ASSERT(set_cursor_seek(cursor, &values[i]));
+		TEST_ASSERT(set_node_value(set, set_cursor_node(cursor)) == &values[i]);
+		int missing = values[i] - 1;
+		TEST_ASSERT(!set_cursor_seek(cursor, &missing));
+		TEST_ASSERT(set_node_value(set, set_cursor_node(cursor)) == &values[i]);
+	}
+	int beyond = 2*N;
+	TEST_ASSERT(!set_cursor_seek(cursor, &beyond));
+	TEST_ASSERT(set_cursor_node(cursor) == SET_EOF);
+
+	// From SET_EOF, next goes to the first node and previous to the last one
+	TEST_ASSERT(set_node_value(set, set_cursor_next(cursor)) == &values[0]);
+	TEST_ASSERT(set_cursor_previous(cursor) == SET_BOF);
+	TEST_ASSERT(set_node_value(set, set_cursor_previous(cursor)) == &values[N-1]);
+	TEST_ASSERT(set_cursor_next(cursor) == SET_EOF);
+
+	// Remove every other value, the cursor moves to the next one
+	set_cursor_seek(cursor, &values[0]);
+	for (int i = 0; i < N; i += 2) {
+		TEST_ASSERT(set_node_value(set, set_cursor_node(cursor)) == &values[i]);
+		set_cursor_remove(cursor);
+		TEST_ASSERT(set_node_value(set, set_cursor_node(cursor)) == &values[i+1]);
+		set_cursor_next(cursor);
+	}
+	TEST_ASSERT(set_cursor_node(cursor) == SET_EOF);
+
+	int expected[N/2];
+	for (int i = 0; i < N/2; i++)
+		expected[i] = values[2*i + 1];
+	check_contents(set, expected, N/2);
+
+	set_cursor_destroy(cursor);
+	set_destroy(set);
 }
 
-void set_insert(set set, pointer value) {
-	bool inserted;
-	pointer old_value;
-	set->root = node_insert(set->root, set->compare, value, &inserted, &old_value);;
+void test_freeze(void) {
+	int values[N], order[N];
+	for (int i = 0; i < N; i++)
+		values[i] = 2 * i;
+
+	for (int n = 0; n <= N; n += n < 40 ? 1 : 321) { // small sizes fill the levels of the array in every way
+		Set set = set_create(compare_ints, NULL);
+		shuffle(order, n);
+		for (int i = 0; i < n; i++)
+			set_insert(set, &values[order[i]]);
+
+		set_freeze(set);
+		check_contents(set, values, n);
+		for (int i = 0; i < n; i++) {
+			TEST_ASSERT(set_find(set, &values[i]) == &values[i]);
+			TEST_ASSERT(set_node_value(set, set_find_node(set, &values[i])) == &values[i]);
+			int missing = values[i] + 1;
+			TEST_ASSERT(set_find(set, &missing) == NULL);
+			TEST_ASSERT(set_rank(set, &missing) == i + 1);
+			TEST_ASSERT(set_node_value(set, set_select(set, i)) == &values[i]);
+			SetNode bound = set_upper_bound(set, &values[i]);
+			TEST_ASSERT(i == n-1 ? bound == SET_EOF : set_node_value(set, bound) == &values[i+1]);
+		}
 
-	// The size only changes if a new node is inserted. In updates we destroy the old value
-	if (inserted)
-		set->size++;;
-	else if (set->destroy_value != NULL)
-		set->destroy_value(old_value);
+		long sum = 0;
+		set_visit_ctx(set, visit_sum, &sum);
+		TEST_ASSERT(sum == (long)n * (n-1));
+		set_destroy(set);
+	}
 }
 
-bool set_remove(set set set, pointer value) {
-	bool removed;
-	pointer old_value = NULL;
-	set->root = node_remove(set->root, set->compare, value, &removed, &old_value);;
+// Set algebra on the multiples of 2 and of 3 below N, for sets of similar sizes (merged) and of very different sizes
+// (searched)
 
-	// The size only changes if a node is actually removed
-	if (removed) {
-		set->size--;;
+static Set create_multiples(int* values, int step, int n) {
+	Set set = set_create(compare_ints, NULL);
+	for (int i = 0; i < n; i += step)
+		set_insert(set, &values[i]);
+	return set;
+}
 
-		if (set->destroy_value != NULL)
-			set->destroy_value(old_value);
-	}
+// Checks that set contains exactly the values[i] (i < n) for which included(i)
 
-	return removed;
+static void check_values(Set set, int* values, int n, bool (*included)(int)) {
+	int expected[N], count = 0;
+	for (int i = 0; i < n; i++)
+		if (included(i))
+			expected[count++] = values[i];
+	check_contents(set, expected, count);
 }
 
-pointer set_find(set set, pointer value) {
-	SetNode node = node_find_equal(set->root, set->compare, value);;
-	return node == NULL ? NULL : node->value;
+static int step_b;
+
+static bool in_union(int i) { return i % 2 == 0 || i % step_b == 0; }
+static bool in_intersection(int i) { return i % 2 == 0 && i % step_b == 0; }
+static bool in_difference(int i) { return i % 2 == 0 && i % step_b != 0; }
+
+void test_set_algebra(void) {
+	int values[N];
+	for (int i = 0; i < N; i++)
+		values[i] = i;
+
+	int steps[] = { 3, 97 };
+	for (int s = 0; s < 2; s++) {
+		step_b = steps[s];
+		Set a = create_multiples(values, 2, N);
+		Set b = create_multiples(values, step_b, N);
+
+		Set result = set_union(a, b);
+		check_values(result, values, N, in_union);
+		set_destroy(result);
+		result = set_intersection(a, b);
+		check_values(result, values, N, in_intersection);
+		set_destroy(result);
+		result = set_difference(a, b);
+		check_values(result, values, N, in_difference);
+		TEST_ASSERT(set_is_subset(result, a));
+		TEST_ASSERT(!set_is_subset(a, result));
+		TEST_ASSERT(!set_is_subset(b, a));
+		set_destroy(result);
+
+		// The in-place versions, on copies of a
+		Set c = create_multiples(values, 2, N);
+		set_union_in_place(c, b);
+		check_values(c, values, N, in_union);
+		set_destroy(c);
+		c = create_multiples(values, 2, N);
+		set_intersection_in_place(c, b);
+		check_values(c, values, N, in_intersection);
+		set_destroy(c);
+		c = create_multiples(values, 2, N);
+		set_difference_in_place(c, b);
+		check_values(c, values, N, in_difference);
+		set_destroy(c);
+
+		set_destroy(a);
+		set_destroy(b);
+	}
 }
 
-DestroyFunc set_set_destroy_value(Set vec, DestroyFunc destroy_value) {
-	DestroyFunc old = vec->destroy_value;
-	vec->destroy_value = destroy_value;
-	return old;
+void test_split_join(void) {
+	int values[N], order[N];
+	for (int i = 0; i < N; i++)
+		values[i] = 2 * i;
+
+	for (int pivot = -1; pivot <= 2*N; pivot += 37) {
+		Set set = set_create(compare_ints, NULL);
+		shuffle(order, N);
+		for (int i = 0; i < N; i++)
+			set_insert(set, &values[order[i]]);
+
+		// The values < pivot go left, the rest right
+		Set left, right;
+		set_split(set, &pivot, &left, &right);
+		int count = pivot < 0 ? 0 : (pivot + 1) / 2;
+		if (count > N)
+			count = N;
+		check_contents(left, values, count);
+		check_contents(right, values + count, N - count);
+		for (int k = 0; k < N - count; k++)
+			TEST_ASSERT(set_node_value(right, set_select(right, k)) == &values[count + k]);
+
+		// Both remain usable, and join back to the same set
+		if (count > 0) {
+			set_remove(left, &values[0]);
+			set_insert(left, &values[0]);
+		}
+		Set joined = set_join(left, right);
+		check_contents(joined, values, N);
+		for (int k = 0; k < N; k++)
+			TEST_ASSERT(set_rank(joined, &values[k]) == k);
+		set_destroy(joined);
+	}
+
+	// Joins of sets that do not come from the same split, of different sizes
+	Set a = set_create(compare_ints, NULL), b = set_create(compare_ints, NULL);
+	for (int i = 0; i < 10; i++)
+		set_insert(a, &values[i]);
+	for (int i = 10; i < N; i++)
+		set_insert(b, &values[i]);
+	Set joined = set_join(a, b);
+	check_contents(joined, values, N);
+	set_destroy(joined);
 }
 
-void set_destroy(set set) {
-	node_destroy(set->root, set->destroy_value);;
-	free(set);
+void test_write_buffers(void) {
+	int values[N], order[N];
+	for (int i = 0; i < N; i++)
+		values[i] = i;
+	Set set = set_create(compare_ints, free);
+	if (!set_use_write_buffers(set, true)) { // only UsingBTree has write buffers
+		set_destroy(set);
+		return;
+	}
+
+	shuffle(order, N);
+	for (int i = 0; i < N; i++)
+		set_insert(set, create_int(order[i]));
+
+	// Updates of buffered values replace (and destroy) them, removals also remove them from the buffers
+	int* value = create_int(order[0]);
+	set_insert(set, value);
+	TEST_ASSERT(set_find(set, &order[0]) == value);
+	for (int i = 0; i < N; i += 3)
+		TEST_ASSERT(set_remove(set, &values[i]));
+	int missing = 0;
+	TEST_ASSERT(!set_remove(set, &missing));
+
+	for (int i = 0; i < N; i++)
+		TEST_ASSERT((set_find(set, &values[i]) != NULL) == (i % 3 != 0));
+	TEST_ASSERT(set_size(set) == N - (N + 2) / 3);
+
+	set_use_write_buffers(set, false);
+	int expected[N], count = 0;
+	for (int i = 0; i < N; i++)
+		if (i % 3 != 0)
+			expected[count++] = i;
+	check_contents(set, expected, count);
+	set_destroy(set);
 }
 
-SetNode set_first(Set set) {
-	return node_find_min(set->root);;
+// A set of 0 ... N-1 with lazy removal, in which every third value is removed (less than COMPACT_REMOVED_PERCENT, so
+// the marked values are still in the tree). Stores the remaining values in expected, and their number in *count.
+
+static Set create_lazy(int* values, int* expected, int* count) {
+	Set set = set_create(compare_ints, NULL);
+	for (int i = 0; i < N; i++)
+		set_insert(set, &values[i]);
+	set_use_lazy_removal(set, true);
+
+	*count = 0;
+	for (int i = 0; i < N; i++)
+		if (i % 3 == 0)
+			TEST_ASSERT(set_remove(set, &values[i]));
+		else
+			expected[(*count)++] = i;
+	return set;
 }
 
-SetNode set_last(Set set) {
-	return node_find_max(set->root);;
+void test_lazy_removal(void) {
+	int values[N], expected[N], count;
+	for (int i = 0; i < N; i++)
+		values[i] = i;
+
+	Set set = create_lazy(values, expected, &count);
+	check_contents(set, expected, count);
+	for (int i = 0; i < N; i++) {
+		TEST_ASSERT((set_find(set, &values[i]) != NULL) == (i % 3 != 0));
+		SetNode bound = set_lower_bound(set, &values[i]);
+		int lower = i % 3 == 0 ? i + 1 : i;
+		TEST_ASSERT(lower == N ? bound == SET_EOF : set_node_value(set, bound) == &values[lower]);
+	}
+	TEST_ASSERT(!set_remove(set, &values[0])); // already removed
+
+	long sum = 0, expected_sum = 0;
+	for (int i = 0; i < count; i++)
+		expected_sum += expected[i];
+	set_visit_ctx(set, visit_sum, &sum);
+	TEST_ASSERT(sum == expected_sum);
+
+	// A marked value returns to the set
+	set_insert(set, &values[0]);
+	TEST_ASSERT(set_find(set, &values[0]) == &values[0]);
+	TEST_ASSERT(set_size(set) == count + 1);
+	set_remove(set, &values[0]);
+
+	set_compact(set);
+	check_contents(set, expected, count);
+
+	// Removing the rest compacts the tree automatically
+	for (int i = 0; i < count; i++)
+		TEST_ASSERT(set_remove(set, &values[expected[i]]));
+	TEST_ASSERT(set_size(set) == 0);
+	TEST_ASSERT(set_first(set) == SET_EOF);
+	set_destroy(set);
 }
 
-SetNode set_previous(Set set, SetNode node) {
-	return node_find_previous(set->root, set->compare, node);;
+// rank/select and the parallel visits count by the sizes of the subtrees, which also include the marked values
+
+void test_lazy_removal_rank_visit(void) {
+	int values[N], expected[N], count;
+	for (int i = 0; i < N; i++)
+		values[i] = i;
+
+	Set set = create_lazy(values, expected, &count);
+	for (int k = 0; k < count; k++) {
+		TEST_ASSERT(set_node_value(set, set_select(set, k)) == &values[expected[k]]);
+		TEST_ASSERT(set_rank(set, &values[expected[k]]) == k);
+	}
+	TEST_ASSERT(set_select(set, count) == SET_EOF);
+	set_destroy(set);
+
+	long expected_sum = 0;
+	for (int i = 0; i < count; i++)
+		expected_sum += expected[i];
+
+	set = create_lazy(values, expected, &count);
+	long sum = 0;
+	set_visit_parallel(set, visit_sum_atomic, &sum, 4);
+	TEST_ASSERT(sum == expected_sum);
+	set_destroy(set);
+
+	set = create_lazy(values, expected, &count);
+	PartResult results[4] = { 0 };
+	Pointer ctxs[4] = { &results[0], &results[1], &results[2], &results[3] };
+	set_visit_parallel_ordered(set, visit_part, ctxs, 4, 2);
+	int visited = 0;
+	for (int i = 0; i < 4; i++) {
+		TEST_ASSERT(results[i].first % 3 != 0 && results[i].last % 3 != 0);
+		visited += results[i].count;
+	}
+	TEST_ASSERT(visited == count);
+	set_destroy(set);
 }
 
-SetNode set_next(Set set, SetNode node) {
-	return node_find_next(set->root, set->compare, node);;
+// Cursors skip the marked values, set_cursor_insert revives them and set_cursor_remove only marks its value
+
+void test_lazy_removal_cursor(void) {
+	int values[N], expected[N], count;
+	for (int i = 0; i < N; i++)
+		values[i] = i;
+
+	Set set = create_lazy(values, expected, &count);
+	SetCursor cursor = set_cursor_create(set);
+	TEST_ASSERT(set_node_value(set, set_cursor_node(cursor)) == &values[1]);
+
+	TEST_ASSERT(!set_cursor_seek(cursor, &values[3]));
+	TEST_ASSERT(set_node_value(set, set_cursor_node(cursor)) == &values[4]);
+	TEST_ASSERT(set_node_value(set, set_cursor_previous(cursor)) == &values[2]);
+	TEST_ASSERT(set_node_value(set, set_cursor_next(cursor)) == &values[4]);
+
+	set_cursor_insert(cursor, &values[3]);
+	TEST_ASSERT(set_find(set, &values[3]) == &values[3]);
+	TEST_ASSERT(set_size(set) == count + 1);
+	set_cursor_insert(cursor, &values[3]);
+	TEST_ASSERT(set_size(set) == count + 1);
+
+	// Remove everything through the cursor, which never rests on a removed value
+	set_cursor_seek(cursor, &values[0]);
+	int removed = 0;
+	for (SetNode node = set_cursor_node(cursor); node != SET_EOF; node = set_cursor_node(cursor)) {
+		int value = *(int*)set_node_value(set, node);
+		TEST_ASSERT(value % 3 != 0 || value == 3);
+		set_cursor_remove(cursor);
+		removed++;
+		TEST_ASSERT(set_size(set) == count + 1 - removed);
+	}
+	TEST_ASSERT(removed == count + 1);
+	TEST_ASSERT(set_first(set) == SET_EOF);
+	set_cursor_destroy(cursor);
+	set_destroy(set);
 }
 
-Pointer set_node_value(Set set, SetNode node) {
-	return node->value;
+// The in-place operations remove the values themselves, also with lazy removal (the values are destroyed exactly
+// once, both those marked before and those removed by the operation)
+
+void test_lazy_removal_algebra(void) {
+	int values[N];
+	for (int i = 0; i < N; i++)
+		values[i] = i;
+
+	for (int op = 0; op < 2; op++) {
+		Set set = set_create(compare_ints, free);
+		for (int i = 0; i < N; i++)
+			set_insert(set, create_int(i));
+		set_use_lazy_removal(set, true);
+		for (int i = 0; i < N; i += 3) {
+			int* value = create_int(i);
+			TEST_ASSERT(set_remove(set, value));
+			free(value);
+		}
+
+		// Both operations remove the values 1, 4, 7, ... up to 100
+		Set other = set_create(compare_ints, NULL);
+		for (int i = 0; i < N; i++)
+			if ((i % 3 == 1 && i < 100) == (op == 1))
+				set_insert(other, &values[i]);
+		if (op == 0)
+			set_intersection_in_place(set, other);
+		else
+			set_difference_in_place(set, other);
+
+		int expected[N], count = 0;
+		for (int i = 0; i < N; i++)
+			if (i % 3 == 2 || (i % 3 == 1 && i >= 100))
+				expected[count++] = i;
+		check_contents(set, expected, count);
+
+		// The set still uses lazy removal
+		TEST_ASSERT(set_remove(set, &values[2]));
+		TEST_ASSERT(set_find(set, &values[2]) == NULL);
+		set_compact(set);
+		check_contents(set, expected + 1, count - 1);
+
+		set_destroy(set);
+		set_destroy(other);
+	}
 }
 
-SetNode set_find_node(set set set, pointer value) {
-	return node_find_equal(set->root, set->compare, value);;
+void test_clear(void) {
+	int order[N];
+	Set set = set_create(compare_ints, free);
+	shuffle(order, N);
+	for (int i = 0; i < N; i++)
+		set_insert(set, create_int(order[i]));
+
+	set_clear(set);
+	TEST_ASSERT(set_size(set) == 0);
+	TEST_ASSERT(set_first(set) == SET_EOF);
+	TEST_ASSERT(set_find(set, &order[0]) == NULL);
+
+	// The insertions that follow destroy the old tree in steps, a second clear destroys the rest of the first one
+	int values[N];
+	for (int i = 0; i < N; i++)
+		values[i] = i;
+	for (int i = 0; i < N/2; i++)
+		set_insert(set, create_int(i));
+	check_contents(set, values, N/2);
+	set_clear(set);
+	for (int i = 0; i < N/4; i++)
+		set_insert(set, create_int(i));
+	check_contents(set, values, N/4);
+	set_destroy(set);
 }
 
+// The values of the cleared tree are destroyed with the destroy_value of set_clear, even while the in-place algebra
+// removes values without it
+
+void test_clear_algebra(void) {
+	int values[N];
+	for (int i = 0; i < N; i++)
+		values[i] = i;
+
+	// Both operations remove the values 95 ... 99, in small batches that also continue the destruction of the
+	// cleared tree, which must still destroy its values.
+	for (int op = 0; op < 2; op++) {
+		Set other = set_create(compare_ints, NULL);
+		for (int i = 0; i < 100; i++)
+			if ((i < 95) == (op == 0))
+				set_insert(other, &values[i]);
+
+		Set set = set_create(compare_ints, free);
+		for (int i = 0; i < N; i++)
+			set_insert(set, create_int(i));
+		set_clear(set);
+		for (int i = 0; i < 100; i++)
+			set_insert(set, create_int(i));
+
+		if (op == 0)
+			set_intersection_in_place(set, other);
+		else
+			set_difference_in_place(set, other);
+		check_contents(set, values, 95);
+
+		set_destroy(set);
+		set_destroy(other);
+	}
+}
 
+void test_destroy_incremental(void) {
+	int order[N];
+	for (int budget = 1; budget <= 1000; budget *= 10) {
+		Set set = set_create(compare_ints, free);
+		shuffle(order, N);
+		for (int i = 0; i < N; i++)
+			set_insert(set, create_int(order[i]));
+
+		// At least 1 and at most 3 steps per value
+		int calls = 1;
+		while (!set_destroy_incremental(set, budget))
+			calls++;
+		TEST_ASSERT(calls <= 3*N / budget + 1);
+		TEST_ASSERT(calls >= N / budget);
+	}
 
-// Functions that do not exist in the public interface but are used in tests.
-// They check that the tree is a correct BST.
+	// A degenerate tree (sorted insertions in the BST), without recursion. set_destroy completes the destruction.
+	Set set = set_create(compare_ints, free);
+	for (int i = 0; i < 10*N; i++)
+		set_insert(set, create_int(i));
+	TEST_ASSERT(!set_destroy_incremental(set, 10));
+	set_destroy(set);
+}
 
-// LCOV_EXCL_START (we don't care about the coverage of the test commands, and furthermore only true branches are executed in a successful test)
+void test_find_many(void) {
+	int values[N], order[N], keys_values[2*N];
+	for (int i = 0; i < N; i++)
+		values[i] = 2 * i;
+	Set set = set_create(compare_ints, NULL);
+	shuffle(order, N);
+	for (int i = 0; i < N; i++)
+		set_insert(set, &values[order[i]]);
+
+	// Hits and misses, in random order, in batches of every size around FIND_GROUP
+	Pointer keys[2*N], found[2*N];
+	shuffle(keys_values, 2*N);
+	for (int i = 0; i < 2*N; i++)
+		keys[i] = &keys_values[i];
+
+	for (int n = 0; n <= 2*N; n += n < 40 ? 1 : 333) {
+		set_find_many(set, keys, n, found);
+		for (int i = 0; i < n; i++)
+			TEST_ASSERT(found[i] == set_find(set, keys[i]));
+	}
+	set_find_many(set, keys, 2*N, found);
+	int hits = 0;
+	for (int i = 0; i < 2*N; i++)
+		hits += found[i] != NULL;
+	TEST_ASSERT(hits == N);
+	set_destroy(set);
+
+	set = set_create(compare_ints, NULL);
+	set_find_many(set, keys, 100, found);
+	for (int i = 0; i < 100; i++)
+		TEST_ASSERT(found[i] == NULL);
+	set_destroy(set);
+}
 
-static bool node_is_bst(SetNode node, CompareFunc compare) {
-	if (node == NULL)
-		return true;
+void test_find_cache(void) {
+	int values[N];
+	for (int i = 0; i < N; i++)
+		values[i] = 2 * i;
+	Set set = set_create(compare_ints, NULL);
+	for (int i = 0; i < N; i++)
+		set_insert(set, &values[i]);
+
+	TEST_ASSERT(!set_has_find_cache(set));
+	if (!set_use_find_cache(set, hash_int, 64)) { // UsingBTree has no find cache
+		TEST_ASSERT(!set_has_find_cache(set));
+		set_destroy(set);
+		return;
+	}
+	TEST_ASSERT(set_has_find_cache(set));
+
+	// Skewed lookups: most of them search the same few values, which then stay in the cache
+	for (int round = 0; round < 10; round++)
+		for (int i = 0; i < N; i++) {
+			int k = rand() % 4 != 0 ? rand() % 8 : rand() % N;
+			TEST_ASSERT(set_find(set, &values[k]) == &values[k]);
+			TEST_ASSERT(set_node_value(set, set_find_node(set, &values[k])) == &values[k]);
+			int missing = values[k] + 1;
+			TEST_ASSERT(set_find(set, &missing) == NULL);
+		}
 
-	// We check the property:
-	// each node is > left child, > rightmost node of the left subtree, < right child, < leftmost node of the right subtree.
-	// It is equivalent to the BST property (each node is > left subtree and < right subtree) but easier to check.
-	bool res = true;
-	if(node->left != NULL)
-		res = res && compare(node->left->value, node->value) < 0 && compare(node_find_max(node->left)->value, node->value) < 0;
-	if(node->right != NULL)
-		res = res && compare(node->right->value, node->value) > 0 && compare(node_find_min(node->right)->value, node->value) > 0;
+	// A removed value is not found in its slot, and the cache follows the nodes that replace it
+	for (int i = 0; i < 8; i++) {
+		TEST_ASSERT(set_remove(set, &values[i]));
+		TEST_ASSERT(set_find(set, &values[i]) == NULL);
+		TEST_ASSERT(set_find(set, &values[i + 8]) == &values[i + 8]);
+	}
+	for (int i = 0; i < 8; i++) {
+		set_insert(set, &values[i]);
+		TEST_ASSERT(set_find(set, &values[i]) == &values[i]);
+	}
+	check_contents(set, values, N);
+
+	// set_clear frees all nodes
+	set_clear(set);
+	TEST_ASSERT(set_find(set, &values[0]) == NULL);
+	set_insert(set, &values[1]);
+	TEST_ASSERT(set_find(set, &values[0]) == NULL);
+	TEST_ASSERT(set_find(set, &values[1]) == &values[1]);
+
+	TEST_ASSERT(set_use_find_cache(set, NULL, 0));
+	TEST_ASSERT(!set_has_find_cache(set));
+	TEST_ASSERT(set_find(set, &values[1]) == &values[1]);
+	set_destroy(set);
+}
 
-	return res &&
-		node_is_bst(node->left, compare) &&
-		node_is_bst(node->right, compare);;
+void test_node_pool(void) {
+	int order[N], values[N];
+	for (int i = 0; i < N; i++)
+		values[i] = i;
+	for (int with_destroy = 0; with_destroy < 2; with_destroy++) {
+		Set set = set_create(compare_ints, with_destroy ? free : NULL);
+		set_use_node_pool(set, true);
+		shuffle(order, N);
+		for (int i = 0; i < N; i++)
+			set_insert(set, with_destroy ? create_int(order[i]) : &values[order[i]]);
+		check_contents(set, values, N);
+
+		// The freed nodes are reused
+		for (int i = 0; i < N; i += 2)
+			set_remove(set, &values[i]);
+		for (int i = 0; i < N; i += 2)
+			set_insert(set, with_destroy ? create_int(i) : &values[i]);
+		check_contents(set, values, N);
+		set_destroy(set);
+	}
 }
 
-bool set_is_proper(set node) {
-	return node_is_bst(node->root, node->compare);;
+void test_get_stats(void) {
+	int values[N];
+	for (int i = 0; i < N; i++)
+		values[i] = i;
+	Set set = set_create(compare_ints, NULL);
+	SetStats stats;
+	set_get_stats(set, &stats);
+	TEST_ASSERT(stats.height == 0);
+
+	for (int i = 0; i < N; i++)
+		set_insert(set, &values[i]);
+	for (int i = 0; i < N; i++)
+		set_find(set, &values[i]);
+
+	// The counters only with -DSET_STATS, the shape of the tree always
+	if (set_get_stats(set, &stats)) {
+		TEST_ASSERT(stats.lookups >= 2*N);
+		TEST_ASSERT(stats.compares >= 2*N);
+		TEST_ASSERT(stats.nodes_visited >= stats.lookups);
+	} else {
+		TEST_ASSERT(stats.lookups == 0 && stats.compares == 0);
+	}
+	TEST_ASSERT(stats.height > 0 && stats.height <= N);
+	TEST_ASSERT(stats.fill_factor > 0 && stats.fill_factor <= 1);
+	set_destroy(set);
 }
 
-// LCOV_EXCL_STOP
+// The key function of set_set_key_func, consistent with compare_ints
 
+static int64_t key_int(Pointer value) {
+	return *(int*)value;
+}
 
+void test_key_func(void) {
+	int values[N], order[N];
+	for (int i = 0; i < N; i++)
+		values[i] = 2 * i - N; // also negative keys
+	Set set = set_create(compare_ints, NULL);
+	set_set_key_func(set, key_int);
+	shuffle(order, N);
+	for (int i = 0; i < N; i++)
+		set_insert(set, &values[order[i]]);
+	check_contents(set, values, N);
+
+	for (int i = 0; i < N; i++) {
+		TEST_ASSERT(set_find(set, &values[i]) == &values[i]);
+		int missing = values[i] + 1;
+		TEST_ASSERT(set_find(set, &missing) == NULL);
+		SetNode bound = set_lower_bound(set, &missing);
+		TEST_ASSERT(i == N-1 ? bound == SET_EOF : set_node_value(set, bound) == &values[i+1]);
+	}
+	for (int i = 0; i < N; i += 2)
+		TEST_ASSERT(set_remove(set, &values[i]));
+	TEST_ASSERT(set_size(set) == N/2);
+	set_destroy(set);
+}
 
+// With stable SetNodes, a SetNode remains valid until its own value is removed, also across the updates of other
+// values (in UsingBTree the values move between nodes, in the others set_use_stable_nodes has no effect)
+
+void test_stable_nodes(void) {
+	int values[2*N], order[2*N];
+	for (int i = 0; i < 2*N; i++)
+		values[i] = i;
+	Set set = set_create(compare_ints, NULL);
+	set_use_stable_nodes(set, true);
+	for (int i = 0; i < N; i++)
+		set_insert(set, &values[2*i]);
+
+	SetNode nodes[N];
+	for (int i = 0; i < N; i++) {
+		nodes[i] = set_find_node(set, &values[2*i]);
+		TEST_ASSERT(nodes[i] != SET_EOF);
+	}
+	SetNode first = set_first(set), select = set_select(set, N-2), bound = set_lower_bound(set, &values[3]);
+
+	// Insert the odd values and remove the values 4k+2, in random order
+	shuffle(order, 2*N);
+	for (int i = 0; i < 2*N; i++)
+		if (order[i] % 2 == 1)
+			set_insert(set, &values[order[i]]);
+		else if (order[i] % 4 == 2)
+			TEST_ASSERT(set_remove(set, &values[order[i]]));
+
+	TEST_ASSERT(set_node_value(set, first) == &values[0]);
+	TEST_ASSERT(set_node_value(set, select) == &values[2*N-4]);
+	TEST_ASSERT(set_node_value(set, bound) == &values[4]);
+	for (int i = 0; i < 2*N; i += 4) {
+		SetNode node = nodes[i / 2];
+		TEST_ASSERT(set_node_value(set, node) == &values[i]);
+		TEST_ASSERT(set_node_value(set, set_next(set, node)) == &values[i+1]);
+		TEST_ASSERT(i == 0 ? set_previous(set, node) == SET_BOF : set_node_value(set, set_previous(set, node)) == &values[i-1]);
+	}
 
-//// Additional functions to be implemented in Lab 5
+	int expected[2*N], count = 0;
+	for (int i = 0; i < 2*N; i++)
+		if (i % 4 != 2)
+			expected[count++] = i;
+	check_contents(set, expected, count);
+
+	// A cursor moves as without stable SetNodes
+	SetCursor cursor = set_cursor_create(set);
+	for (int i = 0; i < count; i++) {
+		TEST_ASSERT(set_node_value(set, set_cursor_node(cursor)) == &values[expected[i]]);
+		set_cursor_next(cursor);
+	}
+	TEST_ASSERT(set_cursor_node(cursor) == SET_EOF);
+	set_cursor_destroy(cursor);
 
-void set_visit(Set set, VisitFunc visit) {
+	set_destroy(set);
+}
 
+// Once the snapshot is destroyed, the set is a normal set again (in UsingAVL its nodes are relinked by its next update),
+// so also the functions that cannot be used together with snapshots work
+
+void test_snapshot_destroyed(void) {
+	int values[N], expected[N];
+	for (int i = 0; i < N; i++)
+		values[i] = i;
+	Set set = set_create(compare_ints, NULL);
+	for (int i = 0; i < N; i++)
+		set_insert(set, &values[i]);
+
+	// Both sets copy the paths they change
+	Set snapshot = set_snapshot(set);
+	for (int i = 0; i < N; i += 4)
+		set_remove(set, &values[i]);
+	for (int i = 1; i < N; i += 4)
+		set_remove(snapshot, &values[i]);
+	set_destroy(snapshot);
+
+	// The values 4k+2 are removed with lazy removal, the values 4k+3 with the hash index
+	set_remove(set, &values[1]);
+	set_use_lazy_removal(set, true);
+	for (int i = 2; i < N; i += 4)
+		TEST_ASSERT(set_remove(set, &values[i]));
+	set_use_lazy_removal(set, false);
+	set_use_hash_index(set, hash_int);
+	for (int i = 3; i < N; i += 4)
+		TEST_ASSERT(set_remove(set, &values[i]));
+
+	int count = 0;
+	for (int i = 5; i < N; i += 4)
+		expected[count++] = i;
+	check_contents(set, expected, count);
+	for (int i = 0; i < N; i++)
+		TEST_ASSERT((set_find(set, &values[i]) != NULL) == (i % 4 == 1 && i > 1));
+	set_destroy(set);
 }
+
+
+// List of all tests to be executed
+TEST_LIST = {
+	{ "set_create", test_create },
+	{ "set_insert_remove", test_insert_remove },
+	{ "set_create_with_order", test_create_with_order },
+	{ "set_bounds", test_bounds },
+	{ "set_visit_range", test_visit_range },
+	{ "set_rank_select", test_rank_select },
+	{ "set_create_from_sorted", test_create_from_sorted },
+	{ "set_create_from_array", test_create_from_array },
+	{ "set_insert_remove_many", test_insert_remove_many },
+	{ "set_use_concurrent_writes", test_concurrent_writes },
+	{ "set_snapshot", test_snapshot },
+	{ "set_visit_parallel", test_visit_parallel },
+	{ "set_save_open_mmap", test_save_open_mmap },
+	{ "set_use_hash_index", test_hash_index },
+	{ "set_cursor", test_cursor },
+	{ "set_freeze", test_freeze },
+	{ "set_algebra", test_set_algebra },
+	{ "set_split_join", test_split_join },
+	{ "set_use_write_buffers", test_write_buffers },
+	{ "set_use_lazy_removal", test_lazy_removal },
+	{ "set_use_lazy_removal_rank_visit", test_lazy_removal_rank_visit },
+	{ "set_use_lazy_removal_cursor", test_lazy_removal_cursor },
+	{ "set_use_lazy_removal_algebra", test_lazy_removal_algebra },
+	{ "set_clear", test_clear },
+	{ "set_clear_algebra", test_clear_algebra },
+	{ "set_destroy_incremental", test_destroy_incremental },
+	{ "set_find_many", test_find_many },
+	{ "set_use_find_cache", test_find_cache },
+	{ "set_use_node_pool", test_node_pool },
+	{ "set_get_stats", test_get_stats },
+	{ "set_set_key_func", test_key_func },
+	{ "set_use_stable_nodes", test_stable_nodes },
+	{ "set_snapshot_destroyed", test_snapshot_destroyed },
+
+	{ NULL, NULL } // end of the list
+};